@@ -0,0 +1,297 @@
+#include "scene.h"
+#include "Renderer.h"
+#include "ChainRecorder.h"
+#include "ProceduralScene.h"
+#include "Stats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+// Records per-pixel mutation chains to a binary log and replays them.
+//
+//   renderer_replay record [--scene spec] [--size N] [--mutations K]
+//                          [--mutator T] [--multi-try M]
+//                          [--sobol] [--jitter] [--fraction F]
+//                          [--pixel x,y]... out.log
+//   renderer_replay [--scene spec | --obj file] [--chain I] [--pixel x,y]
+//                   [--top N] [--dump] in.log
+//
+// Replay re-executes each selected chain with the recorded seeds and
+// parameters and checks that every step (strategy, vertex index, outcome,
+// failure reason, proposed vertex) and the pixel value match bit for bit.
+// It then lists the slowest chains and the failure reasons seen in the log.
+// The scene is rebuilt from the description stored in the log unless
+// --scene or --obj overrides it.
+
+struct Options {
+    bool record = false;
+    std::string sceneSpec;
+    std::string objPath;
+    int size = 32;
+    int mutations = 16;
+    int mutator = 0;
+    bool sobol = false;
+    bool jitter = false;
+    int multiTry = 1;
+    float fraction = 0.01f;
+    std::vector<std::pair<int, int>> pixels;
+    long chain = -1;
+    int top = 10;
+    bool dump = false;
+    std::string logPath;
+};
+
+static const char* kOutcomeNames[3] = { "accepted", "rejected", "failed" };
+
+static bool parse_pixel(const std::string& v, std::pair<int, int>& out) {
+    const size_t comma = v.find(',');
+    if (comma == std::string::npos) return false;
+    out.first = std::stoi(v.substr(0, comma));
+    out.second = std::stoi(v.substr(comma + 1));
+    return true;
+}
+
+static bool parse_args(int argc, char** argv, Options& opt) {
+    int i = 1;
+    if (argc > 1 && std::string(argv[1]) == "record") {
+        opt.record = true;
+        ++i;
+    }
+
+    for (; i < argc; ++i) {
+        const std::string a = argv[i];
+        if (a.rfind("--", 0) != 0) {
+            opt.logPath = a;
+            continue;
+        }
+        if (a == "--dump") {
+            opt.dump = true;
+            continue;
+        }
+        if (a == "--sobol") {
+            opt.sobol = true;
+            continue;
+        }
+        if (a == "--jitter") {
+            opt.jitter = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "missing value for " << a << "\n";
+            return false;
+        }
+        const std::string v = argv[++i];
+
+        if (a == "--scene") opt.sceneSpec = v;
+        else if (a == "--obj") opt.objPath = v;
+        else if (a == "--size") opt.size = std::max(1, std::stoi(v));
+        else if (a == "--mutations") opt.mutations = std::max(0, std::stoi(v));
+        else if (a == "--mutator") opt.mutator = std::clamp(std::stoi(v), 0, 4);
+        else if (a == "--multi-try") opt.multiTry = std::max(1, std::stoi(v));
+        else if (a == "--fraction") opt.fraction = std::stof(v);
+        else if (a == "--chain") opt.chain = std::stol(v);
+        else if (a == "--top") opt.top = std::max(0, std::stoi(v));
+        else if (a == "--pixel") {
+            std::pair<int, int> p;
+            if (!parse_pixel(v, p)) {
+                std::cerr << "--pixel expects x,y\n";
+                return false;
+            }
+            opt.pixels.push_back(p);
+        }
+        else {
+            std::cerr << "unknown option " << a << "\n";
+            return false;
+        }
+    }
+
+    if (opt.logPath.empty()) {
+        std::cerr << "usage: renderer_replay [record] [options] file.log\n";
+        return false;
+    }
+    return true;
+}
+
+// A scene description is a model path if such a file exists, otherwise a
+// ProceduralScene spec.
+static bool build_scene(const std::string& desc, Scene& scene) {
+    if (std::filesystem::exists(desc)) return scene.load(desc);
+
+    ProceduralScene::Mesh mesh;
+    return ProceduralScene::from_spec(desc, mesh) && ProceduralScene::build(scene, mesh);
+}
+
+static std::string reason_name(uint16_t reason) {
+    if (reason >= Stats::COUNTER_COUNT) return "unspecified";
+    return Stats::counter_name((Stats::Counter)reason);
+}
+
+static bool same_step(const Renderer::ChainStep& a, const Renderer::ChainStep& b) {
+    return a.strategy == b.strategy && a.outcome == b.outcome && a.reason == b.reason &&
+        a.index == b.index && std::memcmp(a.vertex, b.vertex, sizeof(a.vertex)) == 0 &&
+        std::memcmp(&a.acceptance, &b.acceptance, sizeof(float)) == 0;
+}
+
+static void dump_chain(const Renderer::Chain& c) {
+    std::printf("  seed path: %zu vertices%s\n", c.seedPath.size(), c.seedOk ? "" : " (seed failed)");
+    for (size_t k = 0; k < c.steps.size(); ++k) {
+        const Renderer::ChainStep& s = c.steps[k];
+        std::printf("  %4zu  strategy=%d idx=%d %-8s a=%.3f lum=%.4g %8.1f us  v=(%.4f %.4f %.4f) %s\n",
+            k, s.strategy, s.index, kOutcomeNames[std::min<int>(s.outcome, 2)], s.acceptance, s.luminance,
+            s.micros, s.vertex[0], s.vertex[1], s.vertex[2], reason_name(s.reason).c_str());
+    }
+}
+
+static int record(const Options& opt) {
+    const std::string desc = !opt.objPath.empty() ? opt.objPath
+        : (!opt.sceneSpec.empty() ? opt.sceneSpec : std::string("cornell:8"));
+
+    Scene scene;
+    if (!build_scene(desc, scene)) return 1;
+
+    // Same view of the unit room as renderer_scaling.
+    Renderer::Camera cam;
+    cam.center = glm::vec3(0.5f, 0.45f, 0.98f);
+    cam.forward = glm::vec3(0.0f, 0.0f, -1.0f);
+    cam.world_up = glm::vec3(0.0f, 1.0f, 0.0f);
+    cam.width = opt.size;
+    cam.height = opt.size;
+    cam.pixel_size = 1.0f / (float)opt.size;
+    cam.focal_length = 0.8f;
+
+    Renderer::RenderParams params;
+    params.Kmutations = opt.mutations;
+    params.multiTry = opt.multiTry;
+    params.russianRoulette = true;
+    params.sampler = opt.sobol ? Sampler::SOBOL : Sampler::RANDOM;
+    params.pixelJitter = opt.jitter;
+
+    Renderer renderer(scene, cam, glm::vec3(0.5f, 0.9f, 0.5f), params);
+
+    ChainRecorder::Selection sel;
+    sel.pixels = opt.pixels;
+    sel.fraction = opt.fraction;
+
+    ChainRecorder recorder;
+    if (!recorder.open(opt.logPath, renderer, desc, sel)) return 1;
+
+    renderer.set_chain_recorder(&recorder);
+    renderer.render_scene(1337u, opt.mutator);
+    renderer.set_chain_recorder(nullptr);
+
+    const uint64_t n = recorder.chain_count();
+    if (!recorder.close()) {
+        std::cerr << "failed to write " << opt.logPath << "\n";
+        return 1;
+    }
+    std::printf("recorded %llu chains to %s\n", (unsigned long long)n, opt.logPath.c_str());
+    return 0;
+}
+
+static int replay(const Options& opt) {
+    ChainLog log;
+    if (!log.open(opt.logPath)) return 1;
+
+    const std::string desc = !opt.objPath.empty() ? opt.objPath
+        : (!opt.sceneSpec.empty() ? opt.sceneSpec : log.scene());
+
+    Scene scene;
+    if (!build_scene(desc, scene)) return 1;
+
+    Renderer renderer(scene, log.camera(), log.light_pos(), log.params());
+
+    struct Timing {
+        size_t chain;
+        double recorded;
+        double replayed;
+    };
+    std::vector<Timing> timings;
+    std::map<std::string, uint64_t> reasons;
+    uint64_t stepsTotal = 0;
+    size_t replayed = 0;
+    size_t diverged = 0;
+
+    Renderer::Chain rec;
+    Renderer::Chain rep;
+
+    for (size_t i = 0; i < log.chain_count(); ++i) {
+        if (opt.chain >= 0 && (size_t)opt.chain != i) continue;
+        if (!log.read_chain(i, rec)) {
+            std::cerr << "corrupt chain record " << i << "\n";
+            return 1;
+        }
+        if (!opt.pixels.empty() &&
+            std::find(opt.pixels.begin(), opt.pixels.end(), std::make_pair(rec.px, rec.py)) == opt.pixels.end()) {
+            continue;
+        }
+
+        for (const Renderer::ChainStep& s : rec.steps) {
+            if (s.outcome == Renderer::CHAIN_FAILED) ++reasons[reason_name(s.reason)];
+        }
+        stepsTotal += rec.steps.size();
+
+        rep.replayStrategies.clear();
+        for (const Renderer::ChainStep& s : rec.steps) rep.replayStrategies.push_back(s.strategy);
+
+        renderer.render_pixel(rec.px, rec.py, rec.renderSeed, rec.mutatorType, rec.pass, &rep);
+        ++replayed;
+
+        size_t firstDiff = std::min(rec.steps.size(), rep.steps.size());
+        for (size_t k = 0; k < firstDiff; ++k) {
+            if (!same_step(rec.steps[k], rep.steps[k])) {
+                firstDiff = k;
+                break;
+            }
+        }
+        const bool stepsMatch = firstDiff == rec.steps.size() && rec.steps.size() == rep.steps.size();
+        const bool resultMatch = std::memcmp(&rec.result, &rep.result, sizeof(glm::vec3)) == 0;
+
+        if (!stepsMatch || !resultMatch || rec.seedPath != rep.seedPath) {
+            ++diverged;
+            std::printf("chain %zu pixel (%d,%d): diverged at step %zu of %zu\n",
+                i, rec.px, rec.py, firstDiff, rec.steps.size());
+        }
+
+        if (opt.dump) {
+            std::printf("chain %zu pixel (%d,%d) seed %u type %d: %zu steps, %.1f us recorded, %.1f us replayed\n",
+                i, rec.px, rec.py, rec.renderSeed, rec.mutatorType, rec.steps.size(), rec.micros, rep.micros);
+            dump_chain(rec);
+        }
+
+        timings.push_back({ i, rec.micros, rep.micros });
+    }
+
+    std::printf("%zu chains, %llu steps replayed: %zu identical, %zu diverged\n",
+        replayed, (unsigned long long)stepsTotal, replayed - diverged, diverged);
+
+    std::sort(timings.begin(), timings.end(), [](const Timing& a, const Timing& b) { return a.recorded > b.recorded; });
+    if (opt.top > 0 && !timings.empty()) {
+        std::printf("slowest chains (recorded / replayed us):\n");
+        for (size_t k = 0; k < timings.size() && k < (size_t)opt.top; ++k) {
+            Renderer::Chain c;
+            log.read_chain(timings[k].chain, c);
+            std::printf("  chain %6zu pixel (%4d,%4d) %10.1f %10.1f  %zu steps\n",
+                timings[k].chain, c.px, c.py, timings[k].recorded, timings[k].replayed, c.steps.size());
+        }
+    }
+
+    if (!reasons.empty()) {
+        std::printf("failed steps by reason:\n");
+        for (const auto& [name, n] : reasons) std::printf("  %-32s %llu\n", name.c_str(), (unsigned long long)n);
+    }
+
+    return diverged > 0 ? 2 : 0;
+}
+
+int main(int argc, char** argv) {
+    Options opt;
+    if (!parse_args(argc, argv, opt)) return 1;
+    return opt.record ? record(opt) : replay(opt);
+}
@@ -0,0 +1,384 @@
+#include "scene.h"
+#include "Renderer.h"
+#include "ImageUtil.h"
+#include "ProceduralScene.h"
+#include "Trace.h"
+#include "Denoiser.h"
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Equal-time convergence benchmark. Renders a high-sample reference once, then
+// runs every strategy in progressive passes for a fixed wall-time budget and
+// logs RMSE and relative MSE against the reference after each pass.
+//
+//   renderer_convergence [--scene spec | --obj file] [--size N] [--threads T]
+//                        [--strategies a,b,...] [--mutations K] [--time S]
+//                        [--ref-passes P] [--ref-mutations K] [--reference file]
+//                        [--target-rmse E] [--sampling uniform|cosine]
+//                        [--sampler random|sobol] [--jitter]
+//                        [--radiance-cache depth] [--guiding fraction] [--denoise]
+//                        [--csv out.csv] [--trace out.json]
+//
+// Strategies are retrace, meshwalk, project, resample, adaptive and subpath, each
+// optionally suffixed with +mh for Metropolis-Hastings chains. The reference
+// is path traced (resample with uniform averaging), which is unbiased. With
+// --reference it is cached in that file and reused when the size matches.
+//
+// Time to target is where RMSE first drops to the target, interpolated
+// log-linearly between passes. The default target is the worst final RMSE
+// of all strategies, so every strategy gets a time.
+//
+// --sampling picks the bounce direction sampler and --sampler the source of
+// sample values (independent or scrambled Sobol) for every render; to compare
+// them against the same reference, cache it with --reference. --jitter
+// anti-aliases all renders, the reference included. --radiance-cache lets
+// the strategy renders (not the reference) stop paths at a cached cell from
+// vertex depth on; the RMSE then includes the cache's bias. --guiding draws
+// that fraction of the bounce directions of the strategy renders from a path
+// guide trained after every pass. --denoise scores the strategy renders
+// after the edge-aware filter (see Denoiser); its time counts towards the
+// budget.
+
+struct Options {
+    std::string sceneSpec = "cornell:8";
+    std::string objPath;
+    int size = 64;
+    int threads = 0;
+    std::vector<std::string> strategies{ "retrace", "meshwalk", "project", "resample", "adaptive", "retrace+mh" };
+    int mutations = 16;
+    double seconds = 10.0;
+    int refPasses = 16;
+    int refMutations = 256;
+    std::string referencePath;
+    double targetRmse = 0.0;
+    BSDFSampler::Type sampling = BSDFSampler::COSINE;
+    Sampler::Type sampler = Sampler::RANDOM;
+    bool jitter = false;
+    bool denoise = false;
+    int cacheDepth = 0;
+    float guiding = 0.0f;
+    std::string csvPath;
+    std::string tracePath;
+};
+
+struct Strategy {
+    std::string name;
+    int mutatorType = 0;
+    bool metropolis = false;
+};
+
+struct Sample {
+    int pass = 0;
+    double seconds = 0.0;
+    double rmse = 0.0;
+    double relMse = 0.0;
+};
+
+static std::vector<std::string> split(const std::string& s, char sep) {
+    std::vector<std::string> out;
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, sep)) {
+        if (!item.empty()) out.push_back(item);
+    }
+    return out;
+}
+
+static bool parse_strategy(const std::string& name, Strategy& out) {
+    static const char* kTypes[] = { "retrace", "meshwalk", "project", "resample", "adaptive", "subpath" };
+
+    std::string base = name;
+    out.name = name;
+    out.metropolis = false;
+
+    const std::string mh = "+mh";
+    if (base.size() > mh.size() && base.compare(base.size() - mh.size(), mh.size(), mh) == 0) {
+        out.metropolis = true;
+        base.resize(base.size() - mh.size());
+    }
+
+    for (int t = 0; t < 6; ++t) {
+        if (base == kTypes[t]) {
+            out.mutatorType = t;
+            return true;
+        }
+    }
+
+    std::cerr << "unknown strategy " << name << "\n";
+    return false;
+}
+
+// The whole of s as a number; false on anything else, including overflow.
+template <class T>
+static bool parse_number(const std::string& s, T& out) {
+    const char* end = s.data() + s.size();
+    const auto [p, ec] = std::from_chars(s.data(), end, out);
+    return ec == std::errc() && p == end;
+}
+
+static bool parse_args(int argc, char** argv, Options& opt) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string a = argv[i];
+        if (a == "--jitter") {
+            opt.jitter = true;
+            continue;
+        }
+        if (a == "--denoise") {
+            opt.denoise = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "missing value for " << a << "\n";
+            return false;
+        }
+        const std::string v = argv[++i];
+
+        int n = 0;
+        bool ok = true;
+        if (a == "--scene") opt.sceneSpec = v;
+        else if (a == "--obj") opt.objPath = v;
+        else if (a == "--size") { ok = parse_number(v, n); opt.size = std::max(1, n); }
+        else if (a == "--threads") { ok = parse_number(v, n); opt.threads = std::max(0, n); }
+        else if (a == "--strategies") opt.strategies = split(v, ',');
+        else if (a == "--mutations") { ok = parse_number(v, n); opt.mutations = std::max(0, n); }
+        else if (a == "--time") ok = parse_number(v, opt.seconds);
+        else if (a == "--ref-passes") { ok = parse_number(v, n); opt.refPasses = std::max(1, n); }
+        else if (a == "--ref-mutations") { ok = parse_number(v, n); opt.refMutations = std::max(0, n); }
+        else if (a == "--reference") opt.referencePath = v;
+        else if (a == "--target-rmse") ok = parse_number(v, opt.targetRmse);
+        else if (a == "--sampling") {
+            if (v == "uniform") opt.sampling = BSDFSampler::UNIFORM;
+            else if (v == "cosine") opt.sampling = BSDFSampler::COSINE;
+            else {
+                std::cerr << "--sampling expects uniform or cosine\n";
+                return false;
+            }
+        }
+        else if (a == "--sampler") {
+            if (v == "random") opt.sampler = Sampler::RANDOM;
+            else if (v == "sobol") opt.sampler = Sampler::SOBOL;
+            else {
+                std::cerr << "--sampler expects random or sobol\n";
+                return false;
+            }
+        }
+        else if (a == "--radiance-cache") { ok = parse_number(v, n); opt.cacheDepth = std::max(1, n); }
+        else if (a == "--guiding") ok = parse_number(v, opt.guiding);
+        else if (a == "--csv") opt.csvPath = v;
+        else if (a == "--trace") opt.tracePath = v;
+        else {
+            std::cerr << "unknown option " << a << "\n";
+            return false;
+        }
+
+        if (!ok) {
+            std::cerr << "invalid value for " << a << ": " << v << "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Raw float cache: width, height, then width * height RGB triples.
+static bool load_reference(const std::string& path, int W, int H, std::vector<glm::vec3>& img) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+
+    int32_t dims[2] = { 0, 0 };
+    in.read((char*)dims, sizeof(dims));
+    if (!in || dims[0] != W || dims[1] != H) return false;
+
+    img.resize((size_t)W * (size_t)H);
+    in.read((char*)img.data(), (std::streamsize)(img.size() * sizeof(glm::vec3)));
+    return (bool)in;
+}
+
+static bool save_reference(const std::string& path, int W, int H, const std::vector<glm::vec3>& img) {
+    std::ofstream out(path, std::ios::binary);
+    if (!out) return false;
+
+    const int32_t dims[2] = { W, H };
+    out.write((const char*)dims, sizeof(dims));
+    out.write((const char*)img.data(), (std::streamsize)(img.size() * sizeof(glm::vec3)));
+    return (bool)out;
+}
+
+static double time_to_target(const std::vector<Sample>& samples, double target) {
+    for (size_t i = 0; i < samples.size(); ++i) {
+        if (samples[i].rmse > target) continue;
+        if (i == 0 || !(samples[i - 1].rmse > 0.0) || !(samples[i].rmse > 0.0)) return samples[i].seconds;
+
+        const Sample& a = samples[i - 1];
+        const Sample& b = samples[i];
+        const double f = (std::log(a.rmse) - std::log(target)) / (std::log(a.rmse) - std::log(b.rmse));
+        return a.seconds + f * (b.seconds - a.seconds);
+    }
+    return -1.0;
+}
+
+int main(int argc, char** argv) {
+    Options opt;
+    if (!parse_args(argc, argv, opt)) {
+        std::cerr << "usage: renderer_convergence [--scene spec | --obj file] [--size N] [--threads T]\n"
+            "                            [--strategies a,b,...] [--mutations K] [--time S]\n"
+            "                            [--ref-passes P] [--ref-mutations K] [--reference file]\n"
+            "                            [--target-rmse E] [--sampling uniform|cosine]\n"
+            "                            [--sampler random|sobol] [--jitter]\n"
+            "                            [--radiance-cache depth] [--guiding fraction] [--denoise]\n"
+            "                            [--csv out.csv] [--trace out.json]\n";
+        return 1;
+    }
+
+    if (!opt.tracePath.empty()) {
+        Trace::enable();
+        Trace::set_thread_name("main");
+    }
+
+    std::vector<Strategy> strategies;
+    for (const std::string& name : opt.strategies) {
+        Strategy s;
+        if (!parse_strategy(name, s)) return 1;
+        strategies.push_back(s);
+    }
+
+    Scene scene;
+    if (!opt.objPath.empty()) {
+        if (!scene.load(opt.objPath)) return 1;
+    }
+    else {
+        ProceduralScene::Mesh mesh;
+        if (!ProceduralScene::from_spec(opt.sceneSpec, mesh) || !ProceduralScene::build(scene, mesh)) return 1;
+    }
+
+    // Same framing as main.cpp: the camera looks down -z at the scene bounds.
+    const glm::vec3 bmin = scene.bounds_min();
+    const glm::vec3 bmax = scene.bounds_max();
+    const glm::vec3 diag = bmax - bmin;
+    const float sceneDiag = std::sqrt(glm::dot(diag, diag));
+
+    Renderer::Camera cam;
+    cam.center = glm::vec3(0.5f * (bmin.x + bmax.x), 0.5f * (bmin.y + bmax.y), bmax.z + 0.5f * sceneDiag);
+    cam.forward = glm::vec3(0.0f, 0.0f, -1.0f);
+    cam.world_up = glm::vec3(0.0f, 1.0f, 0.0f);
+    cam.width = opt.size;
+    cam.height = opt.size;
+    cam.pixel_size = sceneDiag / (float)opt.size;
+    cam.focal_length = sceneDiag;
+
+    const glm::vec3 lightPos = bmin + glm::vec3(0.5f) * diag + glm::vec3(0.0f, 0.35f * diag.y, 0.0f);
+
+    Renderer::RenderParams params;
+    params.russianRoulette = true;
+    params.threads = opt.threads;
+    params.sampling = opt.sampling;
+    params.sampler = opt.sampler;
+    params.pixelJitter = opt.jitter;
+
+    std::vector<glm::vec3> reference;
+    if (opt.referencePath.empty() || !load_reference(opt.referencePath, cam.width, cam.height, reference)) {
+        Renderer::RenderParams refParams = params;
+        refParams.Kmutations = opt.refMutations;
+        Renderer refRenderer(scene, cam, lightPos, refParams);
+
+        std::printf("rendering reference: %d passes, K=%d\n", opt.refPasses, opt.refMutations);
+        const auto t0 = std::chrono::steady_clock::now();
+        reference = refRenderer.render_progressive(7u, 3, opt.refPasses, nullptr);
+        const auto t1 = std::chrono::steady_clock::now();
+        std::printf("reference done in %.1f s\n", std::chrono::duration<double>(t1 - t0).count());
+
+        if (!opt.referencePath.empty() && !save_reference(opt.referencePath, cam.width, cam.height, reference)) {
+            std::cerr << "failed to write reference " << opt.referencePath << "\n";
+        }
+    }
+
+    std::vector<std::vector<Sample>> curves(strategies.size());
+
+    for (size_t si = 0; si < strategies.size(); ++si) {
+        const Strategy& st = strategies[si];
+
+        Renderer::RenderParams sp = params;
+        sp.Kmutations = opt.mutations;
+        sp.metropolis = st.metropolis;
+        sp.radianceCache.enabled = opt.cacheDepth > 0;
+        sp.radianceCache.depth = opt.cacheDepth;
+        sp.guiding.enabled = opt.guiding > 0.0f;
+        sp.guiding.fraction = opt.guiding;
+        Renderer renderer(scene, cam, lightPos, sp);
+
+        Denoiser denoiser(Denoiser::Params{});
+        Renderer::AOVs aovs;
+        std::vector<glm::vec3> filtered;
+
+        // Error evaluation is excluded from the clock.
+        double evalSeconds = 0.0;
+        const auto start = std::chrono::steady_clock::now();
+
+        auto onPass = [&](int pass, const std::vector<glm::vec3>& img) {
+            const bool useFiltered = opt.denoise && denoiser.denoise(img, aovs, filtered);
+            const std::vector<glm::vec3>& scored = useFiltered ? filtered : img;
+
+            const auto t0 = std::chrono::steady_clock::now();
+
+            Sample s;
+            s.pass = pass;
+            s.seconds = std::chrono::duration<double>(t0 - start).count() - evalSeconds;
+            s.rmse = ImageUtil::rmse(scored, reference);
+            s.relMse = ImageUtil::rel_mse(scored, reference);
+            curves[si].push_back(s);
+
+            evalSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+            return s.seconds < opt.seconds;
+        };
+
+        renderer.render_progressive(1337u, st.mutatorType, 1 << 30, onPass, nullptr,
+            opt.denoise ? &aovs : nullptr);
+
+        const Sample& last = curves[si].back();
+        std::printf("%-16s passes=%4d time=%7.2fs rmse=%.5g relMSE=%.5g\n",
+            st.name.c_str(), last.pass + 1, last.seconds, last.rmse, last.relMse);
+    }
+
+    double target = opt.targetRmse;
+    if (!(target > 0.0)) {
+        for (const auto& c : curves) target = std::max(target, c.back().rmse);
+    }
+
+    std::printf("time to rmse <= %.5g:\n", target);
+    for (size_t si = 0; si < strategies.size(); ++si) {
+        const double t = time_to_target(curves[si], target);
+        if (t < 0.0) std::printf("  %-16s not reached\n", strategies[si].name.c_str());
+        else std::printf("  %-16s %8.3f s\n", strategies[si].name.c_str(), t);
+    }
+
+    if (!opt.tracePath.empty()) {
+        Trace::disable();
+        if (!Trace::write_json(opt.tracePath)) std::cerr << "failed to write trace " << opt.tracePath << "\n";
+    }
+
+    if (!opt.csvPath.empty()) {
+        std::ofstream out(opt.csvPath);
+        if (!out) {
+            std::cerr << "failed to open " << opt.csvPath << "\n";
+            return 1;
+        }
+
+        out << "strategy,pass,seconds,rmse,rel_mse\n";
+        for (size_t si = 0; si < strategies.size(); ++si) {
+            for (const Sample& s : curves[si]) {
+                out << strategies[si].name << "," << s.pass << "," << s.seconds << ","
+                    << s.rmse << "," << s.relMse << "\n";
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,141 @@
+#include "scene.h"
+#include "path_mutator.h"
+#include "GeomUtil.h"
+#include "PathExporter.h"
+#include "ProceduralScene.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// Dumps mutated light paths for inspection as a binary PLY of polylines.
+// Samples a pool of seed paths, then writes `paths` mutations of them,
+// coloured by mutator (retrace red, meshwalk green, project blue).
+//
+//   renderer_paths [--scene spec] [--paths N] [--seeds S] out.ply
+//
+// Mutation and export time are reported separately.
+
+struct Options {
+    std::string sceneSpec = "cornell:8";
+    uint64_t paths = 1000000;
+    int seeds = 1024;
+    std::string outPath;
+};
+
+static bool parse_args(int argc, char** argv, Options& opt) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string a = argv[i];
+        if (a.rfind("--", 0) != 0) {
+            opt.outPath = a;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "missing value for " << a << "\n";
+            return false;
+        }
+        const std::string v = argv[++i];
+
+        if (a == "--scene") opt.sceneSpec = v;
+        else if (a == "--paths") opt.paths = std::stoull(v);
+        else if (a == "--seeds") opt.seeds = std::max(1, std::stoi(v));
+        else {
+            std::cerr << "unknown option " << a << "\n";
+            return false;
+        }
+    }
+
+    if (opt.outPath.empty()) {
+        std::cerr << "usage: renderer_paths [options] out.ply\n";
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    Options opt;
+    if (!parse_args(argc, argv, opt)) return 1;
+
+    ProceduralScene::Mesh mesh;
+    Scene scene;
+    if (!ProceduralScene::from_spec(opt.sceneSpec, mesh) || !ProceduralScene::build(scene, mesh)) return 1;
+
+    // Camera and light inside the unit room, as in renderer_scaling.
+    const glm::vec3 eye(0.5f, 0.45f, 0.98f);
+    const glm::vec3 lightPos(0.5f, 0.9f, 0.5f);
+    PathMutator mutator(scene, eye, lightPos);
+
+    const int maxBounces = 8;
+    const int retries = 12;
+    const float radius = 0.05f;
+
+    std::mt19937 rng(7u);
+    std::uniform_real_distribution<float> u01(0.0f, 1.0f);
+
+    std::vector<PathMutator::Path> seeds;
+    for (int attempt = 0; (int)seeds.size() < opt.seeds && attempt < 100 * opt.seeds; ++attempt) {
+        const glm::vec3 target(u01(rng), u01(rng), 0.0f);
+        PathMutator::Path p;
+        if (mutator.sample_path(p, maxBounces, GeomUtil::safe_normalize(target - eye), retries, rng) &&
+            p.vertices.size() >= 4) {
+            seeds.push_back(std::move(p));
+        }
+    }
+    if (seeds.empty()) {
+        std::cerr << "no seed paths in " << opt.sceneSpec << "\n";
+        return 1;
+    }
+
+    const glm::vec3 colors[3] = { glm::vec3(1, 0.2f, 0.2f), glm::vec3(0.2f, 1, 0.2f), glm::vec3(0.2f, 0.4f, 1) };
+
+    PathExporter exporter;
+    if (!exporter.open(opt.outPath)) return 1;
+
+    double mutateSec = 0.0;
+    double exportSec = 0.0;
+    uint64_t rejected = 0;
+
+    PathMutator::Path proposal;
+    for (uint64_t i = 0; i < opt.paths; ++i) {
+        const auto t0 = std::chrono::steady_clock::now();
+
+        const int type = (int)(i % 3);
+        proposal = seeds[(size_t)(i % seeds.size())];
+        const int lo = 2;
+        const int hi = (int)proposal.vertices.size() - 2;
+        const int idx = std::min(hi, lo + (int)(u01(rng) * (float)(hi - lo + 1)));
+
+        bool ok = false;
+        if (type == 0) ok = mutator.mutate_vertex_retrace(proposal, idx, rng);
+        else if (type == 1) ok = mutator.mutate_vertex_meshwalk(proposal, idx, radius, rng);
+        else ok = mutator.mutate_vertex_project(proposal, idx, radius, rng);
+
+        const auto t1 = std::chrono::steady_clock::now();
+
+        if (ok) exporter.add_path(proposal, colors[type]);
+        else ++rejected;
+
+        const auto t2 = std::chrono::steady_clock::now();
+        mutateSec += std::chrono::duration<double>(t1 - t0).count();
+        exportSec += std::chrono::duration<double>(t2 - t1).count();
+    }
+
+    const auto c0 = std::chrono::steady_clock::now();
+    if (!exporter.close()) {
+        std::cerr << "failed to write " << opt.outPath << "\n";
+        return 1;
+    }
+    exportSec += std::chrono::duration<double>(std::chrono::steady_clock::now() - c0).count();
+
+    std::printf("%llu paths (%llu rejected mutations skipped), %llu vertices, %llu edges -> %s\n",
+        (unsigned long long)exporter.path_count(), (unsigned long long)rejected,
+        (unsigned long long)exporter.vertex_count(), (unsigned long long)exporter.edge_count(),
+        opt.outPath.c_str());
+    std::printf("mutate %.2f s, export %.2f s (%.0f paths/s)\n",
+        mutateSec, exportSec, exportSec > 0.0 ? (double)exporter.path_count() / exportSec : 0.0);
+    return 0;
+}
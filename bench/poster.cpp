@@ -0,0 +1,140 @@
+#include "scene.h"
+#include "Renderer.h"
+#include "ProceduralScene.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+// Streams a large render straight to disk with Renderer::render_to_file and
+// reports time and peak RSS, which should stay flat as the resolution grows.
+//
+//   renderer_poster [--scene spec] [--width W] [--height H] [--mutations K]
+//                   [--threads T] [--trace out.json] out.{ppm,pfm,exr}
+
+struct Options {
+    std::string sceneSpec = "cornell:8";
+    int width = 16384;
+    int height = 16384;
+    int mutations = 1;
+    int threads = 0;
+    std::string tracePath;
+    std::string outPath;
+};
+
+static double peak_rss_mb() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) return 0.0;
+    return (double)pmc.PeakWorkingSetSize / (1024.0 * 1024.0);
+#else
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0) return 0.0;
+#ifdef __APPLE__
+    return (double)ru.ru_maxrss / (1024.0 * 1024.0);
+#else
+    return (double)ru.ru_maxrss / 1024.0;
+#endif
+#endif
+}
+
+static bool parse_args(int argc, char** argv, Options& opt) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string a = argv[i];
+        if (a.rfind("--", 0) != 0) {
+            opt.outPath = a;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "missing value for " << a << "\n";
+            return false;
+        }
+        const std::string v = argv[++i];
+
+        if (a == "--scene") opt.sceneSpec = v;
+        else if (a == "--width") opt.width = std::max(1, std::stoi(v));
+        else if (a == "--height") opt.height = std::max(1, std::stoi(v));
+        else if (a == "--mutations") opt.mutations = std::max(0, std::stoi(v));
+        else if (a == "--threads") opt.threads = std::max(0, std::stoi(v));
+        else if (a == "--trace") opt.tracePath = v;
+        else {
+            std::cerr << "unknown option " << a << "\n";
+            return false;
+        }
+    }
+
+    if (opt.outPath.empty()) {
+        std::cerr << "usage: renderer_poster [options] out.{ppm,pfm,exr}\n";
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    Options opt;
+    if (!parse_args(argc, argv, opt)) return 1;
+
+    if (!opt.tracePath.empty()) {
+        Trace::enable();
+        Trace::set_thread_name("main");
+    }
+
+    ProceduralScene::Mesh mesh;
+    Scene scene;
+    if (!ProceduralScene::from_spec(opt.sceneSpec, mesh) || !ProceduralScene::build(scene, mesh)) return 1;
+    mesh = ProceduralScene::Mesh{};
+
+    // Same view of the unit room as renderer_scaling.
+    Renderer::Camera cam;
+    cam.center = glm::vec3(0.5f, 0.45f, 0.98f);
+    cam.forward = glm::vec3(0.0f, 0.0f, -1.0f);
+    cam.world_up = glm::vec3(0.0f, 1.0f, 0.0f);
+    cam.width = opt.width;
+    cam.height = opt.height;
+    cam.pixel_size = 1.0f / (float)std::max(opt.width, opt.height);
+    cam.focal_length = 0.8f;
+
+    Renderer::RenderParams params;
+    params.Kmutations = opt.mutations;
+    params.russianRoulette = true;
+    params.threads = opt.threads;
+
+    Renderer renderer(scene, cam, glm::vec3(0.5f, 0.9f, 0.5f), params);
+
+    const double rssBefore = peak_rss_mb();
+    const auto t0 = std::chrono::steady_clock::now();
+
+    Renderer::RenderStats stats;
+    const bool ok = renderer.render_to_file(opt.outPath, 1337u, 0, &stats);
+
+    const auto t1 = std::chrono::steady_clock::now();
+
+    if (!opt.tracePath.empty()) {
+        Trace::disable();
+        if (!Trace::write_json(opt.tracePath)) std::cerr << "failed to write trace " << opt.tracePath << "\n";
+    }
+
+    if (!ok) return 1;
+
+    // A float framebuffer would have needed 12 bytes per pixel on top.
+    const double framebufferMb = 12.0 * (double)opt.width * (double)opt.height / (1024.0 * 1024.0);
+    std::printf("%dx%d -> %s in %.1f s, %.0f rays/s\n",
+        opt.width, opt.height, opt.outPath.c_str(),
+        std::chrono::duration<double>(t1 - t0).count(),
+        (double)stats.rays / std::max(1e-9, std::chrono::duration<double>(t1 - t0).count()));
+    std::printf("peak RSS %.1f MB (%.1f MB after scene build; float framebuffer would be %.0f MB)\n",
+        peak_rss_mb(), rssBefore, framebufferMb);
+    return 0;
+}
@@ -0,0 +1,775 @@
+#include "scene.h"
+#include "path_mutator.h"
+#include "Renderer.h"
+#include "GeomUtil.h"
+#include "ProceduralScene.h"
+#include "ImageUtil.h"
+#include "ClusterVisibility.h"
+#include "LightSet.h"
+#include "RelightStore.h"
+#include "SequenceRenderer.h"
+#include "Denoiser.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// Microbenchmarks for the geometric kernels and mutators on built-in
+// procedural scenes. Every benchmark uses fixed seeds so runs are comparable.
+//
+//   renderer_bench [filter]
+//
+// Only benchmarks whose name contains `filter` are run.
+
+struct BenchResult {
+    double nsPerOp = 0.0;
+    double successRate = 0.0;
+};
+
+struct BenchScene {
+    std::string name;
+    Scene scene;
+    Renderer::Camera cam;
+    glm::vec3 lightPos{ 0.0f };
+};
+
+static const int kReps = 5;
+
+// Runs fn(ops, successes) kReps times and keeps the fastest rep.
+template <class F>
+static BenchResult run_bench(F&& fn) {
+    BenchResult best;
+    best.nsPerOp = 1e300;
+
+    for (int r = 0; r < kReps; ++r) {
+        uint64_t ops = 0;
+        uint64_t successes = 0;
+
+        const auto t0 = std::chrono::steady_clock::now();
+        fn(ops, successes);
+        const auto t1 = std::chrono::steady_clock::now();
+
+        if (ops == 0) continue;
+
+        const double ns = std::chrono::duration<double, std::nano>(t1 - t0).count() / (double)ops;
+        if (ns < best.nsPerOp) {
+            best.nsPerOp = ns;
+            best.successRate = (double)successes / (double)ops;
+        }
+    }
+
+    return best;
+}
+
+static void report(const std::string& name, const BenchResult& r, const char* successLabel) {
+    const double opsPerSec = r.nsPerOp > 0.0 ? 1e9 / r.nsPerOp : 0.0;
+
+    std::printf("%-40s %12.1f ns/op %14.0f op/s", name.c_str(), r.nsPerOp, opsPerSec);
+    if (successLabel) {
+        std::printf("  %s %12.0f /s (%.1f%%)", successLabel, opsPerSec * r.successRate, 100.0 * r.successRate);
+    }
+    std::printf("\n");
+}
+
+static void setup_view(BenchScene& bs) {
+    const glm::vec3 bmin = bs.scene.bounds_min();
+    const glm::vec3 bmax = bs.scene.bounds_max();
+    const glm::vec3 diag = bmax - bmin;
+    const float sceneDiag = std::sqrt(glm::dot(diag, diag));
+
+    bs.cam.center = glm::vec3(0.5f * (bmin.x + bmax.x), 0.5f * (bmin.y + bmax.y), bmax.z + 0.5f * sceneDiag);
+    bs.cam.forward = glm::vec3(0.0f, 0.0f, -1.0f);
+    bs.cam.world_up = glm::vec3(0.0f, 1.0f, 0.0f);
+    bs.cam.width = 64;
+    bs.cam.height = 48;
+    bs.cam.pixel_size = sceneDiag / float(bs.cam.width);
+    bs.cam.focal_length = sceneDiag;
+
+    bs.lightPos = bmin + glm::vec3(0.5f) * diag + glm::vec3(0.0f, 0.35f * diag.y, 0.0f);
+}
+
+static glm::vec3 random_in_box(std::mt19937& rng, const glm::vec3& a, const glm::vec3& b) {
+    std::uniform_real_distribution<float> u01(0.0f, 1.0f);
+    return a + glm::vec3(u01(rng), u01(rng), u01(rng)) * (b - a);
+}
+
+static glm::vec3 random_dir(std::mt19937& rng) {
+    std::uniform_real_distribution<float> u01(0.0f, 1.0f);
+    glm::vec3 d = GeomUtil::sample_hemisphere_uniform(glm::vec3(0, 0, 1), rng, u01);
+    if (u01(rng) < 0.5f) d.z = -d.z;
+    return d;
+}
+
+static glm::vec3 primary_dir(const BenchScene& bs, std::mt19937& rng) {
+    // Aim at a random point on the room's back half so paths start inside.
+    const glm::vec3 bmin = bs.scene.bounds_min();
+    const glm::vec3 bmax = bs.scene.bounds_max();
+    glm::vec3 target = random_in_box(rng, bmin, bmax);
+    return GeomUtil::safe_normalize(target - bs.cam.center);
+}
+
+static bool matches(const std::string& name, const std::string& filter) {
+    return filter.empty() || name.find(filter) != std::string::npos;
+}
+
+static void bench_moller_trumbore(const std::string& filter) {
+    const std::string name = "moller_trumbore";
+    if (!matches(name, filter)) return;
+
+    std::mt19937 rng(7u);
+    const int N = 4096;
+
+    std::vector<glm::vec3> ro(N), rd(N), v0(N), v1(N), v2(N);
+    for (int i = 0; i < N; ++i) {
+        ro[i] = random_in_box(rng, glm::vec3(-1.0f), glm::vec3(1.0f));
+        rd[i] = random_dir(rng);
+        v0[i] = random_in_box(rng, glm::vec3(-1.0f), glm::vec3(1.0f));
+        v1[i] = v0[i] + random_in_box(rng, glm::vec3(-0.5f), glm::vec3(0.5f));
+        v2[i] = v0[i] + random_in_box(rng, glm::vec3(-0.5f), glm::vec3(0.5f));
+    }
+
+    const int passes = 64;
+    auto r = run_bench([&](uint64_t& ops, uint64_t& hits) {
+        for (int p = 0; p < passes; ++p) {
+            for (int i = 0; i < N; ++i) {
+                const int j = (i + p) % N;
+                float t, u, v;
+                if (GeomUtil::moller_trumbore(ro[i], rd[i], v0[j], v1[j], v2[j], t, u, v)) ++hits;
+                ++ops;
+            }
+        }
+    });
+
+    report(name, r, "hits");
+}
+
+// Encodes an 8K frame in each output format; ops are pixels, so ns/op is the
+// per-pixel encode cost.
+static void bench_image_encode(const std::string& filter) {
+    const int W = 7680;
+    const int H = 4320;
+
+    const char* names[4] = { "encode_ppm", "encode_pfm", "encode_exr_half", "encode_exr_float" };
+    bool any = false;
+    for (const char* n : names) any |= matches(n, filter);
+    if (!any) return;
+
+    std::mt19937 rng(31u);
+    std::uniform_real_distribution<float> u(0.0f, 4.0f);
+    std::vector<glm::vec3> img((size_t)W * (size_t)H);
+    for (glm::vec3& c : img) c = glm::vec3(u(rng), u(rng), u(rng));
+
+    std::vector<uint8_t> out;
+    for (int f = 0; f < 4; ++f) {
+        if (!matches(names[f], filter)) continue;
+
+        auto r = run_bench([&](uint64_t& ops, uint64_t& ok) {
+            bool good = false;
+            if (f == 0) good = ImageUtil::encode_ppm(img, W, H, 2.2f, out);
+            else if (f == 1) good = ImageUtil::encode_pfm(img, W, H, out);
+            else good = ImageUtil::encode_exr(img, W, H, f == 2, out);
+
+            ops += img.size();
+            if (good) ok += img.size();
+        });
+        report(names[f], r, nullptr);
+    }
+}
+
+// Picks one light per shading point from sets of 1 to 4096 random point
+// lights through the light BVH; ns/op should grow with the log of the light
+// count. light_sum_all evaluates every light instead, as NEE without a
+// hierarchy would.
+static void bench_light_sampling(const std::string& filter) {
+    const int counts[4] = { 1, 64, 1024, 4096 };
+
+    for (int count : counts) {
+        const std::string name = "light_bvh_sample/" + std::to_string(count);
+        const std::string allName = "light_sum_all/" + std::to_string(count);
+        if (!matches(name, filter) && !matches(allName, filter)) continue;
+
+        std::mt19937 rng(37u);
+        std::uniform_real_distribution<float> u01(0.0f, 1.0f);
+
+        LightSet lights;
+        for (int i = 0; i < count; ++i) {
+            lights.add_point(random_in_box(rng, glm::vec3(-1.0f), glm::vec3(1.0f)), glm::vec3(0.1f + u01(rng)));
+        }
+        lights.build();
+
+        const int N = 4096;
+        std::vector<glm::vec3> x(N), n(N), u(N);
+        for (int i = 0; i < N; ++i) {
+            x[i] = random_in_box(rng, glm::vec3(-1.0f), glm::vec3(1.0f));
+            n[i] = random_dir(rng);
+            u[i] = glm::vec3(u01(rng), u01(rng), u01(rng));
+        }
+
+        if (matches(name, filter)) {
+            auto r = run_bench([&](uint64_t& ops, uint64_t& ok) {
+                LightSet::Sample ls;
+                for (int i = 0; i < N; ++i) {
+                    if (lights.sample(x[i], n[i], u[i], ls)) ++ok;
+                    ++ops;
+                }
+            });
+            report(name, r, "sampled");
+        }
+
+        if (matches(allName, filter)) {
+            volatile float sink = 0.0f;
+            auto r = run_bench([&](uint64_t& ops, uint64_t& ok) {
+                for (int i = 0; i < N; ++i) {
+                    float sum = 0.0f;
+                    for (int l = 0; l < count; ++l) {
+                        const glm::vec3 d = lights.light(l).p0 - x[i];
+                        const float dist2 = glm::dot(d, d);
+                        if (glm::dot(n[i], d) > 0.0f && dist2 > 0.0f) sum += lights.light(l).emission.x / dist2;
+                    }
+                    if (sum > 0.0f) ++ok;
+                    sink = sink + sum;
+                    ++ops;
+                }
+            });
+            report(allName, r, "lit");
+        }
+    }
+}
+
+static void bench_scene(BenchScene& bs, const std::string& filter) {
+    const std::string prefix = bs.name + "/";
+    const glm::vec3 bmin = bs.scene.bounds_min();
+    const glm::vec3 bmax = bs.scene.bounds_max();
+
+    std::printf("-- %s: %zu triangles\n", bs.name.c_str(), bs.scene.triangles().size());
+
+    if (matches(prefix + "intersect", filter)) {
+        std::mt19937 rng(11u);
+        const int N = 2048;
+        std::vector<glm::vec3> ro(N), rd(N);
+        for (int i = 0; i < N; ++i) {
+            ro[i] = random_in_box(rng, bmin, bmax);
+            rd[i] = random_dir(rng);
+        }
+
+        auto r = run_bench([&](uint64_t& ops, uint64_t& hits) {
+            Scene::Hit h;
+            GeomUtil::Triangle tri;
+            for (int i = 0; i < N; ++i) {
+                if (bs.scene.intersect(ro[i], rd[i], h, tri)) ++hits;
+                ++ops;
+            }
+        });
+        report(prefix + "intersect", r, "hits");
+    }
+
+    if (matches(prefix + "visible", filter)) {
+        std::mt19937 rng(13u);
+        const int N = 2048;
+        std::vector<glm::vec3> a(N), b(N);
+        for (int i = 0; i < N; ++i) {
+            a[i] = random_in_box(rng, bmin, bmax);
+            b[i] = random_in_box(rng, bmin, bmax);
+        }
+
+        auto r = run_bench([&](uint64_t& ops, uint64_t& vis) {
+            for (int i = 0; i < N; ++i) {
+                if (bs.scene.visible(a[i], b[i])) ++vis;
+                ++ops;
+            }
+        });
+        report(prefix + "visible", r, "visible");
+
+        auto rb = run_bench([&](uint64_t& ops, uint64_t& vis) {
+            std::vector<uint8_t> out;
+            bs.scene.visible_batch(a, b, out);
+            for (uint8_t v : out) vis += v;
+            ops += out.size();
+        });
+        report(prefix + "visible_batch", rb, "visible");
+    }
+
+    PathMutator mutator(bs.scene, bs.cam.center, bs.lightPos);
+
+    const int maxBounces = 8;
+    const int retries = 12;
+
+    if (matches(prefix + "sample_path", filter)) {
+        std::mt19937 dirRng(17u);
+        const int N = 512;
+        std::vector<glm::vec3> dirs(N);
+        for (int i = 0; i < N; ++i) dirs[i] = primary_dir(bs, dirRng);
+
+        auto r = run_bench([&](uint64_t& ops, uint64_t& ok) {
+            std::mt19937 rng(19u);
+            PathMutator::Path path;
+            for (int i = 0; i < N; ++i) {
+                if (mutator.sample_path(path, maxBounces, dirs[i], retries, rng)) ++ok;
+                ++ops;
+            }
+        });
+        report(prefix + "sample_path", r, "paths");
+    }
+
+    // Fixed set of seed paths shared by the mutator and radiance benchmarks.
+    // The draws are capped, and the benchmarks that need the seeds are
+    // skipped if the view yields too few paths with a bounce.
+    std::vector<PathMutator::Path> seeds;
+    const int wanted = 256;
+    {
+        std::mt19937 rng(23u);
+        const int maxDraws = 64 * wanted;
+        for (int draw = 0; draw < maxDraws && (int)seeds.size() < wanted; ++draw) {
+            PathMutator::Path p;
+            if (mutator.sample_path(p, maxBounces, primary_dir(bs, rng), retries, rng) &&
+                p.vertices.size() >= 4) {
+                seeds.push_back(std::move(p));
+            }
+        }
+        if ((int)seeds.size() < wanted) {
+            std::cerr << prefix << ": only " << seeds.size() << " of " << wanted << " seed paths in "
+                << maxDraws << " draws, skipping the benchmarks that mutate them\n";
+        }
+    }
+    const bool haveSeeds = (int)seeds.size() == wanted;
+
+    const glm::vec3 diag = bmax - bmin;
+    const float radius = 0.05f * std::sqrt(glm::dot(diag, diag));
+
+    const char* mutatorNames[3] = { "mutate_vertex_retrace", "mutate_vertex_meshwalk", "mutate_vertex_project" };
+
+    for (int type = 0; type < 3; ++type) {
+        const std::string name = prefix + mutatorNames[type];
+        if (!haveSeeds || !matches(name, filter)) continue;
+
+        const int passes = 8;
+        auto r = run_bench([&](uint64_t& ops, uint64_t& accepted) {
+            std::mt19937 rng(29u);
+            std::uniform_real_distribution<float> u01(0.0f, 1.0f);
+
+            for (int p = 0; p < passes; ++p) {
+                for (const PathMutator::Path& seed : seeds) {
+                    PathMutator::Path proposal = seed;
+                    const int lo = 2;
+                    const int hi = (int)proposal.vertices.size() - 2;
+                    int idx = std::min(hi, lo + (int)(u01(rng) * (float)(hi - lo + 1)));
+
+                    bool ok = false;
+                    if (type == 0) ok = mutator.mutate_vertex_retrace(proposal, idx, rng);
+                    else if (type == 1) ok = mutator.mutate_vertex_meshwalk(proposal, idx, radius, rng);
+                    else ok = mutator.mutate_vertex_project(proposal, idx, radius, rng);
+
+                    if (ok) ++accepted;
+                    ++ops;
+                }
+            }
+        });
+        report(name, r, "accepted");
+    }
+
+    // Regenerates the picked vertex and the one after it, traced from the
+    // vertex before; compare with the single-vertex mutators above.
+    if (haveSeeds && matches(prefix + "mutate_subpath", filter)) {
+        const int passes = 8;
+        auto r = run_bench([&](uint64_t& ops, uint64_t& accepted) {
+            std::mt19937 rng(29u);
+            std::uniform_real_distribution<float> u01(0.0f, 1.0f);
+
+            for (int p = 0; p < passes; ++p) {
+                for (const PathMutator::Path& seed : seeds) {
+                    PathMutator::Path proposal = seed;
+                    const int N = (int)proposal.vertices.size();
+                    const int lo = 2;
+                    const int hi = N - 2;
+                    int idx = std::min(hi, lo + (int)(u01(rng) * (float)(hi - lo + 1)));
+
+                    if (mutator.mutate_subpath(proposal, idx - 1, std::min(N - 1, idx + 2), rng)) ++accepted;
+                    ++ops;
+                }
+            }
+        });
+        report(prefix + "mutate_subpath", r, "accepted");
+    }
+
+    if (haveSeeds && matches(prefix + "visibility_table", filter)) {
+        ClusterVisibility table;
+        ClusterVisibility::Params vp;
+        vp.threads = 1;
+        if (table.build(bs.scene, vp)) {
+            const ClusterVisibility::BuildInfo& info = table.info();
+            std::printf("%-40s %8.1f ms build  %zu clusters  %zu occluders  %zu/%zu pairs occluded  %zu KiB\n",
+                (prefix + "visibility_table").c_str(), info.seconds * 1e3, info.clusters,
+                info.occluders, info.occludedPairs, info.pairs, info.bytes / 1024);
+
+            // Connections between surface vertices of different seed paths:
+            // how many the table rejects, and how many of those a ray finds
+            // visible after all.
+            std::mt19937 rng(31u);
+            uint64_t queries = 0, occluded = 0, rejected = 0, wrong = 0;
+            for (int q = 0; q < 20000; ++q) {
+                const PathMutator::Path& pa = seeds[rng() % seeds.size()];
+                const PathMutator::Path& pb = seeds[rng() % seeds.size()];
+                const glm::vec3& a = pa.vertices[1 + rng() % (pa.vertices.size() - 2)];
+                const glm::vec3& b = pb.vertices[1 + rng() % (pb.vertices.size() - 2)];
+
+                const bool vis = bs.scene.visible(a, b, 1e-4f);
+                const bool maybe = table.maybe_visible(a, b);
+                ++queries;
+                if (!vis) ++occluded;
+                if (!maybe) ++rejected;
+                if (!maybe && vis) ++wrong;
+            }
+            std::printf("%-40s %5.1f%% occluded  %5.1f%% rejected by table  %llu of %llu wrongly\n",
+                (prefix + "visibility_table_connections").c_str(),
+                100.0 * (double)occluded / (double)queries, 100.0 * (double)rejected / (double)queries,
+                (unsigned long long)wrong, (unsigned long long)rejected);
+
+            PathMutator tableMutator(bs.scene, bs.cam.center, bs.lightPos);
+            tableMutator.set_visibility_table(&table);
+
+            for (int type : { 0, 2 }) {
+                const std::string name = prefix + mutatorNames[type] + "+vistable";
+
+                const int passes = 8;
+                auto r = run_bench([&](uint64_t& ops, uint64_t& accepted) {
+                    std::mt19937 rng(29u);
+                    std::uniform_real_distribution<float> u01(0.0f, 1.0f);
+
+                    for (int p = 0; p < passes; ++p) {
+                        for (const PathMutator::Path& seed : seeds) {
+                            PathMutator::Path proposal = seed;
+                            const int lo = 2;
+                            const int hi = (int)proposal.vertices.size() - 2;
+                            int idx = std::min(hi, lo + (int)(u01(rng) * (float)(hi - lo + 1)));
+
+                            bool ok = false;
+                            if (type == 0) ok = tableMutator.mutate_vertex_retrace(proposal, idx, rng);
+                            else ok = tableMutator.mutate_vertex_project(proposal, idx, radius, rng);
+
+                            if (ok) ++accepted;
+                            ++ops;
+                        }
+                    }
+                });
+                report(name, r, "accepted");
+            }
+        }
+    }
+
+    // A small render recorded into a relight store, then relit under the
+    // same light (which must reproduce it) and under a moved one. The moved
+    // relight is scored against a plain path-traced reference next to a
+    // fresh render at the same settings, for both estimators.
+    if (matches(prefix + "relight", filter)) {
+        const glm::vec3 diag = bmax - bmin;
+        const glm::vec3 movedPos = bs.lightPos - glm::vec3(0.25f * diag.x, 0.2f * diag.y, 0.0f);
+
+        Renderer::RenderParams rp;
+        rp.Kmutations = 0;
+        rp.threads = 1;
+        const std::vector<glm::vec3> reference =
+            Renderer(bs.scene, bs.cam, movedPos, rp).render_progressive(61u, 0, 256, nullptr);
+
+        rp.Kmutations = 16;
+        for (int mode = 0; mode < 2; ++mode) {
+            rp.metropolis = (mode == 1);
+            const std::string name = prefix + (rp.metropolis ? "relight_metropolis" : "relight");
+
+            RelightStore store;
+            Renderer renderer(bs.scene, bs.cam, bs.lightPos, rp);
+            renderer.set_relight_store(&store);
+
+            const auto t0 = std::chrono::steady_clock::now();
+            const std::vector<glm::vec3> img = renderer.render_scene(41u, 0);
+            const auto t1 = std::chrono::steady_clock::now();
+            const std::vector<glm::vec3> same = renderer.relight(store);
+            const auto t2 = std::chrono::steady_clock::now();
+
+            float maxDiff = 0.0f;
+            for (size_t i = 0; i < img.size(); ++i) {
+                const glm::vec3 d = glm::abs(img[i] - same[i]);
+                maxDiff = std::max(maxDiff, std::max(d.x, std::max(d.y, d.z)));
+            }
+
+            std::printf("%-40s %8.1f ms render  %8.1f ms relight  %zu vertices  %zu KiB  max diff %g\n",
+                name.c_str(),
+                std::chrono::duration<double, std::milli>(t1 - t0).count(),
+                std::chrono::duration<double, std::milli>(t2 - t1).count(),
+                store.vertex_count(), store.memory_bytes() / 1024, maxDiff);
+
+            Renderer moved(bs.scene, bs.cam, movedPos, rp);
+            const std::vector<glm::vec3> relit = moved.relight(store);
+            const std::vector<glm::vec3> fresh = moved.render_scene(41u, 0);
+            std::printf("%-40s rmse vs reference: relit %.4g  fresh render %.4g\n",
+                (name + "_moved_light").c_str(), ImageUtil::rmse(relit, reference), ImageUtil::rmse(fresh, reference));
+
+            volatile float sink = 0.0f;
+            auto r = run_bench([&](uint64_t& ops, uint64_t&) {
+                const std::vector<glm::vec3> out = moved.relight(store);
+                sink = sink + out[out.size() / 2].x;
+                ops += store.vertex_count();
+            });
+            report(name + "_moved_light (per vertex)", r, nullptr);
+        }
+    }
+
+    // Metropolis renders per mutator type: moves the chain accepted per
+    // second of render, the rate that matters on occluded scenes, where a
+    // proposal that survives its own checks can still be rejected. Subpath
+    // mutations also run at each regenerated length.
+    if (matches(prefix + "mh_accepts", filter)) {
+        struct Run { const char* name; int type; int length; };
+        const Run runs[] = {
+            { "retrace", 0, 2 }, { "meshwalk", 1, 2 }, { "project", 2, 2 }, { "resample", 3, 2 },
+            { "adaptive", 4, 2 }, { "subpath/1", 5, 1 }, { "subpath/2", 5, 2 }, { "subpath/3", 5, 3 },
+            { "subpath/4", 5, 4 },
+        };
+        for (const Run& run : runs) {
+            Renderer::RenderParams rp;
+            rp.metropolis = true;
+            rp.Kmutations = 32;
+            rp.threads = 1;
+            rp.subpathLength = run.length;
+
+            Renderer renderer(bs.scene, bs.cam, bs.lightPos, rp);
+            Renderer::RenderStats rs;
+            const auto t0 = std::chrono::steady_clock::now();
+            renderer.render_scene(71u, run.type, &rs);
+            const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+            std::printf("%-40s %12.0f accepted/s  %5.1f%% of %llu attempts  %8.1f ms\n",
+                (prefix + "mh_accepts/" + run.name).c_str(), (double)rs.mutationAccepts / secs,
+                rs.mutationAttempts ? 100.0 * (double)rs.mutationAccepts / (double)rs.mutationAttempts : 0.0,
+                (unsigned long long)rs.mutationAttempts, 1e3 * secs);
+        }
+    }
+
+    // Direct light from 16 point lights, one sampled per vertex, averaged
+    // over progressive passes against the sum of one render per light (each
+    // exact, as a single point light leaves nothing to sample). The error
+    // must keep falling with the passes.
+    if (matches(prefix + "multi_light", filter)) {
+        Renderer::RenderParams rp;
+        rp.maxBounces = 1;
+        rp.Kmutations = 1;
+        rp.threads = 1;
+
+        const glm::vec3 diag = bmax - bmin;
+        const int count = 16;
+        std::mt19937 rng(53u);
+        std::vector<glm::vec3> positions;
+        for (int l = 0; l < count; ++l) {
+            const glm::vec3 lo = glm::max(bmin, bs.lightPos - 0.2f * diag);
+            const glm::vec3 hi = glm::min(bmax, bs.lightPos + 0.2f * diag);
+            positions.push_back(random_in_box(rng, lo, hi));
+        }
+        const glm::vec3 intensity = rp.lightIntensity / (float)count;
+
+        std::vector<glm::vec3> reference;
+        for (const glm::vec3& p : positions) {
+            LightSet one;
+            one.add_point(p, intensity);
+            Renderer single(bs.scene, bs.cam, bs.lightPos, rp);
+            single.set_lights(std::move(one));
+            const std::vector<glm::vec3> img = single.render_scene(59u, 0);
+            if (reference.empty()) reference.assign(img.size(), glm::vec3(0.0f));
+            for (size_t i = 0; i < img.size(); ++i) reference[i] += img[i];
+        }
+
+        LightSet all;
+        for (const glm::vec3& p : positions) all.add_point(p, intensity);
+        Renderer renderer(bs.scene, bs.cam, bs.lightPos, rp);
+        renderer.set_lights(std::move(all));
+
+        std::string line;
+        renderer.render_progressive(59u, 0, 64, [&](int pass, const std::vector<glm::vec3>& img) {
+            const int done = pass + 1;
+            if (done == 1 || done == 4 || done == 16 || done == 64) {
+                char buf[48];
+                std::snprintf(buf, sizeof(buf), "  %d passes %.4g", done, ImageUtil::rmse(img, reference));
+                line += buf;
+            }
+            return true;
+        });
+        std::printf("%-40s rmse vs all lights:%s\n", (prefix + "multi_light").c_str(), line.c_str());
+    }
+
+    // A short fly-by with reservoir reuse, against one render_scene frame,
+    // then a static camera. Errors are against a 256-pass path-traced
+    // reference, next to a single 1-path-per-pixel pass of it.
+    if (matches(prefix + "sequence", filter)) {
+        Renderer::RenderParams rp;
+        rp.Kmutations = 16;
+        rp.threads = 1;
+
+        Renderer single(bs.scene, bs.cam, bs.lightPos, rp);
+        Renderer::RenderStats rs;
+        const auto t0 = std::chrono::steady_clock::now();
+        single.render_scene(43u, 0, &rs);
+        const auto t1 = std::chrono::steady_clock::now();
+        std::printf("%-40s %8.1f ms/frame  %llu mutations\n", (prefix + "sequence_render_scene").c_str(),
+            std::chrono::duration<double, std::milli>(t1 - t0).count(),
+            (unsigned long long)rs.mutationAttempts);
+
+        auto path_traced = [&](const Renderer::Camera& cam, int passes) {
+            Renderer::RenderParams pt = rp;
+            pt.Kmutations = 0;
+            return Renderer(bs.scene, cam, bs.lightPos, pt).render_progressive(67u, 0, passes, nullptr);
+        };
+        auto mean = [](const std::vector<glm::vec3>& img) {
+            double sum = 0.0;
+            for (const glm::vec3& c : img) sum += (c.x + c.y + c.z) / 3.0;
+            return img.empty() ? 0.0 : sum / (double)img.size();
+        };
+
+        const glm::vec3 diag = bmax - bmin;
+        const int frames = 8;
+        Renderer::Camera last = bs.cam;
+        last.center.x += 0.01f * diag.x * (float)(frames - 1);
+        const std::vector<glm::vec3> reference = path_traced(last, 256);
+        const std::vector<glm::vec3> onePass = path_traced(last, 1);
+
+        SequenceRenderer seq(bs.scene, bs.cam, bs.lightPos, rp, SequenceRenderer::Params{});
+        SequenceRenderer::FrameStats fs;
+        std::vector<glm::vec3> img;
+        double total = 0.0;
+        for (int f = 0; f < frames; ++f) {
+            Renderer::Camera cam = bs.cam;
+            cam.center.x += 0.01f * diag.x * (float)f;
+            img = seq.render_frame(cam, 43u, &fs);
+            total += fs.seconds;
+        }
+        std::printf("%-40s %8.1f ms/frame  %llu new paths  %llu temporal  %llu spatial  %llu visibility rays"
+            "  rmse %.4g (1 pass %.4g)\n",
+            (prefix + "sequence").c_str(), 1e3 * total / frames,
+            (unsigned long long)fs.newPaths, (unsigned long long)fs.temporalReuse,
+            (unsigned long long)fs.spatialReuse, (unsigned long long)fs.visibilityRays,
+            ImageUtil::rmse(img, reference), ImageUtil::rmse(onePass, reference));
+
+        const std::vector<glm::vec3> staticRef = path_traced(bs.cam, 256);
+        SequenceRenderer still(bs.scene, bs.cam, bs.lightPos, rp, SequenceRenderer::Params{});
+        std::string line;
+        for (int f = 1; f <= 16; ++f) {
+            img = still.render_frame(bs.cam, 43u);
+            if (f == 1 || f == 4 || f == 16) {
+                char buf[64];
+                std::snprintf(buf, sizeof(buf), "  frame %d rmse %.4g mean %.4g", f,
+                    ImageUtil::rmse(img, staticRef), mean(img));
+                line += buf;
+            }
+        }
+        std::printf("%-40s reference mean %.4g  1 pass rmse %.4g%s\n", (prefix + "sequence_static").c_str(),
+            mean(staticRef), ImageUtil::rmse(path_traced(bs.cam, 1), staticRef), line.c_str());
+    }
+
+    // A K=4 render denoised at one, three (the default) and five iterations,
+    // scored against a 256-pass path-traced reference; a render at more
+    // mutations is no reference, as its error is close to the K=4 render's.
+    // Then the filter is timed on a nearest-upsampled copy at about a
+    // megapixel, with one Denoiser reused across frames as a sequence
+    // would use it.
+    if (matches(prefix + "denoise", filter)) {
+        Renderer::RenderParams rp;
+        rp.threads = 1;
+        rp.Kmutations = 0;
+        const std::vector<glm::vec3> reference =
+            Renderer(bs.scene, bs.cam, bs.lightPos, rp).render_progressive(47u, 0, 256, nullptr);
+
+        rp.Kmutations = 4;
+        Renderer low(bs.scene, bs.cam, bs.lightPos, rp);
+        Renderer::AOVs aovs;
+        const std::vector<glm::vec3> img = low.render_scene(47u, 0, nullptr, &aovs);
+
+        Denoiser denoiser(Denoiser::Params{});
+        std::vector<glm::vec3> filtered;
+        std::string line;
+        for (int iterations : { 1, 3, 5 }) {
+            Denoiser::Params dp;
+            dp.iterations = iterations;
+            Denoiser(dp).denoise(img, aovs, filtered);
+            char buf[64];
+            std::snprintf(buf, sizeof(buf), "  %d it %.4g", iterations, ImageUtil::rmse(filtered, reference));
+            line += buf;
+        }
+        std::printf("%-40s rmse vs reference: raw K=4 %.4g  denoised%s\n", (prefix + "denoise").c_str(),
+            ImageUtil::rmse(img, reference), line.c_str());
+
+        const int scale = 16;
+        const int W = aovs.width * scale;
+        const int H = aovs.height * scale;
+        Renderer::AOVs big;
+        big.resize(W, H);
+        std::vector<glm::vec3> bigImg((size_t)W * (size_t)H);
+        for (int y = 0; y < H; ++y) {
+            for (int x = 0; x < W; ++x) {
+                const size_t i = (size_t)y * (size_t)W + (size_t)x;
+                const size_t j = (size_t)(y / scale) * (size_t)aovs.width + (size_t)(x / scale);
+                bigImg[i] = img[j];
+                big.triangleId[i] = aovs.triangleId[j];
+                big.depth[i] = aovs.depth[j];
+                big.normal[i] = aovs.normal[j];
+                big.albedo[i] = aovs.albedo[j];
+            }
+        }
+
+        auto r = run_bench([&](uint64_t& ops, uint64_t& ok) {
+            if (denoiser.denoise(bigImg, big, filtered)) ++ok;
+            ++ops;
+        });
+        const double mp = (double)W * (double)H * 1e-6;
+        std::printf("%-40s %8.1f ms for %dx%d  %8.1f ms/megapixel\n", (prefix + "denoise_frame").c_str(),
+            r.nsPerOp * 1e-6, W, H, r.nsPerOp * 1e-6 / mp);
+    }
+
+    if (haveSeeds && matches(prefix + "compute_radiance_for_path", filter)) {
+        Renderer renderer(bs.scene, bs.cam, bs.lightPos);
+        renderer.resolve_light_visibility(seeds);
+
+        const int passes = 64;
+        volatile float sink = 0.0f;
+
+        auto r = run_bench([&](uint64_t& ops, uint64_t& nonzero) {
+            for (int p = 0; p < passes; ++p) {
+                for (const PathMutator::Path& path : seeds) {
+                    glm::vec3 L = renderer.compute_radiance_for_path(path);
+                    if (L.x + L.y + L.z > 0.0f) ++nonzero;
+                    sink = sink + L.x;
+                    ++ops;
+                }
+            }
+        });
+        report(prefix + "compute_radiance_for_path", r, "nonzero");
+    }
+}
+
+int main(int argc, char** argv) {
+    const std::string filter = (argc > 1) ? argv[1] : "";
+
+    bench_moller_trumbore(filter);
+    bench_image_encode(filter);
+    bench_light_sampling(filter);
+
+    std::vector<BenchScene> scenes(3);
+    scenes[0].name = "cornell";
+    scenes[1].name = "sphere";
+    scenes[2].name = "maze";
+
+    if (!ProceduralScene::build(scenes[0].scene, ProceduralScene::cornell_box(4)) ||
+        !ProceduralScene::build(scenes[1].scene, ProceduralScene::sphere_room(24)) ||
+        !ProceduralScene::build(scenes[2].scene, ProceduralScene::maze(6, 2))) {
+        std::cerr << "Failed to build procedural scenes\n";
+        return 1;
+    }
+
+    for (BenchScene& bs : scenes) {
+        setup_view(bs);
+        bench_scene(bs, filter);
+    }
+
+    return 0;
+}
@@ -0,0 +1,306 @@
+#include "scene.h"
+#include "Renderer.h"
+#include "ProceduralScene.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+// Scaling regression harness. Generates procedural scenes of increasing size,
+// renders each at several thread counts and records load time, rays/sec and
+// peak RSS. Results can be stored as a baseline and later runs compared
+// against it.
+//
+//   renderer_scaling [--scenes a,b,...] [--threads 1,2,4] [--size N]
+//                    [--mutations K] [--reps R] [--csv out.csv]
+//                    [--baseline in.csv] [--tolerance 0.15] [--trace out.json]
+//
+// Scenes use the ProceduralScene spec syntax (e.g. room:10000000). Each render
+// is repeated R times and the fastest is kept. Peak RSS is a process-wide
+// high-water mark, so scenes should be listed smallest first.
+// The exit code is 2 when a metric regressed past the tolerance.
+
+struct Options {
+    std::vector<std::string> scenes{ "cornell:8", "spheres:4:32", "maze:16:1", "room:100000", "room:1000000" };
+    std::vector<int> threads;
+    int size = 64;
+    int mutations = 16;
+    int reps = 3;
+    std::string csvPath;
+    std::string tracePath;
+    std::string baselinePath;
+    double tolerance = 0.15;
+};
+
+struct Result {
+    std::string scene;
+    int threads = 1;
+    uint64_t triangles = 0;
+    double loadMs = 0.0;
+    double renderMs = 0.0;
+    double raysPerSec = 0.0;
+    double peakRssMb = 0.0;
+};
+
+static double peak_rss_mb() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) return 0.0;
+    return (double)pmc.PeakWorkingSetSize / (1024.0 * 1024.0);
+#else
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0) return 0.0;
+#ifdef __APPLE__
+    return (double)ru.ru_maxrss / (1024.0 * 1024.0);
+#else
+    return (double)ru.ru_maxrss / 1024.0;
+#endif
+#endif
+}
+
+static std::vector<std::string> split(const std::string& s, char sep) {
+    std::vector<std::string> out;
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, sep)) {
+        if (!item.empty()) out.push_back(item);
+    }
+    return out;
+}
+
+// The whole of s as a number; false on anything else, including overflow.
+template <class T>
+static bool parse_number(const std::string& s, T& out) {
+    const char* end = s.data() + s.size();
+    const auto [p, ec] = std::from_chars(s.data(), end, out);
+    return ec == std::errc() && p == end;
+}
+
+static bool parse_args(int argc, char** argv, Options& opt) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string a = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "missing value for " << a << "\n";
+            return false;
+        }
+        const std::string v = argv[++i];
+
+        int n = 0;
+        bool ok = true;
+        if (a == "--scenes") opt.scenes = split(v, ',');
+        else if (a == "--threads") {
+            opt.threads.clear();
+            for (const std::string& t : split(v, ',')) {
+                ok = ok && parse_number(t, n);
+                opt.threads.push_back(std::max(1, n));
+            }
+        }
+        else if (a == "--size") { ok = parse_number(v, n); opt.size = std::max(1, n); }
+        else if (a == "--mutations") { ok = parse_number(v, n); opt.mutations = std::max(0, n); }
+        else if (a == "--reps") { ok = parse_number(v, n); opt.reps = std::max(1, n); }
+        else if (a == "--csv") opt.csvPath = v;
+        else if (a == "--trace") opt.tracePath = v;
+        else if (a == "--baseline") opt.baselinePath = v;
+        else if (a == "--tolerance") ok = parse_number(v, opt.tolerance);
+        else {
+            std::cerr << "unknown option " << a << "\n";
+            return false;
+        }
+
+        if (!ok) {
+            std::cerr << "invalid value for " << a << ": " << v << "\n";
+            return false;
+        }
+    }
+
+    if (opt.threads.empty()) {
+        const int hw = std::max(1, (int)std::thread::hardware_concurrency());
+        for (int t = 1; t < hw; t *= 2) opt.threads.push_back(t);
+        opt.threads.push_back(hw);
+    }
+    return true;
+}
+
+static const char* kCsvHeader = "scene,threads,triangles,load_ms,render_ms,rays_per_sec,peak_rss_mb";
+
+static bool write_csv(const std::string& path, const std::vector<Result>& results) {
+    std::ofstream out(path);
+    if (!out) {
+        std::cerr << "failed to open " << path << "\n";
+        return false;
+    }
+
+    out << kCsvHeader << "\n";
+    for (const Result& r : results) {
+        out << r.scene << "," << r.threads << "," << r.triangles << ","
+            << r.loadMs << "," << r.renderMs << "," << r.raysPerSec << "," << r.peakRssMb << "\n";
+    }
+    return true;
+}
+
+static bool read_csv(const std::string& path, std::map<std::string, Result>& out) {
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "failed to open baseline " << path << "\n";
+        return false;
+    }
+
+    std::string line;
+    std::getline(in, line);
+    while (std::getline(in, line)) {
+        std::vector<std::string> f = split(line, ',');
+        if (f.size() < 7) continue;
+
+        Result r;
+        r.scene = f[0];
+        if (!parse_number(f[1], r.threads) || !parse_number(f[2], r.triangles) ||
+            !parse_number(f[3], r.loadMs) || !parse_number(f[4], r.renderMs) ||
+            !parse_number(f[5], r.raysPerSec) || !parse_number(f[6], r.peakRssMb)) {
+            std::cerr << "skipping malformed baseline line: " << line << "\n";
+            continue;
+        }
+        out[r.scene + "@" + std::to_string(r.threads)] = r;
+    }
+    return true;
+}
+
+// Camera and light inside the unit room every procedural scene is built in.
+static Renderer::Camera make_camera(int size) {
+    Renderer::Camera cam;
+    cam.center = glm::vec3(0.5f, 0.45f, 0.98f);
+    cam.forward = glm::vec3(0.0f, 0.0f, -1.0f);
+    cam.world_up = glm::vec3(0.0f, 1.0f, 0.0f);
+    cam.width = size;
+    cam.height = size;
+    cam.pixel_size = 1.0f / (float)size;
+    cam.focal_length = 0.8f;
+    return cam;
+}
+
+int main(int argc, char** argv) {
+    Options opt;
+    if (!parse_args(argc, argv, opt)) {
+        std::cerr << "usage: renderer_scaling [--scenes a,b,...] [--threads 1,2,4] [--size N] [--mutations K]\n"
+            "                        [--reps R] [--csv out.csv] [--baseline in.csv] [--tolerance T]\n"
+            "                        [--trace out.json]\n";
+        return 1;
+    }
+
+    if (!opt.tracePath.empty()) {
+        Trace::enable();
+        Trace::set_thread_name("main");
+    }
+
+    std::vector<Result> results;
+
+    std::printf("%-20s %7s %12s %10s %10s %14s %10s\n",
+        "scene", "threads", "triangles", "load ms", "render ms", "rays/s", "peak MB");
+
+    for (const std::string& spec : opt.scenes) {
+        const auto t0 = std::chrono::steady_clock::now();
+
+        ProceduralScene::Mesh mesh;
+        if (!ProceduralScene::from_spec(spec, mesh)) return 1;
+
+        Scene scene;
+        if (!ProceduralScene::build(scene, mesh)) {
+            std::cerr << "failed to build " << spec << "\n";
+            return 1;
+        }
+        mesh = ProceduralScene::Mesh{};
+
+        const auto t1 = std::chrono::steady_clock::now();
+        const double loadMs = std::chrono::duration<double, std::milli>(t1 - t0).count();
+
+        Renderer::RenderParams params;
+        params.Kmutations = opt.mutations;
+        params.russianRoulette = true;
+
+        for (int threads : opt.threads) {
+            params.threads = threads;
+            Renderer renderer(scene, make_camera(opt.size), glm::vec3(0.5f, 0.9f, 0.5f), params);
+
+            Renderer::RenderStats stats;
+            double renderMs = 1e300;
+            for (int rep = 0; rep < opt.reps; ++rep) {
+                const auto r0 = std::chrono::steady_clock::now();
+                renderer.render_scene(1337u, 0, &stats);
+                const auto r1 = std::chrono::steady_clock::now();
+                renderMs = std::min(renderMs, std::chrono::duration<double, std::milli>(r1 - r0).count());
+            }
+
+            Result r;
+            r.scene = spec;
+            r.threads = threads;
+            r.triangles = scene.triangles().size();
+            r.loadMs = loadMs;
+            r.renderMs = renderMs;
+            r.raysPerSec = r.renderMs > 0.0 ? (double)stats.rays / (r.renderMs * 1e-3) : 0.0;
+            r.peakRssMb = peak_rss_mb();
+            results.push_back(r);
+
+            std::printf("%-20s %7d %12llu %10.1f %10.1f %14.0f %10.1f\n",
+                r.scene.c_str(), r.threads, (unsigned long long)r.triangles,
+                r.loadMs, r.renderMs, r.raysPerSec, r.peakRssMb);
+        }
+    }
+
+    if (!opt.tracePath.empty()) {
+        Trace::disable();
+        if (!Trace::write_json(opt.tracePath)) std::cerr << "failed to write trace " << opt.tracePath << "\n";
+    }
+
+    if (!opt.csvPath.empty() && !write_csv(opt.csvPath, results)) return 1;
+
+    if (opt.baselinePath.empty()) return 0;
+
+    std::map<std::string, Result> baseline;
+    if (!read_csv(opt.baselinePath, baseline)) return 1;
+
+    // Throughput may not drop, and load time and memory may not grow, by more
+    // than the tolerance.
+    int regressions = 0;
+    auto check = [&](const Result& r, const char* metric, double cur, double base, bool higherIsBetter) {
+        if (!(base > 0.0)) return;
+        const double change = (cur - base) / base;
+        const bool bad = higherIsBetter ? (change < -opt.tolerance) : (change > opt.tolerance);
+        if (bad) {
+            ++regressions;
+            std::printf("REGRESSION %s threads=%d %s: %.3g -> %.3g (%+.1f%%)\n",
+                r.scene.c_str(), r.threads, metric, base, cur, 100.0 * change);
+        }
+    };
+
+    for (const Result& r : results) {
+        auto it = baseline.find(r.scene + "@" + std::to_string(r.threads));
+        if (it == baseline.end()) {
+            std::printf("no baseline for %s threads=%d\n", r.scene.c_str(), r.threads);
+            continue;
+        }
+        const Result& b = it->second;
+        check(r, "rays_per_sec", r.raysPerSec, b.raysPerSec, true);
+        check(r, "load_ms", r.loadMs, b.loadMs, false);
+        check(r, "peak_rss_mb", r.peakRssMb, b.peakRssMb, false);
+    }
+
+    std::printf("%d regression(s) against %s\n", regressions, opt.baselinePath.c_str());
+    return regressions > 0 ? 2 : 0;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <cstdint>
+
+// Direction sampling for the Lambertian surfaces the renderer shades.
+// PathMutator draws bounce and retrace directions through a BSDFSampler, and
+// the renderer divides each bounce by pdf() of the direction actually taken,
+// so the radiance estimate and the Metropolis path densities stay consistent
+// with whichever sampler produced the path. pdf() is in solid angle measure
+// and only depends on the vertex position, the normal and the direction, so
+// it can be evaluated again after a mutation moved a vertex (the built-in
+// samplers ignore the position, GuidedSampler does not). Directions are a
+// deterministic mapping of a 2D sample u in [0,1)^2, so a Sampler can supply
+// stratified values. Implementations must not change during a render (they
+// are shared by all render threads).
+class BSDFSampler {
+public:
+    enum Type : uint8_t {
+        UNIFORM = 0,   // uniform over the hemisphere, pdf 1 / 2pi
+        COSINE = 1     // cosine weighted, pdf cos / pi
+    };
+
+    virtual ~BSDFSampler() = default;
+
+    // Maps u to a direction in the hemisphere around the unit normal n at
+    // position p. Returns false if no usable direction was produced.
+    virtual bool sample(const glm::vec3& p,
+        const glm::vec3& n,
+        const glm::vec2& u,
+        glm::vec3& dir,
+        float& pdf) const = 0;
+
+    // Density of sample() producing the unit direction dir; 0 below the
+    // surface.
+    virtual float pdf(const glm::vec3& p, const glm::vec3& n, const glm::vec3& dir) const = 0;
+
+    // Shared instance of a built-in sampler.
+    static const BSDFSampler& get(Type type);
+};
+
+class UniformHemisphereSampler : public BSDFSampler {
+public:
+    bool sample(const glm::vec3& p,
+        const glm::vec3& n,
+        const glm::vec2& u,
+        glm::vec3& dir,
+        float& pdf) const override;
+
+    float pdf(const glm::vec3& p, const glm::vec3& n, const glm::vec3& dir) const override;
+};
+
+class CosineHemisphereSampler : public BSDFSampler {
+public:
+    bool sample(const glm::vec3& p,
+        const glm::vec3& n,
+        const glm::vec2& u,
+        glm::vec3& dir,
+        float& pdf) const override;
+
+    float pdf(const glm::vec3& p, const glm::vec3& n, const glm::vec3& dir) const override;
+};
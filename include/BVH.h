@@ -0,0 +1,65 @@
+#pragma once
+
+#include "GeomUtil.h"
+
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// Bounding volume hierarchy over the scene triangles, built with binned SAH.
+// Triangle indices reported by the queries refer to the array passed to
+// build(), so callers keep using their own triangle storage.
+class BVH {
+public:
+    struct Node {
+        glm::vec3 bmin;
+        uint32_t  leftFirst = 0;   // first child for inner nodes, first triangle for leaves
+        glm::vec3 bmax;
+        uint32_t  count = 0;       // 0 for inner nodes
+    };
+
+    void build(const std::vector<GeomUtil::Triangle>& triangles);
+    void clear();
+
+    bool empty() const { return m_nodes.empty(); }
+    size_t node_count() const { return m_nodes.size(); }
+    size_t memory_bytes() const;
+
+    // Closest hit with t in [tMin, tMax). Returns the original triangle index.
+    bool intersect(const glm::vec3& origin,
+        const glm::vec3& dir,
+        float tMin,
+        float tMax,
+        int& triIndex,
+        float& t,
+        float& u,
+        float& v) const;
+
+    // Any hit with t in [tMin, tMax).
+    bool occluded(const glm::vec3& origin,
+        const glm::vec3& dir,
+        float tMin,
+        float tMax) const;
+
+private:
+    // Triangles in leaf order with the edges precomputed for Moller-Trumbore.
+    struct Tri {
+        glm::vec3 v0, e1, e2;
+    };
+
+    template <bool AnyHit>
+    bool traverse(const glm::vec3& origin,
+        const glm::vec3& dir,
+        float tMin,
+        float tMax,
+        int& triIndex,
+        float& t,
+        float& u,
+        float& v) const;
+
+private:
+    std::vector<Node>     m_nodes;
+    std::vector<Tri>      m_tris;
+    std::vector<uint32_t> m_triIndex;
+};
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "Renderer.h"
+
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// Binary log of per-pixel mutation chains for offline profiling and replay.
+//
+// Layout (little-endian, every record 8-byte aligned):
+//   FileHeader; the settings block (camera, light position and render
+//   parameters, field by field); the scene description;
+//   per chain: ChainHeader, seedVertices glm::vec3, steps Renderer::ChainStep;
+//   an index of uint64 chain offsets and a Trailer at the end of the file.
+//
+// The settings are written as an explicit list of 4-byte fields (see
+// ChainRecorder.cpp), so logs do not depend on the in-memory layout of
+// Camera or RenderParams; any change to that list bumps kVersion.
+// write() may be called from several render threads at once.
+class ChainRecorder {
+public:
+    static constexpr uint32_t kVersion = 3;
+
+    struct FileHeader {
+        char     magic[8];        // "PMCHAIN\0"
+        uint32_t version;
+        uint32_t settingsBytes;
+        uint32_t sceneBytes;
+        uint32_t reserved;
+    };
+
+    struct ChainHeader {
+        uint32_t magic;           // 'CHN1'
+        int32_t  px;
+        int32_t  py;
+        uint32_t renderSeed;
+        uint32_t pixelSeed;
+        int32_t  mutatorType;
+        int32_t  pass;
+        uint32_t seedVertices;
+        uint32_t steps;
+        float    result[3];
+        uint32_t seedOk;
+        uint32_t reserved;
+        double   micros;
+    };
+
+    struct Trailer {
+        uint64_t indexOffset;
+        uint64_t chainCount;
+        char     magic[8];        // "PMCHEND\0"
+    };
+
+    // Pixels to record: the listed ones plus a pseudo-random `fraction` of
+    // all pixels (picked by hashing the pixel with `salt`).
+    struct Selection {
+        std::vector<std::pair<int, int>> pixels;
+        float    fraction = 0.0f;
+        uint32_t salt = 0;
+    };
+
+public:
+    ChainRecorder() = default;
+    ~ChainRecorder();
+
+    ChainRecorder(const ChainRecorder&) = delete;
+    ChainRecorder& operator=(const ChainRecorder&) = delete;
+
+    // scene describes how to rebuild the scene for replay: a ProceduralScene
+    // spec or a model path.
+    bool open(const std::string& path,
+        const Renderer& renderer,
+        const std::string& scene,
+        const Selection& selection);
+
+    bool wants(int px, int py) const;
+
+    void write(const Renderer::Chain& chain);
+
+    // Writes the index and trailer. Returns false if any write failed.
+    bool close();
+
+    uint64_t chain_count() const { return m_offsets.size(); }
+
+private:
+    std::ofstream m_out;
+    std::mutex    m_mutex;
+
+    std::unordered_set<uint64_t> m_pixels;
+    uint32_t m_threshold = 0;
+    uint32_t m_salt = 0;
+
+    std::vector<uint64_t> m_offsets;
+    uint64_t m_pos = 0;
+    bool     m_failed = false;
+};
+
+// Reads a log written by ChainRecorder. Chains are loaded on demand through
+// the offset index.
+class ChainLog {
+public:
+    bool open(const std::string& path);
+
+    const Renderer::Camera&       camera() const { return m_cam; }
+    const glm::vec3&              light_pos() const { return m_lightPos; }
+    const Renderer::RenderParams& params() const { return m_params; }
+    const std::string&            scene() const { return m_scene; }
+
+    size_t chain_count() const { return m_offsets.size(); }
+    bool read_chain(size_t i, Renderer::Chain& out);
+
+private:
+    std::ifstream m_in;
+
+    Renderer::Camera       m_cam;
+    glm::vec3              m_lightPos{ 0.0f };
+    Renderer::RenderParams m_params;
+    std::string            m_scene;
+
+    std::vector<uint64_t> m_offsets;
+};
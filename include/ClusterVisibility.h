@@ -0,0 +1,71 @@
+#pragma once
+
+#include "scene.h"
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <vector>
+
+// Precomputed from-region visibility between clusters of surface. The scene
+// bounds are cut into a grid of cells; every cell a triangle's bounds touch
+// is one cluster. build() merges coplanar triangles that share an edge into
+// convex polygons, the occluders, and marks a pair of clusters occluded only
+// if one occluder separates their cells: the cells lie strictly on opposite
+// sides of its plane, and all 64 corner-to-corner segments cross the plane
+// inside the polygon. Every segment between the two cells then crosses it
+// too, because the crossings of all such segments lie in the convex hull of
+// the corner crossings. Pairs are stored in a packed upper-triangular bitset.
+//
+// maybe_visible() answers from the table without tracing: false means every
+// segment between the two points passes through one occluder, so a mutation
+// can reject the connection before its shadow ray. The table is
+// conservative; it misses occlusion by several occluders together, which
+// the shadow ray still finds. Points in cells without surface always count
+// as maybe visible.
+//
+// The build costs O(clusters^2 * occluders) cheap plane-side tests plus the
+// polygon tests of the candidates; resolution and maxOccluders bound it.
+class ClusterVisibility {
+public:
+    struct Params {
+        bool enabled = false;
+        int  resolution = 12;        // cells along the longest scene axis
+        // Only the largest occluders by area are kept.
+        int  maxOccluders = 4096;
+        int  threads = 0;            // build threads, 0 = all hardware threads
+    };
+
+    struct BuildInfo {
+        size_t clusters = 0;
+        size_t pairs = 0;
+        size_t occludedPairs = 0;
+        size_t occluders = 0;
+        double seconds = 0.0;
+        size_t bytes = 0;
+    };
+
+public:
+    // Returns false if the scene has no triangles.
+    bool build(const Scene& scene, const Params& params);
+
+    bool maybe_visible(const glm::vec3& a, const glm::vec3& b) const;
+
+    // Cluster of the cell containing p, or -1.
+    int cluster_of(const glm::vec3& p) const;
+
+    const BuildInfo& info() const { return m_info; }
+
+private:
+    size_t pair_bit(int i, int j) const;
+
+private:
+    glm::vec3 m_origin{ 0.0f };
+    float     m_invCell = 1.0f;
+    int       m_dims[3] = { 0, 0, 0 };
+
+    std::vector<int32_t>  m_cellCluster;   // -1 for cells without surface
+    std::vector<uint64_t> m_occluded;      // bit per cluster pair i < j
+    int                   m_clusters = 0;
+
+    BuildInfo m_info;
+};
@@ -47,7 +47,20 @@ public:
         std::uniform_real_distribution<float>& u01
     );
 
+    // Cosine-weighted (Malley's method): pdf = cos(theta) / pi.
+    static glm::vec3 sample_hemisphere_cosine(
+        const glm::vec3& n,
+        std::mt19937& rng,
+        std::uniform_real_distribution<float>& u01
+    );
+
+    // The same mappings from a 2D sample u in [0,1)^2; the rng versions use
+    // two consecutive draws as u.
+    static glm::vec3 sample_hemisphere_uniform(const glm::vec3& n, const glm::vec2& u);
+    static glm::vec3 sample_hemisphere_cosine(const glm::vec3& n, const glm::vec2& u);
+
     static glm::vec3 face_normal_geom(const Triangle& t);
+    static glm::vec3 interpolated_normal(const Triangle& t, const glm::vec3& bary);
     static glm::vec3 project_to_plane(const glm::vec3& d, const glm::vec3& n);
 
     static float cross2(const glm::vec2& a, const glm::vec2& b);
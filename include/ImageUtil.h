@@ -0,0 +1,99 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+class ImageUtil {
+public:
+    // Root-mean-square error over all channels. Returns a negative value if the
+    // images differ in size.
+    static double rmse(const std::vector<glm::vec3>& img,
+        const std::vector<glm::vec3>& reference);
+
+    // Relative MSE, mean of (img - ref)^2 / (ref^2 + eps) over all channels,
+    // which keeps bright regions from dominating the error.
+    static double rel_mse(const std::vector<glm::vec3>& img,
+        const std::vector<glm::vec3>& reference,
+        double eps = 1e-2);
+
+    // Encoders fill `out` with the complete file. Rows are encoded in parallel
+    // for large images. They return false if img does not hold W * H pixels.
+
+    // Linear value to 8-bit byte: clamped to [0,1] and gamma-encoded through a
+    // table of per-byte thresholds, equivalent to lround(pow(c, 1/gamma) * 255)
+    // up to float rounding exactly at code boundaries. gamma <= 0 encodes
+    // linearly. NaN encodes as 0.
+    class ByteEncoder {
+    public:
+        explicit ByteEncoder(float gamma);
+
+        uint8_t operator()(float c) const {
+            const float v = c >= 0.0f ? std::min(c, 1.0f) : 0.0f;
+
+            // The float's exponent and top mantissa bits pick a bucket; walk
+            // up from the bucket's first byte (a few steps at most).
+            uint32_t bits;
+            std::memcpy(&bits, &v, sizeof(bits));
+            int b = m_start[bits >> kBucketShift];
+            while (v >= m_thresholds[b + 1]) ++b;
+            return (uint8_t)b;
+        }
+
+    private:
+        static constexpr int      kBucketShift = 17;
+        static constexpr uint32_t kBuckets = (0x3f800000u >> kBucketShift) + 1;
+
+        // m_thresholds[b] is the smallest value that encodes to byte b.
+        float   m_thresholds[257];
+        uint8_t m_start[kBuckets];
+    };
+
+    // Binary 8-bit PPM, encoded with ByteEncoder.
+    static bool encode_ppm(const std::vector<glm::vec3>& img, int W, int H,
+        float gamma,
+        std::vector<uint8_t>& out);
+
+    // Portable float map, linear and unclamped.
+    static bool encode_pfm(const std::vector<glm::vec3>& img, int W, int H,
+        std::vector<uint8_t>& out);
+
+    // Single-part scanline OpenEXR without compression, with R, G and B
+    // channels stored as half or float. Linear and unclamped.
+    static bool encode_exr(const std::vector<glm::vec3>& img, int W, int H,
+        bool halfFloat,
+        std::vector<uint8_t>& out);
+
+    static bool write_ppm(const std::string& path, const std::vector<glm::vec3>& img, int W, int H,
+        float gamma = 2.2f);
+    static bool write_pfm(const std::string& path, const std::vector<glm::vec3>& img, int W, int H);
+    static bool write_exr(const std::string& path, const std::vector<glm::vec3>& img, int W, int H,
+        bool halfFloat = true);
+
+    // Picks the format from the extension: .ppm, .pfm or .exr (half).
+    static bool write_image(const std::string& path, const std::vector<glm::vec3>& img, int W, int H);
+
+    // File headers, for writers that place pixel data themselves. The EXR
+    // header includes the scanline offset table; each scanline chunk that
+    // follows is exr_chunk_bytes long.
+    static std::string ppm_header(int W, int H);
+    static std::string pfm_header(int W, int H);
+    static void exr_header(int W, int H, bool halfFloat, std::vector<uint8_t>& out);
+    static size_t exr_chunk_bytes(int W, bool halfFloat);
+
+    static uint16_t float_to_half(float f);
+
+    // Runs fn(y0, y1) over [0, H) split into row ranges, on several threads
+    // when the image has at least minPixels pixels. The default suits a few
+    // operations per pixel; passes that spend far longer per pixel lower it.
+    static void parallel_rows(int W, int H, const std::function<void(int, int)>& fn,
+        size_t minPixels = (size_t)1 << 20);
+
+private:
+    static bool write_file(const std::string& path, const std::vector<uint8_t>& data);
+};
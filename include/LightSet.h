@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// Point and emissive-triangle lights for next-event estimation, with a light
+// BVH over them. sample() walks the tree from the root and picks each child
+// in proportion to an importance estimate for the shading point: the child's
+// power over the squared distance to its bounds, or zero when the bounds lie
+// entirely below the surface (and, at a triangle leaf, when the point is
+// behind the emitting side). Lights are picked roughly in proportion to
+// their contribution, and a sample costs one step per tree level, so NEE
+// grows with the log of the light count rather than linearly.
+//
+// Importance is only zero where the light cannot contribute, so the estimate
+// stays unbiased however rough it is. Emitter orientation is not bounded
+// above the leaves; strongly one-sided clusters are sampled less well.
+class LightSet {
+public:
+    enum Type : uint8_t {
+        POINT = 0,
+        TRIANGLE = 1
+    };
+
+    struct Light {
+        Type      type = POINT;
+        glm::vec3 p0{ 0.0f };          // position, or the first triangle vertex
+        glm::vec3 p1{ 0.0f };
+        glm::vec3 p2{ 0.0f };
+        glm::vec3 n{ 0.0f };           // unit normal of the emitting side
+        float     area = 0.0f;
+        glm::vec3 emission{ 0.0f };    // intensity for POINT, radiance for TRIANGLE
+        float     power = 0.0f;        // luminance of the emitted flux
+    };
+
+    struct Sample {
+        glm::vec3 p{ 0.0f };    // point on the light
+        // Radiance arriving at the shading point from p, already divided by
+        // the selection and position densities; times the BSDF and the
+        // receiver cosine it gives the NEE estimate.
+        glm::vec3 Li{ 0.0f };
+        float     pmf = 0.0f;   // probability of choosing this light
+        int       light = -1;
+    };
+
+public:
+    void add_point(const glm::vec3& p, const glm::vec3& intensity);
+    // Emits on the side where (p1 - p0) x (p2 - p0) points.
+    void add_triangle(const glm::vec3& p0, const glm::vec3& p1, const glm::vec3& p2, const glm::vec3& radiance);
+
+    // Builds the tree; call after the last add_*.
+    void build();
+    void clear();
+
+    bool empty() const { return m_lights.empty(); }
+    size_t size() const { return m_lights.size(); }
+    const Light& light(int i) const { return m_lights[i]; }
+    size_t node_count() const { return m_nodes.size(); }
+
+    // Picks a light for shading point x with normal n using u.x, and a point
+    // on it using u.y and u.z. Returns false when the walk ends in a subtree
+    // with no light that can reach x; the sample then counts as zero, and
+    // the pmf of the other lights already accounts for that.
+    bool sample(const glm::vec3& x, const glm::vec3& n, const glm::vec3& u, Sample& out) const;
+
+    // Probability that sample() picks light i at (x, n).
+    float pmf(const glm::vec3& x, const glm::vec3& n, int i) const;
+
+private:
+    struct Node {
+        glm::vec3 bmin;
+        int32_t   left = -1;     // -1 for leaves
+        glm::vec3 bmax;
+        int32_t   right = -1;
+        float     power = 0.0f;
+        int32_t   light = -1;    // leaves only
+        int32_t   parent = -1;
+    };
+
+    int build_node(std::vector<int>& order, int begin, int end, int parent);
+    float importance(const Node& node, const glm::vec3& x, const glm::vec3& n) const;
+
+private:
+    std::vector<Light> m_lights;
+    std::vector<Node>  m_nodes;
+    std::vector<int>   m_leafOf;    // leaf node of each light
+};
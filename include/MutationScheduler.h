@@ -0,0 +1,97 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+// Adaptive mixture over the mutation strategies (retrace, meshwalk, project,
+// resample, subpath). Attempts, accepts, accepted contribution and cost are
+// tracked per strategy, per path vertex index and optionally per image
+// region; selection probabilities follow the accepted contribution per
+// microsecond, with a floor so that no strategy is ever starved.
+//
+// The probabilities are frozen for a pass, so a chain's proposal kernel does
+// not change while it runs. Each render thread records into its own Tally;
+// after the pass the tallies are merged and update() recomputes the tables
+// for the next one. select() and probability() only read the tables and may
+// be called from any thread during a pass.
+//
+// Strategies are named by their mutator type. Type 4 is the scheduler
+// itself, so the subpath mutation is type 5 and takes the fifth slot.
+class MutationScheduler {
+public:
+    static constexpr int kNumStrategies = 5;
+    static constexpr std::array<int, kNumStrategies> kStrategies{ 0, 1, 2, 3, 5 };
+
+    struct Params {
+        int   regionsX = 1;
+        int   regionsY = 1;
+        int   maxVertexIndex = 16;
+        float minProbability = 0.05f;
+        int   warmupAttempts = 32;
+    };
+
+    struct Stats {
+        std::array<double, kNumStrategies> attempts{};
+        std::array<double, kNumStrategies> accepts{};
+        std::array<double, kNumStrategies> contribution{};
+        std::array<double, kNumStrategies> micros{};
+
+        double total_attempts() const;
+    };
+
+    // One render thread's records for a pass, bucketed like the scheduler's.
+    struct Tally {
+        std::vector<Stats> region;
+        std::vector<Stats> vertex;
+        Stats              totals;
+    };
+
+public:
+    MutationScheduler(int width, int height);
+    MutationScheduler(int width, int height, const Params& params);
+
+    // Returns a mutator type from kStrategies.
+    int select(int px, int py, int vertexIndex, float u) const;
+
+    double probability(int px, int py, int vertexIndex, int strategy) const;
+
+    // An empty tally sized for this scheduler.
+    Tally make_tally() const;
+
+    void record(Tally& tally, int px, int py, int vertexIndex, int strategy,
+        bool accepted,
+        double contribution,
+        double micros) const;
+
+    // Adds a finished tally to the scheduler's statistics and clears it. Call
+    // after the threads that recorded into it have joined.
+    void merge(Tally& tally);
+
+    // Recomputes the selection tables from the statistics merged so far.
+    void update();
+
+    const Stats& totals() const { return m_totals; }
+
+private:
+    int region_of(int px, int py) const;
+    int vertex_slot(int vertexIndex) const;
+    // Slot of a mutator type in the Stats arrays, or -1.
+    static int strategy_slot(int strategy);
+
+    std::array<double, kNumStrategies> probabilities(int region, int slot) const;
+    std::array<double, kNumStrategies> probabilities_from(const Stats& s) const;
+
+private:
+    int    m_width = 1;
+    int    m_height = 1;
+    Params m_params;
+
+    std::vector<Stats> m_regionStats;
+    std::vector<Stats> m_vertexStats;
+    Stats              m_totals;
+
+    // Selection probabilities per region and vertex slot, fixed between
+    // update() calls.
+    std::vector<std::array<double, kNumStrategies>> m_tables;
+};
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "path_mutator.h"
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// Streams light paths to a binary little-endian PLY file as polylines: one
+// coloured vertex per path vertex and one edge per segment. Vertex records
+// are written through a fixed-size buffer as paths arrive; only the vertex
+// count of each path is kept, and the edges are generated from those counts
+// on close. The header's element counts are reserved as fixed-width fields
+// and patched on close. Not thread-safe.
+class PathExporter {
+public:
+    PathExporter() = default;
+    ~PathExporter();
+
+    PathExporter(const PathExporter&) = delete;
+    PathExporter& operator=(const PathExporter&) = delete;
+
+    bool open(const std::string& path);
+
+    // Paths with fewer than two vertices are skipped. Edge indices are
+    // 32-bit, so a path that would take the file past 2^31 vertices is
+    // dropped and close() reports failure.
+    void add_path(const PathMutator::Path& path, const glm::vec3& color);
+    void add_polyline(const glm::vec3* points, size_t count, const glm::vec3& color);
+
+    // Writes the edges and final counts. Returns false if any write failed.
+    bool close();
+
+    bool is_open() const { return m_out.is_open(); }
+    uint64_t path_count() const { return m_counts.size(); }
+    uint64_t vertex_count() const { return m_vertices; }
+    uint64_t edge_count() const { return m_vertices - m_counts.size(); }
+
+private:
+    void flush();
+
+private:
+    std::ofstream         m_out;
+    std::vector<uint8_t>  m_buffer;
+    std::vector<uint32_t> m_counts;
+    uint64_t              m_vertices = 0;
+    bool                  m_failed = false;
+};
@@ -0,0 +1,118 @@
+#pragma once
+
+#include "BSDFSampler.h"
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <vector>
+
+// Online path guiding in the style of an SD-tree: a binary tree over the
+// scene bounds whose leaves each hold a quadtree over the sphere of
+// directions (cylindrical equal-area mapping). The renderer records the
+// incident radiance its seed paths find along each bounce, and update(),
+// called between progressive passes, turns all records so far into new
+// sampling distributions: quadrants holding more than directionalThreshold
+// of a leaf's energy are subdivided, and spatial leaves holding more than
+// spatialThreshold records are split in half.
+//
+// Sampling and pdf only read the distributions built by the last update(),
+// so they may run on every render thread at once. record() accumulates in
+// fixed point with atomic integer adds, which keeps the trained
+// distributions, and with them the image, independent of the thread count.
+class PathGuide {
+public:
+    struct Params {
+        bool  enabled = false;
+        // Share of bounce directions drawn from the guide; the rest come from
+        // the BSDF sampler, which keeps every direction reachable. Clamped to
+        // [0, 0.95].
+        float fraction = 0.5f;
+        int   spatialThreshold = 4000;
+        float directionalThreshold = 0.01f;
+        int   maxSpatialDepth = 24;
+        int   maxDirectionalDepth = 12;
+    };
+
+public:
+    PathGuide(const glm::vec3& boundsMin, const glm::vec3& boundsMax, const Params& params);
+
+    // Radiance (luminance) arriving at p from the unit direction dir, which
+    // was sampled with solid angle density pdf.
+    void record(const glm::vec3& p, const glm::vec3& dir, float radiance, float pdf);
+
+    // Rebuilds the distributions from the records so far. Must not run
+    // concurrently with rendering.
+    void update();
+
+    // Spatial leaf containing p, or -1 if it has no distribution yet.
+    int region(const glm::vec3& p) const;
+
+    // Draws a direction from the distribution of region, pdf in solid angle
+    // measure.
+    bool sample(int region, const glm::vec2& u, glm::vec3& dir, float& pdf) const;
+    float pdf(int region, const glm::vec3& dir) const;
+
+    const Params& params() const { return m_params; }
+    int iterations() const { return m_iterations; }
+    size_t regions() const { return m_leaves.size(); }
+
+private:
+    // Quadrant q covers [qx/2, (qx+1)/2) x [qy/2, (qy+1)/2) of its node with
+    // q = qx + 2 qy; child 0 marks a leaf quadrant.
+    struct QuadNode {
+        float    energy[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        uint32_t child[4] = { 0, 0, 0, 0 };
+    };
+
+    struct Leaf {
+        std::vector<QuadNode> nodes;      // sampling distribution
+        float                 total = 0.0f;
+        std::vector<uint64_t> records;    // fixed-point energy, 4 per node
+        uint32_t              count = 0;  // records, halved by each split
+        int                   depth = 0;
+    };
+
+    struct SpatialNode {
+        glm::vec3 bmin{ 0.0f };
+        glm::vec3 bmax{ 0.0f };
+        int   child[2] = { -1, -1 };
+        int   leaf = -1;              // -1 for inner nodes
+        int   axis = 0;
+    };
+
+    int find_leaf(const glm::vec3& p) const;
+    void rebuild_directions(Leaf& leaf) const;
+    void split_leaf(int node);
+
+    static glm::vec2 dir_to_square(const glm::vec3& dir);
+    static glm::vec3 square_to_dir(const glm::vec2& u);
+
+private:
+    Params m_params;
+    std::vector<SpatialNode> m_nodes;
+    std::vector<Leaf>        m_leaves;
+    int m_iterations = 0;
+};
+
+// Mixes a PathGuide with a BSDF sampler: a fraction of the directions comes
+// from the guide where it has a distribution, and pdf() is the mixture
+// density, so estimates stay unbiased wherever the BSDF sampler is.
+class GuidedSampler : public BSDFSampler {
+public:
+    GuidedSampler(const PathGuide& guide, const BSDFSampler& bsdf);
+
+    bool sample(const glm::vec3& p,
+        const glm::vec3& n,
+        const glm::vec2& u,
+        glm::vec3& dir,
+        float& pdf) const override;
+
+    float pdf(const glm::vec3& p, const glm::vec3& n, const glm::vec3& dir) const override;
+
+    const BSDFSampler& bsdf() const { return m_bsdf; }
+
+private:
+    const PathGuide&   m_guide;
+    const BSDFSampler& m_bsdf;
+    float              m_fraction = 0.5f;
+};
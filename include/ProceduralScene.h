@@ -0,0 +1,61 @@
+#pragma once
+
+#include "scene.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// Built-in test scenes generated in memory, so benchmarks and tools do not
+// depend on external asset paths.
+class ProceduralScene {
+public:
+    struct Mesh {
+        std::vector<glm::vec3> positions;
+        std::vector<glm::vec3> normals;
+        std::vector<uint32_t>  indices;
+
+        size_t triangle_count() const { return indices.size() / 3; }
+
+        // nu x nv quad grid spanning origin + [0,1]*edgeU + [0,1]*edgeV, facing
+        // along cross(edgeU, edgeV). Grid vertices are shared.
+        void add_grid(const glm::vec3& origin,
+            const glm::vec3& edgeU,
+            const glm::vec3& edgeV,
+            int nu,
+            int nv);
+
+        // Axis-aligned box with outward-facing sides.
+        void add_box(const glm::vec3& bmin, const glm::vec3& bmax, int subdiv);
+
+        void add_sphere(const glm::vec3& center, float radius, int rings);
+
+        // Shared-vertex OBJ with per-vertex normals.
+        bool export_obj(const std::string& path) const;
+    };
+
+    // Unit room open towards +z with two boxes, walls split subdiv x subdiv.
+    static Mesh cornell_box(int subdiv = 4);
+
+    // Unit room with a tessellated sphere of `rings` latitude bands.
+    static Mesh sphere_room(int rings = 32);
+
+    // n x n tessellated spheres standing on the floor of a closed unit room.
+    static Mesh sphere_grid(int n, int rings);
+
+    // Closed unit room holding a cells x cells perfect maze (depth-first
+    // backtracker, fixed seed). Wall boxes are split subdiv x subdiv per side.
+    static Mesh maze(int cells, int subdiv, uint32_t seed = 1u);
+
+    // Closed unit room whose six walls are tessellated to roughly
+    // targetTriangles triangles in total.
+    static Mesh closed_room(uint64_t targetTriangles);
+
+    // Parses "cornell[:subdiv]", "sphere[:rings]", "spheres:n[:rings]",
+    // "maze:cells[:subdiv]" or "room:triangles" and generates that scene.
+    static bool from_spec(const std::string& spec, Mesh& out);
+
+    static bool build(Scene& scene, const Mesh& mesh);
+};
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+// Spatial hash of outgoing radiance on diffuse surfaces, keyed by a grid
+// cell of the position and a coarse bin of the normal. Outgoing radiance of
+// a Lambertian surface does not depend on direction, so one value per cell
+// serves every path that ends there.
+//
+// The renderer adds the radiance its seed paths carry out of each vertex
+// and lets sample_path stop at a vertex whose cell has at least minSamples
+// of them, reading the rest of the path from the cache. This trades a
+// little bias (the cell average instead of the exact point) for shorter
+// paths.
+//
+// add() and lookup() are lock-free and may be called from every render
+// thread at once: slots are claimed with a compare-and-swap on the key and
+// filled with atomic adds, with linear probing on collisions. A full probe
+// window drops the sample. Because threads fill the cache concurrently, a
+// render that uses it depends on the thread count and on scheduling.
+class RadianceCache {
+public:
+    struct Params {
+        bool  enabled = false;
+        // Paths stop at the first vertex at or past this index (1 is the
+        // primary hit) whose cell has a cached value.
+        int   depth = 2;
+        // Cell edge as a fraction of the scene diagonal.
+        float cellSize = 0.02f;
+        int   log2Entries = 18;
+        int   minSamples = 16;
+    };
+
+public:
+    RadianceCache(float cellSize, int log2Entries, int minSamples);
+
+    RadianceCache(const RadianceCache&) = delete;
+    RadianceCache& operator=(const RadianceCache&) = delete;
+
+    void add(const glm::vec3& p, const glm::vec3& n, const glm::vec3& L);
+
+    // Mean of the cell's samples, if it has at least minSamples.
+    bool lookup(const glm::vec3& p, const glm::vec3& n, glm::vec3& L) const;
+
+    void clear();
+
+    size_t capacity() const { return m_mask + 1; }
+    size_t occupied() const;
+
+private:
+    struct Entry {
+        std::atomic<uint64_t> key{ 0 };
+        std::atomic<uint32_t> count{ 0 };
+        std::atomic<float>    sum[3];
+    };
+
+    uint64_t key_of(const glm::vec3& p, const glm::vec3& n) const;
+
+    static constexpr int kMaxProbes = 16;
+
+private:
+    std::unique_ptr<Entry[]> m_entries;
+    size_t   m_mask = 0;
+    float    m_invCell = 1.0f;
+    uint32_t m_minSamples = 1;
+};
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Light-independent record of a render, for relighting it. A pixel's
+// estimate is a weighted sum of path radiances, and a path's radiance is a
+// sum of next-event terms, throughput * BSDF * Li * cos, over its surface
+// vertices. Only Li depends on the lights, so the store keeps, per pixel, the
+// distinct surface vertices with their normals, the random numbers of their
+// light samples and the summed estimator weight times throughput.
+// Renderer::relight re-evaluates them with one light sample and shadow ray
+// per stored vertex instead of a re-render.
+//
+// Mutation chains share most vertices between states, so merging vertices
+// by position keeps a pixel at roughly one vertex per accepted mutation plus
+// one path, far smaller than the paths themselves.
+class RelightStore {
+public:
+    struct Vertex {
+        glm::vec3 p{ 0.0f };
+        int32_t   index = 0;         // position in its path
+        glm::vec3 n{ 0.0f };
+        glm::vec3 lightU{ 0.0f };    // random numbers of its light sample
+        glm::vec3 weight{ 0.0f };
+    };
+
+    // One pixel's vertices while it renders; each render thread keeps one.
+    class Pixel {
+    public:
+        void add(const glm::vec3& p, int index, const glm::vec3& n, const glm::vec3& lightU, const glm::vec3& weight);
+        void scale(float s);
+        void clear();
+
+    private:
+        friend class RelightStore;
+
+        std::vector<Vertex>                    m_vertices;
+        std::unordered_map<uint64_t, uint32_t> m_lookup;
+    };
+
+public:
+    void reset(int width, int height);
+
+    // Moves pixel into (px, py), after what earlier passes stored there, and
+    // clears it. Different pixels may be stored from different threads.
+    void store(int px, int py, Pixel& pixel);
+
+    // Counts a finished pass; relighting averages over the passes.
+    void end_pass() { ++m_passes; }
+
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+    int passes() const { return m_passes; }
+    bool empty() const { return m_pixels.empty(); }
+
+    const std::vector<Vertex>& pixel(int px, int py) const {
+        return m_pixels[(size_t)py * (size_t)m_width + (size_t)px];
+    }
+
+    size_t vertex_count() const;
+    size_t memory_bytes() const;
+
+private:
+    int m_width = 0;
+    int m_height = 0;
+    int m_passes = 0;
+    std::vector<std::vector<Vertex>> m_pixels;
+};
@@ -3,11 +3,25 @@
 #include "scene.h"
 #include "path_mutator.h"
 #include "GeomUtil.h"
+#include "BSDFSampler.h"
+#include "Sampler.h"
+#include "MutationScheduler.h"
+#include "RadianceCache.h"
+#include "PathGuide.h"
+#include "LightSet.h"
+#include "RelightStore.h"
 
 #include <glm/glm.hpp>
+#include <chrono>
 #include <vector>
 #include <random>
 #include <string>
+#include <functional>
+#include <memory>
+
+class TileWriter;
+class ChainRecorder;
+class SequenceRenderer;
 
 class Renderer {
 public:
@@ -30,32 +44,447 @@ public:
         float visibilityEps = 1e-4f;
         float mutateRadiusFrac = 0.05;
 
+        // Metropolis-Hastings instead of uniform averaging of every accepted
+        // mutation: chains over the whole image whose state is a pixel and a
+        // path through it, with seedPaths path-traced samples per pixel for
+        // the normalization. Each pass runs `chains` chains for Kmutations
+        // steps per pixel in total; largeStepProb of the steps propose a
+        // fresh path through a uniformly chosen pixel, the rest mutate the
+        // current path with mutator_type (see render_metropolis_chains).
+        bool  metropolis = false;
+        int   seedPaths = 4;
+        int   chains = 256;
+        float largeStepProb = 0.3f;
+
+        // Candidates drawn per chain step (multiple-try proposals). 1 keeps
+        // the single-proposal chain.
+        int   multiTry = 1;
+
+        // Used by mutator_type 4, which mixes all strategies adaptively.
+        MutationScheduler::Params scheduler;
+
+        // Vertices regenerated by a mutator_type 5 step: it traces from the
+        // vertex before the picked one and reconnects subpathLength vertices
+        // later, or at the light. 1 gets the most accepted moves per second
+        // (renderer_bench mh_accepts) but moves a single vertex; 2 gave the
+        // lowest equal-time error of lengths 1-4 on cornell and maze.
+        int   subpathLength = 2;
+
+        // Unbiased Russian roulette on the albedo-weighted throughput once a
+        // path has rrMinBounces bounces.
+        bool  russianRoulette = false;
+        int   rrMinBounces = 3;
+
+        // Direction sampler for path bounces and retrace proposals. Cosine
+        // weighting matches the Lambertian cos term, so every bounce carries
+        // weight albedo instead of 2 cos * albedo.
+        BSDFSampler::Type sampling = BSDFSampler::COSINE;
+
+        // Source of pixel jitter, bounce directions and mutation offsets (see
+        // Sampler). SOBOL stratifies them across the seed path and mutations
+        // of a pixel and across the passes of render_progressive.
+        Sampler::Type sampler = Sampler::RANDOM;
+
+        // Jitters the primary ray over the pixel footprint (anti-aliasing)
+        // instead of shooting it through the pixel centre.
+        bool  pixelJitter = false;
+
+        // Reuses indirect light across pixels: seed paths fill a spatial
+        // cache of outgoing radiance and later paths stop at a cached cell
+        // (see RadianceCache). Biased, and with more than one thread the
+        // image depends on scheduling, so chain replay needs it off.
+        RadianceCache::Params radianceCache;
+
+        // Guides bounce and retrace directions with a distribution of
+        // incident light learnt from the seed paths (see PathGuide). It is
+        // trained after every pass of render_progressive, so the first pass
+        // is unguided; chain replay needs it off.
+        PathGuide::Params guiding;
+
+        // Cluster-to-cluster visibility table built with the renderer, which
+        // rejects project and retrace proposals through known occluders
+        // before their shadow rays (see ClusterVisibility). Its build uses
+        // `threads` when visibilityTable.threads is 0.
+        ClusterVisibility::Params visibilityTable;
+
+        // Worker threads for render_scene (0 = all hardware threads). Pixels
+        // are handed out in tileSize x tileSize tiles; each pixel has its own
+        // RNG stream, so the image does not depend on the thread count. The
+        // exceptions are the radiance cache and mutator_type 4 after the first
+        // progressive pass: its scheduler tables are fixed during a pass but
+        // learned from measured timings between passes.
+        int   threads = 0;
+        int   tileSize = 16;
+
         glm::vec3 albedo{ 0.7f, 0.7f, 0.7f };
 
+        // Intensity of the point light at lightPos; set_lights replaces it.
         glm::vec3 lightIntensity{ 20.0f, 20.0f, 20.0f };
     };
 
+    struct RenderStats {
+        uint64_t pixels = 0;
+        uint64_t seedPaths = 0;
+        uint64_t seedVertices = 0;
+        uint64_t rays = 0;
+        uint64_t mutationAttempts = 0;
+        uint64_t mutationAccepts = 0;
+
+        double avg_vertices_per_path() const;
+        double rays_per_pixel() const;
+        double acceptance_rate() const;
+
+        void add(const RenderStats& o);
+    };
+
+    // Optional per-pixel auxiliary outputs. The cost channels sum over all
+    // passes; the geometry channels describe the primary hit through the
+    // pixel centre, also with pixelJitter (triangle -1 and zero depth, normal
+    // and albedo where the primary ray misses).
+    struct AOVs {
+        int width = 0;
+        int height = 0;
+
+        std::vector<float>     rays;
+        std::vector<float>     attempts;
+        std::vector<float>     accepts;
+        std::vector<float>     pathLength;   // mean vertices of the seed paths
+        std::vector<float>     timeMs;
+        std::vector<int32_t>   triangleId;
+        std::vector<float>     depth;
+        std::vector<glm::vec3> normal;
+        std::vector<glm::vec3> albedo;
+
+        void resize(int w, int h);
+    };
+
+    enum ChainOutcome : uint8_t {
+        CHAIN_ACCEPTED = 0,
+        CHAIN_REJECTED = 1,   // valid proposal refused by the Metropolis test
+        CHAIN_FAILED = 2      // mutator produced no proposal
+    };
+
+    // One mutation step of a recorded chain. Fixed-size so logs can be read
+    // in place (see ChainRecorder).
+    struct ChainStep {
+        uint8_t  strategy = 0;
+        uint8_t  outcome = CHAIN_FAILED;
+        uint16_t reason = 0xffff;      // Stats::Counter of the failed check, stats builds only
+        int32_t  index = 0;            // mutated vertex
+        float    acceptance = 0.0f;
+        float    luminance = 0.0f;     // of the proposal
+        float    micros = 0.0f;
+        float    vertex[3] = { 0.0f, 0.0f, 0.0f };   // proposed vertex position
+    };
+
+    // The mutation chain of one pixel. If replayStrategies is set, step k
+    // uses replayStrategies[k] instead of asking the adaptive scheduler, so
+    // mutator_type 4 chains can be re-executed without its shared state.
+    struct Chain {
+        int32_t  px = 0;
+        int32_t  py = 0;
+        uint32_t renderSeed = 0;
+        uint32_t pixelSeed = 0;
+        int32_t  mutatorType = 0;
+        int32_t  pass = 0;
+        bool     seedOk = false;
+
+        std::vector<glm::vec3> seedPath;
+        std::vector<ChainStep> steps;
+        glm::vec3 result{ 0.0f };
+        double    micros = 0.0;
+
+        std::vector<uint8_t> replayStrategies;
+    };
+
 public:
+    Renderer(const Scene& scene,
+        const Camera& cam,
+        const glm::vec3& lightPos);
+
     Renderer(const Scene& scene,
         const Camera& cam,
         const glm::vec3& lightPos,
-        const RenderParams& params = RenderParams{});
+        const RenderParams& params);
+
+    // train feeds the radiance along the path to the radiance cache and the
+    // path guide, where enabled. first > 1 gives the radiance leaving vertex
+    // first towards first - 1, i.e. of the subpath starting there (never
+    // trained).
+    glm::vec3 compute_radiance_for_path(const PathMutator::Path& path, bool train = false, int first = 1) const;
+
+    // Traces the shadow rays still marked LIGHT_UNKNOWN that
+    // compute_radiance_for_path will need, as one batch.
+    void resolve_light_visibility(PathMutator::Path& path) const;
+    void resolve_light_visibility(std::vector<PathMutator::Path>& paths) const;
+    void resolve_light_visibility(PathMutator::Path* const* paths, size_t count) const;
+
+    // mutator_type: 0 retrace, 1 meshwalk, 2 project, 3 resample,
+    // 4 adaptive mixture of the others, 5 subpath regeneration.
+    std::vector<glm::vec3> render_scene(uint32_t seed = 1337u, const int mutator_type=0,
+        RenderStats* stats = nullptr,
+        AOVs* aovs = nullptr) const;
+
+    // Renders one pixel exactly as render_scene(seed, mutator_type) does, or
+    // as pass `pass` of render_progressive(seed, ...), and optionally records
+    // its chain. Used to replay recorded chains. Metropolis renders have no
+    // chain per pixel; for them it prints an error and returns black.
+    glm::vec3 render_pixel(int px, int py,
+        uint32_t seed,
+        int mutator_type,
+        int pass = 0,
+        Chain* chain = nullptr) const;
+
+    // Chains of the pixels the recorder selects are written to it by
+    // render_scene, render_progressive and render_to_file. Metropolis
+    // renders, whose chains span the image, record nothing. The recorder
+    // must outlive the renders; nullptr turns recording off.
+    void set_chain_recorder(ChainRecorder* recorder) { m_recorder = recorder; }
+
+    // render_scene, render_progressive and render_to_file reset the store
+    // and record into it what relight() needs to redo the image under other
+    // lights. Metropolis renders record only their seed paths with weight
+    // 1 / seedPaths: the chain weights, 1 / luminance under the old lights,
+    // mean nothing under new ones. The store must outlive the renders;
+    // nullptr turns recording off. Returns false and records nothing with
+    // the radiance cache on, whose cached tails hold the old lighting.
+    bool set_relight_store(RelightStore* store);
 
-    
-    glm::vec3 compute_radiance_for_path(const PathMutator::Path& path) const;
+    // The image the store was recorded from, re-evaluated under this
+    // renderer's lights: one light sample and shadow ray per stored vertex,
+    // no paths traced. Any renderer with the same camera, scene and albedo
+    // can relight it, so a new light position needs only a new Renderer.
+    // With the single point light, averaged chains reject moves of the last
+    // vertex out of the old light's view, so they keep some of the old
+    // lighting's distribution; re-render after large changes.
+    std::vector<glm::vec3> relight(const RelightStore& store) const;
 
-    std::vector<glm::vec3> render_scene(uint32_t seed = 1337u, const int mutator_type=0) const;
+    // Replaces the sampler chosen by RenderParams::sampling (mixed with the
+    // path guide, if enabled). The sampler must outlive the renderer.
+    void set_bsdf_sampler(const BSDFSampler& sampler);
+
+    const Camera& camera() const { return m_cam; }
+    // Moves the camera for later renders, e.g. between frames of a sequence.
+    void set_camera(const Camera& cam);
+    const glm::vec3& light_pos() const { return m_lightPos; }
+
+    // Replaces the point light at lightPos with a set of point and emissive
+    // triangle lights for next-event estimation (built here if needed). Each
+    // vertex samples one light from the set's light BVH. Paths still end at
+    // lightPos, but as a placeholder: the last surface vertex no longer has
+    // to see it. Chain logs record only lightPos and cannot replay such
+    // renders.
+    void set_lights(LightSet lights);
+    const LightSet& lights() const { return m_lights; }
+    const RenderParams& params() const { return m_params; }
+
+    // nullptr unless RenderParams::radianceCache is enabled. The cache
+    // persists across renders; clear it to render from scratch.
+    const RadianceCache* radiance_cache() const { return m_cache.get(); }
+    void clear_radiance_cache() { if (m_cache) m_cache->clear(); }
+
+    // nullptr unless RenderParams::guiding is enabled. update() it between
+    // calls to render_scene to train it outside render_progressive.
+    PathGuide* path_guide() { return m_guide.get(); }
+
+    // nullptr unless RenderParams::visibilityTable is enabled (or the scene
+    // is empty); info() has its build cost.
+    const ClusterVisibility* visibility_table() const { return m_visTable.get(); }
+
+    // Renders like render_scene but streams finished tiles straight into
+    // path (.ppm, .pfm or .exr, see TileWriter) instead of keeping the
+    // framebuffer, so memory is bounded by the rows of tiles in flight
+    // rather than by the resolution. Metropolis chains move across the whole
+    // image, so those renders keep the framebuffer and write it at the end.
+    // Returns false if the file cannot be written.
+    bool render_to_file(const std::string& path,
+        uint32_t seed = 1337u,
+        int mutator_type = 0,
+        RenderStats* stats = nullptr) const;
+
+    // Called after each pass of render_progressive with the average of the
+    // passes so far. Returning false stops the render.
+    using PassCallback = std::function<bool(int pass, const std::vector<glm::vec3>& image)>;
+
+    // Renders up to maxPasses independent passes of render_scene and returns
+    // their running average. The adaptive scheduler learns between passes,
+    // and its probabilities stay fixed during each.
+    std::vector<glm::vec3> render_progressive(uint32_t seed,
+        int mutator_type,
+        int maxPasses,
+        const PassCallback& onPass,
+        RenderStats* stats = nullptr,
+        AOVs* aovs = nullptr) const;
 
     static bool write_ppm(const std::string& path,
         const std::vector<glm::vec3>& img,
         int W, int H,
         float gamma = 2.2f);
 
-private:
-    glm::vec3 generate_primary_dir(int px, int py) const;
+    // Writes every AOV as <prefix>_<name>.ppm: cost channels as heatmaps
+    // scaled to their maximum, depth as grey levels, normals mapped to
+    // [0,1] and triangle ids as random colours.
+    static bool write_aovs(const std::string& prefix, const AOVs& aovs);
+
+    // Per-pixel steps of a render, for renderers built on this one's
+    // camera, sampling and lighting (see SequenceRenderer).
+
+    // Starts the pixel's first sample of the pass and returns its primary
+    // direction, jittered if RenderParams::pixelJitter is set.
+    glm::vec3 begin_pixel(int px, int py, int pass, Sampler& sampler) const;
+
+    // Traces a camera path along rd0 with RenderParams::maxBounces and
+    // retriesPerBounce, as the seed paths of a render are.
+    bool sample_path(PathMutator::Path& path, const glm::vec3& rd0, Sampler& sampler) const;
+
+    const BSDFSampler& bsdf_sampler() const { return m_mutator.sampler(); }
+
+    // Russian-roulette survival probability past vertex, 1 with roulette
+    // off (see PathMutator::continue_probability).
+    float continue_probability(int vertex, const glm::vec3& beta) const;
 
     glm::vec3 shading_normal_at(const PathMutator::Path& path, int i) const;
 
+    // Next-event term f * Li * cos at internal vertex i with normal ni, using
+    // path.light_visible where resolved. False when it is zero.
+    bool direct_light(const PathMutator::Path& path, int i, const glm::vec3& ni, glm::vec3& out) const;
+
+    static float luminance(const glm::vec3& c);
+    static uint32_t pixel_seed(uint32_t seed, int px, int py);
+    static uint32_t pass_seed(uint32_t seed, int pass);
+
+private:
+    // offset is the position within the pixel, (0.5, 0.5) at its centre.
+    glm::vec3 generate_primary_dir(int px, int py, const glm::vec2& offset = glm::vec2(0.5f)) const;
+
+    void render_pass(uint32_t seed,
+        int pass,
+        int mutator_type,
+        MutationScheduler* scheduler,
+        std::vector<glm::vec3>& img,
+        TileWriter* sink,
+        RenderStats* stats,
+        AOVs* aovs) const;
+
+    void fill_primary_aovs(int px, int py, const glm::vec3& dir, AOVs& aovs) const;
+
+    bool propose_mutation(PathMutator::Path& proposal,
+        int index,
+        int mutator_type,
+        float radius,
+        const glm::vec3& primaryDir,
+        Sampler& sampler) const;
+
+    // Last kept vertex of a subpath mutation at index.
+    int subpath_end(const PathMutator::Path& path, int index) const;
+
+    int propose_multi_try(const PathMutator::Path& from,
+        int index,
+        int mutator_type,
+        float radius,
+        const glm::vec3& primaryDir,
+        int tries,
+        Sampler& sampler,
+        std::vector<PathMutator::Path>& out) const;
+
+    double multi_try_weight(const PathMutator::Path& from,
+        const PathMutator::Path& to,
+        float toLum,
+        int index,
+        int mutator_type,
+        float radius) const;
+
+    bool multi_try_average_step(PathMutator::Path& proposal,
+        glm::vec3& propL,
+        int index,
+        int mutator_type,
+        float radius,
+        const glm::vec3& primaryDir,
+        Sampler& sampler,
+        std::uniform_real_distribution<float>& u01) const;
+
+    bool multi_try_metropolis_step(const PathMutator::Path& cur,
+        float curLum,
+        PathMutator::Path& proposal,
+        glm::vec3& propL,
+        float& propLum,
+        double& acceptance,
+        int index,
+        int mutator_type,
+        float radius,
+        const glm::vec3& primaryDir,
+        Sampler& sampler,
+        std::uniform_real_distribution<float>& u01,
+        double selectRatio = 1.0) const;
+
+    double metropolis_acceptance(const PathMutator::Path& cur,
+        const PathMutator::Path& proposal,
+        float curLum,
+        float propLum,
+        int index,
+        int mutator_type,
+        float radius,
+        double selectRatio = 1.0) const;
+
+    int select_strategy(int px, int py, int index, int step,
+        int mutator_type,
+        const MutationScheduler* scheduler,
+        const Chain* chain,
+        std::mt19937& rng,
+        std::uniform_real_distribution<float>& u01) const;
+
+    static void begin_chain(Chain& chain, int px, int py, uint32_t seed, int pass, int mutator_type);
+    static void end_chain(Chain& chain, const glm::vec3& result);
+
+    static void record_step(Chain& chain,
+        int strategy,
+        int index,
+        ChainOutcome outcome,
+        double acceptance,
+        float proposalLum,
+        const PathMutator::Path& proposal,
+        std::chrono::steady_clock::time_point t0);
+
+    glm::vec3 render_pixel_average(int px, int py,
+        const glm::vec3& rd0,
+        int mutator_type,
+        float radius,
+        const MutationScheduler* scheduler,
+        MutationScheduler::Tally* tally,
+        RenderStats* stats,
+        Sampler& sampler,
+        std::uniform_real_distribution<float>& u01,
+        Chain* chain,
+        RelightStore::Pixel* relight = nullptr) const;
+
+    // The seed phase of a Metropolis pass for one pixel: traces seedPaths
+    // paths, writes their luminances to seedLum and returns their mean.
+    glm::vec3 seed_pixel(const glm::vec3& rd0,
+        RenderStats* stats,
+        Sampler& sampler,
+        float* seedLum,
+        RelightStore::Pixel* relight = nullptr) const;
+
+    // Runs the image-wide Metropolis chains of a pass from the seed
+    // luminances of every pixel and replaces img with their estimate.
+    void render_metropolis_chains(uint32_t seed,
+        int pass,
+        int mutator_type,
+        MutationScheduler* scheduler,
+        const std::vector<float>& seedLum,
+        std::vector<glm::vec3>& img,
+        RenderStats* stats) const;
+
+    // The light sample for NEE at internal vertex i with normal ni, from the
+    // random numbers in path.light_u[i - 1]. compute_radiance_for_path and
+    // resolve_light_visibility therefore pick the same one, and
+    // path.light_visible[i - 1] is its visibility.
+    bool sample_light(const PathMutator::Path& path, int i, const glm::vec3& ni, LightSet::Sample& ls) const;
+
+    // Adds the surface vertices of path whose next-event terms
+    // compute_radiance_for_path sums, each with weight times its throughput.
+    void record_relight(const PathMutator::Path& path, float weight, RelightStore::Pixel& out) const;
+
     static float clamp01(float x);
 
 private:
@@ -63,8 +492,17 @@ private:
     Camera         m_cam;
     glm::vec3      m_lightPos;
     RenderParams   m_params;
+    LightSet       m_lights;
 
     PathMutator    m_mutator;
 
     float          m_sceneDiag = 1.0f;
+
+    ChainRecorder* m_recorder = nullptr;
+    RelightStore*  m_relight = nullptr;
+
+    std::unique_ptr<RadianceCache> m_cache;
+    std::unique_ptr<PathGuide>     m_guide;
+    std::unique_ptr<GuidedSampler> m_guidedSampler;
+    std::unique_ptr<ClusterVisibility> m_visTable;
 };
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <random>
+
+// Sample values for one pixel: pixel jitter, bounce directions and mutation
+// offsets. The samples of a pixel are numbered; start_sample(i) begins sample
+// i and rewinds the dimension counter, and each get_1d / get_2d call takes
+// the next dimension.
+//
+// RANDOM draws every value from the pixel's mt19937 (in the same order as
+// drawing from it directly). SOBOL returns padded Owen-scrambled Sobol
+// points: each dimension pair is the first two Sobol dimensions with its own
+// hash-based nested uniform scramble and index shuffle, keyed by the pixel
+// and the pair. Samples 0..n-1 of a pixel are then stratified in every 2D
+// projection the renderer consumes, which converges faster than independent
+// draws at low sample counts.
+//
+// Decisions that gain nothing from stratification (Russian roulette, vertex
+// and strategy choice, Metropolis acceptance) draw from rng() in both modes.
+class Sampler {
+public:
+    enum Type : uint8_t {
+        RANDOM = 0,
+        SOBOL = 1
+    };
+
+    // A RANDOM sampler over rng.
+    explicit Sampler(std::mt19937& rng);
+
+    // key identifies the pixel's scrambles; it must not change between the
+    // passes of a progressive render, or the passes are not stratified.
+    Sampler(Type type, std::mt19937& rng, uint32_t key);
+
+    void start_sample(uint32_t index);
+    uint32_t sample_index() const { return m_index; }
+
+    float get_1d();
+    glm::vec2 get_2d();
+
+    std::mt19937& rng() { return m_rng; }
+    Type type() const { return m_type; }
+
+    // Component dim (0 or 1) of point index of the scrambled, shuffled
+    // 2D Sobol sequence selected by seed, in [0, 1).
+    static float sobol_2d(uint32_t index, int dim, uint32_t seed);
+
+private:
+    uint32_t pair_seed(uint32_t pair) const;
+
+private:
+    Type          m_type = RANDOM;
+    std::mt19937& m_rng;
+    std::uniform_real_distribution<float> m_u01{ 0.0f, 1.0f };
+
+    uint32_t m_key = 0;
+    uint32_t m_index = 0;
+    uint32_t m_pair = 0;   // next dimension pair of the current sample
+};
@@ -0,0 +1,140 @@
+#pragma once
+
+#include "Renderer.h"
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <vector>
+
+// Renders camera sequences (turntables, fly-throughs) with per-pixel
+// reservoirs of indirect samples that are reused across frames and between
+// neighbouring pixels, in the manner of ReSTIR GI. Each frame traces one new
+// path per pixel; its first bounce vertex and the radiance leaving that
+// vertex form the pixel's new candidate. The reservoir then resamples among
+// that candidate, the reservoir of the previous frame's pixel that the
+// primary hit reprojects to, and those of a few nearby pixels. A sample taken
+// over from another primary hit is weighted by the reconnection Jacobian and
+// revalidated with a Scene::visible ray from the new one.
+//
+// A pixel is the direct light at its primary hit plus the indirect light of
+// its reservoir's sample. The sample's weight is normalized by Z, the
+// candidate counts M of only those sources that could have produced it
+// (their primary hit sees it and the Jacobian test passes), not by the sum
+// of all M; a sample visible here but shadowed at a neighbour is otherwise
+// divided by counts that could never have found it, which darkens the image
+// frame after frame. That costs one visibility ray per source and pixel.
+// The similarity tests and the history cap still leave some bias, but the
+// reuse reaches a given noise level with far fewer traced paths than
+// independent render_scene frames.
+class SequenceRenderer {
+public:
+    struct Params {
+        bool  temporal = true;
+        bool  spatial = true;
+        // Temporal history is capped at historyCap candidates, so the
+        // reservoir keeps following changes in the scene.
+        int   historyCap = 20;
+        int   spatialNeighbors = 3;
+        float spatialRadius = 12.0f;     // pixels
+        // Pixels only reuse from primary hits with a normal within
+        // normalThreshold (cosine) and a camera distance within
+        // depthThreshold (relative).
+        float normalThreshold = 0.9f;
+        float depthThreshold = 0.1f;
+        // Samples whose reconnection Jacobian is beyond this factor either
+        // way are not reused.
+        float maxJacobian = 10.0f;
+    };
+
+    struct FrameStats {
+        uint64_t newPaths = 0;
+        uint64_t temporalReuse = 0;
+        uint64_t spatialReuse = 0;
+        uint64_t visibilityRays = 0;
+        double   seconds = 0.0;
+    };
+
+public:
+    SequenceRenderer(const Scene& scene,
+        const Renderer::Camera& cam,
+        const glm::vec3& lightPos,
+        const Renderer::RenderParams& params,
+        const Params& sequence);
+
+    // Renders the next frame from cam. The previous frame's reservoirs are
+    // reused unless the resolution changed or reset() was called. Frames are
+    // independent of the thread count.
+    std::vector<glm::vec3> render_frame(const Renderer::Camera& cam,
+        uint32_t seed,
+        FrameStats* stats = nullptr);
+
+    // Forgets the history, e.g. at a camera cut.
+    void reset();
+
+    int frame() const { return m_frame; }
+    Renderer& renderer() { return m_renderer; }
+
+private:
+    // The indirect sample: point y on the first bounce, its normal, and the
+    // radiance leaving it.
+    struct Reservoir {
+        glm::vec3 y{ 0.0f };
+        glm::vec3 ny{ 0.0f };
+        glm::vec3 Lo{ 0.0f };
+        float     wsum = 0.0f;
+        float     M = 0.0f;
+        float     phat = 0.0f;   // target at the owning pixel
+        float     W = 0.0f;      // unbiased contribution weight
+    };
+
+    struct Surface {
+        glm::vec3 x{ 0.0f };
+        glm::vec3 n{ 0.0f };
+        float     depth = 0.0f;
+        bool      valid = false;
+    };
+
+    // A reservoir merged into a pixel's: its primary hit and candidate count.
+    struct Source {
+        glm::vec3 x{ 0.0f };
+        glm::vec3 n{ 0.0f };
+        float     M = 0.0f;
+    };
+
+    bool similar(const Surface& a, const Surface& b) const;
+
+    // Reconnection Jacobian of sample point y with normal ny moved from
+    // primary hit qx to x: solid angle at x per solid angle at qx. 0 if y
+    // faces away from either or the factor is beyond maxJacobian.
+    float jacobian(const glm::vec3& y, const glm::vec3& ny, const glm::vec3& x, const glm::vec3& qx) const;
+
+    // True if x with normal nx and y with normal ny face each other and see
+    // each other (one visibility ray).
+    bool connects(const glm::vec3& x, const glm::vec3& nx, const glm::vec3& y, const glm::vec3& ny,
+        uint64_t& rays) const;
+
+    // Streams reservoir q, built for primary hit qx, into r at surface s with
+    // candidate count M. Returns true if r took q's sample.
+    bool merge(Reservoir& r, const Reservoir& q, const glm::vec3& qx, const Surface& s,
+        float M, float u, uint64_t& rays) const;
+
+    // Sets r.W from Z, ownM plus the M of every source that could have
+    // produced r's sample; `picked` is the source it came from, or -1.
+    // Returns Z.
+    float finish(Reservoir& r, const Surface& s, float ownM, const std::vector<Source>& sources,
+        int picked, uint64_t& rays) const;
+
+    glm::vec3 shade(const Reservoir& r, const Surface& s) const;
+
+private:
+    const Scene& m_scene;
+    Renderer     m_renderer;
+    Params       m_seq;
+
+    int m_frame = 0;
+
+    bool                   m_hasHistory = false;
+    Renderer::Camera       m_prevCam;
+    std::vector<Surface>   m_prevSurface;
+    std::vector<Reservoir> m_prevReservoir;
+};
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#ifndef RENDERER_ENABLE_STATS
+#define RENDERER_ENABLE_STATS 0
+#endif
+
+// Hot-path counters and timers. Each thread increments its own block with
+// relaxed atomic loads and stores, so merged() may read the blocks while
+// other threads render; counts still in flight are simply not in its sum.
+// With RENDERER_ENABLE_STATS=0 the PM_STAT_* macros expand to nothing. The
+// ray counters are the exception: Scene always counts its rays here, and
+// Scene::rays_traced reads them back.
+class Stats {
+public:
+    enum Counter : int {
+        RAYS_INTERSECT,
+        RAYS_VISIBLE,
+        RAYS_VISIBLE_BATCH,
+        TRIANGLE_TESTS,
+        BVH_NODES_VISITED,
+
+        SAMPLE_PATH_CALLS,
+        SAMPLE_PATH_NO_PRIMARY_HIT,
+        SAMPLE_PATH_BOUNCES,
+        SAMPLE_PATH_RETRIES_EXHAUSTED,
+        SAMPLE_PATH_ROULETTE_KILLED,
+
+        // For each mutator, attempts = ok + the sum of its fail counters,
+        // for single and batched proposals alike.
+        MESHWALK_ATTEMPTS,
+        MESHWALK_OK,
+        MESHWALK_FAIL_INPUT,
+        MESHWALK_FAIL_DEGENERATE,
+        MESHWALK_FAIL_OFF_MESH,
+        MESHWALK_FAIL_GUARD,
+        MESHWALK_FAIL_IRREVERSIBLE,
+        MESHWALK_FAIL_PREV_OCCLUDED,
+        MESHWALK_FAIL_NEXT_OCCLUDED,
+
+        PROJECT_ATTEMPTS,
+        PROJECT_OK,
+        PROJECT_FAIL_INPUT,
+        PROJECT_FAIL_DEGENERATE,
+        PROJECT_FAIL_DIRECTION,
+        PROJECT_FAIL_NO_HIT,
+        PROJECT_FAIL_PREV_OCCLUDED,
+        PROJECT_FAIL_NEXT_OCCLUDED,
+
+        RETRACE_ATTEMPTS,
+        RETRACE_OK,
+        RETRACE_FAIL_INPUT,
+        RETRACE_FAIL_DEGENERATE,
+        RETRACE_FAIL_DIRECTION,
+        RETRACE_FAIL_NO_HIT,
+        RETRACE_FAIL_PREV_OCCLUDED,
+        RETRACE_FAIL_NEXT_OCCLUDED,
+
+        SUBPATH_ATTEMPTS,
+        SUBPATH_OK,
+        SUBPATH_FAIL_INPUT,
+        SUBPATH_FAIL_DIRECTION,
+        SUBPATH_FAIL_NO_HIT,
+        SUBPATH_FAIL_OCCLUDED,
+
+        RADIANCE_EVALS,
+        SHADOW_RAYS_DEFERRED,
+
+        RADIANCE_CACHE_LOOKUPS,
+        RADIANCE_CACHE_HITS,
+        RADIANCE_CACHE_INSERTS,
+        RADIANCE_CACHE_DROPPED,
+        VISIBILITY_TABLE_QUERIES,
+        VISIBILITY_TABLE_REJECTS,
+
+        COUNTER_COUNT
+    };
+
+    enum Timer : int {
+        T_INTERSECT,
+        T_VISIBLE_BATCH,
+        T_SAMPLE_PATH,
+        T_MESHWALK,
+        T_PROJECT,
+        T_RETRACE,
+        T_SUBPATH,
+        T_RADIANCE,
+        T_RESOLVE_LIGHT,
+        T_RENDER,
+        T_SCENE_BUILD,
+        T_VISIBILITY_BUILD,
+
+        TIMER_COUNT
+    };
+
+    // A snapshot of counts, as merged() returns them.
+    struct Block {
+        uint64_t counters[COUNTER_COUNT] = {};
+        uint64_t nanos[TIMER_COUNT] = {};
+        uint64_t calls[TIMER_COUNT] = {};
+    };
+
+    // One thread's running counts. Only that thread writes them.
+    struct LiveBlock {
+        std::atomic<uint64_t> counters[COUNTER_COUNT] = {};
+        std::atomic<uint64_t> nanos[TIMER_COUNT] = {};
+        std::atomic<uint64_t> calls[TIMER_COUNT] = {};
+    };
+
+    static void add(Counter c, uint64_t n) { bump(local().counters[c], n); }
+
+    static void add_time(Timer t, uint64_t nanos) {
+        LiveBlock& b = local();
+        bump(b.nanos[t], nanos);
+        bump(b.calls[t], 1);
+    }
+
+    // The calling thread's count of c since it started or the last reset().
+    static uint64_t thread_count(Counter c) { return local().counters[c].load(std::memory_order_relaxed); }
+
+    // Sum over all threads, including ones that have already exited.
+    static Block merged();
+    static void reset();
+
+    static bool write_json(const std::string& path, const std::string& label);
+
+    static const char* counter_name(Counter c);
+    static const char* timer_name(Timer t);
+
+    // Counter of the most recent PM_STAT_FAIL on this thread, or COUNTER_COUNT.
+    // Only set when stats are compiled in, so recorded mutation chains carry
+    // failure reasons only in such builds.
+    static Counter last_failure() { return t_lastFailure; }
+    static void set_last_failure(Counter c) { t_lastFailure = c; }
+
+    class ScopedTimer {
+    public:
+        explicit ScopedTimer(Timer t)
+            : m_timer(t), m_start(std::chrono::steady_clock::now()) {}
+
+        ~ScopedTimer() {
+            auto d = std::chrono::steady_clock::now() - m_start;
+            add_time(m_timer, (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+        }
+
+        ScopedTimer(const ScopedTimer&) = delete;
+        ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+    private:
+        Timer m_timer;
+        std::chrono::steady_clock::time_point m_start;
+    };
+
+private:
+    static void bump(std::atomic<uint64_t>& a, uint64_t n) {
+        a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    static LiveBlock& local() {
+        thread_local LiveBlock* block = nullptr;
+        if (!block) block = register_thread();
+        return *block;
+    }
+
+    static LiveBlock* register_thread();
+
+    static inline thread_local Counter t_lastFailure = COUNTER_COUNT;
+};
+
+#define PM_STAT_CONCAT_INNER(a, b) a##b
+#define PM_STAT_CONCAT(a, b) PM_STAT_CONCAT_INNER(a, b)
+
+#if RENDERER_ENABLE_STATS
+#define PM_STAT_ADD(counter, n) Stats::add(Stats::counter, (uint64_t)(n))
+#define PM_STAT_INC(counter) Stats::add(Stats::counter, 1)
+#define PM_STAT_TIMER(timer) Stats::ScopedTimer PM_STAT_CONCAT(pm_stat_timer_, __LINE__)(Stats::timer)
+#else
+#define PM_STAT_ADD(counter, n) ((void)0)
+#define PM_STAT_INC(counter) ((void)0)
+#define PM_STAT_TIMER(timer) ((void)0)
+#endif
+
+// For `return PM_STAT_FAIL(counter);` at a rejecting check.
+#if RENDERER_ENABLE_STATS
+#define PM_STAT_FAIL(counter) (Stats::set_last_failure(Stats::counter), PM_STAT_INC(counter), false)
+#else
+#define PM_STAT_FAIL(counter) false
+#endif
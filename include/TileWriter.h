@@ -0,0 +1,92 @@
+#pragma once
+
+#include "ImageUtil.h"
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// Writes an image file tile by tile. The header goes out when the file is
+// opened. Tiles are encoded into the band of full image rows they belong to,
+// and a band is written to its final offset in one call (pwrite, or
+// WriteFile with an OVERLAPPED offset on Windows) as soon as its tiles cover
+// the whole width, so only the bands still being rendered are held in
+// memory. Supports .ppm (8-bit, gamma), .pfm and .exr (uncompressed half),
+// whose pixel layouts all have fixed offsets.
+//
+// write_tile may be called from several threads at once. Tiles are expected
+// on a grid: the same y0 implies the same height, and each tile is written
+// once. A tile whose height does not match its band is written row by row.
+class TileWriter {
+public:
+    enum class Format { PPM, PFM, EXR };
+
+public:
+    TileWriter() = default;
+    ~TileWriter();
+
+    TileWriter(const TileWriter&) = delete;
+    TileWriter& operator=(const TileWriter&) = delete;
+
+    // Creates (or truncates) path and writes the header. The format comes
+    // from the extension; gamma only applies to PPM.
+    bool open(const std::string& path, int W, int H, float gamma = 2.2f);
+
+    // pixels holds w * h values, row-major, for the rectangle at (x0, y0).
+    bool write_tile(int x0, int y0, int w, int h, const glm::vec3* pixels);
+
+    // Returns false if opening or any tile write failed.
+    bool close();
+
+    bool is_open() const;
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+
+private:
+    // The file bytes of image rows [y0, y0 + h), encoded as tiles arrive.
+    struct Band {
+        int                  h = 0;
+        uint64_t             offset = 0;
+        std::vector<uint8_t> bytes;
+        int64_t              pixels = 0;
+        std::vector<std::pair<int, int>> tiles;   // x0, w of the tiles received
+    };
+
+    uint64_t row_offset(int y) const;
+    uint64_t band_offset(int y0, int h) const;
+
+    // Encodes the tile into base, which holds the file bytes from baseOffset.
+    void encode_rows(int x0, int y0, int w, int h, const glm::vec3* pixels,
+        uint8_t* base, uint64_t baseOffset) const;
+    // Writes only the tile's own byte runs from base.
+    bool write_runs(int x0, int y0, int w, int h, const uint8_t* base, uint64_t baseOffset);
+
+    bool write_at(uint64_t offset, const void* data, size_t size);
+
+private:
+    Format m_format = Format::PPM;
+    int    m_width = 0;
+    int    m_height = 0;
+
+    uint64_t m_dataOffset = 0;
+    size_t   m_rowBytes = 0;   // one image row; an EXR scanline chunk
+
+    std::unique_ptr<ImageUtil::ByteEncoder> m_encode;
+    std::atomic<bool> m_failed{ false };
+
+    std::mutex                           m_bandMutex;
+    std::map<int, std::unique_ptr<Band>> m_bands;   // by y0
+
+#ifdef _WIN32
+    void* m_handle = nullptr;
+#else
+    int m_fd = -1;
+#endif
+};
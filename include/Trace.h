@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Timeline of scoped events (scene load phases, BVH build, passes, tiles)
+// written as Chrome trace-event JSON for chrome://tracing or Perfetto.
+// Recording is switched on at runtime; while it is off a PM_TRACE_SCOPE costs
+// one relaxed atomic load. Each thread records into its own ring buffer,
+// which grows as needed up to its capacity, so only the most recent events
+// per thread are kept.
+class Trace {
+public:
+    struct Event {
+        const char* name = nullptr;
+        const char* category = nullptr;
+        const char* argName = nullptr;
+        int64_t     arg = 0;
+        uint64_t    startNs = 0;
+        uint64_t    durationNs = 0;
+    };
+
+    // Starts recording and drops earlier events. Buffers hold eventsPerThread
+    // events each; the events of exited threads are kept up to retiredEvents
+    // in total, dropping the oldest threads first. Safe to call while other
+    // threads record: each thread drops its own earlier events on its next
+    // record.
+    static void enable(size_t eventsPerThread = 1u << 16, size_t retiredEvents = 1u << 18);
+    static void disable();
+    static bool enabled() { return s_enabled.load(std::memory_order_relaxed); }
+
+    // Shown as the thread's name in the viewer.
+    static void set_thread_name(const std::string& name);
+
+    // Call while no thread is recording, e.g. after a render.
+    static bool write_json(const std::string& path);
+
+    static void record(const Event& e);
+    static uint64_t now_ns();
+
+    class Scope {
+    public:
+        Scope(const char* name, const char* category, const char* argName = nullptr, int64_t arg = 0)
+            : m_active(enabled())
+        {
+            if (!m_active) return;
+            m_event.name = name;
+            m_event.category = category;
+            m_event.argName = argName;
+            m_event.arg = arg;
+            m_event.startNs = now_ns();
+        }
+
+        ~Scope() {
+            if (!m_active) return;
+            m_event.durationNs = now_ns() - m_event.startNs;
+            record(m_event);
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        bool  m_active;
+        Event m_event;
+    };
+
+private:
+    static std::atomic<bool> s_enabled;
+};
+
+#define PM_TRACE_CONCAT_INNER(a, b) a##b
+#define PM_TRACE_CONCAT(a, b) PM_TRACE_CONCAT_INNER(a, b)
+
+// name and category must be string literals (they are stored by pointer).
+#define PM_TRACE_SCOPE(name, category) \
+    Trace::Scope PM_TRACE_CONCAT(pm_trace_scope_, __LINE__)(name, category)
+#define PM_TRACE_SCOPE_ARG(name, category, argName, arg) \
+    Trace::Scope PM_TRACE_CONCAT(pm_trace_scope_, __LINE__)(name, category, argName, (int64_t)(arg))
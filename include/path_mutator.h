@@ -1,18 +1,57 @@
 #pragma once
 
 #include "scene.h"
+#include "BSDFSampler.h"
+#include "Sampler.h"
+#include "RadianceCache.h"
+#include "ClusterVisibility.h"
 #include <glm/glm.hpp>
 #include <vector>
 #include <random>
 
 class PathMutator {
 public:
+    enum LightVisibility : uint8_t {
+        LIGHT_UNKNOWN = 0,
+        LIGHT_VISIBLE = 1,
+        LIGHT_OCCLUDED = 2
+    };
+
     struct Path {
         std::vector<glm::vec3> vertices;
         std::vector<GeomUtil::Triangle> faces;
         std::vector<glm::vec3> bary_points;
-        std::vector<bool> light_visible;
+        // Per internal vertex, one of LightVisibility.
+        std::vector<uint8_t> light_visible;
+        // Per internal vertex, the random numbers of its next-event light
+        // sample (light choice, then the point on the light). They are drawn
+        // when the vertex is created or moved, so light_visible stays valid
+        // for the vertex until a mutation moves it.
+        std::vector<glm::vec3> light_u;
         int bounces = 0;
+        // sample_path stopped at the last internal vertex on Russian
+        // roulette. Survival probabilities are not stored: they follow from
+        // the throughput, so continue_probability recomputes them after a
+        // mutation.
+        bool roulette_ended = false;
+        // sample_path stopped at the last internal vertex because the
+        // radiance cache covers the rest of the path.
+        bool cached_tail = false;
+    };
+
+    struct Roulette {
+        bool      enabled = false;
+        int       minBounces = 3;
+        glm::vec3 albedo{ 0.7f, 0.7f, 0.7f };
+    };
+
+    // A proposed replacement for a single path vertex.
+    struct Candidate {
+        glm::vec3 p{ 0.0f };
+        GeomUtil::Triangle face;
+        glm::vec3 bary{ 0.0f };
+        uint8_t light = LIGHT_UNKNOWN;
+        glm::vec3 lightU{ 0.0f };
     };
 
     PathMutator(const Scene& scene,
@@ -24,6 +63,49 @@ public:
         const glm::vec3& initialDir,
         int retriesPerBounce = 8) const;
 
+    bool sample_path(Path& path,
+        int maxBounces,
+        const glm::vec3& initialDir,
+        int retriesPerBounce,
+        std::mt19937& rng) const;
+
+    // Bounce directions take one get_2d() each from sampler (every retry
+    // included) and every internal vertex a get_1d() and a get_2d() for its
+    // light sample; roulette draws from sampler.rng().
+    bool sample_path(Path& path,
+        int maxBounces,
+        const glm::vec3& initialDir,
+        int retriesPerBounce,
+        Sampler& sampler) const;
+
+    void set_roulette(const Roulette& rr);
+
+    // Probability that sample_path continues past internal vertex `vertex`
+    // when the throughput up to it (1 / q factors included) is beta.
+    float continue_probability(int vertex, const glm::vec3& beta) const;
+
+    // Moves the path start for later sample_path calls.
+    void set_camera_center(const glm::vec3& c) { m_C = c; }
+
+    // Direction sampler for sample_path bounces and retrace proposals
+    // (cosine weighted by default). The sampler must outlive the mutator.
+    void set_sampler(const BSDFSampler& sampler);
+    const BSDFSampler& sampler() const { return *m_sampler; }
+
+    // With a cache, sample_path stops at the first vertex at or past index
+    // depth whose cell has a cached value. nullptr turns this off.
+    void set_radiance_cache(const RadianceCache* cache, int depth);
+
+    // With a table, project and retrace proposals whose connections to the
+    // neighbouring surface vertices it shows as occluded are rejected before
+    // their shadow rays. nullptr turns this off.
+    void set_visibility_table(const ClusterVisibility* table) { m_visTable = table; }
+
+    // Paths end at light_pos. By default a proposal for the last surface
+    // vertex must see it; turn that off when light_pos is only a placeholder
+    // for a set of lights sampled elsewhere.
+    void set_light_connection(bool check) { m_lightConnection = check; }
+
     bool mutate_vertex_meshwalk(
         Path& path,
         int index,
@@ -37,8 +119,100 @@ public:
     bool mutate_vertex_retrace(Path& path,
         int index) const;
 
+    bool mutate_vertex_meshwalk(Path& path, int index, float radius, std::mt19937& rng) const;
+    bool mutate_vertex_project(Path& path, int index, float radius, std::mt19937& rng) const;
+    bool mutate_vertex_retrace(Path& path, int index, std::mt19937& rng) const;
+
+    // The proposal's direction or disk offset takes one get_2d() from
+    // sampler, and the moved vertex's light sample a get_1d() and a get_2d().
+    bool mutate_vertex_meshwalk(Path& path, int index, float radius, Sampler& sampler) const;
+    bool mutate_vertex_project(Path& path, int index, float radius, Sampler& sampler) const;
+    bool mutate_vertex_retrace(Path& path, int index, Sampler& sampler) const;
+
+    // Regenerates vertices i+1..j-1 by tracing from vertex i, one get_2d()
+    // per bounce plus each new vertex's light sample, and connects the last of them to vertex j, which stays in
+    // place along with the path length. Needs 1 <= i and i + 2 <= j <= N-1.
+    // The new vertices' light visibility is reset to LIGHT_UNKNOWN.
+    bool mutate_subpath(Path& path, int i, int j, std::mt19937& rng) const;
+    bool mutate_subpath(Path& path, int i, int j, Sampler& sampler) const;
+
+    // Multiple-try proposal: draws numTries candidates for path.vertices[index]
+    // with mutator_type 0 (retrace), 1 (meshwalk) or 2 (project) and returns
+    // the ones whose neighbour connections are unoccluded. All connection
+    // rays are traced as one batch.
+    int propose_vertex_batch(const Path& path,
+        int index,
+        int mutator_type,
+        float radius,
+        int numTries,
+        Sampler& sampler,
+        std::vector<Candidate>& out) const;
+
+    void apply_candidate(Path& path, int index, const Candidate& c) const;
+
+    // Area-measure density of vertices 2..N-2 given the primary hit, as
+    // produced by sample_path, with the roulette survival probabilities and,
+    // for a path roulette ended, the probability of stopping at its last
+    // vertex. Used as the path pdf in Metropolis ratios.
+    double path_pdf(const Path& path) const;
+
+    // Area-measure density of proposing to.vertices[index] from `from`.
+    double transition_pdf_retrace(const Path& from,
+        const Path& to,
+        int index) const;
+
+    double transition_pdf_project(const Path& from,
+        const Path& to,
+        int index,
+        float radius) const;
+
+    // Area-measure density of mutate_subpath producing vertices i+1..j-1 of
+    // path; the same for both directions of a move since vertex i is kept.
+    double transition_pdf_subpath(const Path& path, int i, int j) const;
+
+private:
+    bool propose_vertex_meshwalk(const Path& path, int index, float radius,
+        Sampler& sampler, Candidate& out) const;
+    bool propose_vertex_project(const Path& path, int index, float radius,
+        Sampler& sampler, Candidate& out) const;
+    bool propose_vertex_retrace(const Path& path, int index,
+        Sampler& sampler, Candidate& out) const;
+
+    enum Walk {
+        WALK_OK,
+        WALK_DEGENERATE,
+        WALK_OFF_MESH,
+        WALK_GUARD
+    };
+
+    Walk walk_geodesic(GeomUtil::Triangle& face, glm::vec3& p, glm::vec3& d, float L) const;
+
+    enum Connection {
+        CONNECTION_OK,
+        CONNECTION_PREV_OCCLUDED,
+        CONNECTION_NEXT_OCCLUDED
+    };
+
+    Connection connections_visible(const Path& path, int index, const glm::vec3& p) const;
+
+    static glm::vec3 draw_light_u(Sampler& sampler);
+
+    // The connection the visibility table rules out without tracing, or
+    // CONNECTION_OK.
+    Connection connections_table_check(const Path& path, int index, const glm::vec3& p) const;
+
 private:
     const Scene& m_scene;
     glm::vec3    m_C;
     glm::vec3    m_L;
+    Roulette     m_rr;
+
+    const BSDFSampler* m_sampler = &BSDFSampler::get(BSDFSampler::COSINE);
+
+    const RadianceCache* m_cache = nullptr;
+    int                  m_cacheDepth = 2;
+
+    const ClusterVisibility* m_visTable = nullptr;
+
+    bool m_lightConnection = true;
 };
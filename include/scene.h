@@ -5,12 +5,20 @@
 #include <glm/glm.hpp>
 #include <limits>
 #include "GeomUtil.h"
+#include "BVH.h"
 
 class Scene {
 public:
 
     bool load(const std::string& filename);
+
+    // Builds the scene from an indexed triangle list. normals may be empty or
+    // hold one normal per position. Shared indices define mesh adjacency.
+    bool build(const std::vector<glm::vec3>& positions,
+        const std::vector<glm::vec3>& normals,
+        const std::vector<uint32_t>& indices);
     const std::vector<GeomUtil::Triangle>& triangles() const { return m_triangles; }
+    const BVH& bvh() const { return m_bvh; }
 
     const glm::vec3& bounds_min() const { return m_boundsMin; }
     const glm::vec3& bounds_max() const { return m_boundsMax; }
@@ -32,11 +40,23 @@ public:
         float t_target,
         float eps = 1e-4f) const;
 
+    // Batched form of visible(): outVisible[i] = visible(origins[i], targets[i]).
+    // Each ray is answered from the BVH on the calling thread.
+    void visible_batch(const std::vector<glm::vec3>& origins,
+        const std::vector<glm::vec3>& targets,
+        std::vector<uint8_t>& outVisible,
+        float eps = 1e-4f) const;
+
     bool intersect(const glm::vec3& origin,
         const glm::vec3& dir,
         Hit& outHit,
         GeomUtil::Triangle& tri) const;
 
+    // Rays traced (intersections plus visibility queries) by the calling
+    // thread since it started or the last Stats::reset(), from the Stats ray
+    // counters, which are kept even with RENDERER_ENABLE_STATS off.
+    static uint64_t rays_traced();
+
     void draw_ray(const glm::vec3& origin,
         const glm::vec3& dir,
         float length,
@@ -62,6 +82,7 @@ private:
     std::vector<GeomUtil::Triangle> m_triangles;
     std::vector<GeomUtil::Triangle> m_debugTriangles;
     std::vector<glm::vec3> m_positions;
+    BVH m_bvh;
 
     glm::vec3 m_boundsMin;
     glm::vec3 m_boundsMax;
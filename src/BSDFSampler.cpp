@@ -0,0 +1,42 @@
+#include "BSDFSampler.h"
+#include "GeomUtil.h"
+
+static constexpr float INV_PI = 0.318309886183790671538f;
+static constexpr float INV_2PI = 0.159154943091895335769f;
+
+const BSDFSampler& BSDFSampler::get(Type type) {
+    static const UniformHemisphereSampler uniform;
+    static const CosineHemisphereSampler cosine;
+    return type == COSINE ? static_cast<const BSDFSampler&>(cosine) : uniform;
+}
+
+bool UniformHemisphereSampler::sample(const glm::vec3&,
+    const glm::vec3& n,
+    const glm::vec2& u,
+    glm::vec3& dir,
+    float& pdf) const
+{
+    dir = GeomUtil::sample_hemisphere_uniform(n, u);
+    pdf = INV_2PI;
+    return glm::dot(dir, n) > 0.0f;
+}
+
+float UniformHemisphereSampler::pdf(const glm::vec3&, const glm::vec3& n, const glm::vec3& dir) const {
+    return glm::dot(n, dir) > 0.0f ? INV_2PI : 0.0f;
+}
+
+bool CosineHemisphereSampler::sample(const glm::vec3&,
+    const glm::vec3& n,
+    const glm::vec2& u,
+    glm::vec3& dir,
+    float& pdf) const
+{
+    dir = GeomUtil::sample_hemisphere_cosine(n, u);
+    const float c = glm::dot(dir, n);
+    pdf = c * INV_PI;
+    return c > 0.0f;
+}
+
+float CosineHemisphereSampler::pdf(const glm::vec3&, const glm::vec3& n, const glm::vec3& dir) const {
+    return std::max(0.0f, glm::dot(n, dir)) * INV_PI;
+}
@@ -0,0 +1,354 @@
+#include "BVH.h"
+#include "Stats.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+
+namespace {
+
+constexpr int kBins = 12;
+constexpr uint32_t kMinLeafSize = 2;
+constexpr uint32_t kMaxLeafSize = 8;
+constexpr int kStackSize = 128;
+// Traversal pushes at most one node per level, so nodes at this depth are
+// made leaves and the traversal stack cannot overflow.
+constexpr uint32_t kMaxDepth = kStackSize;
+
+struct Bounds {
+    glm::vec3 bmin{ std::numeric_limits<float>::infinity() };
+    glm::vec3 bmax{ -std::numeric_limits<float>::infinity() };
+
+    void grow(const glm::vec3& p) {
+        bmin = glm::min(bmin, p);
+        bmax = glm::max(bmax, p);
+    }
+
+    void grow(const Bounds& b) {
+        bmin = glm::min(bmin, b.bmin);
+        bmax = glm::max(bmax, b.bmax);
+    }
+
+    float area() const {
+        glm::vec3 e = bmax - bmin;
+        if (e.x < 0.0f || e.y < 0.0f || e.z < 0.0f) return 0.0f;
+        return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+    }
+};
+
+float component(const glm::vec3& v, int axis) {
+    return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+// Slab test; returns the entry distance or +inf on a miss.
+float slab_entry(const BVH::Node& n,
+    const glm::vec3& origin,
+    const glm::vec3& invDir,
+    float tMin,
+    float tMax)
+{
+    float tx0 = (n.bmin.x - origin.x) * invDir.x;
+    float tx1 = (n.bmax.x - origin.x) * invDir.x;
+    float ty0 = (n.bmin.y - origin.y) * invDir.y;
+    float ty1 = (n.bmax.y - origin.y) * invDir.y;
+    float tz0 = (n.bmin.z - origin.z) * invDir.z;
+    float tz1 = (n.bmax.z - origin.z) * invDir.z;
+
+    float tNear = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::max(std::min(tz0, tz1), tMin));
+    float tFar = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::min(std::max(tz0, tz1), tMax));
+
+    return tNear <= tFar ? tNear : std::numeric_limits<float>::infinity();
+}
+
+}
+
+void BVH::clear() {
+    m_nodes.clear();
+    m_tris.clear();
+    m_triIndex.clear();
+}
+
+size_t BVH::memory_bytes() const {
+    return m_nodes.capacity() * sizeof(Node)
+        + m_tris.capacity() * sizeof(Tri)
+        + m_triIndex.capacity() * sizeof(uint32_t);
+}
+
+void BVH::build(const std::vector<GeomUtil::Triangle>& triangles) {
+    PM_STAT_TIMER(T_SCENE_BUILD);
+    PM_TRACE_SCOPE("BVH::build", "accel");
+
+    clear();
+
+    const uint32_t n = (uint32_t)triangles.size();
+    if (n == 0) return;
+
+    std::vector<Bounds> triBounds(n);
+    std::vector<glm::vec3> centroids(n);
+
+    m_triIndex.resize(n);
+    for (uint32_t i = 0; i < n; ++i) {
+        const GeomUtil::Triangle& t = triangles[i];
+        triBounds[i].grow(t.v0);
+        triBounds[i].grow(t.v1);
+        triBounds[i].grow(t.v2);
+        centroids[i] = (t.v0 + t.v1 + t.v2) / 3.0f;
+        m_triIndex[i] = i;
+    }
+
+    m_nodes.reserve(2 * (size_t)n);
+    m_nodes.emplace_back();
+    m_nodes[0].leftFirst = 0;
+    m_nodes[0].count = n;
+
+    // (node, depth) pairs.
+    std::vector<std::pair<uint32_t, uint32_t>> stack;
+    stack.push_back({ 0, 0 });
+
+    while (!stack.empty()) {
+        const auto [nodeIdx, depth] = stack.back();
+        stack.pop_back();
+
+        const uint32_t first = m_nodes[nodeIdx].leftFirst;
+        const uint32_t count = m_nodes[nodeIdx].count;
+
+        Bounds nodeBounds, centroidBounds;
+        for (uint32_t i = first; i < first + count; ++i) {
+            nodeBounds.grow(triBounds[m_triIndex[i]]);
+            centroidBounds.grow(centroids[m_triIndex[i]]);
+        }
+        m_nodes[nodeIdx].bmin = nodeBounds.bmin;
+        m_nodes[nodeIdx].bmax = nodeBounds.bmax;
+
+        if (count <= kMinLeafSize || depth >= kMaxDepth) continue;
+
+        // Binned SAH over all three axes.
+        int bestAxis = -1;
+        int bestSplit = 0;
+        float bestCost = std::numeric_limits<float>::infinity();
+
+        for (int axis = 0; axis < 3; ++axis) {
+            const float lo = component(centroidBounds.bmin, axis);
+            const float hi = component(centroidBounds.bmax, axis);
+            if (!(hi > lo)) continue;
+
+            const float scale = (float)kBins / (hi - lo);
+
+            Bounds bins[kBins];
+            uint32_t binCount[kBins] = {};
+
+            for (uint32_t i = first; i < first + count; ++i) {
+                const uint32_t t = m_triIndex[i];
+                int b = std::min(kBins - 1, (int)((component(centroids[t], axis) - lo) * scale));
+                bins[b].grow(triBounds[t]);
+                binCount[b]++;
+            }
+
+            float rightArea[kBins - 1];
+            uint32_t rightCount[kBins - 1];
+            Bounds acc;
+            uint32_t accCount = 0;
+            for (int b = kBins - 1; b > 0; --b) {
+                acc.grow(bins[b]);
+                accCount += binCount[b];
+                rightArea[b - 1] = acc.area();
+                rightCount[b - 1] = accCount;
+            }
+
+            acc = Bounds{};
+            accCount = 0;
+            for (int b = 0; b < kBins - 1; ++b) {
+                acc.grow(bins[b]);
+                accCount += binCount[b];
+                if (accCount == 0 || rightCount[b] == 0) continue;
+
+                float cost = acc.area() * (float)accCount + rightArea[b] * (float)rightCount[b];
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestSplit = b;
+                }
+            }
+        }
+
+        // Every centroid coincides: nothing to split on.
+        if (bestAxis < 0) continue;
+
+        const float leafCost = nodeBounds.area() * (float)count;
+        if (bestCost >= leafCost && count <= kMaxLeafSize) continue;
+
+        const float lo = component(centroidBounds.bmin, bestAxis);
+        const float scale = (float)kBins / (component(centroidBounds.bmax, bestAxis) - lo);
+
+        uint32_t* begin = m_triIndex.data() + first;
+        uint32_t* mid = std::partition(begin, begin + count, [&](uint32_t t) {
+            int b = std::min(kBins - 1, (int)((component(centroids[t], bestAxis) - lo) * scale));
+            return b <= bestSplit;
+        });
+
+        const uint32_t leftCount = (uint32_t)(mid - begin);
+        if (leftCount == 0 || leftCount == count) continue;
+
+        const uint32_t left = (uint32_t)m_nodes.size();
+        m_nodes.emplace_back();
+        m_nodes.emplace_back();
+
+        m_nodes[left].leftFirst = first;
+        m_nodes[left].count = leftCount;
+        m_nodes[left + 1].leftFirst = first + leftCount;
+        m_nodes[left + 1].count = count - leftCount;
+
+        m_nodes[nodeIdx].leftFirst = left;
+        m_nodes[nodeIdx].count = 0;
+
+        stack.push_back({ left + 1, depth + 1 });
+        stack.push_back({ left, depth + 1 });
+    }
+
+    m_nodes.shrink_to_fit();
+
+    m_tris.resize(n);
+    for (uint32_t i = 0; i < n; ++i) {
+        const GeomUtil::Triangle& t = triangles[m_triIndex[i]];
+        m_tris[i].v0 = t.v0;
+        m_tris[i].e1 = t.v1 - t.v0;
+        m_tris[i].e2 = t.v2 - t.v0;
+    }
+}
+
+// Same test as GeomUtil::moller_trumbore with the edges precomputed. Leaves
+// are stored in m_tris in traversal order so their data is contiguous.
+template <bool AnyHit>
+bool BVH::traverse(const glm::vec3& origin,
+    const glm::vec3& dir,
+    float tMin,
+    float tMax,
+    int& triIndex,
+    float& tOut,
+    float& uOut,
+    float& vOut) const
+{
+    if (m_nodes.empty()) return false;
+
+    const float detEps = 1e-8f;
+    const float inf = std::numeric_limits<float>::infinity();
+
+    // A large finite reciprocal keeps 0 * invDir from turning into NaN for
+    // rays that start on a slab plane.
+    const float big = 1e30f;
+    const glm::vec3 invDir(
+        dir.x != 0.0f ? 1.0f / dir.x : big,
+        dir.y != 0.0f ? 1.0f / dir.y : big,
+        dir.z != 0.0f ? 1.0f / dir.z : big);
+
+    uint32_t stack[kStackSize];
+    int sp = 0;
+
+    uint64_t tests = 0;
+    uint64_t visited = 0;
+
+    float bestT = tMax;
+    int bestLeaf = -1;
+    float bestU = 0.0f, bestV = 0.0f;
+
+    uint32_t nodeIdx = 0;
+    if (slab_entry(m_nodes[0], origin, invDir, tMin, bestT) == inf) return false;
+
+    for (;;) {
+        const Node& node = m_nodes[nodeIdx];
+        ++visited;
+
+        if (node.count > 0) {
+            for (uint32_t i = node.leftFirst; i < node.leftFirst + node.count; ++i) {
+                const Tri& tri = m_tris[i];
+                ++tests;
+
+                const glm::vec3 pvec = glm::cross(dir, tri.e2);
+                const float det = glm::dot(tri.e1, pvec);
+                if (std::fabs(det) < detEps) continue;
+
+                const float invDet = 1.0f / det;
+                const glm::vec3 tvec = origin - tri.v0;
+
+                const float u = glm::dot(tvec, pvec) * invDet;
+                if (u < 0.0f || u > 1.0f) continue;
+
+                const glm::vec3 qvec = glm::cross(tvec, tri.e1);
+                const float v = glm::dot(dir, qvec) * invDet;
+                if (v < 0.0f || (u + v) > 1.0f) continue;
+
+                const float t = glm::dot(tri.e2, qvec) * invDet;
+                if (t < tMin || t >= bestT) continue;
+
+                bestT = t;
+                bestLeaf = (int)i;
+                bestU = u;
+                bestV = v;
+
+                if (AnyHit) break;
+            }
+
+            if (AnyHit && bestLeaf >= 0) break;
+            if (sp == 0) break;
+            nodeIdx = stack[--sp];
+            continue;
+        }
+
+        // Visit the nearer child first and push the other one.
+        uint32_t a = node.leftFirst;
+        uint32_t b = node.leftFirst + 1;
+        float ta = slab_entry(m_nodes[a], origin, invDir, tMin, bestT);
+        float tb = slab_entry(m_nodes[b], origin, invDir, tMin, bestT);
+
+        if (ta > tb) {
+            std::swap(a, b);
+            std::swap(ta, tb);
+        }
+
+        if (ta == inf) {
+            if (sp == 0) break;
+            nodeIdx = stack[--sp];
+            continue;
+        }
+
+        nodeIdx = a;
+        if (tb != inf) stack[sp++] = b;
+    }
+
+    PM_STAT_ADD(TRIANGLE_TESTS, tests);
+    PM_STAT_ADD(BVH_NODES_VISITED, visited);
+    (void)tests;
+    (void)visited;
+
+    if (bestLeaf < 0) return false;
+
+    triIndex = (int)m_triIndex[bestLeaf];
+    tOut = bestT;
+    uOut = bestU;
+    vOut = bestV;
+    return true;
+}
+
+bool BVH::intersect(const glm::vec3& origin,
+    const glm::vec3& dir,
+    float tMin,
+    float tMax,
+    int& triIndex,
+    float& t,
+    float& u,
+    float& v) const
+{
+    return traverse<false>(origin, dir, tMin, tMax, triIndex, t, u, v);
+}
+
+bool BVH::occluded(const glm::vec3& origin,
+    const glm::vec3& dir,
+    float tMin,
+    float tMax) const
+{
+    int triIndex;
+    float t, u, v;
+    return traverse<true>(origin, dir, tMin, tMax, triIndex, t, u, v);
+}
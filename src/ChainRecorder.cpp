@@ -0,0 +1,318 @@
+#include "ChainRecorder.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <type_traits>
+#include <vector>
+
+static_assert(sizeof(Renderer::ChainStep) == 32, "ChainStep layout is part of the file format");
+static_assert(sizeof(ChainRecorder::ChainHeader) % 8 == 0, "chain records stay 8-byte aligned");
+
+namespace {
+
+constexpr char kFileMagic[8] = { 'P', 'M', 'C', 'H', 'A', 'I', 'N', '\0' };
+constexpr char kEndMagic[8] = { 'P', 'M', 'C', 'H', 'E', 'N', 'D', '\0' };
+constexpr uint32_t kChainMagic = 0x314e4843u;   // "CHN1"
+
+size_t pad8(size_t n) { return (8 - (n & 7)) & 7; }
+
+// The settings block: every field as a 4-byte little-endian value (bools
+// and enums as int32, vectors as three floats) in the order listed by
+// camera_fields and params_fields. Adding, removing or reordering a field
+// changes the format and needs a new ChainRecorder::kVersion.
+struct FieldWriter {
+    std::vector<char>& out;
+
+    void raw(const void* p) { out.insert(out.end(), (const char*)p, (const char*)p + 4); }
+    void operator()(const int32_t& v) { raw(&v); }
+    void operator()(const float& v) { raw(&v); }
+    void operator()(const bool& v) { const int32_t i = v ? 1 : 0; raw(&i); }
+    void operator()(const glm::vec3& v) { (*this)(v.x); (*this)(v.y); (*this)(v.z); }
+    template <class E, class = std::enable_if_t<std::is_enum_v<E>>>
+    void operator()(const E& v) { const int32_t i = (int32_t)v; raw(&i); }
+};
+
+struct FieldReader {
+    const char* p;
+    const char* end;
+    bool ok = true;
+
+    bool raw(void* dst) {
+        if (end - p < 4) return ok = false;
+        std::memcpy(dst, p, 4);
+        p += 4;
+        return true;
+    }
+    void operator()(int32_t& v) { raw(&v); }
+    void operator()(float& v) { raw(&v); }
+    void operator()(bool& v) { int32_t i = 0; if (raw(&i)) v = i != 0; }
+    void operator()(glm::vec3& v) { (*this)(v.x); (*this)(v.y); (*this)(v.z); }
+    template <class E, class = std::enable_if_t<std::is_enum_v<E>>>
+    void operator()(E& v) { int32_t i = 0; if (raw(&i)) v = (E)i; }
+};
+
+template <class Io, class Camera>
+void camera_fields(Io& io, Camera& c) {
+    io(c.center);
+    io(c.forward);
+    io(c.world_up);
+    io(c.focal_length);
+    io(c.pixel_size);
+    io(c.width);
+    io(c.height);
+}
+
+template <class Io, class Params>
+void params_fields(Io& io, Params& p) {
+    io(p.maxBounces);
+    io(p.retriesPerBounce);
+    io(p.Kmutations);
+    io(p.visibilityEps);
+    io(p.mutateRadiusFrac);
+
+    io(p.metropolis);
+    io(p.seedPaths);
+    io(p.chains);
+    io(p.largeStepProb);
+    io(p.multiTry);
+
+    io(p.scheduler.regionsX);
+    io(p.scheduler.regionsY);
+    io(p.scheduler.maxVertexIndex);
+    io(p.scheduler.minProbability);
+    io(p.scheduler.warmupAttempts);
+
+    io(p.subpathLength);
+    io(p.russianRoulette);
+    io(p.rrMinBounces);
+    io(p.sampling);
+    io(p.sampler);
+    io(p.pixelJitter);
+
+    io(p.radianceCache.enabled);
+    io(p.radianceCache.depth);
+    io(p.radianceCache.cellSize);
+    io(p.radianceCache.log2Entries);
+    io(p.radianceCache.minSamples);
+
+    io(p.guiding.enabled);
+    io(p.guiding.fraction);
+    io(p.guiding.spatialThreshold);
+    io(p.guiding.directionalThreshold);
+    io(p.guiding.maxSpatialDepth);
+    io(p.guiding.maxDirectionalDepth);
+
+    io(p.visibilityTable.enabled);
+    io(p.visibilityTable.resolution);
+    io(p.visibilityTable.maxOccluders);
+    io(p.visibilityTable.threads);
+
+    io(p.threads);
+    io(p.tileSize);
+    io(p.albedo);
+    io(p.lightIntensity);
+}
+
+uint64_t pixel_key(int px, int py) {
+    return ((uint64_t)(uint32_t)py << 32) | (uint64_t)(uint32_t)px;
+}
+
+uint32_t hash_pixel(uint32_t salt, int px, int py) {
+    uint64_t h = pixel_key(px, py) ^ ((uint64_t)salt * 0x9e3779b97f4a7c15ULL);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return (uint32_t)h;
+}
+
+}
+
+ChainRecorder::~ChainRecorder() {
+    if (m_out.is_open()) close();
+}
+
+bool ChainRecorder::open(const std::string& path,
+    const Renderer& renderer,
+    const std::string& scene,
+    const Selection& selection)
+{
+    if (m_out.is_open()) close();
+
+    m_offsets.clear();
+    m_pos = 0;
+    m_failed = false;
+
+    m_pixels.clear();
+    for (const auto& p : selection.pixels) m_pixels.insert(pixel_key(p.first, p.second));
+
+    const double f = std::min(1.0, std::max(0.0, (double)selection.fraction));
+    m_threshold = f >= 1.0 ? UINT32_MAX : (uint32_t)(f * 4294967296.0);
+    m_salt = selection.salt;
+
+    m_out.open(path, std::ios::binary | std::ios::trunc);
+    if (!m_out) {
+        std::cerr << "ChainRecorder: failed to open " << path << "\n";
+        return false;
+    }
+
+    std::vector<char> settings;
+    FieldWriter w{ settings };
+    camera_fields(w, renderer.camera());
+    w(renderer.light_pos());
+    params_fields(w, renderer.params());
+
+    FileHeader h{};
+    std::memcpy(h.magic, kFileMagic, sizeof(h.magic));
+    h.version = kVersion;
+    h.settingsBytes = (uint32_t)settings.size();
+    h.sceneBytes = (uint32_t)scene.size();
+    h.reserved = 0;
+
+    std::vector<char> buf((const char*)&h, (const char*)&h + sizeof(h));
+    buf.insert(buf.end(), settings.begin(), settings.end());
+    buf.insert(buf.end(), scene.begin(), scene.end());
+    buf.resize(buf.size() + pad8(buf.size()), '\0');
+
+    m_out.write(buf.data(), (std::streamsize)buf.size());
+    m_pos = buf.size();
+    return (bool)m_out;
+}
+
+bool ChainRecorder::wants(int px, int py) const {
+    if (!m_pixels.empty() && m_pixels.count(pixel_key(px, py))) return true;
+    return m_threshold > 0 && hash_pixel(m_salt, px, py) < m_threshold;
+}
+
+void ChainRecorder::write(const Renderer::Chain& chain) {
+    ChainHeader h{};
+    h.magic = kChainMagic;
+    h.px = chain.px;
+    h.py = chain.py;
+    h.renderSeed = chain.renderSeed;
+    h.pixelSeed = chain.pixelSeed;
+    h.mutatorType = chain.mutatorType;
+    h.pass = chain.pass;
+    h.seedVertices = (uint32_t)chain.seedPath.size();
+    h.steps = (uint32_t)chain.steps.size();
+    h.result[0] = chain.result.x;
+    h.result[1] = chain.result.y;
+    h.result[2] = chain.result.z;
+    h.seedOk = chain.seedOk ? 1u : 0u;
+    h.micros = chain.micros;
+
+    const size_t seedBytes = chain.seedPath.size() * sizeof(glm::vec3);
+    const size_t stepBytes = chain.steps.size() * sizeof(Renderer::ChainStep);
+    const size_t padding = pad8(seedBytes + stepBytes);
+    const char zeros[8] = {};
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_out.is_open()) return;
+
+    m_offsets.push_back(m_pos);
+    m_out.write((const char*)&h, sizeof(h));
+    m_out.write((const char*)chain.seedPath.data(), (std::streamsize)seedBytes);
+    m_out.write((const char*)chain.steps.data(), (std::streamsize)stepBytes);
+    m_out.write(zeros, (std::streamsize)padding);
+    m_pos += sizeof(h) + seedBytes + stepBytes + padding;
+
+    if (!m_out) m_failed = true;
+}
+
+bool ChainRecorder::close() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_out.is_open()) return !m_failed;
+
+    Trailer t{};
+    t.indexOffset = m_pos;
+    t.chainCount = m_offsets.size();
+    std::memcpy(t.magic, kEndMagic, sizeof(t.magic));
+
+    m_out.write((const char*)m_offsets.data(), (std::streamsize)(m_offsets.size() * sizeof(uint64_t)));
+    m_out.write((const char*)&t, sizeof(t));
+    if (!m_out) m_failed = true;
+
+    m_out.close();
+    return !m_failed;
+}
+
+bool ChainLog::open(const std::string& path) {
+    m_in.close();
+    m_in.clear();
+    m_offsets.clear();
+
+    m_in.open(path, std::ios::binary);
+    if (!m_in) {
+        std::cerr << "ChainLog: failed to open " << path << "\n";
+        return false;
+    }
+
+    ChainRecorder::FileHeader h{};
+    m_in.read((char*)&h, sizeof(h));
+    if (!m_in || std::memcmp(h.magic, kFileMagic, sizeof(h.magic)) != 0) {
+        std::cerr << "ChainLog: " << path << " is not a chain log\n";
+        return false;
+    }
+    if (h.version != ChainRecorder::kVersion) {
+        std::cerr << "ChainLog: " << path << " has format version " << h.version
+            << ", expected " << ChainRecorder::kVersion << "\n";
+        return false;
+    }
+
+    std::vector<char> settings(h.settingsBytes);
+    m_in.read(settings.data(), (std::streamsize)settings.size());
+    m_scene.resize(h.sceneBytes);
+    m_in.read(m_scene.data(), (std::streamsize)m_scene.size());
+
+    m_cam = Renderer::Camera{};
+    m_params = Renderer::RenderParams{};
+    FieldReader r{ settings.data(), settings.data() + settings.size() };
+    camera_fields(r, m_cam);
+    r(m_lightPos);
+    params_fields(r, m_params);
+    if (!m_in || !r.ok || r.p != r.end) {
+        std::cerr << "ChainLog: " << path << " has a malformed settings block\n";
+        return false;
+    }
+
+    ChainRecorder::Trailer t{};
+    m_in.seekg(-(std::streamoff)sizeof(t), std::ios::end);
+    m_in.read((char*)&t, sizeof(t));
+    if (!m_in || std::memcmp(t.magic, kEndMagic, sizeof(t.magic)) != 0) {
+        std::cerr << "ChainLog: " << path << " is truncated (recorder not closed?)\n";
+        return false;
+    }
+
+    m_offsets.resize((size_t)t.chainCount);
+    m_in.seekg((std::streamoff)t.indexOffset);
+    m_in.read((char*)m_offsets.data(), (std::streamsize)(m_offsets.size() * sizeof(uint64_t)));
+    return (bool)m_in;
+}
+
+bool ChainLog::read_chain(size_t i, Renderer::Chain& out) {
+    if (i >= m_offsets.size()) return false;
+
+    ChainRecorder::ChainHeader h{};
+    m_in.seekg((std::streamoff)m_offsets[i]);
+    m_in.read((char*)&h, sizeof(h));
+    if (!m_in || h.magic != kChainMagic) return false;
+
+    out.px = h.px;
+    out.py = h.py;
+    out.renderSeed = h.renderSeed;
+    out.pixelSeed = h.pixelSeed;
+    out.mutatorType = h.mutatorType;
+    out.pass = h.pass;
+    out.seedOk = h.seedOk != 0;
+    out.result = glm::vec3(h.result[0], h.result[1], h.result[2]);
+    out.micros = h.micros;
+    out.replayStrategies.clear();
+
+    out.seedPath.resize(h.seedVertices);
+    out.steps.resize(h.steps);
+    m_in.read((char*)out.seedPath.data(), (std::streamsize)(out.seedPath.size() * sizeof(glm::vec3)));
+    m_in.read((char*)out.steps.data(), (std::streamsize)(out.steps.size() * sizeof(Renderer::ChainStep)));
+    return (bool)m_in;
+}
@@ -0,0 +1,330 @@
+#include "ClusterVisibility.h"
+#include "Stats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <thread>
+#include <unordered_map>
+
+namespace {
+
+// Groups larger than this are not merged (the merge is quadratic); their
+// triangles become occluders on their own.
+constexpr size_t kMaxMergeGroup = 256;
+
+// Convex polygon, counter-clockwise about n, on the plane n . x = d.
+struct Occluder {
+    std::vector<glm::vec3> v;
+    std::vector<glm::vec3> inward;   // unit, in the plane, per edge v[k] -> v[k + 1]
+    glm::vec3 n{ 0.0f };
+    float     d = 0.0f;
+    float     area = 0.0f;
+};
+
+// Unit normal flipped so its largest component is positive, so the two
+// sides of a wall group on the same plane.
+glm::vec3 canonical_normal(const glm::vec3& n) {
+    const glm::vec3 a = glm::abs(n);
+    const float c = a.x >= a.y && a.x >= a.z ? n.x : (a.y >= a.z ? n.y : n.z);
+    return c < 0.0f ? -n : n;
+}
+
+uint64_t plane_key(const glm::vec3& n, float d, float invScale) {
+    auto q = [](float x) { return (uint64_t)(uint16_t)(int16_t)std::lround(x * 8192.0f); };
+    uint64_t h = q(n.x) | (q(n.y) << 16) | (q(n.z) << 32);
+    h ^= (uint64_t)(uint32_t)(int32_t)std::lround(d * invScale * 8192.0f) * 0x9e3779b97f4a7c15ULL;
+    return h;
+}
+
+// Merges q into p if p has an edge (a, b) that q has as (b, a) and the
+// union is convex. Collinear vertices are dropped.
+bool merge_convex(std::vector<glm::vec3>& p, const std::vector<glm::vec3>& q, const glm::vec3& n) {
+    const size_t pm = p.size();
+    const size_t qm = q.size();
+
+    for (size_t i = 0; i < pm; ++i) {
+        const glm::vec3& a = p[i];
+        const glm::vec3& b = p[(i + 1) % pm];
+
+        for (size_t k = 0; k < qm; ++k) {
+            if (q[k] != b || q[(k + 1) % qm] != a) continue;
+
+            // p from b around to a, then q after a up to b.
+            std::vector<glm::vec3> m;
+            m.reserve(pm + qm - 2);
+            for (size_t s = 1; s <= pm; ++s) m.push_back(p[(i + s) % pm]);
+            for (size_t s = 2; s < qm; ++s) m.push_back(q[(k + s) % qm]);
+
+            std::vector<glm::vec3> out;
+            const size_t mm = m.size();
+            for (size_t s = 0; s < mm; ++s) {
+                const glm::vec3 e0 = m[s] - m[(s + mm - 1) % mm];
+                const glm::vec3 e1 = m[(s + 1) % mm] - m[s];
+                const float turn = glm::dot(glm::cross(e0, e1), n);
+                const float tol = 1e-5f * glm::length(e0) * glm::length(e1);
+                if (turn < -tol) return false;
+                if (turn > tol) out.push_back(m[s]);
+            }
+            if (out.size() < 3) return false;
+
+            p = std::move(out);
+            return true;
+        }
+    }
+    return false;
+}
+
+}
+
+bool ClusterVisibility::build(const Scene& scene, const Params& params) {
+    PM_STAT_TIMER(T_VISIBILITY_BUILD);
+    const auto t0 = std::chrono::steady_clock::now();
+
+    const std::vector<GeomUtil::Triangle>& tris = scene.triangles();
+    if (tris.empty()) return false;
+
+    m_info = BuildInfo();
+
+    // Grid over the bounds, slightly padded so points on the outer walls
+    // fall inside it.
+    const glm::vec3 bmin = scene.bounds_min();
+    const glm::vec3 bmax = scene.bounds_max();
+    const glm::vec3 extent = bmax - bmin;
+    const float longest = std::max(extent.x, std::max(extent.y, extent.z));
+    const float cell = (longest > 0.0f ? longest : 1.0f) / (float)std::max(1, params.resolution);
+
+    m_origin = bmin - glm::vec3(0.01f * cell);
+    m_invCell = 1.0f / cell;
+    for (int a = 0; a < 3; ++a) {
+        m_dims[a] = std::max(1, (int)std::ceil((extent[a] + 0.02f * cell) * m_invCell));
+    }
+
+    const size_t cellCount = (size_t)m_dims[0] * m_dims[1] * m_dims[2];
+    m_cellCluster.assign(cellCount, -1);
+
+    // Every cell a triangle's bounds touch gets a cluster.
+    std::vector<int> clusterCell;
+    for (const GeomUtil::Triangle& t : tris) {
+        const glm::vec3 lo = (glm::min(t.v0, glm::min(t.v1, t.v2)) - m_origin) * m_invCell;
+        const glm::vec3 hi = (glm::max(t.v0, glm::max(t.v1, t.v2)) - m_origin) * m_invCell;
+        int c0[3], c1[3];
+        for (int a = 0; a < 3; ++a) {
+            c0[a] = std::clamp((int)std::floor(lo[a]), 0, m_dims[a] - 1);
+            c1[a] = std::clamp((int)std::floor(hi[a]), 0, m_dims[a] - 1);
+        }
+        for (int z = c0[2]; z <= c1[2]; ++z)
+            for (int y = c0[1]; y <= c1[1]; ++y)
+                for (int x = c0[0]; x <= c1[0]; ++x) {
+                    const size_t c = ((size_t)z * m_dims[1] + y) * m_dims[0] + x;
+                    if (m_cellCluster[c] >= 0) continue;
+                    m_cellCluster[c] = (int32_t)clusterCell.size();
+                    clusterCell.push_back((int)c);
+                }
+    }
+    m_clusters = (int)clusterCell.size();
+
+    // Occluders: coplanar triangles sharing edges, merged into convex
+    // polygons, largest first.
+    const float invScale = 1.0f / (longest > 0.0f ? longest : 1.0f);
+    std::unordered_map<uint64_t, std::vector<size_t>> groups;
+    std::vector<glm::vec3> triNormal(tris.size());
+    for (size_t t = 0; t < tris.size(); ++t) {
+        const glm::vec3 c = glm::cross(tris[t].v1 - tris[t].v0, tris[t].v2 - tris[t].v0);
+        const float len = glm::length(c);
+        if (!(len > 0.0f)) continue;
+        triNormal[t] = canonical_normal(c / len);
+        groups[plane_key(triNormal[t], glm::dot(triNormal[t], tris[t].v0), invScale)].push_back(t);
+    }
+
+    std::vector<Occluder> occluders;
+    for (const auto& [key, members] : groups) {
+        const glm::vec3 n = triNormal[members[0]];
+
+        std::vector<std::vector<glm::vec3>> polys;
+        polys.reserve(members.size());
+        for (size_t t : members) {
+            const GeomUtil::Triangle& tri = tris[t];
+            const glm::vec3 c = glm::cross(tri.v1 - tri.v0, tri.v2 - tri.v0);
+            if (glm::dot(c, n) >= 0.0f) polys.push_back({ tri.v0, tri.v1, tri.v2 });
+            else polys.push_back({ tri.v0, tri.v2, tri.v1 });
+        }
+
+        if (polys.size() <= kMaxMergeGroup) {
+            for (size_t i = 0; i < polys.size(); ++i) {
+                for (size_t j = i + 1; j < polys.size();) {
+                    if (merge_convex(polys[i], polys[j], n)) {
+                        polys.erase(polys.begin() + (ptrdiff_t)j);
+                        j = i + 1;
+                    }
+                    else {
+                        ++j;
+                    }
+                }
+            }
+        }
+
+        for (std::vector<glm::vec3>& p : polys) {
+            Occluder o;
+            o.n = n;
+            o.d = glm::dot(n, p[0]);
+            for (size_t k = 1; k + 1 < p.size(); ++k) {
+                o.area += 0.5f * glm::dot(glm::cross(p[k] - p[0], p[k + 1] - p[0]), n);
+            }
+            for (size_t k = 0; k < p.size(); ++k) {
+                const glm::vec3 in = glm::cross(n, p[(k + 1) % p.size()] - p[k]);
+                const float len = glm::length(in);
+                o.inward.push_back(len > 0.0f ? in / len : glm::vec3(0.0f));
+            }
+            o.v = std::move(p);
+            occluders.push_back(std::move(o));
+        }
+    }
+
+    // The crossings of the segments between two cells cover at least a
+    // quarter of a cell face, so smaller polygons never block a pair.
+    occluders.erase(std::remove_if(occluders.begin(), occluders.end(), [&](const Occluder& o) {
+        return o.area < 0.25f * cell * cell;
+    }), occluders.end());
+    std::sort(occluders.begin(), occluders.end(), [](const Occluder& a, const Occluder& b) {
+        return a.area > b.area;
+    });
+    if ((int)occluders.size() > std::max(0, params.maxOccluders)) occluders.resize((size_t)std::max(0, params.maxOccluders));
+    const int numOccluders = (int)occluders.size();
+
+    // Cells count as separated by a plane, and crossings as inside a polygon,
+    // only with this margin, which also covers the eps of Scene::visible.
+    const float margin = std::max(1e-3f * cell, 1e-3f);
+
+    auto corners = [&](int cluster, glm::vec3 out[8]) {
+        const int c = clusterCell[cluster];
+        const glm::vec3 lo = m_origin + cell * glm::vec3(
+            (float)(c % m_dims[0]), (float)((c / m_dims[0]) % m_dims[1]), (float)(c / (m_dims[0] * m_dims[1])));
+        for (int k = 0; k < 8; ++k) {
+            out[k] = lo + cell * glm::vec3((float)(k & 1), (float)((k >> 1) & 1), (float)((k >> 2) & 1));
+        }
+    };
+
+    // Per cluster, bitsets over the occluders whose plane has the cell
+    // strictly in front (above) or behind (below); a pair's candidates are
+    // the occluders with one cell on either side.
+    const size_t words = ((size_t)numOccluders + 63) / 64;
+    std::vector<uint64_t> above((size_t)m_clusters * words, 0), below((size_t)m_clusters * words, 0);
+    std::vector<glm::vec3> cellCorners((size_t)m_clusters * 8);
+    for (int c = 0; c < m_clusters; ++c) {
+        glm::vec3* cc = &cellCorners[(size_t)c * 8];
+        corners(c, cc);
+        for (int o = 0; o < numOccluders; ++o) {
+            float lo = INFINITY, hi = -INFINITY;
+            for (int k = 0; k < 8; ++k) {
+                const float s = glm::dot(occluders[o].n, cc[k]) - occluders[o].d;
+                lo = std::min(lo, s);
+                hi = std::max(hi, s);
+            }
+            const uint64_t bit = uint64_t(1) << (o & 63);
+            if (lo > margin) above[(size_t)c * words + (o >> 6)] |= bit;
+            if (hi < -margin) below[(size_t)c * words + (o >> 6)] |= bit;
+        }
+    }
+
+    auto blocks = [&](const Occluder& o, const glm::vec3* a, const glm::vec3* b) {
+        for (int i = 0; i < 8; ++i) {
+            const float da = glm::dot(o.n, a[i]) - o.d;
+            for (int j = 0; j < 8; ++j) {
+                const float db = glm::dot(o.n, b[j]) - o.d;
+                const glm::vec3 x = a[i] + (da / (da - db)) * (b[j] - a[i]);
+                for (size_t e = 0; e < o.v.size(); ++e) {
+                    if (glm::dot(o.inward[e], x - o.v[e]) < margin) return false;
+                }
+            }
+        }
+        return true;
+    };
+
+    const size_t pairs = (size_t)m_clusters * (size_t)(m_clusters - 1) / 2;
+    m_occluded.assign((pairs + 63) / 64, 0);
+
+    // Rows are handed out dynamically; every pair's result is independent
+    // of the others, so the table does not depend on the thread count.
+    std::atomic<int> nextRow{ 0 };
+    std::atomic<size_t> occludedPairs{ 0 };
+
+    auto worker = [&] {
+        size_t localOccluded = 0;
+
+        for (int i = nextRow.fetch_add(1); i < m_clusters; i = nextRow.fetch_add(1)) {
+            const uint64_t* ai = &above[(size_t)i * words];
+            const uint64_t* bi = &below[(size_t)i * words];
+            for (int j = i + 1; j < m_clusters; ++j) {
+                const uint64_t* aj = &above[(size_t)j * words];
+                const uint64_t* bj = &below[(size_t)j * words];
+
+                bool occluded = false;
+                for (size_t w = 0; w < words && !occluded; ++w) {
+                    for (uint64_t m = (ai[w] & bj[w]) | (bi[w] & aj[w]); m && !occluded; m &= m - 1) {
+                        const int o = (int)(w * 64) + std::countr_zero(m);
+                        occluded = blocks(occluders[o], &cellCorners[(size_t)i * 8], &cellCorners[(size_t)j * 8]);
+                    }
+                }
+
+                if (occluded) {
+                    const size_t bit = pair_bit(i, j);
+                    std::atomic_ref<uint64_t>(m_occluded[bit >> 6]).fetch_or(uint64_t(1) << (bit & 63), std::memory_order_relaxed);
+                    ++localOccluded;
+                }
+            }
+        }
+
+        occludedPairs += localOccluded;
+    };
+
+    int threads = params.threads > 0 ? params.threads : (int)std::thread::hardware_concurrency();
+    threads = std::max(1, std::min(threads, m_clusters));
+
+    if (threads <= 1) {
+        worker();
+    }
+    else {
+        std::vector<std::thread> pool;
+        pool.reserve(threads);
+        for (int t = 0; t < threads; ++t) pool.emplace_back(worker);
+        for (auto& th : pool) th.join();
+    }
+
+    m_info.clusters = (size_t)m_clusters;
+    m_info.pairs = pairs;
+    m_info.occludedPairs = occludedPairs.load();
+    m_info.occluders = (size_t)numOccluders;
+    m_info.bytes = m_occluded.size() * sizeof(uint64_t) + m_cellCluster.size() * sizeof(int32_t);
+    m_info.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    return true;
+}
+
+// Row-major upper triangle without the diagonal.
+size_t ClusterVisibility::pair_bit(int i, int j) const {
+    if (i > j) std::swap(i, j);
+    return (size_t)i * (size_t)(2 * m_clusters - i - 1) / 2 + (size_t)(j - i - 1);
+}
+
+int ClusterVisibility::cluster_of(const glm::vec3& p) const {
+    if (m_cellCluster.empty()) return -1;
+
+    const glm::vec3 g = (p - m_origin) * m_invCell;
+    const int ix = (int)std::floor(g.x);
+    const int iy = (int)std::floor(g.y);
+    const int iz = (int)std::floor(g.z);
+    if (ix < 0 || iy < 0 || iz < 0 || ix >= m_dims[0] || iy >= m_dims[1] || iz >= m_dims[2]) return -1;
+
+    return m_cellCluster[((size_t)iz * m_dims[1] + iy) * m_dims[0] + ix];
+}
+
+bool ClusterVisibility::maybe_visible(const glm::vec3& a, const glm::vec3& b) const {
+    const int ca = cluster_of(a);
+    const int cb = cluster_of(b);
+    if (ca < 0 || cb < 0 || ca == cb) return true;
+
+    const size_t bit = pair_bit(ca, cb);
+    return ((m_occluded[bit >> 6] >> (bit & 63)) & 1) == 0;
+}
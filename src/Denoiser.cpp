@@ -0,0 +1,407 @@
+#include "Denoiser.h"
+#include "ImageUtil.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <iostream>
+
+// GCC and Clang on x86 also build the filter loops for AVX2 and FMA and pick
+// that version at run time; the rest of the renderer stays on the baseline
+// instruction set.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define PM_DENOISE_AVX2 1
+#define PM_DENOISE_INLINE static inline __attribute__((always_inline))
+#else
+#define PM_DENOISE_AVX2 0
+#define PM_DENOISE_INLINE static inline
+#endif
+
+// exp(-x) for x >= 0 to about 1e-5 relative, in plain arithmetic so the tap
+// loops vectorize: 2^t is split into a rounded integer exponent, taken with
+// the 1.5 * 2^23 shifter, and a polynomial for the remaining fraction. Large
+// x flush to zero through the exponent; a clamp on x itself would keep the
+// compiler from if-converting the loop.
+PM_DENOISE_INLINE float fast_exp_neg(float x) {
+    const float t = x * -1.44269504f;
+    const float shifter = 12582912.0f;
+    const float j = t + shifter;
+    const float f = t - (j - shifter);   // in [-0.5, 0.5]
+
+    float p = 1.3333558e-3f;
+    p = p * f + 9.6181291e-3f;
+    p = p * f + 5.5504109e-2f;
+    p = p * f + 2.4022651e-1f;
+    p = p * f + 6.9314718e-1f;
+    p = p * f + 1.0f;
+
+    int32_t jb;
+    std::memcpy(&jb, &j, sizeof(jb));
+    const int32_t e = std::max(jb - 0x4b400000 + 127, 0);
+
+    const uint32_t bits = (uint32_t)e << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+static constexpr int kDenoiseLanes = 8;
+
+// A filter pass spends tens of nanoseconds per pixel, so it pays to thread
+// from far smaller images than ImageUtil's per-pixel passes.
+static void denoise_rows(int W, int H, const std::function<void(int, int)>& fn) {
+    ImageUtil::parallel_rows(W, H, fn, (size_t)1 << 14);
+}
+
+// The working planes, carved from Denoiser's buffer. Pixels without a
+// primary hit have depth -1.
+struct Planes {
+    float* r;
+    float* g;
+    float* b;
+    float* nx;
+    float* ny;
+    float* nz;
+    float* z;
+    float* gx;     // depth change per pixel along x
+    float* gy;     // and along y
+    float* ar;
+    float* ag;
+    float* ab;
+    float* lum;
+    float* r2;
+    float* g2;
+    float* b2;
+};
+static constexpr size_t kPlaneCount = 16;
+
+struct Sigmas {
+    float invC;
+    float n;
+    float invA;
+    float z;
+};
+
+// Edge-stopping weight of tap j for the pixel with features fi.
+PM_DENOISE_INLINE float tap_weight(const Planes& p, ptrdiff_t j,
+    float nx, float ny, float nz, float z, float ar, float ag, float ab, float l, float invZ, const Sigmas& s)
+{
+    const float dn = 1.0f - (nx * p.nx[j] + ny * p.ny[j] + nz * p.nz[j]);
+    const float dz = std::fabs(z - p.z[j]) * invZ;
+    const float da = std::fabs(ar - p.ar[j]) + std::fabs(ag - p.ag[j]) + std::fabs(ab - p.ab[j]);
+    const float e = std::fabs(l - p.lum[j]) * s.invC + dn * s.n + dz + da * s.invA;
+    return fast_exp_neg(e);
+}
+
+// One axis of an iteration over the rows [y0, y1): the 1D B3-spline kernel
+// with taps at -2, -1, 1 and 2 times step along x (vertical false) or y,
+// from r, g, b into r2, g2, b2 or back (toSecond false). Pixels go in
+// blocks of kDenoiseLanes with a fixed trip count, which compilers
+// vectorize even at -O2; a block keeps its features and sums in locals
+// across the taps, so a tap loads only the tapped pixels. Lanes past W
+// read the padding that the planes carry and are never stored. Along x a
+// block whose taps leave the image takes them through clamped indices
+// with zero weight on the lanes outside; lanes are zeroed through the
+// bits, as a float select would stop the vectorizer. Along y a tap is in
+// or out for the whole row, and taps outside the image are skipped; the
+// weights are normalized per pixel.
+PM_DENOISE_INLINE void filter_axis_body(const Planes& p, int W, int H, int y0, int y1,
+    int step, bool vertical, bool toSecond, const Sigmas& s)
+{
+    constexpr int L = kDenoiseLanes;
+    static const float kH[3] = { 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+    const float* r = toSecond ? p.r : p.r2;
+    const float* g = toSecond ? p.g : p.g2;
+    const float* b = toSecond ? p.b : p.b2;
+    float* r2 = toSecond ? p.r2 : p.r;
+    float* g2 = toSecond ? p.g2 : p.g;
+    float* b2 = toSecond ? p.b2 : p.b;
+    const float* grad = vertical ? p.gy : p.gx;
+
+    // The depth tolerance grows with the tap distance along the gradient.
+    const float zStep1 = s.z * (float)step;
+    const float zStep2 = 2.0f * zStep1;
+
+    for (int y = y0; y < y1; ++y) {
+        const ptrdiff_t row = (ptrdiff_t)y * W;
+
+        int ks[4];
+        int nTaps = 0;
+        for (int k : { -2, -1, 1, 2 }) {
+            const int off = k * step;
+            if (vertical ? (y + off < 0 || y + off >= H) : (off <= -W || off >= W)) continue;
+            ks[nTaps++] = k;
+        }
+
+        for (int x = 0; x < W; x += L) {
+            float fnx[L], fny[L], fnz[L], fz[L], far[L], fag[L], fab[L], fl[L], iz1[L], iz2[L];
+            float sr[L], sg[L], sb[L], sw[L];
+            for (int l = 0; l < L; ++l) {
+                const ptrdiff_t i = row + x + l;
+                fnx[l] = p.nx[i];
+                fny[l] = p.ny[i];
+                fnz[l] = p.nz[i];
+                fz[l] = p.z[i];
+                far[l] = p.ar[i];
+                fag[l] = p.ag[i];
+                fab[l] = p.ab[i];
+                fl[l] = p.lum[i];
+                const float eps = 1e-3f * std::fabs(fz[l]) + 1e-6f;
+                iz1[l] = 1.0f / (grad[i] * zStep1 + eps);
+                iz2[l] = 1.0f / (grad[i] * zStep2 + eps);
+                sr[l] = kH[0] * r[i];
+                sg[l] = kH[0] * g[i];
+                sb[l] = kH[0] * b[i];
+                sw[l] = kH[0];
+            }
+
+            for (int t = 0; t < nTaps; ++t) {
+                const int k = ks[t];
+                const float h = kH[std::abs(k)];
+                const float* iz = std::abs(k) == 1 ? iz1 : iz2;
+                const int off = k * step;
+
+                if (vertical || (x + off >= 0 && x + L + off <= W)) {
+                    const ptrdiff_t q = row + x + (vertical ? (ptrdiff_t)off * W : (ptrdiff_t)off);
+                    for (int l = 0; l < L; ++l) {
+                        const ptrdiff_t j = q + l;
+                        const float w = h * tap_weight(p, j, fnx[l], fny[l], fnz[l], fz[l],
+                            far[l], fag[l], fab[l], fl[l], iz[l], s);
+                        sr[l] += w * r[j];
+                        sg[l] += w * g[j];
+                        sb[l] += w * b[j];
+                        sw[l] += w;
+                    }
+                }
+                else {
+                    for (int l = 0; l < L; ++l) {
+                        const int xq = x + l + off;
+                        const ptrdiff_t j = row + std::clamp(xq, 0, W - 1);
+                        const float wRaw = h * tap_weight(p, j, fnx[l], fny[l], fnz[l], fz[l],
+                            far[l], fag[l], fab[l], fl[l], iz[l], s);
+                        uint32_t bits;
+                        std::memcpy(&bits, &wRaw, sizeof(bits));
+                        bits &= 0u - (uint32_t)(xq >= 0 && xq < W);
+                        float w;
+                        std::memcpy(&w, &bits, sizeof(w));
+                        sr[l] += w * r[j];
+                        sg[l] += w * g[j];
+                        sb[l] += w * b[j];
+                        sw[l] += w;
+                    }
+                }
+            }
+
+            // Pixels without a hit pass through.
+            const int m = std::min(L, W - x);
+            for (int l = 0; l < m; ++l) {
+                const ptrdiff_t i = row + x + l;
+                const bool keep = !(fz[l] >= 0.0f) || !(sw[l] > 0.0f);
+                const float inv = keep ? 0.0f : 1.0f / sw[l];
+                r2[i] = keep ? r[i] : sr[l] * inv;
+                g2[i] = keep ? g[i] : sg[l] * inv;
+                b2[i] = keep ? b[i] : sb[l] * inv;
+            }
+        }
+    }
+}
+
+#if PM_DENOISE_AVX2
+__attribute__((target("avx2,fma")))
+static void filter_axis_avx2(const Planes& p, int W, int H, int y0, int y1,
+    int step, bool vertical, bool toSecond, const Sigmas& s)
+{
+    filter_axis_body(p, W, H, y0, y1, step, vertical, toSecond, s);
+}
+#endif
+
+static void filter_axis(const Planes& p, int W, int H, int y0, int y1,
+    int step, bool vertical, bool toSecond, const Sigmas& s)
+{
+#if PM_DENOISE_AVX2
+    static const bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    if (avx2) {
+        filter_axis_avx2(p, W, H, y0, y1, step, vertical, toSecond, s);
+        return;
+    }
+#endif
+    filter_axis_body(p, W, H, y0, y1, step, vertical, toSecond, s);
+}
+
+// Luminance of r, g, b as 3x3 means over the valid pixels around each valid
+// pixel; invalid pixels keep their own. Separable: sums of valid luminance
+// and valid counts along x go to r2 and g2, which are free until the
+// iteration filters into them, then are added up along y.
+static void luminance_box3(const Planes& p, int W, int H) {
+    auto lum = [&](size_t i) { return 0.2126f * p.r[i] + 0.7152f * p.g[i] + 0.0722f * p.b[i]; };
+    auto valid = [&](size_t i) { return p.z[i] >= 0.0f ? 1.0f : 0.0f; };
+
+    denoise_rows(W, H, [&](int y0, int y1) {
+        for (int y = y0; y < y1; ++y) {
+            const size_t row = (size_t)y * (size_t)W;
+            for (int x = 0; x < W; ++x) {
+                const size_t i = row + (size_t)x;
+                float s = valid(i) * lum(i);
+                float c = valid(i);
+                if (x > 0) {
+                    s += valid(i - 1) * lum(i - 1);
+                    c += valid(i - 1);
+                }
+                if (x + 1 < W) {
+                    s += valid(i + 1) * lum(i + 1);
+                    c += valid(i + 1);
+                }
+                p.r2[i] = s;
+                p.g2[i] = c;
+            }
+        }
+    });
+
+    denoise_rows(W, H, [&](int y0, int y1) {
+        for (int y = y0; y < y1; ++y) {
+            const size_t row = (size_t)y * (size_t)W;
+            const size_t up = y > 0 ? row - (size_t)W : row;
+            const size_t down = y + 1 < H ? row + (size_t)W : row;
+            const float wu = y > 0 ? 1.0f : 0.0f;
+            const float wd = y + 1 < H ? 1.0f : 0.0f;
+            for (int x = 0; x < W; ++x) {
+                const size_t i = row + (size_t)x;
+                const float s = p.r2[i] + wu * p.r2[up + x] + wd * p.r2[down + x];
+                const float c = p.g2[i] + wu * p.g2[up + x] + wd * p.g2[down + x];
+                p.lum[i] = valid(i) > 0.0f ? s / c : lum(i);
+            }
+        }
+    });
+}
+
+Denoiser::Denoiser(const Params& params)
+    : m_params(params) {
+    m_params.iterations = std::max(0, m_params.iterations);
+}
+
+bool Denoiser::denoise(const std::vector<glm::vec3>& img,
+    const Renderer::AOVs& aovs,
+    std::vector<glm::vec3>& out)
+{
+    const int W = aovs.width;
+    const int H = aovs.height;
+    const size_t n = (size_t)std::max(0, W) * (size_t)std::max(0, H);
+
+    if (img.size() != n || aovs.triangleId.size() != n || aovs.depth.size() != n ||
+        aovs.normal.size() != n || aovs.albedo.size() != n) {
+        std::cerr << "Denoiser::denoise: image and AOVs differ in size\n";
+        return false;
+    }
+
+    // Planar copies of the image and the guide features, padded for the
+    // last block of filter_axis. The buffer only ever grows, so frames of
+    // one size allocate nothing after the first.
+    const size_t np = n + kDenoiseLanes;
+    if (m_planes.size() < kPlaneCount * np) m_planes.resize(kPlaneCount * np);
+
+    float* next = m_planes.data();
+    auto plane = [&]() {
+        float* q = next;
+        next += np;
+        std::fill(q + n, q + np, 0.0f);
+        return q;
+    };
+    const Planes p{ plane(), plane(), plane(), plane(), plane(), plane(), plane(), plane(),
+        plane(), plane(), plane(), plane(), plane(), plane(), plane(), plane() };
+
+    const float albedoFloor = 1e-3f;
+    denoise_rows(W, H, [&](int y0, int y1) {
+        for (size_t i = (size_t)y0 * (size_t)W; i < (size_t)y1 * (size_t)W; ++i) {
+            const bool hit = aovs.triangleId[i] >= 0;
+
+            glm::vec3 c = img[i];
+            const glm::vec3 a = aovs.albedo[i];
+            if (m_params.demodulate && hit) c /= glm::max(a, glm::vec3(albedoFloor));
+
+            p.r[i] = c.x;
+            p.g[i] = c.y;
+            p.b[i] = c.z;
+            p.ar[i] = a.x;
+            p.ag[i] = a.y;
+            p.ab[i] = a.z;
+
+            // Pixels without a hit get a zero normal and a negative depth,
+            // which no valid pixel's weights let through.
+            const glm::vec3 nn = hit ? aovs.normal[i] : glm::vec3(0.0f);
+            p.nx[i] = nn.x;
+            p.ny[i] = nn.y;
+            p.nz[i] = nn.z;
+            p.z[i] = hit ? std::max(0.0f, aovs.depth[i]) : -1.0f;
+        }
+    });
+
+    // Depth change per pixel: the smaller one-sided difference, so a
+    // silhouette next to the pixel does not widen its tolerance.
+    denoise_rows(W, H, [&](int y0, int y1) {
+        for (int y = y0; y < y1; ++y) {
+            for (int x = 0; x < W; ++x) {
+                const size_t i = (size_t)y * (size_t)W + (size_t)x;
+                p.gx[i] = 0.0f;
+                p.gy[i] = 0.0f;
+                if (p.z[i] < 0.0f) continue;
+
+                float dX = 1e30f, dY = 1e30f;
+                if (x > 0 && p.z[i - 1] >= 0.0f) dX = std::min(dX, std::fabs(p.z[i] - p.z[i - 1]));
+                if (x + 1 < W && p.z[i + 1] >= 0.0f) dX = std::min(dX, std::fabs(p.z[i + 1] - p.z[i]));
+                if (y > 0 && p.z[i - W] >= 0.0f) dY = std::min(dY, std::fabs(p.z[i] - p.z[i - W]));
+                if (y + 1 < H && p.z[i + W] >= 0.0f) dY = std::min(dY, std::fabs(p.z[i + W] - p.z[i]));
+                if (dX < 1e30f) p.gx[i] = dX;
+                if (dY < 1e30f) p.gy[i] = dY;
+            }
+        }
+    });
+
+    double lumSum = 0.0;
+    size_t lumCount = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (p.z[i] < 0.0f) continue;
+        lumSum += 0.2126 * p.r[i] + 0.7152 * p.g[i] + 0.0722 * p.b[i];
+        ++lumCount;
+    }
+    const float meanLum = lumCount ? (float)(lumSum / (double)lumCount) : 0.0f;
+
+    if (meanLum > 0.0f && m_params.colorSigma > 0.0f) {
+        Sigmas sig;
+        sig.n = std::max(0.0f, m_params.normalSigma);
+        sig.invA = m_params.albedoSigma > 0.0f ? 1.0f / m_params.albedoSigma : 0.0f;
+        sig.z = std::max(1e-6f, m_params.depthSigma);
+
+        for (int it = 0; it < m_params.iterations; ++it) {
+            const int step = 1 << it;
+            sig.invC = 1.0f / (m_params.colorSigma * meanLum * std::ldexp(1.0f, -it));
+
+            // The edge test compares 3x3 means of luminance, so an outlier
+            // pixel is smoothed like its neighbours instead of being kept
+            // apart by its own brightness.
+            luminance_box3(p, W, H);
+
+            // Along x into the second planes, then along y back.
+            denoise_rows(W, H, [&](int y0, int y1) {
+                filter_axis(p, W, H, y0, y1, step, false, true, sig);
+            });
+            denoise_rows(W, H, [&](int y0, int y1) {
+                filter_axis(p, W, H, y0, y1, step, true, false, sig);
+            });
+        }
+    }
+
+    out.resize(n);
+    denoise_rows(W, H, [&](int y0, int y1) {
+        for (size_t i = (size_t)y0 * (size_t)W; i < (size_t)y1 * (size_t)W; ++i) {
+            glm::vec3 c(p.r[i], p.g[i], p.b[i]);
+            if (m_params.demodulate && p.z[i] >= 0.0f) {
+                c *= glm::max(glm::vec3(p.ar[i], p.ag[i], p.ab[i]), glm::vec3(albedoFloor));
+            }
+            out[i] = c;
+        }
+    });
+    return true;
+}
@@ -56,34 +56,63 @@ bool GeomUtil::moller_trumbore(
     return true;
 }
 
+// Maps local hemisphere coordinates around n to world space.
+static glm::vec3 hemisphere_to_world(const glm::vec3& n, const glm::vec3& local) {
+    glm::vec3 w = GeomUtil::safe_normalize(n);
+    if (glm::dot(w, w) == 0.0f) w = glm::vec3(0, 1, 0);
+
+    glm::vec3 u, v;
+    GeomUtil::make_orthonormal_basis(w, u, v);
+
+    return GeomUtil::safe_normalize(local.x * u + local.y * v + local.z * w);
+}
+
 glm::vec3 GeomUtil::sample_hemisphere_uniform(
     const glm::vec3& n,
     std::mt19937& rng,
     std::uniform_real_distribution<float>& u01
 ) {
-    float z = u01(rng);
-    float phi = 6.283185307179586f * u01(rng);
+    const float a = u01(rng);
+    const float b = u01(rng);
+    return sample_hemisphere_uniform(n, glm::vec2(a, b));
+}
+
+glm::vec3 GeomUtil::sample_hemisphere_uniform(const glm::vec3& n, const glm::vec2& u) {
+    float z = u.x;
+    float phi = 6.283185307179586f * u.y;
     float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
 
-    glm::vec3 local{
-        r * std::cos(phi),
-        r * std::sin(phi),
-        z
-    };
+    return hemisphere_to_world(n, glm::vec3(r * std::cos(phi), r * std::sin(phi), z));
+}
 
-    glm::vec3 w = safe_normalize(n);
-    if (glm::dot(w, w) == 0.0f) w = glm::vec3(0, 1, 0);
+glm::vec3 GeomUtil::sample_hemisphere_cosine(
+    const glm::vec3& n,
+    std::mt19937& rng,
+    std::uniform_real_distribution<float>& u01
+) {
+    const float a = u01(rng);
+    const float b = u01(rng);
+    return sample_hemisphere_cosine(n, glm::vec2(a, b));
+}
 
-    glm::vec3 u, v;
-    make_orthonormal_basis(w, u, v);
+glm::vec3 GeomUtil::sample_hemisphere_cosine(const glm::vec3& n, const glm::vec2& u) {
+    float r = std::sqrt(u.x);
+    float phi = 6.283185307179586f * u.y;
+    float z = std::sqrt(std::max(0.0f, 1.0f - r * r));
 
-    return safe_normalize(local.x * u + local.y * v + local.z * w);
+    return hemisphere_to_world(n, glm::vec3(r * std::cos(phi), r * std::sin(phi), z));
 }
 
 glm::vec3 GeomUtil::face_normal_geom(const Triangle& t) {
     return safe_normalize(glm::cross(t.v1 - t.v0, t.v2 - t.v0));
 }
 
+glm::vec3 GeomUtil::interpolated_normal(const Triangle& t, const glm::vec3& bary) {
+    glm::vec3 n = bary.x * t.n0 + bary.y * t.n1 + bary.z * t.n2;
+    if (glm::dot(n, n) <= 0.0f) return face_normal_geom(t);
+    return safe_normalize(n);
+}
+
 glm::vec3 GeomUtil::project_to_plane(const glm::vec3& d, const glm::vec3& n) {
     return d - n * glm::dot(d, n);
 }
@@ -0,0 +1,369 @@
+#include "ImageUtil.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <thread>
+
+double ImageUtil::rmse(const std::vector<glm::vec3>& img,
+    const std::vector<glm::vec3>& reference)
+{
+    if (img.size() != reference.size()) return -1.0;
+    if (img.empty()) return 0.0;
+
+    double sum = 0.0;
+    for (size_t i = 0; i < img.size(); ++i) {
+        const glm::vec3 d = img[i] - reference[i];
+        sum += (double)d.x * d.x + (double)d.y * d.y + (double)d.z * d.z;
+    }
+
+    return std::sqrt(sum / (3.0 * (double)img.size()));
+}
+
+double ImageUtil::rel_mse(const std::vector<glm::vec3>& img,
+    const std::vector<glm::vec3>& reference,
+    double eps)
+{
+    if (img.size() != reference.size()) return -1.0;
+    if (img.empty()) return 0.0;
+
+    double sum = 0.0;
+    for (size_t i = 0; i < img.size(); ++i) {
+        for (int c = 0; c < 3; ++c) {
+            const double r = (double)reference[i][c];
+            const double d = (double)img[i][c] - r;
+            sum += d * d / (r * r + eps);
+        }
+    }
+
+    return sum / (3.0 * (double)img.size());
+}
+
+void ImageUtil::parallel_rows(int W, int H, const std::function<void(int, int)>& fn, size_t minPixels) {
+    if (H <= 0) return;
+
+    // Below minPixels the thread start-up costs more than it saves.
+    const size_t pixels = (size_t)std::max(0, W) * (size_t)H;
+    const unsigned hw = std::max(1u, std::thread::hardware_concurrency());
+    const int threads = (pixels < minPixels) ? 1 : (int)std::min<unsigned>(hw, (unsigned)H);
+
+    if (threads <= 1) {
+        fn(0, H);
+        return;
+    }
+
+    std::vector<std::thread> pool;
+    pool.reserve(threads);
+
+    const int chunk = (H + threads - 1) / threads;
+    for (int t = 0; t < threads; ++t) {
+        const int y0 = t * chunk;
+        const int y1 = std::min(H, y0 + chunk);
+        if (y0 >= y1) break;
+        pool.emplace_back([&fn, y0, y1] { fn(y0, y1); });
+    }
+    for (auto& th : pool) th.join();
+}
+
+bool ImageUtil::write_file(const std::string& path, const std::vector<uint8_t>& data) {
+    std::ofstream out(path, std::ios::binary);
+    if (!out) return false;
+
+    out.write((const char*)data.data(), (std::streamsize)data.size());
+    return (bool)out;
+}
+
+ImageUtil::ByteEncoder::ByteEncoder(float gamma) {
+    const float g = gamma > 0.0f ? gamma : 1.0f;
+
+    m_thresholds[0] = 0.0f;
+    for (int b = 1; b < 256; ++b) {
+        m_thresholds[b] = std::pow(((float)b - 0.5f) / 255.0f, g);
+    }
+    m_thresholds[256] = INFINITY;
+
+    int b = 0;
+    for (uint32_t k = 0; k < kBuckets; ++k) {
+        const uint32_t bits = k << kBucketShift;
+        float lo;
+        std::memcpy(&lo, &bits, sizeof(lo));
+        while (lo >= m_thresholds[b + 1]) ++b;
+        m_start[k] = (uint8_t)b;
+    }
+}
+
+std::string ImageUtil::ppm_header(int W, int H) {
+    return "P6\n" + std::to_string(W) + " " + std::to_string(H) + "\n255\n";
+}
+
+std::string ImageUtil::pfm_header(int W, int H) {
+    // A negative scale marks little-endian data.
+    return "PF\n" + std::to_string(W) + " " + std::to_string(H) + "\n-1.0\n";
+}
+
+bool ImageUtil::encode_ppm(const std::vector<glm::vec3>& img, int W, int H,
+    float gamma,
+    std::vector<uint8_t>& out)
+{
+    if (W <= 0 || H <= 0 || img.size() != (size_t)W * (size_t)H) return false;
+
+    const ByteEncoder encode(gamma);
+
+    const std::string header = ppm_header(W, H);
+    out.resize(header.size() + 3 * (size_t)W * (size_t)H);
+    std::memcpy(out.data(), header.data(), header.size());
+
+    uint8_t* pixels = out.data() + header.size();
+
+    parallel_rows(W, H, [&](int y0, int y1) {
+        for (size_t i = (size_t)y0 * (size_t)W; i < (size_t)y1 * (size_t)W; ++i) {
+            pixels[3 * i + 0] = encode(img[i].x);
+            pixels[3 * i + 1] = encode(img[i].y);
+            pixels[3 * i + 2] = encode(img[i].z);
+        }
+    });
+
+    return true;
+}
+
+bool ImageUtil::encode_pfm(const std::vector<glm::vec3>& img, int W, int H,
+    std::vector<uint8_t>& out)
+{
+    if (W <= 0 || H <= 0 || img.size() != (size_t)W * (size_t)H) return false;
+
+    // PFM stores rows bottom-up.
+    const std::string header = pfm_header(W, H);
+    const size_t rowBytes = 3 * sizeof(float) * (size_t)W;
+
+    out.resize(header.size() + rowBytes * (size_t)H);
+    std::memcpy(out.data(), header.data(), header.size());
+
+    uint8_t* data = out.data() + header.size();
+
+    // The header length is arbitrary, so rows are not float-aligned and
+    // every value is copied bytewise.
+    parallel_rows(W, H, [&](int y0, int y1) {
+        for (int y = y0; y < y1; ++y) {
+            uint8_t* row = data + rowBytes * (size_t)(H - 1 - y);
+            const glm::vec3* src = img.data() + (size_t)y * (size_t)W;
+            for (int x = 0; x < W; ++x) {
+                const float rgb[3] = { src[x].x, src[x].y, src[x].z };
+                std::memcpy(row + sizeof(rgb) * (size_t)x, rgb, sizeof(rgb));
+            }
+        }
+    });
+
+    return true;
+}
+
+// Round-to-nearest-even float to IEEE half conversion (F. Giesen's
+// float_to_half_fast3_rtne). Overflow gives infinity, NaN stays NaN.
+uint16_t ImageUtil::float_to_half(float f) {
+    const uint32_t f32infty = 255u << 23;
+    const uint32_t f16max = (127u + 16u) << 23;
+    const uint32_t denormMagicBits = ((127u - 15u) + (23u - 10u) + 1u) << 23;
+
+    uint32_t u;
+    std::memcpy(&u, &f, sizeof(u));
+
+    const uint32_t sign = u & 0x80000000u;
+    u ^= sign;
+
+    uint16_t o;
+    if (u >= f16max) {
+        o = (u > f32infty) ? 0x7e00 : 0x7c00;
+    }
+    else if (u < (113u << 23)) {
+        // Result is a half denormal: let the FPU round by adding a magic value.
+        float v, magic;
+        std::memcpy(&v, &u, sizeof(v));
+        std::memcpy(&magic, &denormMagicBits, sizeof(magic));
+        v += magic;
+        std::memcpy(&u, &v, sizeof(u));
+        o = (uint16_t)(u - denormMagicBits);
+    }
+    else {
+        const uint32_t mantOdd = (u >> 13) & 1u;
+        u -= 112u << 23;
+        u += 0xfffu + mantOdd;
+        o = (uint16_t)(u >> 13);
+    }
+
+    return (uint16_t)(o | (sign >> 16));
+}
+
+namespace {
+
+void put_bytes(std::vector<uint8_t>& out, const void* p, size_t n) {
+    const uint8_t* b = (const uint8_t*)p;
+    out.insert(out.end(), b, b + n);
+}
+
+void put_str(std::vector<uint8_t>& out, const char* s) {
+    put_bytes(out, s, std::strlen(s) + 1);
+}
+
+void put_i32(std::vector<uint8_t>& out, int32_t v) { put_bytes(out, &v, 4); }
+void put_f32(std::vector<uint8_t>& out, float v) { put_bytes(out, &v, 4); }
+
+void put_attr(std::vector<uint8_t>& out, const char* name, const char* type, int32_t size) {
+    put_str(out, name);
+    put_str(out, type);
+    put_i32(out, size);
+}
+
+}
+
+void ImageUtil::exr_header(int W, int H, bool halfFloat, std::vector<uint8_t>& out) {
+    out.clear();
+
+    // Magic number and version 2, single-part scanline file.
+    const uint8_t magic[4] = { 0x76, 0x2f, 0x31, 0x01 };
+    put_bytes(out, magic, 4);
+    put_i32(out, 2);
+
+    // Channels are listed (and stored) in alphabetical order.
+    const char* channels[3] = { "B", "G", "R" };
+    const int32_t pixelType = halfFloat ? 1 : 2;
+
+    put_attr(out, "channels", "chlist", 3 * (2 + 16) + 1);
+    for (const char* ch : channels) {
+        put_str(out, ch);
+        put_i32(out, pixelType);
+        const uint8_t linearAndReserved[4] = { 0, 0, 0, 0 };
+        put_bytes(out, linearAndReserved, 4);
+        put_i32(out, 1);
+        put_i32(out, 1);
+    }
+    out.push_back(0);
+
+    put_attr(out, "compression", "compression", 1);
+    out.push_back(0);
+
+    for (const char* window : { "dataWindow", "displayWindow" }) {
+        put_attr(out, window, "box2i", 16);
+        put_i32(out, 0);
+        put_i32(out, 0);
+        put_i32(out, W - 1);
+        put_i32(out, H - 1);
+    }
+
+    put_attr(out, "lineOrder", "lineOrder", 1);
+    out.push_back(0);
+
+    put_attr(out, "pixelAspectRatio", "float", 4);
+    put_f32(out, 1.0f);
+
+    put_attr(out, "screenWindowCenter", "v2f", 8);
+    put_f32(out, 0.0f);
+    put_f32(out, 0.0f);
+
+    put_attr(out, "screenWindowWidth", "float", 4);
+    put_f32(out, 1.0f);
+
+    out.push_back(0);
+
+    // Offset table: absolute file offset of every scanline chunk.
+    const size_t tableStart = out.size();
+    const size_t dataStart = tableStart + 8 * (size_t)H;
+    const size_t chunkBytes = exr_chunk_bytes(W, halfFloat);
+
+    out.resize(dataStart);
+    for (int y = 0; y < H; ++y) {
+        const uint64_t offset = dataStart + chunkBytes * (size_t)y;
+        std::memcpy(out.data() + tableStart + 8 * (size_t)y, &offset, 8);
+    }
+}
+
+size_t ImageUtil::exr_chunk_bytes(int W, bool halfFloat) {
+    return 8 + 3 * (halfFloat ? 2 : 4) * (size_t)W;
+}
+
+bool ImageUtil::encode_exr(const std::vector<glm::vec3>& img, int W, int H,
+    bool halfFloat,
+    std::vector<uint8_t>& out)
+{
+    if (W <= 0 || H <= 0 || img.size() != (size_t)W * (size_t)H) return false;
+
+    exr_header(W, H, halfFloat, out);
+
+    // One chunk per scanline: y, byte count, then the scanline's B, G and R
+    // samples. Every chunk has the same size, so all rows can be encoded in
+    // place in parallel.
+    const size_t sampleBytes = halfFloat ? 2 : 4;
+    const size_t chunkBytes = exr_chunk_bytes(W, halfFloat);
+    const size_t lineBytes = chunkBytes - 8;
+    const size_t dataStart = out.size();
+
+    out.resize(dataStart + chunkBytes * (size_t)H);
+
+    uint8_t* data = out.data() + dataStart;
+
+    parallel_rows(W, H, [&](int y0, int y1) {
+        for (int y = y0; y < y1; ++y) {
+            uint8_t* chunk = data + chunkBytes * (size_t)y;
+            const int32_t yy = y;
+            const int32_t size = (int32_t)lineBytes;
+            std::memcpy(chunk, &yy, 4);
+            std::memcpy(chunk + 4, &size, 4);
+
+            const glm::vec3* src = img.data() + (size_t)y * (size_t)W;
+            for (int c = 0; c < 3; ++c) {
+                const int comp = 2 - c;   // B, G, R
+                uint8_t* dst = chunk + 8 + (size_t)c * sampleBytes * (size_t)W;
+
+                // Chunks follow a variable-length header and offset table,
+                // so samples are not aligned.
+                if (halfFloat) {
+                    for (int x = 0; x < W; ++x) {
+                        const uint16_t h = float_to_half(src[x][comp]);
+                        std::memcpy(dst + 2 * (size_t)x, &h, 2);
+                    }
+                }
+                else {
+                    for (int x = 0; x < W; ++x) {
+                        const float f = src[x][comp];
+                        std::memcpy(dst + 4 * (size_t)x, &f, 4);
+                    }
+                }
+            }
+        }
+    });
+
+    return true;
+}
+
+bool ImageUtil::write_ppm(const std::string& path, const std::vector<glm::vec3>& img, int W, int H,
+    float gamma)
+{
+    std::vector<uint8_t> data;
+    return encode_ppm(img, W, H, gamma, data) && write_file(path, data);
+}
+
+bool ImageUtil::write_pfm(const std::string& path, const std::vector<glm::vec3>& img, int W, int H) {
+    std::vector<uint8_t> data;
+    return encode_pfm(img, W, H, data) && write_file(path, data);
+}
+
+bool ImageUtil::write_exr(const std::string& path, const std::vector<glm::vec3>& img, int W, int H,
+    bool halfFloat)
+{
+    std::vector<uint8_t> data;
+    return encode_exr(img, W, H, halfFloat, data) && write_file(path, data);
+}
+
+bool ImageUtil::write_image(const std::string& path, const std::vector<glm::vec3>& img, int W, int H) {
+    std::string ext = std::filesystem::path(path).extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char ch) { return (char)std::tolower(ch); });
+
+    if (ext == ".pfm") return write_pfm(path, img, W, H);
+    if (ext == ".exr") return write_exr(path, img, W, H, true);
+    if (ext == ".ppm") return write_ppm(path, img, W, H);
+
+    std::cerr << "ImageUtil::write_image: unsupported extension '" << ext << "'\n";
+    return false;
+}
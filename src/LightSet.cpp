@@ -0,0 +1,206 @@
+#include "LightSet.h"
+
+#include <algorithm>
+#include <cmath>
+
+static constexpr float PI = 3.14159265358979323846f;
+static constexpr float ONE_MINUS_EPSILON = 0x1.fffffep-1f;
+
+static float light_luminance(const glm::vec3& c) {
+    return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
+void LightSet::add_point(const glm::vec3& p, const glm::vec3& intensity) {
+    Light l;
+    l.type = POINT;
+    l.p0 = l.p1 = l.p2 = p;
+    l.emission = intensity;
+    l.power = 4.0f * PI * light_luminance(intensity);
+    m_lights.push_back(l);
+}
+
+void LightSet::add_triangle(const glm::vec3& p0, const glm::vec3& p1, const glm::vec3& p2, const glm::vec3& radiance) {
+    const glm::vec3 c = glm::cross(p1 - p0, p2 - p0);
+    const float len = std::sqrt(glm::dot(c, c));
+    if (!(len > 0.0f)) return;
+
+    Light l;
+    l.type = TRIANGLE;
+    l.p0 = p0;
+    l.p1 = p1;
+    l.p2 = p2;
+    l.n = c / len;
+    l.area = 0.5f * len;
+    l.emission = radiance;
+    l.power = PI * l.area * light_luminance(radiance);
+    m_lights.push_back(l);
+}
+
+void LightSet::clear() {
+    m_lights.clear();
+    m_nodes.clear();
+    m_leafOf.clear();
+}
+
+void LightSet::build() {
+    m_nodes.clear();
+    m_leafOf.assign(m_lights.size(), -1);
+    if (m_lights.empty()) return;
+
+    std::vector<int> order(m_lights.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = (int)i;
+
+    m_nodes.reserve(2 * m_lights.size() - 1);
+    build_node(order, 0, (int)order.size(), -1);
+}
+
+// Median split along the longest axis of the light centroids. Every leaf
+// holds one light, so the walk in sample() ends on the light it picked.
+int LightSet::build_node(std::vector<int>& order, int begin, int end, int parent) {
+    const int index = (int)m_nodes.size();
+    m_nodes.emplace_back();
+    m_nodes[index].parent = parent;
+
+    glm::vec3 bmin(INFINITY), bmax(-INFINITY);
+    glm::vec3 cmin(INFINITY), cmax(-INFINITY);
+    float power = 0.0f;
+    for (int k = begin; k < end; ++k) {
+        const Light& l = m_lights[order[k]];
+        bmin = glm::min(bmin, glm::min(l.p0, glm::min(l.p1, l.p2)));
+        bmax = glm::max(bmax, glm::max(l.p0, glm::max(l.p1, l.p2)));
+        const glm::vec3 c = (l.p0 + l.p1 + l.p2) / 3.0f;
+        cmin = glm::min(cmin, c);
+        cmax = glm::max(cmax, c);
+        power += l.power;
+    }
+    m_nodes[index].bmin = bmin;
+    m_nodes[index].bmax = bmax;
+    m_nodes[index].power = power;
+
+    if (end - begin == 1) {
+        m_nodes[index].light = order[begin];
+        m_leafOf[order[begin]] = index;
+        return index;
+    }
+
+    const glm::vec3 extent = cmax - cmin;
+    int axis = 0;
+    if (extent.y > extent[axis]) axis = 1;
+    if (extent.z > extent[axis]) axis = 2;
+
+    const int mid = begin + (end - begin) / 2;
+    std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+        [&](int a, int b) {
+            const Light& la = m_lights[a];
+            const Light& lb = m_lights[b];
+            return (la.p0[axis] + la.p1[axis] + la.p2[axis]) < (lb.p0[axis] + lb.p1[axis] + lb.p2[axis]);
+        });
+
+    const int left = build_node(order, begin, mid, index);
+    const int right = build_node(order, mid, end, index);
+    m_nodes[index].left = left;
+    m_nodes[index].right = right;
+    return index;
+}
+
+float LightSet::importance(const Node& node, const glm::vec3& x, const glm::vec3& n) const {
+    if (!(node.power > 0.0f)) return 0.0f;
+
+    // Nothing in bounds that lie wholly below the tangent plane can light x.
+    if (glm::dot(n, n) > 0.0f) {
+        bool above = false;
+        for (int c = 0; c < 8 && !above; ++c) {
+            const glm::vec3 corner((c & 1) ? node.bmax.x : node.bmin.x,
+                (c & 2) ? node.bmax.y : node.bmin.y,
+                (c & 4) ? node.bmax.z : node.bmin.z);
+            above = glm::dot(n, corner - x) > 0.0f;
+        }
+        if (!above) return 0.0f;
+    }
+
+    if (node.light >= 0) {
+        const Light& l = m_lights[node.light];
+        if (l.type == TRIANGLE && glm::dot(l.n, x - l.p0) <= 0.0f) return 0.0f;
+    }
+
+    // Distance to the centre, but no closer than the bounds' radius so a
+    // point inside a large cluster does not blow up its weight.
+    const glm::vec3 c = 0.5f * (node.bmin + node.bmax);
+    const glm::vec3 h = 0.5f * (node.bmax - node.bmin);
+    const glm::vec3 d = x - c;
+    const float d2 = std::max(std::max(glm::dot(d, d), glm::dot(h, h)), 1e-8f);
+    return node.power / d2;
+}
+
+bool LightSet::sample(const glm::vec3& x, const glm::vec3& n, const glm::vec3& u, Sample& out) const {
+    if (m_nodes.empty()) return false;
+
+    int node = 0;
+    float pmf = 1.0f;
+    float us = u.x;
+
+    while (m_nodes[node].left >= 0) {
+        const Node& nd = m_nodes[node];
+        const float wl = importance(m_nodes[nd.left], x, n);
+        const float wr = importance(m_nodes[nd.right], x, n);
+        if (!(wl + wr > 0.0f)) return false;
+
+        // Reuse the selection number at each level, rescaled to [0, 1).
+        const float pl = wl / (wl + wr);
+        if (us < pl) {
+            us = std::min(us / pl, ONE_MINUS_EPSILON);
+            pmf *= pl;
+            node = nd.left;
+        }
+        else {
+            us = std::min((us - pl) / (1.0f - pl), ONE_MINUS_EPSILON);
+            pmf *= 1.0f - pl;
+            node = nd.right;
+        }
+    }
+
+    const Light& l = m_lights[m_nodes[node].light];
+    out.light = m_nodes[node].light;
+    out.pmf = pmf;
+
+    if (l.type == POINT) {
+        const glm::vec3 toL = l.p0 - x;
+        const float dist2 = glm::dot(toL, toL);
+        if (!(dist2 > 0.0f)) return false;
+
+        out.p = l.p0;
+        out.Li = l.emission / dist2 / pmf;
+        return true;
+    }
+
+    // Area-uniform point on the triangle.
+    const float su = std::sqrt(u.y);
+    const float b0 = 1.0f - su;
+    const float b1 = u.z * su;
+    const glm::vec3 p = b0 * l.p0 + b1 * l.p1 + (1.0f - b0 - b1) * l.p2;
+
+    const glm::vec3 toL = p - x;
+    const float dist2 = glm::dot(toL, toL);
+    if (!(dist2 > 0.0f)) return false;
+
+    const float cosL = -glm::dot(l.n, toL) / std::sqrt(dist2);
+    if (!(cosL > 0.0f)) return false;
+
+    out.p = p;
+    out.Li = l.emission * (cosL * l.area / (dist2 * pmf));
+    return true;
+}
+
+float LightSet::pmf(const glm::vec3& x, const glm::vec3& n, int i) const {
+    if (i < 0 || i >= (int)m_leafOf.size() || m_leafOf[i] < 0) return 0.0f;
+
+    float p = 1.0f;
+    for (int node = m_leafOf[i]; m_nodes[node].parent >= 0; node = m_nodes[node].parent) {
+        const Node& parent = m_nodes[m_nodes[node].parent];
+        const float wl = importance(m_nodes[parent.left], x, n);
+        const float wr = importance(m_nodes[parent.right], x, n);
+        if (!(wl + wr > 0.0f)) return 0.0f;
+        p *= (node == parent.left ? wl : wr) / (wl + wr);
+    }
+    return p;
+}
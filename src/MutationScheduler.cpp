@@ -0,0 +1,183 @@
+#include "MutationScheduler.h"
+
+#include <algorithm>
+
+double MutationScheduler::Stats::total_attempts() const {
+    double n = 0.0;
+    for (double a : attempts) n += a;
+    return n;
+}
+
+MutationScheduler::MutationScheduler(int width, int height)
+    : MutationScheduler(width, height, Params{})
+{
+}
+
+MutationScheduler::MutationScheduler(int width, int height, const Params& params)
+    : m_width(std::max(1, width))
+    , m_height(std::max(1, height))
+    , m_params(params)
+{
+    m_params.regionsX = std::max(1, m_params.regionsX);
+    m_params.regionsY = std::max(1, m_params.regionsY);
+    m_params.maxVertexIndex = std::max(0, m_params.maxVertexIndex);
+    m_params.minProbability = std::clamp(m_params.minProbability, 0.0f, 1.0f / kNumStrategies);
+
+    const size_t slots = (size_t)m_params.maxVertexIndex + 1;
+    m_regionStats.resize((size_t)m_params.regionsX * (size_t)m_params.regionsY * slots);
+    m_vertexStats.resize(slots);
+    update();
+}
+
+int MutationScheduler::region_of(int px, int py) const {
+    int rx = std::clamp(px * m_params.regionsX / m_width, 0, m_params.regionsX - 1);
+    int ry = std::clamp(py * m_params.regionsY / m_height, 0, m_params.regionsY - 1);
+    return ry * m_params.regionsX + rx;
+}
+
+int MutationScheduler::vertex_slot(int vertexIndex) const {
+    return std::clamp(vertexIndex, 0, m_params.maxVertexIndex);
+}
+
+int MutationScheduler::strategy_slot(int strategy) {
+    for (int k = 0; k < kNumStrategies; ++k) {
+        if (kStrategies[k] == strategy) return k;
+    }
+    return -1;
+}
+
+// Score is accepted contribution per microsecond. Strategies with few samples
+// get one pseudo-attempt at the bucket's average rate so they are neither
+// favoured nor dismissed before they have been measured.
+std::array<double, MutationScheduler::kNumStrategies>
+MutationScheduler::probabilities_from(const Stats& s) const {
+    std::array<double, kNumStrategies> p{};
+
+    double n = 0.0, c = 0.0, t = 0.0;
+    for (int k = 0; k < kNumStrategies; ++k) {
+        n += s.attempts[k];
+        c += s.contribution[k];
+        t += s.micros[k];
+    }
+
+    const double c0 = (n > 0.0) ? c / n : 0.0;
+    const double t0 = (n > 0.0) ? t / n : 1.0;
+
+    double sum = 0.0;
+    for (int k = 0; k < kNumStrategies; ++k) {
+        double den = s.micros[k] + t0;
+        p[k] = (den > 0.0) ? (s.contribution[k] + c0) / den : 0.0;
+        sum += p[k];
+    }
+
+    const double floor = (double)m_params.minProbability;
+    for (int k = 0; k < kNumStrategies; ++k) {
+        double share = (sum > 0.0) ? p[k] / sum : 1.0 / kNumStrategies;
+        p[k] = floor + (1.0 - kNumStrategies * floor) * share;
+    }
+
+    return p;
+}
+
+std::array<double, MutationScheduler::kNumStrategies>
+MutationScheduler::probabilities(int region, int slot) const {
+    const size_t slots = (size_t)m_params.maxVertexIndex + 1;
+    const Stats& rs = m_regionStats[(size_t)region * slots + (size_t)slot];
+    const double warm = (double)m_params.warmupAttempts;
+
+    if (rs.total_attempts() >= warm) return probabilities_from(rs);
+
+    const Stats& vs = m_vertexStats[(size_t)slot];
+    if (vs.total_attempts() >= warm) return probabilities_from(vs);
+
+    if (m_totals.total_attempts() >= warm) return probabilities_from(m_totals);
+
+    std::array<double, kNumStrategies> p{};
+    p.fill(1.0 / kNumStrategies);
+    return p;
+}
+
+int MutationScheduler::select(int px, int py, int vertexIndex, float u) const {
+    const size_t slots = (size_t)m_params.maxVertexIndex + 1;
+    const auto& p = m_tables[(size_t)region_of(px, py) * slots + (size_t)vertex_slot(vertexIndex)];
+
+    double acc = 0.0;
+    for (int k = 0; k < kNumStrategies; ++k) {
+        acc += p[k];
+        if ((double)u < acc) return kStrategies[k];
+    }
+    return kStrategies[kNumStrategies - 1];
+}
+
+double MutationScheduler::probability(int px, int py, int vertexIndex, int strategy) const {
+    const int k = strategy_slot(strategy);
+    if (k < 0) return 0.0;
+    const size_t slots = (size_t)m_params.maxVertexIndex + 1;
+    return m_tables[(size_t)region_of(px, py) * slots + (size_t)vertex_slot(vertexIndex)][k];
+}
+
+MutationScheduler::Tally MutationScheduler::make_tally() const {
+    Tally t;
+    t.region.resize(m_regionStats.size());
+    t.vertex.resize(m_vertexStats.size());
+    return t;
+}
+
+void MutationScheduler::record(Tally& tally, int px, int py, int vertexIndex, int strategy,
+    bool accepted,
+    double contribution,
+    double micros) const
+{
+    const int k = strategy_slot(strategy);
+    if (k < 0) return;
+    if (tally.region.size() != m_regionStats.size() || tally.vertex.size() != m_vertexStats.size()) return;
+
+    const size_t slots = (size_t)m_params.maxVertexIndex + 1;
+    const int slot = vertex_slot(vertexIndex);
+
+    Stats* targets[3] = {
+        &tally.region[(size_t)region_of(px, py) * slots + (size_t)slot],
+        &tally.vertex[(size_t)slot],
+        &tally.totals
+    };
+
+    for (Stats* s : targets) {
+        s->attempts[k] += 1.0;
+        if (accepted) {
+            s->accepts[k] += 1.0;
+            s->contribution[k] += contribution;
+        }
+        s->micros[k] += micros;
+    }
+}
+
+void MutationScheduler::merge(Tally& tally) {
+    auto add = [](Stats& dst, Stats& src) {
+        for (int k = 0; k < kNumStrategies; ++k) {
+            dst.attempts[k] += src.attempts[k];
+            dst.accepts[k] += src.accepts[k];
+            dst.contribution[k] += src.contribution[k];
+            dst.micros[k] += src.micros[k];
+        }
+        src = Stats{};
+    };
+
+    if (tally.region.size() == m_regionStats.size()) {
+        for (size_t i = 0; i < m_regionStats.size(); ++i) add(m_regionStats[i], tally.region[i]);
+    }
+    if (tally.vertex.size() == m_vertexStats.size()) {
+        for (size_t i = 0; i < m_vertexStats.size(); ++i) add(m_vertexStats[i], tally.vertex[i]);
+    }
+    add(m_totals, tally.totals);
+}
+
+void MutationScheduler::update() {
+    const size_t slots = (size_t)m_params.maxVertexIndex + 1;
+    const size_t regions = (size_t)m_params.regionsX * (size_t)m_params.regionsY;
+    m_tables.resize(regions * slots);
+    for (size_t r = 0; r < regions; ++r) {
+        for (size_t slot = 0; slot < slots; ++slot) {
+            m_tables[r * slots + slot] = probabilities((int)r, (int)slot);
+        }
+    }
+}
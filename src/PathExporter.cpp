@@ -0,0 +1,145 @@
+#include "PathExporter.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <limits>
+
+namespace {
+
+// Element counts are written as zero-padded fields of this width so they can
+// be overwritten in place once known.
+constexpr int kCountDigits = 12;
+constexpr size_t kBufferBytes = 1u << 20;
+
+// x, y, z as float, then red, green, blue as uchar.
+constexpr size_t kVertexBytes = 3 * sizeof(float) + 3;
+
+// Edges index vertices as PLY int, so vertex indices must fit in int32.
+constexpr uint64_t kMaxVertices = (uint64_t)std::numeric_limits<int32_t>::max() + 1;
+
+std::string make_header(uint64_t vertices, uint64_t edges) {
+    char v[32], e[32];
+    std::snprintf(v, sizeof(v), "%0*llu", kCountDigits, (unsigned long long)vertices);
+    std::snprintf(e, sizeof(e), "%0*llu", kCountDigits, (unsigned long long)edges);
+
+    return std::string("ply\n")
+        + "format binary_little_endian 1.0\n"
+        + "comment light paths as polylines\n"
+        + "element vertex " + v + "\n"
+        + "property float x\n"
+        + "property float y\n"
+        + "property float z\n"
+        + "property uchar red\n"
+        + "property uchar green\n"
+        + "property uchar blue\n"
+        + "element edge " + e + "\n"
+        + "property int vertex1\n"
+        + "property int vertex2\n"
+        + "end_header\n";
+}
+
+uint8_t to_byte(float c) {
+    return (uint8_t)std::lround(std::clamp(c, 0.0f, 1.0f) * 255.0f);
+}
+
+}
+
+PathExporter::~PathExporter() {
+    if (is_open()) close();
+}
+
+bool PathExporter::open(const std::string& path) {
+    if (is_open()) close();
+
+    m_counts.clear();
+    m_vertices = 0;
+    m_failed = false;
+
+    m_out.open(path, std::ios::binary | std::ios::trunc);
+    if (!m_out) {
+        std::cerr << "PathExporter: failed to open " << path << "\n";
+        return false;
+    }
+
+    m_buffer.clear();
+    m_buffer.reserve(kBufferBytes);
+
+    const std::string header = make_header(0, 0);
+    m_out.write(header.data(), (std::streamsize)header.size());
+    return (bool)m_out;
+}
+
+void PathExporter::add_path(const PathMutator::Path& path, const glm::vec3& color) {
+    add_polyline(path.vertices.data(), path.vertices.size(), color);
+}
+
+void PathExporter::add_polyline(const glm::vec3* points, size_t count, const glm::vec3& color) {
+    if (!is_open() || count < 2) return;
+
+    if (count > kMaxVertices - m_vertices) {
+        if (!m_failed) {
+            std::cerr << "PathExporter: more than " << kMaxVertices
+                << " vertices do not fit the int edge indices, dropping further paths\n";
+        }
+        m_failed = true;
+        return;
+    }
+
+    const uint8_t rgb[3] = { to_byte(color.x), to_byte(color.y), to_byte(color.z) };
+
+    for (size_t i = 0; i < count; ++i) {
+        if (m_buffer.size() + kVertexBytes > kBufferBytes) flush();
+
+        const size_t at = m_buffer.size();
+        m_buffer.resize(at + kVertexBytes);
+        std::memcpy(m_buffer.data() + at, &points[i], 3 * sizeof(float));
+        std::memcpy(m_buffer.data() + at + 3 * sizeof(float), rgb, 3);
+    }
+
+    m_counts.push_back((uint32_t)count);
+    m_vertices += count;
+}
+
+void PathExporter::flush() {
+    if (m_buffer.empty()) return;
+    m_out.write((const char*)m_buffer.data(), (std::streamsize)m_buffer.size());
+    if (!m_out) m_failed = true;
+    m_buffer.clear();
+}
+
+bool PathExporter::close() {
+    if (!is_open()) return !m_failed;
+
+    PM_TRACE_SCOPE("PathExporter::close", "io");
+
+    flush();
+
+    // Segments join consecutive vertices of each path. add_polyline keeps
+    // every index below 2^31, though base itself can reach it.
+    uint32_t base = 0;
+    for (uint32_t n : m_counts) {
+        for (uint32_t i = 0; i + 1 < n; ++i) {
+            if (m_buffer.size() + 2 * sizeof(int32_t) > kBufferBytes) flush();
+
+            const int32_t edge[2] = { (int32_t)(base + i), (int32_t)(base + i + 1) };
+            const size_t at = m_buffer.size();
+            m_buffer.resize(at + sizeof(edge));
+            std::memcpy(m_buffer.data() + at, edge, sizeof(edge));
+        }
+        base += n;
+    }
+    flush();
+
+    const std::string header = make_header(m_vertices, edge_count());
+    m_out.seekp(0);
+    m_out.write(header.data(), (std::streamsize)header.size());
+    if (!m_out) m_failed = true;
+
+    m_out.close();
+    m_buffer = std::vector<uint8_t>{};
+    return !m_failed;
+}
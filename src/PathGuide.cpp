@@ -0,0 +1,329 @@
+#include "PathGuide.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+static constexpr float PI = 3.14159265358979323846f;
+static constexpr float INV_4PI = 0.0795774715459476678844f;
+
+// Records are stored as radiance / pdf * kFixedScale, clamped to kMaxRecord
+// so a single firefly cannot overflow a node.
+static constexpr double kFixedScale = 65536.0;
+static constexpr float  kMaxRecord = 16777216.0f;
+
+static constexpr float ONE_MINUS_EPS = 0x1.fffffep-1f;
+
+PathGuide::PathGuide(const glm::vec3& boundsMin, const glm::vec3& boundsMax, const Params& params)
+    : m_params(params)
+{
+    m_params.fraction = std::clamp(m_params.fraction, 0.0f, 0.95f);
+    m_params.maxDirectionalDepth = std::max(1, m_params.maxDirectionalDepth);
+
+    SpatialNode root;
+    root.bmin = boundsMin;
+    root.bmax = boundsMax;
+    root.leaf = 0;
+    root.axis = 0;
+    m_nodes.push_back(root);
+
+    Leaf leaf;
+    leaf.nodes.resize(1);
+    leaf.records.assign(4, 0);
+    m_leaves.push_back(std::move(leaf));
+}
+
+// Cylindrical equal-area mapping: x is (cos theta + 1) / 2, y is phi / 2pi.
+glm::vec2 PathGuide::dir_to_square(const glm::vec3& dir) {
+    const float z = std::clamp(dir.z, -1.0f, 1.0f);
+    float phi = std::atan2(dir.y, dir.x);
+    if (phi < 0.0f) phi += 2.0f * PI;
+    return glm::vec2(
+        std::clamp(0.5f * (z + 1.0f), 0.0f, ONE_MINUS_EPS),
+        std::clamp(phi / (2.0f * PI), 0.0f, ONE_MINUS_EPS));
+}
+
+glm::vec3 PathGuide::square_to_dir(const glm::vec2& u) {
+    const float z = 2.0f * u.x - 1.0f;
+    const float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+    const float phi = 2.0f * PI * u.y;
+    return glm::vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+int PathGuide::find_leaf(const glm::vec3& p) const {
+    int node = 0;
+    while (m_nodes[node].leaf < 0) {
+        const SpatialNode& n = m_nodes[node];
+        const float mid = 0.5f * (n.bmin[n.axis] + n.bmax[n.axis]);
+        node = p[n.axis] < mid ? n.child[0] : n.child[1];
+    }
+    return m_nodes[node].leaf;
+}
+
+int PathGuide::region(const glm::vec3& p) const {
+    const int leaf = find_leaf(p);
+    return m_leaves[leaf].total > 0.0f ? leaf : -1;
+}
+
+void PathGuide::record(const glm::vec3& p, const glm::vec3& dir, float radiance, float pdf) {
+    if (!(pdf > 0.0f) || !(radiance >= 0.0f) || !std::isfinite(radiance)) return;
+
+    Leaf& leaf = m_leaves[find_leaf(p)];
+    std::atomic_ref<uint32_t>(leaf.count).fetch_add(1, std::memory_order_relaxed);
+
+    const float value = std::min(radiance / pdf, kMaxRecord);
+    const uint64_t fixed = (uint64_t)((double)value * kFixedScale);
+    if (fixed == 0) return;
+
+    // Every level of the quadtree gets the record, so each node holds the
+    // energy of its four quadrants.
+    glm::vec2 u = dir_to_square(dir);
+    uint32_t node = 0;
+    for (;;) {
+        const int qx = u.x >= 0.5f ? 1 : 0;
+        const int qy = u.y >= 0.5f ? 1 : 0;
+        const int q = qx + 2 * qy;
+
+        std::atomic_ref<uint64_t>(leaf.records[node * 4 + q]).fetch_add(fixed, std::memory_order_relaxed);
+
+        const uint32_t child = leaf.nodes[node].child[q];
+        if (!child) break;
+
+        u = glm::vec2(2.0f * u.x - (float)qx, 2.0f * u.y - (float)qy);
+        node = child;
+    }
+}
+
+// Rebuilds the quadtree of a leaf from its records: a quadrant holding more
+// than directionalThreshold of the leaf's energy is subdivided, splitting its
+// energy evenly where the old tree had no finer records. The energy carries
+// over into the records of the new tree, so the distribution keeps averaging
+// over every pass instead of following the last one.
+void PathGuide::rebuild_directions(Leaf& leaf) const {
+    double total = 0.0;
+    for (int q = 0; q < 4; ++q) total += (double)leaf.records[q];
+    if (!(total > 0.0)) return;
+
+    const std::vector<QuadNode>& old = leaf.nodes;
+    const double threshold = (double)m_params.directionalThreshold * total;
+
+    std::vector<QuadNode> out;
+    std::vector<uint64_t> carried;
+
+    struct Task {
+        uint32_t newNode;
+        int      oldNode;    // -1 if the old tree has no records this fine
+        double   energy[4];
+        int      depth;
+    };
+
+    Task root{ 0, 0, {}, 1 };
+    for (int q = 0; q < 4; ++q) root.energy[q] = (double)leaf.records[q];
+    out.emplace_back();
+    carried.resize(4);
+
+    std::vector<Task> stack{ root };
+    while (!stack.empty()) {
+        const Task t = stack.back();
+        stack.pop_back();
+
+        for (int q = 0; q < 4; ++q) {
+            out[t.newNode].energy[q] = (float)t.energy[q];
+            carried[(size_t)t.newNode * 4 + q] = (uint64_t)t.energy[q];
+
+            if (t.depth >= m_params.maxDirectionalDepth || !(t.energy[q] > threshold)) continue;
+
+            Task c;
+            c.newNode = (uint32_t)out.size();
+            c.depth = t.depth + 1;
+            c.oldNode = (t.oldNode >= 0 && old[t.oldNode].child[q]) ? (int)old[t.oldNode].child[q] : -1;
+            for (int k = 0; k < 4; ++k) {
+                c.energy[k] = c.oldNode >= 0
+                    ? (double)leaf.records[(size_t)c.oldNode * 4 + k]
+                    : 0.25 * t.energy[q];
+            }
+
+            out[t.newNode].child[q] = c.newNode;
+            out.emplace_back();
+            carried.resize(out.size() * 4);
+            stack.push_back(c);
+        }
+    }
+
+    leaf.nodes = std::move(out);
+    leaf.records = std::move(carried);
+    leaf.total = (float)(total / kFixedScale);
+}
+
+void PathGuide::split_leaf(int node) {
+    const int leafIndex = m_nodes[node].leaf;
+    const int axis = m_nodes[node].axis;
+    const float mid = 0.5f * (m_nodes[node].bmin[axis] + m_nodes[node].bmax[axis]);
+
+    Leaf& leaf = m_leaves[leafIndex];
+    leaf.count /= 2;
+    leaf.depth += 1;
+    for (uint64_t& r : leaf.records) r /= 2;
+
+    SpatialNode lo = m_nodes[node];
+    SpatialNode hi = m_nodes[node];
+    lo.bmax[axis] = mid;
+    hi.bmin[axis] = mid;
+    lo.axis = hi.axis = (axis + 1) % 3;
+    lo.leaf = leafIndex;
+    hi.leaf = (int)m_leaves.size();
+
+    // Both halves start from the parent's distribution.
+    m_leaves.push_back(m_leaves[leafIndex]);
+
+    m_nodes[node].leaf = -1;
+    m_nodes[node].child[0] = (int)m_nodes.size();
+    m_nodes[node].child[1] = (int)m_nodes.size() + 1;
+    m_nodes.push_back(lo);
+    m_nodes.push_back(hi);
+}
+
+void PathGuide::update() {
+    for (Leaf& leaf : m_leaves) rebuild_directions(leaf);
+
+    // Split leaves until none holds more than spatialThreshold records,
+    // assuming each half received half of them. As training data piles up
+    // over the passes, the leaves get smaller.
+    const uint32_t threshold = (uint32_t)std::max(1, m_params.spatialThreshold);
+    for (size_t node = 0; node < m_nodes.size(); ++node) {
+        const int leaf = m_nodes[node].leaf;
+        if (leaf < 0) continue;
+        if (m_leaves[leaf].count > threshold && m_leaves[leaf].depth < m_params.maxSpatialDepth) {
+            split_leaf((int)node);
+        }
+    }
+
+    ++m_iterations;
+}
+
+bool PathGuide::sample(int region, const glm::vec2& u, glm::vec3& dir, float& pdf) const {
+    if (region < 0 || region >= (int)m_leaves.size()) return false;
+    const Leaf& leaf = m_leaves[region];
+
+    glm::vec2 s(std::clamp(u.x, 0.0f, ONE_MINUS_EPS), std::clamp(u.y, 0.0f, ONE_MINUS_EPS));
+    glm::vec2 origin(0.0f);
+    float size = 1.0f;
+    float density = 1.0f;
+
+    // Picks the column with s.x and the quadrant within it with s.y, then
+    // rescales both so the remaining bits position the sample further down.
+    uint32_t node = 0;
+    for (;;) {
+        const QuadNode& qn = leaf.nodes[node];
+        const float left = qn.energy[0] + qn.energy[2];
+        const float right = qn.energy[1] + qn.energy[3];
+        const float total = left + right;
+        if (!(total > 0.0f)) return false;
+
+        int qx = 0;
+        const float pLeft = left / total;
+        if (s.x < pLeft) {
+            s.x = s.x / pLeft;
+        }
+        else {
+            qx = 1;
+            s.x = (s.x - pLeft) / (1.0f - pLeft);
+        }
+
+        const float bottom = qn.energy[qx];
+        const float column = bottom + qn.energy[qx + 2];
+        if (!(column > 0.0f)) return false;
+
+        int qy = 0;
+        const float pBottom = bottom / column;
+        if (s.y < pBottom) {
+            s.y = s.y / pBottom;
+        }
+        else {
+            qy = 1;
+            s.y = (s.y - pBottom) / (1.0f - pBottom);
+        }
+        s = glm::clamp(s, glm::vec2(0.0f), glm::vec2(ONE_MINUS_EPS));
+
+        const int q = qx + 2 * qy;
+        density *= 4.0f * qn.energy[q] / total;
+        size *= 0.5f;
+        origin += glm::vec2((float)qx, (float)qy) * size;
+
+        if (!qn.child[q]) break;
+        node = qn.child[q];
+    }
+
+    dir = square_to_dir(origin + s * size);
+    pdf = density * INV_4PI;
+    return pdf > 0.0f;
+}
+
+float PathGuide::pdf(int region, const glm::vec3& dir) const {
+    if (region < 0 || region >= (int)m_leaves.size()) return 0.0f;
+    const Leaf& leaf = m_leaves[region];
+
+    glm::vec2 u = dir_to_square(dir);
+    float density = 1.0f;
+
+    uint32_t node = 0;
+    for (;;) {
+        const QuadNode& qn = leaf.nodes[node];
+        const float total = qn.energy[0] + qn.energy[1] + qn.energy[2] + qn.energy[3];
+        if (!(total > 0.0f)) return 0.0f;
+
+        const int qx = u.x >= 0.5f ? 1 : 0;
+        const int qy = u.y >= 0.5f ? 1 : 0;
+        const int q = qx + 2 * qy;
+        density *= 4.0f * qn.energy[q] / total;
+
+        if (!qn.child[q]) break;
+        u = glm::vec2(2.0f * u.x - (float)qx, 2.0f * u.y - (float)qy);
+        node = qn.child[q];
+    }
+
+    return density * INV_4PI;
+}
+
+GuidedSampler::GuidedSampler(const PathGuide& guide, const BSDFSampler& bsdf)
+    : m_guide(guide)
+    , m_bsdf(bsdf)
+    , m_fraction(guide.params().fraction)
+{
+}
+
+// u.x picks the guide or the BSDF and is rescaled for the chosen one.
+bool GuidedSampler::sample(const glm::vec3& p,
+    const glm::vec3& n,
+    const glm::vec2& u,
+    glm::vec3& dir,
+    float& pdf) const
+{
+    const int region = m_guide.region(p);
+    if (region < 0 || !(m_fraction > 0.0f)) return m_bsdf.sample(p, n, u, dir, pdf);
+
+    float guidePdf = 0.0f;
+    float bsdfPdf = 0.0f;
+    if (u.x < m_fraction) {
+        const glm::vec2 v(std::min(u.x / m_fraction, ONE_MINUS_EPS), u.y);
+        if (!m_guide.sample(region, v, dir, guidePdf)) return false;
+        if (glm::dot(dir, n) <= 0.0f) return false;
+        bsdfPdf = m_bsdf.pdf(p, n, dir);
+    }
+    else {
+        const glm::vec2 v(std::min((u.x - m_fraction) / (1.0f - m_fraction), ONE_MINUS_EPS), u.y);
+        if (!m_bsdf.sample(p, n, v, dir, bsdfPdf)) return false;
+        guidePdf = m_guide.pdf(region, dir);
+    }
+
+    pdf = m_fraction * guidePdf + (1.0f - m_fraction) * bsdfPdf;
+    return pdf > 0.0f;
+}
+
+float GuidedSampler::pdf(const glm::vec3& p, const glm::vec3& n, const glm::vec3& dir) const {
+    const int region = m_guide.region(p);
+    if (region < 0 || !(m_fraction > 0.0f)) return m_bsdf.pdf(p, n, dir);
+    if (glm::dot(n, dir) <= 0.0f) return 0.0f;
+
+    return m_fraction * m_guide.pdf(region, dir) + (1.0f - m_fraction) * m_bsdf.pdf(p, n, dir);
+}
@@ -1,5 +1,6 @@
 #include "path_mutator.h"
 #include "GeomUtil.h"
+#include "Stats.h"
 #include <cmath>
 #include <algorithm>
 #include <array>
@@ -10,17 +11,65 @@ PathMutator::PathMutator(const Scene& scene,
     : m_scene(scene), m_C(camera_center), m_L(light_pos) {
 }
 
+void PathMutator::set_roulette(const Roulette& rr) {
+    m_rr = rr;
+}
+
+float PathMutator::continue_probability(int vertex, const glm::vec3& beta) const {
+    if (!m_rr.enabled || vertex < m_rr.minBounces) return 1.0f;
+    const glm::vec3 expected = beta * m_rr.albedo;
+    return std::clamp(std::max(expected.x, std::max(expected.y, expected.z)), 0.0f, 1.0f);
+}
+
+void PathMutator::set_sampler(const BSDFSampler& sampler) {
+    m_sampler = &sampler;
+}
+
+void PathMutator::set_radiance_cache(const RadianceCache* cache, int depth) {
+    m_cache = cache;
+    m_cacheDepth = std::max(1, depth);
+}
+
 bool PathMutator::sample_path(
     Path& path,
     int maxBounces,
     const glm::vec3& initialDir,
     int retriesPerBounce) const
 {
+    std::random_device rd_seed;
+    std::mt19937 rng(rd_seed());
+    return sample_path(path, maxBounces, initialDir, retriesPerBounce, rng);
+}
+
+bool PathMutator::sample_path(
+    Path& path,
+    int maxBounces,
+    const glm::vec3& initialDir,
+    int retriesPerBounce,
+    std::mt19937& rng) const
+{
+    Sampler sampler(rng);
+    return sample_path(path, maxBounces, initialDir, retriesPerBounce, sampler);
+}
+
+bool PathMutator::sample_path(
+    Path& path,
+    int maxBounces,
+    const glm::vec3& initialDir,
+    int retriesPerBounce,
+    Sampler& sampler) const
+{
+    PM_STAT_TIMER(T_SAMPLE_PATH);
+    PM_STAT_INC(SAMPLE_PATH_CALLS);
+
     path.vertices.clear();
     path.faces.clear();
     path.bary_points.clear();
     path.light_visible.clear();
+    path.light_u.clear();
     path.bounces = 0;
+    path.cached_tail = false;
+    path.roulette_ended = false;
 
     auto push_vertex_with_face = [&](const glm::vec3& p,
         const GeomUtil::Triangle& face,
@@ -37,8 +86,6 @@ bool PathMutator::sample_path(
 
     push_vertex_no_face(m_C);
 
-    std::random_device rd_seed;
-    std::mt19937 rng(rd_seed());
     std::uniform_real_distribution<float> u01(0.0f, 1.0f);
 
     glm::vec3 ro = m_C;
@@ -49,6 +96,7 @@ bool PathMutator::sample_path(
         path.faces.clear();
         path.bary_points.clear();
         path.light_visible.clear();
+        path.light_u.clear();
         path.bounces = 0;
         return false;
     }
@@ -57,28 +105,54 @@ bool PathMutator::sample_path(
     GeomUtil::Triangle tri;
 
     if (!m_scene.intersect(ro, rd, hit, tri)) {
+        PM_STAT_INC(SAMPLE_PATH_NO_PRIMARY_HIT);
         path.vertices.clear();
         path.faces.clear();
         path.bary_points.clear();
         path.light_visible.clear();
+        path.light_u.clear();
         path.bounces = 0;
         return false;
     }
 
     push_vertex_with_face(hit.p, tri, hit.bary);
+    path.light_u.push_back(draw_light_u(sampler));
     path.bounces = 1;
 
     ro = hit.p + 1e-4f * hit.n;
 
+    // Throughput of the prefix, including the 1/q roulette compensation, in
+    // the same Lambertian model compute_radiance_for_path evaluates.
+    glm::vec3 beta(1.0f);
+
     for (int bounce = 1; bounce < maxBounces; ++bounce) {
+        glm::vec3 cachedL;
+        if (m_cache && bounce >= m_cacheDepth && m_cache->lookup(hit.p, hit.n, cachedL)) {
+            path.cached_tail = true;
+            break;
+        }
+
+        const float q = continue_probability(bounce, beta);
+        if (m_rr.enabled && bounce >= m_rr.minBounces && !(u01(sampler.rng()) < q)) {
+            PM_STAT_INC(SAMPLE_PATH_ROULETTE_KILLED);
+            path.roulette_ended = true;
+            break;
+        }
+
         bool foundNext = false;
+        glm::vec3 nextDir(0.0f);
+        float nextPdf = 0.0f;
 
         Scene::Hit nextHit;
         GeomUtil::Triangle nextTri;
 
         for (int attempt = 0; attempt < retriesPerBounce; ++attempt) {
-            glm::vec3 candDir = GeomUtil::sample_hemisphere_uniform(hit.n, rng, u01);
-            if (glm::dot(candDir, hit.n) <= 0.0f) continue;
+            glm::vec3 candDir;
+            float candPdf = 0.0f;
+            // A direction the sampler rejects (a guided one below the surface)
+            // carries no light and ends the path; drawing again would bias
+            // the estimate towards the directions it accepts.
+            if (!m_sampler->sample(hit.p, hit.n, sampler.get_2d(), candDir, candPdf) || !(candPdf > 0.0f)) break;
 
             Scene::Hit tmpHit;
             GeomUtil::Triangle tmpTri;
@@ -86,18 +160,25 @@ bool PathMutator::sample_path(
                 foundNext = true;
                 nextHit = tmpHit;
                 nextTri = tmpTri;
+                nextDir = candDir;
+                nextPdf = candPdf;
                 break;
             }
         }
 
         if (!foundNext) {
+            PM_STAT_INC(SAMPLE_PATH_RETRIES_EXHAUSTED);
             break;
         }
 
+        PM_STAT_INC(SAMPLE_PATH_BOUNCES);
+        beta *= m_rr.albedo * (glm::dot(nextDir, hit.n) / (3.14159265358979323846f * nextPdf)) / q;
+
         hit = nextHit;
         tri = nextTri;
 
         push_vertex_with_face(hit.p, tri, hit.bary);
+        path.light_u.push_back(draw_light_u(sampler));
         path.bounces++;
 
         ro = hit.p + 1e-4f * hit.n;
@@ -105,69 +186,38 @@ bool PathMutator::sample_path(
 
     push_vertex_no_face(m_L);
 
-    const float visEps = 1e-4f;
     const int nVerts = (int)path.vertices.size();
     const int nInternal = std::max(0, nVerts - 2);
 
-    path.light_visible.resize(nInternal, false);
-
-    for (int i = 1; i <= nVerts - 2; ++i) {
-        path.light_visible[i - 1] = m_scene.visible(path.vertices[i], m_L, visEps);
-    }
+    // Light visibility is resolved on demand by the renderer, which only
+    // traces shadow rays for vertices that face the light.
+    path.light_visible.assign(nInternal, LIGHT_UNKNOWN);
 
     return true;
 }
 
 
 
-bool PathMutator::mutate_vertex_meshwalk(Path& path, int index, float radius) const {
-    if (radius <= 0.0f) return false;
-    if (index < 0 || index >= (int)path.vertices.size()) return false;
-    if ((int)path.faces.size() != (int)path.vertices.size()) return false;
-    if ((int)path.bary_points.size() != (int)path.vertices.size()) return false;
-
-    const int N = (int)path.vertices.size();
-    const int nInternal = std::max(0, N - 2);
-    if ((int)path.light_visible.size() != nInternal) return false;
-
+// Walks p a geodesic distance L over the mesh in direction d, starting on
+// face, and unfolds d across every edge it crosses. On success face, p and d
+// are where the walk ends and the direction it arrives in.
+PathMutator::Walk PathMutator::walk_geodesic(GeomUtil::Triangle& face, glm::vec3& p, glm::vec3& d, float L) const {
     const auto& tris = m_scene.triangles();
-    if (tris.empty()) return false;
-
-    GeomUtil::Triangle cur = path.faces[index];
-    glm::vec3 p = path.vertices[index];
-
-    glm::vec3 n = GeomUtil::face_normal_geom(cur);
-    if (glm::dot(n, n) <= 0.0f) return false;
-
-    std::random_device rd_seed;
-    std::mt19937 rng(rd_seed());
-    std::uniform_real_distribution<float> u01(0.0f, 1.0f);
-
-    glm::vec3 U, V;
-    GeomUtil::make_orthonormal_basis(n, U, V);
-
-    float rho = std::sqrt(u01(rng)) * radius;
-    float phi = 6.283185307179586f * u01(rng);
-
-    glm::vec3 step = (rho * std::cos(phi)) * U + (rho * std::sin(phi)) * V;
-    float L = std::sqrt(glm::dot(step, step));
-    if (L <= 1e-6f) return true;
-
-    glm::vec3 d = GeomUtil::safe_normalize(step);
+    GeomUtil::Triangle cur = face;
 
     int guard = 0;
     const int GUARD_MAX = 100000;
 
     while (L > 1e-6f && guard++ < GUARD_MAX) {
         glm::vec3 n0 = GeomUtil::face_normal_geom(cur);
-        if (glm::dot(n0, n0) <= 0.0f) return false;
+        if (glm::dot(n0, n0) <= 0.0f) return WALK_DEGENERATE;
 
         d = GeomUtil::safe_normalize(GeomUtil::project_to_plane(d, n0));
-        if (glm::dot(d, d) <= 0.0f) return false;
+        if (glm::dot(d, d) <= 0.0f) return WALK_DEGENERATE;
 
         glm::vec3 e1 = cur.v1 - cur.v0;
         float e1len2 = glm::dot(e1, e1);
-        if (e1len2 <= 1e-6f * 1e-6f) return false;
+        if (e1len2 <= 1e-6f * 1e-6f) return WALK_DEGENERATE;
 
         glm::vec3 u = GeomUtil::safe_normalize(e1);
         glm::vec3 v = glm::cross(n0, u);
@@ -179,7 +229,7 @@ bool PathMutator::mutate_vertex_meshwalk(Path& path, int index, float radius) co
 
         glm::vec2 p2 = proj2(p);
         glm::vec2 r2(glm::dot(d, u), glm::dot(d, v));
-        if (r2.x * r2.x + r2.y * r2.y <= 1e-6f * 1e-6f) return false;
+        if (r2.x * r2.x + r2.y * r2.y <= 1e-6f * 1e-6f) return WALK_DEGENERATE;
 
         float bestS = std::numeric_limits<float>::infinity();
         int bestEdge = -1;
@@ -215,34 +265,108 @@ bool PathMutator::mutate_vertex_meshwalk(Path& path, int index, float radius) co
         L -= bestS;
 
         int nextId = cur.adj[bestEdge];
-        if (nextId < 0 || nextId >= (int)tris.size()) return false;
+        if (nextId < 0 || nextId >= (int)tris.size()) return WALK_OFF_MESH;
 
         const GeomUtil::Triangle& nxt = tris[nextId];
         glm::vec3 n1 = GeomUtil::face_normal_geom(nxt);
-        if (glm::dot(n1, n1) <= 0.0f) return false;
+        if (glm::dot(n1, n1) <= 0.0f) return WALK_DEGENERATE;
 
         glm::vec3 ea, eb;
         GeomUtil::edge_endpoints(cur, bestEdge, ea, eb);
         glm::vec3 axis = GeomUtil::safe_normalize(eb - ea);
-        if (glm::dot(axis, axis) <= 0.0f) return false;
+        if (glm::dot(axis, axis) <= 0.0f) return WALK_DEGENERATE;
 
         float theta = GeomUtil::signed_dihedral(n0, n1, axis);
         d = GeomUtil::rodrigues(d, axis, theta);
 
         d = GeomUtil::safe_normalize(GeomUtil::project_to_plane(d, n1));
-        if (glm::dot(d, d) <= 0.0f) return false;
+        if (glm::dot(d, d) <= 0.0f) return WALK_DEGENERATE;
 
         p = p + 1e-6f * d;
 
         cur = nxt;
     }
 
-    if (guard >= GUARD_MAX) return false;
+    if (guard >= GUARD_MAX) return WALK_GUARD;
+
+    face = cur;
+    return WALK_OK;
+}
+
+// The step is an offset drawn uniformly from the disk of the given radius in
+// the face's plane, walked over the mesh. Unfolding the mesh along the walk
+// is an isometry, so every walk that reaches y has density 1 / (pi r^2) in
+// the area measure, and the same walk reversed (from y, against the
+// direction it arrives in, over the same length) is a step of that density
+// from y back to x. The proposal is thus symmetric wherever walks reverse;
+// where one does not (it grazes a vertex, runs off the mesh on the way back,
+// or float error moves its end), the step is rejected. Its reverse then
+// fails the same test, so the rejection removes the pair in both directions
+// and Metropolis ratios need no transition density for meshwalk.
+bool PathMutator::propose_vertex_meshwalk(const Path& path,
+    int index,
+    float radius,
+    Sampler& sampler,
+    Candidate& out) const
+{
+    if (radius <= 0.0f) return PM_STAT_FAIL(MESHWALK_FAIL_INPUT);
+    if (index < 0 || index >= (int)path.vertices.size()) return PM_STAT_FAIL(MESHWALK_FAIL_INPUT);
+    if ((int)path.faces.size() != (int)path.vertices.size()) return PM_STAT_FAIL(MESHWALK_FAIL_INPUT);
+    if ((int)path.bary_points.size() != (int)path.vertices.size()) return PM_STAT_FAIL(MESHWALK_FAIL_INPUT);
+
+    const int N = (int)path.vertices.size();
+    const int nInternal = std::max(0, N - 2);
+    if ((int)path.light_visible.size() != nInternal) return PM_STAT_FAIL(MESHWALK_FAIL_INPUT);
+    if ((int)path.light_u.size() != nInternal) return PM_STAT_FAIL(MESHWALK_FAIL_INPUT);
+
+    const auto& tris = m_scene.triangles();
+    if (tris.empty()) return PM_STAT_FAIL(MESHWALK_FAIL_INPUT);
+
+    GeomUtil::Triangle face = path.faces[index];
+    const glm::vec3 x = path.vertices[index];
+
+    glm::vec3 n = GeomUtil::face_normal_geom(face);
+    if (glm::dot(n, n) <= 0.0f) return PM_STAT_FAIL(MESHWALK_FAIL_DEGENERATE);
+
+    glm::vec3 U, V;
+    GeomUtil::make_orthonormal_basis(n, U, V);
+
+    const glm::vec2 u2 = sampler.get_2d();
+    float rho = std::sqrt(u2.x) * radius;
+    float phi = 6.283185307179586f * u2.y;
+
+    glm::vec3 step = (rho * std::cos(phi)) * U + (rho * std::sin(phi)) * V;
+    float L = std::sqrt(glm::dot(step, step));
+    if (L <= 1e-6f) {
+        out.p = x;
+        out.face = face;
+        out.bary = path.bary_points[index];
+        return true;
+    }
+
+    glm::vec3 p = x;
+    glm::vec3 d = GeomUtil::safe_normalize(step);
+
+    const Walk walk = walk_geodesic(face, p, d, L);
+    if (walk == WALK_DEGENERATE) return PM_STAT_FAIL(MESHWALK_FAIL_DEGENERATE);
+    if (walk == WALK_OFF_MESH) return PM_STAT_FAIL(MESHWALK_FAIL_OFF_MESH);
+    if (walk == WALK_GUARD) return PM_STAT_FAIL(MESHWALK_FAIL_GUARD);
+
+    {
+        GeomUtil::Triangle backFace = face;
+        glm::vec3 back = p;
+        glm::vec3 backDir = -d;
+        const float tol = 1e-3f * radius;
+        if (walk_geodesic(backFace, back, backDir, L) != WALK_OK ||
+            glm::dot(back - x, back - x) > tol * tol) {
+            return PM_STAT_FAIL(MESHWALK_FAIL_IRREVERSIBLE);
+        }
+    }
 
     {
-        const glm::vec3 a = cur.v0;
-        const glm::vec3 b = cur.v1;
-        const glm::vec3 c = cur.v2;
+        const glm::vec3 a = face.v0;
+        const glm::vec3 b = face.v1;
+        const glm::vec3 c = face.v2;
 
         const glm::vec3 v0 = b - a;
         const glm::vec3 v1 = c - a;
@@ -255,58 +379,56 @@ bool PathMutator::mutate_vertex_meshwalk(Path& path, int index, float radius) co
         const float d21 = glm::dot(v2, v1);
 
         const float denom = d00 * d11 - d01 * d01;
-        if (std::fabs(denom) <= 1e-12f) return false;
+        if (std::fabs(denom) <= 1e-12f) return PM_STAT_FAIL(MESHWALK_FAIL_DEGENERATE);
 
         const float invDen = 1.0f / denom;
         const float uu = (d11 * d20 - d01 * d21) * invDen;
         const float vv = (d00 * d21 - d01 * d20) * invDen;
         const float ww = 1.0f - uu - vv;
 
-        path.bary_points[index] = glm::vec3(ww, uu, vv);
+        out.bary = glm::vec3(ww, uu, vv);
     }
 
-    path.vertices[index] = p;
-    path.faces[index] = cur;
-
-    if (index >= 1 && index <= N - 2) {
-        const float visEps = 1e-4f;
-        path.light_visible[index - 1] = m_scene.visible(path.vertices[index], m_L, visEps);
-    }
+    out.p = p;
+    out.face = face;
 
     return true;
 }
 
-bool PathMutator::mutate_vertex_project(Path& path, int index, float radius) const {
-    if (radius <= 0.0f) return false;
-    if (index < 0 || index >= (int)path.vertices.size()) return false;
-    if ((int)path.faces.size() != (int)path.vertices.size()) return false;
-    if ((int)path.bary_points.size() != (int)path.vertices.size()) return false;
+bool PathMutator::propose_vertex_project(const Path& path,
+    int index,
+    float radius,
+    Sampler& sampler,
+    Candidate& out) const
+{
+    if (radius <= 0.0f) return PM_STAT_FAIL(PROJECT_FAIL_INPUT);
+    if (index < 0 || index >= (int)path.vertices.size()) return PM_STAT_FAIL(PROJECT_FAIL_INPUT);
+    if ((int)path.faces.size() != (int)path.vertices.size()) return PM_STAT_FAIL(PROJECT_FAIL_INPUT);
+    if ((int)path.bary_points.size() != (int)path.vertices.size()) return PM_STAT_FAIL(PROJECT_FAIL_INPUT);
 
     const int N = (int)path.vertices.size();
     const int nInternal = std::max(0, N - 2);
-    if ((int)path.light_visible.size() != nInternal) return false;
+    if ((int)path.light_visible.size() != nInternal) return PM_STAT_FAIL(PROJECT_FAIL_INPUT);
+    if ((int)path.light_u.size() != nInternal) return PM_STAT_FAIL(PROJECT_FAIL_INPUT);
 
     const auto& tris = m_scene.triangles();
-    if (tris.empty()) return false;
+    if (tris.empty()) return PM_STAT_FAIL(PROJECT_FAIL_INPUT);
 
     const GeomUtil::Triangle& cur = path.faces[index];
     glm::vec3 p = path.vertices[index];
 
     glm::vec3 n = GeomUtil::face_normal_geom(cur);
-    if (glm::dot(n, n) <= 0.0f) return false;
+    if (glm::dot(n, n) <= 0.0f) return PM_STAT_FAIL(PROJECT_FAIL_DEGENERATE);
 
     float h = std::max(1e-3f, 0.5f * radius);
     glm::vec3 apex = p + h * n;
 
-    std::random_device rd_seed;
-    std::mt19937 rng(rd_seed());
-    std::uniform_real_distribution<float> u01(0.0f, 1.0f);
-
     glm::vec3 U, V;
     GeomUtil::make_orthonormal_basis(n, U, V);
 
-    float rho = std::sqrt(u01(rng)) * radius;
-    float phi = 6.283185307179586f * u01(rng);
+    const glm::vec2 u2 = sampler.get_2d();
+    float rho = std::sqrt(u2.x) * radius;
+    float phi = 6.283185307179586f * u2.y;
 
     glm::vec3 q =
         p
@@ -314,9 +436,9 @@ bool PathMutator::mutate_vertex_project(Path& path, int index, float radius) con
         + (rho * std::sin(phi)) * V;
 
     glm::vec3 d = GeomUtil::safe_normalize(q - apex);
-    if (glm::dot(d, d) <= 0.0f) return false;
+    if (glm::dot(d, d) <= 0.0f) return PM_STAT_FAIL(PROJECT_FAIL_DEGENERATE);
 
-    if (glm::dot(d, n) >= -1e-6f) return false;
+    if (glm::dot(d, n) >= -1e-6f) return PM_STAT_FAIL(PROJECT_FAIL_DIRECTION);
 
     Scene::Hit hit;
     GeomUtil::Triangle hitTri;
@@ -325,57 +447,40 @@ bool PathMutator::mutate_vertex_project(Path& path, int index, float radius) con
     glm::vec3 ro = apex + epsPush * d;
 
     if (!m_scene.intersect(ro, d, hit, hitTri)) {
-        return false;
-    }
-
-    glm::vec3 newP = hit.p;
-
-    const float visEps = 1e-4f;
-
-    if (index - 1 >= 0) {
-        const glm::vec3& pPrev = path.vertices[index - 1];
-        if (!m_scene.visible(pPrev, newP, visEps)) {
-            return false;
-        }
+        return PM_STAT_FAIL(PROJECT_FAIL_NO_HIT);
     }
 
-    if (index + 1 < (int)path.vertices.size()) {
-        const glm::vec3& pNext = path.vertices[index + 1];
-        if (!m_scene.visible(newP, pNext, visEps)) {
-            return false;
-        }
-    }
-
-    path.vertices[index] = newP;
-    path.faces[index] = hitTri;
-    path.bary_points[index] = hit.bary;
-
-    if (index >= 1 && index <= N - 2) {
-        path.light_visible[index - 1] = m_scene.visible(path.vertices[index], m_L, visEps);
-    }
+    out.p = hit.p;
+    out.face = hitTri;
+    out.bary = hit.bary;
 
     return true;
 }
 
-bool PathMutator::mutate_vertex_retrace(Path& path, int index) const {
-    if (index < 0 || index >= (int)path.vertices.size()) return false;
-    if ((int)path.faces.size() != (int)path.vertices.size()) return false;
-    if ((int)path.bary_points.size() != (int)path.vertices.size()) return false;
+bool PathMutator::propose_vertex_retrace(const Path& path,
+    int index,
+    Sampler& sampler,
+    Candidate& out) const
+{
+    if (index < 0 || index >= (int)path.vertices.size()) return PM_STAT_FAIL(RETRACE_FAIL_INPUT);
+    if ((int)path.faces.size() != (int)path.vertices.size()) return PM_STAT_FAIL(RETRACE_FAIL_INPUT);
+    if ((int)path.bary_points.size() != (int)path.vertices.size()) return PM_STAT_FAIL(RETRACE_FAIL_INPUT);
 
     const int N = (int)path.vertices.size();
     const int nInternal = std::max(0, N - 2);
-    if ((int)path.light_visible.size() != nInternal) return false;
+    if ((int)path.light_visible.size() != nInternal) return PM_STAT_FAIL(RETRACE_FAIL_INPUT);
+    if ((int)path.light_u.size() != nInternal) return PM_STAT_FAIL(RETRACE_FAIL_INPUT);
 
-    if (index == 0) return false;
-    if (index == (int)path.vertices.size() - 1) return false;
+    if (index == 0) return PM_STAT_FAIL(RETRACE_FAIL_INPUT);
+    if (index == (int)path.vertices.size() - 1) return PM_STAT_FAIL(RETRACE_FAIL_INPUT);
 
     const auto& tris = m_scene.triangles();
-    if (tris.empty()) return false;
+    if (tris.empty()) return PM_STAT_FAIL(RETRACE_FAIL_INPUT);
 
     const GeomUtil::Triangle& curTri = path.faces[index];
     const glm::vec3 bary = path.bary_points[index];
 
-    if (glm::dot(bary, bary) <= 0.0f) return false;
+    if (glm::dot(bary, bary) <= 0.0f) return PM_STAT_FAIL(RETRACE_FAIL_DEGENERATE);
 
     const float w = bary.x;
     const float u = bary.y;
@@ -395,43 +500,443 @@ bool PathMutator::mutate_vertex_retrace(Path& path, int index) const {
     if (n2 <= 0.0f) {
         n = glm::cross(curTri.v1 - curTri.v0, curTri.v2 - curTri.v0);
         n2 = glm::dot(n, n);
-        if (n2 <= 0.0f) return false;
+        if (n2 <= 0.0f) return PM_STAT_FAIL(RETRACE_FAIL_DEGENERATE);
     }
     n = n / std::sqrt(n2);
 
-    std::random_device rd_seed;
-    std::mt19937 rng(rd_seed());
-    std::uniform_real_distribution<float> u01(0.0f, 1.0f);
-
-    glm::vec3 d = GeomUtil::sample_hemisphere_uniform(n, rng, u01);
-    if (glm::dot(d, n) <= 0.0f) return false;
+    glm::vec3 d;
+    float dPdf = 0.0f;
+    if (!m_sampler->sample(p, n, sampler.get_2d(), d, dPdf)) return PM_STAT_FAIL(RETRACE_FAIL_DIRECTION);
 
     const float epsPush = 1e-4f;
     glm::vec3 ro = p + epsPush * n;
 
     Scene::Hit hit;
     GeomUtil::Triangle hitTri;
-    if (!m_scene.intersect(ro, d, hit, hitTri)) return false;
+    if (!m_scene.intersect(ro, d, hit, hitTri)) return PM_STAT_FAIL(RETRACE_FAIL_NO_HIT);
+
+    out.p = hit.p;
+    out.face = hitTri;
+    out.bary = hit.bary;
+
+    return true;
+}
 
-    glm::vec3 newP = hit.p;
+// Only connections between surface vertices are looked up; the camera and
+// the light are not part of any cluster.
+PathMutator::Connection PathMutator::connections_table_check(const Path& path, int index, const glm::vec3& p) const {
+    if (!m_visTable) return CONNECTION_OK;
 
+    const int N = (int)path.vertices.size();
+    if (index - 1 >= 1) {
+        PM_STAT_INC(VISIBILITY_TABLE_QUERIES);
+        if (!m_visTable->maybe_visible(path.vertices[index - 1], p)) {
+            PM_STAT_INC(VISIBILITY_TABLE_REJECTS);
+            return CONNECTION_PREV_OCCLUDED;
+        }
+    }
+    if (index + 1 <= N - 2) {
+        PM_STAT_INC(VISIBILITY_TABLE_QUERIES);
+        if (!m_visTable->maybe_visible(p, path.vertices[index + 1])) {
+            PM_STAT_INC(VISIBILITY_TABLE_REJECTS);
+            return CONNECTION_NEXT_OCCLUDED;
+        }
+    }
+    return CONNECTION_OK;
+}
+
+PathMutator::Connection PathMutator::connections_visible(const Path& path, int index, const glm::vec3& p) const {
     const float visEps = 1e-4f;
 
+    const Connection table = connections_table_check(path, index, p);
+    if (table != CONNECTION_OK) return table;
+
     if (index - 1 >= 0) {
-        const glm::vec3& pPrev = path.vertices[index - 1];
-        if (!m_scene.visible(pPrev, newP, visEps)) return false;
+        if (!m_scene.visible(path.vertices[index - 1], p, visEps)) return CONNECTION_PREV_OCCLUDED;
     }
 
-    if (index + 1 < (int)path.vertices.size()) {
-        const glm::vec3& pNext = path.vertices[index + 1];
-        if (!m_scene.visible(newP, pNext, visEps)) return false;
+    const int N = (int)path.vertices.size();
+    if (index + 1 < N - 1 || (index + 1 == N - 1 && m_lightConnection)) {
+        if (!m_scene.visible(p, path.vertices[index + 1], visEps)) return CONNECTION_NEXT_OCCLUDED;
+    }
+
+    return CONNECTION_OK;
+}
+
+glm::vec3 PathMutator::draw_light_u(Sampler& sampler) {
+    const float pick = sampler.get_1d();
+    const glm::vec2 onLight = sampler.get_2d();
+    return glm::vec3(pick, onLight.x, onLight.y);
+}
+
+void PathMutator::apply_candidate(Path& path, int index, const Candidate& c) const {
+    path.vertices[index] = c.p;
+    path.faces[index] = c.face;
+    path.bary_points[index] = c.bary;
+
+    const int N = (int)path.vertices.size();
+    if (index >= 1 && index <= N - 2) {
+        path.light_visible[index - 1] = c.light;
+        path.light_u[index - 1] = c.lightU;
     }
+}
+
+bool PathMutator::mutate_vertex_meshwalk(Path& path, int index, float radius) const {
+    std::random_device rd_seed;
+    std::mt19937 rng(rd_seed());
+    return mutate_vertex_meshwalk(path, index, radius, rng);
+}
+
+bool PathMutator::mutate_vertex_meshwalk(Path& path, int index, float radius, std::mt19937& rng) const {
+    Sampler sampler(rng);
+    return mutate_vertex_meshwalk(path, index, radius, sampler);
+}
+
+bool PathMutator::mutate_vertex_meshwalk(Path& path, int index, float radius, Sampler& sampler) const {
+    PM_STAT_TIMER(T_MESHWALK);
+    PM_STAT_INC(MESHWALK_ATTEMPTS);
+
+    Candidate c;
+    if (!propose_vertex_meshwalk(path, index, radius, sampler, c)) return false;
+    c.lightU = draw_light_u(sampler);
+
+    Connection conn = connections_visible(path, index, c.p);
+    if (conn == CONNECTION_PREV_OCCLUDED) return PM_STAT_FAIL(MESHWALK_FAIL_PREV_OCCLUDED);
+    if (conn == CONNECTION_NEXT_OCCLUDED) return PM_STAT_FAIL(MESHWALK_FAIL_NEXT_OCCLUDED);
+
+    PM_STAT_INC(MESHWALK_OK);
+    apply_candidate(path, index, c);
+    return true;
+}
+
+bool PathMutator::mutate_vertex_project(Path& path, int index, float radius) const {
+    std::random_device rd_seed;
+    std::mt19937 rng(rd_seed());
+    return mutate_vertex_project(path, index, radius, rng);
+}
+
+bool PathMutator::mutate_vertex_project(Path& path, int index, float radius, std::mt19937& rng) const {
+    Sampler sampler(rng);
+    return mutate_vertex_project(path, index, radius, sampler);
+}
+
+bool PathMutator::mutate_vertex_project(Path& path, int index, float radius, Sampler& sampler) const {
+    PM_STAT_TIMER(T_PROJECT);
+    PM_STAT_INC(PROJECT_ATTEMPTS);
 
-    path.vertices[index] = newP;
-    path.faces[index] = hitTri;
-    path.bary_points[index] = hit.bary;
+    Candidate c;
+    if (!propose_vertex_project(path, index, radius, sampler, c)) return false;
+    c.lightU = draw_light_u(sampler);
 
-    path.light_visible[index - 1] = m_scene.visible(path.vertices[index], m_L, visEps);
+    Connection conn = connections_visible(path, index, c.p);
+    if (conn == CONNECTION_PREV_OCCLUDED) return PM_STAT_FAIL(PROJECT_FAIL_PREV_OCCLUDED);
+    if (conn == CONNECTION_NEXT_OCCLUDED) return PM_STAT_FAIL(PROJECT_FAIL_NEXT_OCCLUDED);
 
+    PM_STAT_INC(PROJECT_OK);
+    apply_candidate(path, index, c);
     return true;
 }
+
+bool PathMutator::mutate_vertex_retrace(Path& path, int index) const {
+    std::random_device rd_seed;
+    std::mt19937 rng(rd_seed());
+    return mutate_vertex_retrace(path, index, rng);
+}
+
+bool PathMutator::mutate_vertex_retrace(Path& path, int index, std::mt19937& rng) const {
+    Sampler sampler(rng);
+    return mutate_vertex_retrace(path, index, sampler);
+}
+
+bool PathMutator::mutate_vertex_retrace(Path& path, int index, Sampler& sampler) const {
+    PM_STAT_TIMER(T_RETRACE);
+    PM_STAT_INC(RETRACE_ATTEMPTS);
+
+    Candidate c;
+    if (!propose_vertex_retrace(path, index, sampler, c)) return false;
+    c.lightU = draw_light_u(sampler);
+
+    Connection conn = connections_visible(path, index, c.p);
+    if (conn == CONNECTION_PREV_OCCLUDED) return PM_STAT_FAIL(RETRACE_FAIL_PREV_OCCLUDED);
+    if (conn == CONNECTION_NEXT_OCCLUDED) return PM_STAT_FAIL(RETRACE_FAIL_NEXT_OCCLUDED);
+
+    PM_STAT_INC(RETRACE_OK);
+    apply_candidate(path, index, c);
+    return true;
+}
+
+bool PathMutator::mutate_subpath(Path& path, int i, int j, std::mt19937& rng) const {
+    Sampler sampler(rng);
+    return mutate_subpath(path, i, j, sampler);
+}
+
+// The new vertices are traced into scratch first, so a failed proposal
+// leaves path as it was. Only the closing connection needs a shadow ray;
+// every traced segment is visible by construction.
+bool PathMutator::mutate_subpath(Path& path, int i, int j, Sampler& sampler) const {
+    PM_STAT_TIMER(T_SUBPATH);
+    PM_STAT_INC(SUBPATH_ATTEMPTS);
+
+    const int N = (int)path.vertices.size();
+    if ((int)path.faces.size() != N) return PM_STAT_FAIL(SUBPATH_FAIL_INPUT);
+    if ((int)path.bary_points.size() != N) return PM_STAT_FAIL(SUBPATH_FAIL_INPUT);
+    if ((int)path.light_visible.size() != std::max(0, N - 2)) return PM_STAT_FAIL(SUBPATH_FAIL_INPUT);
+    if (path.light_u.size() != path.light_visible.size()) return PM_STAT_FAIL(SUBPATH_FAIL_INPUT);
+    if (i < 1 || j > N - 1 || j - i < 2) return PM_STAT_FAIL(SUBPATH_FAIL_INPUT);
+
+    std::vector<Candidate> fresh;
+    fresh.reserve((size_t)(j - i - 1));
+
+    glm::vec3 p = path.vertices[i];
+    glm::vec3 n = GeomUtil::interpolated_normal(path.faces[i], path.bary_points[i]);
+
+    const float epsPush = 1e-4f;
+    for (int k = i + 1; k < j; ++k) {
+        glm::vec3 d;
+        float dPdf = 0.0f;
+        if (!m_sampler->sample(p, n, sampler.get_2d(), d, dPdf) || !(dPdf > 0.0f)) return PM_STAT_FAIL(SUBPATH_FAIL_DIRECTION);
+
+        Scene::Hit hit;
+        GeomUtil::Triangle hitTri;
+        if (!m_scene.intersect(p + epsPush * n, d, hit, hitTri)) return PM_STAT_FAIL(SUBPATH_FAIL_NO_HIT);
+
+        Candidate c;
+        c.p = hit.p;
+        c.face = hitTri;
+        c.bary = hit.bary;
+        c.lightU = draw_light_u(sampler);
+        fresh.push_back(c);
+
+        p = hit.p;
+        n = GeomUtil::interpolated_normal(hitTri, hit.bary);
+    }
+
+    if (j <= N - 2 && m_visTable) {
+        PM_STAT_INC(VISIBILITY_TABLE_QUERIES);
+        if (!m_visTable->maybe_visible(p, path.vertices[j])) {
+            PM_STAT_INC(VISIBILITY_TABLE_REJECTS);
+            return PM_STAT_FAIL(SUBPATH_FAIL_OCCLUDED);
+        }
+    }
+    if (j < N - 1 || m_lightConnection) {
+        const float visEps = 1e-4f;
+        if (!m_scene.visible(p, path.vertices[j], visEps)) return PM_STAT_FAIL(SUBPATH_FAIL_OCCLUDED);
+    }
+
+    PM_STAT_INC(SUBPATH_OK);
+    for (int k = i + 1; k < j; ++k) apply_candidate(path, k, fresh[(size_t)(k - i - 1)]);
+    return true;
+}
+
+// Candidates are generated first, then every neighbour connection goes
+// through one Scene::visible_batch call.
+int PathMutator::propose_vertex_batch(const Path& path,
+    int index,
+    int mutator_type,
+    float radius,
+    int numTries,
+    Sampler& sampler,
+    std::vector<Candidate>& out) const
+{
+    out.clear();
+    if (numTries <= 0) return 0;
+
+    std::vector<Candidate> cands;
+    cands.reserve(numTries);
+
+    for (int t = 0; t < numTries; ++t) {
+        Candidate c;
+        bool ok = false;
+
+        if (mutator_type == 0) {
+            PM_STAT_INC(RETRACE_ATTEMPTS);
+            ok = propose_vertex_retrace(path, index, sampler, c);
+        }
+        else if (mutator_type == 1) {
+            PM_STAT_INC(MESHWALK_ATTEMPTS);
+            ok = propose_vertex_meshwalk(path, index, radius, sampler, c);
+        }
+        else if (mutator_type == 2) {
+            PM_STAT_INC(PROJECT_ATTEMPTS);
+            ok = propose_vertex_project(path, index, radius, sampler, c);
+        }
+
+        if (!ok) continue;
+        c.lightU = draw_light_u(sampler);
+
+        const Connection table = connections_table_check(path, index, c.p);
+        if (table == CONNECTION_PREV_OCCLUDED) {
+            if (mutator_type == 0) PM_STAT_INC(RETRACE_FAIL_PREV_OCCLUDED);
+            else if (mutator_type == 1) PM_STAT_INC(MESHWALK_FAIL_PREV_OCCLUDED);
+            else if (mutator_type == 2) PM_STAT_INC(PROJECT_FAIL_PREV_OCCLUDED);
+            continue;
+        }
+        if (table == CONNECTION_NEXT_OCCLUDED) {
+            if (mutator_type == 0) PM_STAT_INC(RETRACE_FAIL_NEXT_OCCLUDED);
+            else if (mutator_type == 1) PM_STAT_INC(MESHWALK_FAIL_NEXT_OCCLUDED);
+            else if (mutator_type == 2) PM_STAT_INC(PROJECT_FAIL_NEXT_OCCLUDED);
+            continue;
+        }
+
+        cands.push_back(c);
+    }
+
+    if (cands.empty()) return 0;
+
+    const int N = (int)path.vertices.size();
+    const bool hasPrev = index - 1 >= 0;
+    const bool hasNext = index + 1 < N - 1 || (index + 1 == N - 1 && m_lightConnection);
+
+    std::vector<glm::vec3> from, to;
+    from.reserve(2 * cands.size());
+    to.reserve(2 * cands.size());
+
+    for (const Candidate& c : cands) {
+        if (hasPrev) { from.push_back(path.vertices[index - 1]); to.push_back(c.p); }
+        if (hasNext) { from.push_back(c.p); to.push_back(path.vertices[index + 1]); }
+    }
+
+    std::vector<uint8_t> vis;
+    m_scene.visible_batch(from, to, vis);
+
+    const int perCand = (hasPrev ? 1 : 0) + (hasNext ? 1 : 0);
+
+    for (size_t k = 0; k < cands.size(); ++k) {
+        const bool prevOk = !hasPrev || vis[k * perCand];
+        const bool nextOk = !hasNext || vis[k * perCand + perCand - 1];
+
+        if (!prevOk) {
+            if (mutator_type == 0) PM_STAT_INC(RETRACE_FAIL_PREV_OCCLUDED);
+            else if (mutator_type == 1) PM_STAT_INC(MESHWALK_FAIL_PREV_OCCLUDED);
+            else if (mutator_type == 2) PM_STAT_INC(PROJECT_FAIL_PREV_OCCLUDED);
+            continue;
+        }
+        if (!nextOk) {
+            if (mutator_type == 0) PM_STAT_INC(RETRACE_FAIL_NEXT_OCCLUDED);
+            else if (mutator_type == 1) PM_STAT_INC(MESHWALK_FAIL_NEXT_OCCLUDED);
+            else if (mutator_type == 2) PM_STAT_INC(PROJECT_FAIL_NEXT_OCCLUDED);
+            continue;
+        }
+
+        if (mutator_type == 0) PM_STAT_INC(RETRACE_OK);
+        else if (mutator_type == 1) PM_STAT_INC(MESHWALK_OK);
+        else if (mutator_type == 2) PM_STAT_INC(PROJECT_OK);
+        out.push_back(cands[k]);
+    }
+
+    return (int)out.size();
+}
+
+double PathMutator::path_pdf(const Path& path) const {
+    const int N = (int)path.vertices.size();
+    if (N < 3) return 0.0;
+    if ((int)path.faces.size() != N) return 0.0;
+
+    if ((int)path.bary_points.size() != N) return 0.0;
+
+    double pdf = 1.0;
+    // Throughput before each bounce, for the survival probabilities the
+    // vertices have where they are now.
+    glm::vec3 beta(1.0f);
+
+    for (int k = 1; k + 1 <= N - 2; ++k) {
+        const glm::vec3 d = path.vertices[k + 1] - path.vertices[k];
+        const float dist2 = glm::dot(d, d);
+        if (dist2 <= 0.0f) return 0.0;
+
+        const glm::vec3 dir = d / std::sqrt(dist2);
+        const glm::vec3 nk = GeomUtil::interpolated_normal(path.faces[k], path.bary_points[k]);
+        const double pdfDir = m_sampler->pdf(path.vertices[k], nk, dir);
+        if (!(pdfDir > 0.0)) return 0.0;
+
+        const glm::vec3 n = GeomUtil::face_normal_geom(path.faces[k + 1]);
+        const double cosIn = std::fabs(glm::dot(n, dir));
+
+        pdf *= pdfDir * cosIn / (double)dist2;
+
+        const float q = continue_probability(k, beta);
+        pdf *= (double)q;
+        if (!(q > 0.0f)) return 0.0;
+
+        const float cosOut = std::max(0.0f, glm::dot(nk, dir));
+        beta *= m_rr.albedo * (cosOut / (3.14159265358979323846f * (float)pdfDir)) / q;
+    }
+
+    if (path.roulette_ended) pdf *= 1.0 - (double)continue_probability(N - 2, beta);
+
+    return pdf;
+}
+
+double PathMutator::transition_pdf_retrace(const Path& from, const Path& to, int index) const {
+    if (index <= 0 || index >= (int)from.vertices.size() - 1) return 0.0;
+    if (index >= (int)to.vertices.size() - 1) return 0.0;
+
+    const glm::vec3 n = GeomUtil::interpolated_normal(from.faces[index], from.bary_points[index]);
+
+    const glm::vec3 d = to.vertices[index] - from.vertices[index];
+    const float dist2 = glm::dot(d, d);
+    if (dist2 <= 0.0f) return 0.0;
+
+    const glm::vec3 dir = d / std::sqrt(dist2);
+    const double pdfDir = m_sampler->pdf(from.vertices[index], n, dir);
+    if (!(pdfDir > 0.0)) return 0.0;
+
+    const glm::vec3 nY = GeomUtil::face_normal_geom(to.faces[index]);
+    const double cosY = std::fabs(glm::dot(nY, dir));
+
+    return pdfDir * cosY / (double)dist2;
+}
+
+double PathMutator::transition_pdf_project(const Path& from, const Path& to, int index, float radius) const {
+    if (radius <= 0.0f) return 0.0;
+    if (index <= 0 || index >= (int)from.vertices.size() - 1) return 0.0;
+    if (index >= (int)to.vertices.size() - 1) return 0.0;
+
+    const glm::vec3 n = GeomUtil::face_normal_geom(from.faces[index]);
+    if (glm::dot(n, n) <= 0.0f) return 0.0;
+
+    const glm::vec3 p = from.vertices[index];
+    const float h = std::max(1e-3f, 0.5f * radius);
+    const glm::vec3 apex = p + h * n;
+
+    const glm::vec3 toY = to.vertices[index] - apex;
+    const float distY2 = glm::dot(toY, toY);
+    if (distY2 <= 0.0f) return 0.0;
+
+    const glm::vec3 dir = toY / std::sqrt(distY2);
+    const float cosQ = -glm::dot(dir, n);
+    if (cosQ <= 1e-6f) return 0.0;
+
+    // The proposal picked q uniformly on the tangent disk and shot apex -> q.
+    const float tq = h / cosQ;
+    const glm::vec3 q = apex + tq * dir;
+    if (glm::dot(q - p, q - p) > radius * radius) return 0.0;
+
+    const glm::vec3 nY = GeomUtil::face_normal_geom(to.faces[index]);
+    const double cosY = std::fabs(glm::dot(nY, dir));
+
+    const double pdf_disk = 1.0 / (3.14159265358979323846 * (double)radius * (double)radius);
+    return pdf_disk * ((double)tq * tq / cosQ) * (cosY / (double)distY2);
+}
+
+double PathMutator::transition_pdf_subpath(const Path& path, int i, int j) const {
+    const int N = (int)path.vertices.size();
+    if (i < 1 || j > N - 1 || j - i < 2) return 0.0;
+    if ((int)path.faces.size() != N || (int)path.bary_points.size() != N) return 0.0;
+
+    double pdf = 1.0;
+    for (int k = i; k < j - 1; ++k) {
+        const glm::vec3 d = path.vertices[k + 1] - path.vertices[k];
+        const float dist2 = glm::dot(d, d);
+        if (dist2 <= 0.0f) return 0.0;
+
+        const glm::vec3 dir = d / std::sqrt(dist2);
+        const glm::vec3 nk = GeomUtil::interpolated_normal(path.faces[k], path.bary_points[k]);
+        const double pdfDir = m_sampler->pdf(path.vertices[k], nk, dir);
+        if (!(pdfDir > 0.0)) return 0.0;
+
+        const glm::vec3 nY = GeomUtil::face_normal_geom(path.faces[k + 1]);
+        pdf *= pdfDir * std::fabs(glm::dot(nY, dir)) / (double)dist2;
+    }
+    return pdf;
+}
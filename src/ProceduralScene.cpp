@@ -0,0 +1,302 @@
+#include "ProceduralScene.h"
+#include "GeomUtil.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+
+void ProceduralScene::Mesh::add_grid(const glm::vec3& origin,
+    const glm::vec3& edgeU,
+    const glm::vec3& edgeV,
+    int nu,
+    int nv)
+{
+    nu = std::max(1, nu);
+    nv = std::max(1, nv);
+
+    const glm::vec3 n = GeomUtil::safe_normalize(glm::cross(edgeU, edgeV));
+    const uint32_t base = (uint32_t)positions.size();
+
+    for (int j = 0; j <= nv; ++j) {
+        for (int i = 0; i <= nu; ++i) {
+            float u = (float)i / (float)nu;
+            float v = (float)j / (float)nv;
+            positions.push_back(origin + u * edgeU + v * edgeV);
+            normals.push_back(n);
+        }
+    }
+
+    const uint32_t stride = (uint32_t)nu + 1;
+    for (int j = 0; j < nv; ++j) {
+        for (int i = 0; i < nu; ++i) {
+            uint32_t i00 = base + (uint32_t)j * stride + (uint32_t)i;
+            uint32_t i10 = i00 + 1;
+            uint32_t i01 = i00 + stride;
+            uint32_t i11 = i01 + 1;
+
+            indices.insert(indices.end(), { i00, i10, i11 });
+            indices.insert(indices.end(), { i00, i11, i01 });
+        }
+    }
+}
+
+void ProceduralScene::Mesh::add_box(const glm::vec3& bmin, const glm::vec3& bmax, int subdiv) {
+    const glm::vec3 d = bmax - bmin;
+    const glm::vec3 dx(d.x, 0.0f, 0.0f);
+    const glm::vec3 dy(0.0f, d.y, 0.0f);
+    const glm::vec3 dz(0.0f, 0.0f, d.z);
+
+    add_grid(bmin, dz, dy, subdiv, subdiv);
+    add_grid(bmin + dx, dy, dz, subdiv, subdiv);
+    add_grid(bmin, dx, dz, subdiv, subdiv);
+    add_grid(bmin + dy, dz, dx, subdiv, subdiv);
+    add_grid(bmin, dy, dx, subdiv, subdiv);
+    add_grid(bmin + dz, dx, dy, subdiv, subdiv);
+}
+
+void ProceduralScene::Mesh::add_sphere(const glm::vec3& center, float radius, int rings) {
+    rings = std::max(2, rings);
+    const int segs = 2 * rings;
+    const float PI = 3.14159265358979323846f;
+
+    const uint32_t top = (uint32_t)positions.size();
+    positions.push_back(center + glm::vec3(0.0f, radius, 0.0f));
+    normals.push_back(glm::vec3(0.0f, 1.0f, 0.0f));
+
+    for (int i = 1; i < rings; ++i) {
+        float theta = PI * (float)i / (float)rings;
+        for (int j = 0; j < segs; ++j) {
+            float phi = 2.0f * PI * (float)j / (float)segs;
+            glm::vec3 n(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+            positions.push_back(center + radius * n);
+            normals.push_back(n);
+        }
+    }
+
+    const uint32_t bottom = (uint32_t)positions.size();
+    positions.push_back(center - glm::vec3(0.0f, radius, 0.0f));
+    normals.push_back(glm::vec3(0.0f, -1.0f, 0.0f));
+
+    auto ring_vertex = [&](int i, int j) -> uint32_t {
+        return top + 1 + (uint32_t)(i - 1) * (uint32_t)segs + (uint32_t)(j % segs);
+    };
+
+    // Winding is fixed up per triangle so every face points away from center.
+    auto add_outward = [&](uint32_t a, uint32_t b, uint32_t c) {
+        glm::vec3 fn = glm::cross(positions[b] - positions[a], positions[c] - positions[a]);
+        glm::vec3 out = (positions[a] + positions[b] + positions[c]) / 3.0f - center;
+        if (glm::dot(fn, out) < 0.0f) std::swap(b, c);
+        indices.insert(indices.end(), { a, b, c });
+    };
+
+    for (int j = 0; j < segs; ++j) {
+        add_outward(top, ring_vertex(1, j), ring_vertex(1, j + 1));
+        add_outward(bottom, ring_vertex(rings - 1, j + 1), ring_vertex(rings - 1, j));
+    }
+
+    for (int i = 1; i + 1 < rings; ++i) {
+        for (int j = 0; j < segs; ++j) {
+            uint32_t a = ring_vertex(i, j);
+            uint32_t b = ring_vertex(i, j + 1);
+            uint32_t c = ring_vertex(i + 1, j);
+            uint32_t e = ring_vertex(i + 1, j + 1);
+            add_outward(a, b, e);
+            add_outward(a, e, c);
+        }
+    }
+}
+
+bool ProceduralScene::Mesh::export_obj(const std::string& path) const {
+    std::ofstream out(path, std::ios::out);
+    if (!out) {
+        std::cerr << "Mesh::export_obj: failed to open " << path << "\n";
+        return false;
+    }
+
+    const bool hasNormals = normals.size() == positions.size();
+
+    out << "# Generated by ProceduralScene\n";
+    for (const glm::vec3& p : positions) {
+        out << "v " << p.x << " " << p.y << " " << p.z << "\n";
+    }
+    if (hasNormals) {
+        for (const glm::vec3& n : normals) {
+            out << "vn " << n.x << " " << n.y << " " << n.z << "\n";
+        }
+    }
+
+    for (size_t f = 0; f + 2 < indices.size(); f += 3) {
+        const uint32_t a = indices[f] + 1, b = indices[f + 1] + 1, c = indices[f + 2] + 1;
+        if (hasNormals) {
+            out << "f " << a << "//" << a << " " << b << "//" << b << " " << c << "//" << c << "\n";
+        }
+        else {
+            out << "f " << a << " " << b << " " << c << "\n";
+        }
+    }
+
+    return (bool)out;
+}
+
+// Unit cube room, faces pointing inwards. The +z wall is left out unless
+// closed is set.
+static void add_room(ProceduralScene::Mesh& m, int subdiv, bool closed = false) {
+    const glm::vec3 X(1.0f, 0.0f, 0.0f);
+    const glm::vec3 Y(0.0f, 1.0f, 0.0f);
+    const glm::vec3 Z(0.0f, 0.0f, 1.0f);
+    const glm::vec3 O(0.0f);
+
+    m.add_grid(O, Z, X, subdiv, subdiv);
+    m.add_grid(Y, X, Z, subdiv, subdiv);
+    m.add_grid(O, X, Y, subdiv, subdiv);
+    m.add_grid(O, Y, Z, subdiv, subdiv);
+    m.add_grid(X, Z, Y, subdiv, subdiv);
+
+    if (closed) m.add_grid(Z, Y, X, subdiv, subdiv);
+}
+
+ProceduralScene::Mesh ProceduralScene::cornell_box(int subdiv) {
+    Mesh m;
+    add_room(m, subdiv);
+    m.add_box(glm::vec3(0.15f, 0.0f, 0.20f), glm::vec3(0.45f, 0.60f, 0.50f), subdiv);
+    m.add_box(glm::vec3(0.55f, 0.0f, 0.45f), glm::vec3(0.85f, 0.30f, 0.75f), subdiv);
+    return m;
+}
+
+ProceduralScene::Mesh ProceduralScene::sphere_room(int rings) {
+    Mesh m;
+    add_room(m, 4);
+    m.add_sphere(glm::vec3(0.5f, 0.3f, 0.5f), 0.25f, rings);
+    return m;
+}
+
+ProceduralScene::Mesh ProceduralScene::sphere_grid(int n, int rings) {
+    n = std::max(1, n);
+
+    Mesh m;
+    add_room(m, 4, true);
+
+    const float cell = 1.0f / (float)n;
+    const float r = 0.4f * cell;
+    for (int j = 0; j < n; ++j) {
+        for (int i = 0; i < n; ++i) {
+            m.add_sphere(glm::vec3(((float)i + 0.5f) * cell, r, ((float)j + 0.5f) * cell), r, rings);
+        }
+    }
+    return m;
+}
+
+ProceduralScene::Mesh ProceduralScene::maze(int cells, int subdiv, uint32_t seed) {
+    cells = std::max(1, cells);
+
+    // wallE[y * cells + x]: wall between (x, y) and (x + 1, y);
+    // wallS[y * cells + x]: wall between (x, y) and (x, y + 1).
+    const size_t nc = (size_t)cells * (size_t)cells;
+    std::vector<uint8_t> wallE(nc, 1), wallS(nc, 1), seen(nc, 0);
+
+    std::mt19937 rng(seed);
+    std::vector<int> stack{ 0 };
+    seen[0] = 1;
+
+    while (!stack.empty()) {
+        const int c = stack.back();
+        const int x = c % cells, y = c / cells;
+
+        int next[4];
+        int k = 0;
+        if (x > 0 && !seen[c - 1]) next[k++] = c - 1;
+        if (x + 1 < cells && !seen[c + 1]) next[k++] = c + 1;
+        if (y > 0 && !seen[c - cells]) next[k++] = c - cells;
+        if (y + 1 < cells && !seen[c + cells]) next[k++] = c + cells;
+
+        if (k == 0) {
+            stack.pop_back();
+            continue;
+        }
+
+        const int d = next[rng() % (uint32_t)k];
+        if (d == c + 1) wallE[c] = 0;
+        else if (d == c - 1) wallE[d] = 0;
+        else if (d == c + cells) wallS[c] = 0;
+        else wallS[d] = 0;
+
+        seen[d] = 1;
+        stack.push_back(d);
+    }
+
+    Mesh m;
+    add_room(m, std::max(1, subdiv), true);
+
+    const float cell = 1.0f / (float)cells;
+    const float half = 0.05f * cell;
+    const float height = 0.6f;
+
+    for (int y = 0; y < cells; ++y) {
+        for (int x = 0; x < cells; ++x) {
+            const size_t c = (size_t)y * (size_t)cells + (size_t)x;
+            const float x1 = (float)(x + 1) * cell;
+            const float z1 = (float)(y + 1) * cell;
+
+            if (x + 1 < cells && wallE[c]) {
+                m.add_box(glm::vec3(x1 - half, 0.0f, z1 - cell - half),
+                    glm::vec3(x1 + half, height, z1 + half), subdiv);
+            }
+            if (y + 1 < cells && wallS[c]) {
+                m.add_box(glm::vec3(x1 - cell - half, 0.0f, z1 - half),
+                    glm::vec3(x1 + half, height, z1 + half), subdiv);
+            }
+        }
+    }
+    return m;
+}
+
+ProceduralScene::Mesh ProceduralScene::closed_room(uint64_t targetTriangles) {
+    const int subdiv = std::max(1, (int)std::lround(std::sqrt((double)targetTriangles / 12.0)));
+
+    Mesh m;
+    add_room(m, subdiv, true);
+    return m;
+}
+
+bool ProceduralScene::from_spec(const std::string& spec, Mesh& out) {
+    PM_TRACE_SCOPE("ProceduralScene::generate", "scene");
+
+    std::vector<std::string> parts;
+    std::stringstream ss(spec);
+    std::string part;
+    while (std::getline(ss, part, ':')) parts.push_back(part);
+    if (parts.empty()) return false;
+
+    std::vector<long long> args;
+    for (size_t i = 1; i < parts.size(); ++i) {
+        try {
+            args.push_back(std::stoll(parts[i]));
+        }
+        catch (...) {
+            std::cerr << "ProceduralScene: bad argument '" << parts[i] << "' in " << spec << "\n";
+            return false;
+        }
+    }
+
+    auto arg = [&](size_t i, long long fallback) { return i < args.size() ? args[i] : fallback; };
+
+    const std::string& kind = parts[0];
+    if (kind == "cornell") out = cornell_box((int)arg(0, 4));
+    else if (kind == "sphere") out = sphere_room((int)arg(0, 32));
+    else if (kind == "spheres") out = sphere_grid((int)arg(0, 4), (int)arg(1, 16));
+    else if (kind == "maze") out = maze((int)arg(0, 8), (int)arg(1, 1));
+    else if (kind == "room") out = closed_room((uint64_t)arg(0, 1000000));
+    else {
+        std::cerr << "ProceduralScene: unknown scene kind '" << kind << "'\n";
+        return false;
+    }
+    return true;
+}
+
+bool ProceduralScene::build(Scene& scene, const Mesh& mesh) {
+    return scene.build(mesh.positions, mesh.normals, mesh.indices);
+}
@@ -0,0 +1,116 @@
+#include "RadianceCache.h"
+#include "Stats.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+uint64_t mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+}
+
+RadianceCache::RadianceCache(float cellSize, int log2Entries, int minSamples)
+    : m_entries(std::make_unique<Entry[]>((size_t)1 << std::clamp(log2Entries, 4, 30)))
+    , m_mask(((size_t)1 << std::clamp(log2Entries, 4, 30)) - 1)
+    , m_invCell(cellSize > 0.0f ? 1.0f / cellSize : 1.0f)
+    , m_minSamples((uint32_t)std::max(1, minSamples))
+{
+    clear();
+}
+
+// Cell coordinates in 21 bits each, plus the normal rounded to a 5x5x5 grid
+// so that the two sides of a thin wall or the faces meeting at a corner do
+// not share a cell. 0 marks an empty slot.
+uint64_t RadianceCache::key_of(const glm::vec3& p, const glm::vec3& n) const {
+    const uint64_t ix = (uint64_t)(int64_t)std::floor(p.x * m_invCell) & 0x1fffff;
+    const uint64_t iy = (uint64_t)(int64_t)std::floor(p.y * m_invCell) & 0x1fffff;
+    const uint64_t iz = (uint64_t)(int64_t)std::floor(p.z * m_invCell) & 0x1fffff;
+
+    const int bx = (int)std::lround(std::clamp(n.x, -1.0f, 1.0f) * 2.0f) + 2;
+    const int by = (int)std::lround(std::clamp(n.y, -1.0f, 1.0f) * 2.0f) + 2;
+    const int bz = (int)std::lround(std::clamp(n.z, -1.0f, 1.0f) * 2.0f) + 2;
+    const uint64_t nb = (uint64_t)(bx * 25 + by * 5 + bz);
+
+    const uint64_t k = mix64((ix | (iy << 21) | (iz << 42)) ^ mix64(nb + 1));
+    return k ? k : 1;
+}
+
+void RadianceCache::add(const glm::vec3& p, const glm::vec3& n, const glm::vec3& L) {
+    if (!std::isfinite(L.x) || !std::isfinite(L.y) || !std::isfinite(L.z)) return;
+
+    const uint64_t key = key_of(p, n);
+
+    for (int probe = 0; probe < kMaxProbes; ++probe) {
+        Entry& e = m_entries[(key + (uint64_t)probe) & m_mask];
+
+        uint64_t cur = e.key.load(std::memory_order_acquire);
+        if (cur == 0) {
+            if (e.key.compare_exchange_strong(cur, key, std::memory_order_acq_rel)) {
+                cur = key;
+            }
+        }
+        if (cur != key) continue;
+
+        e.sum[0].fetch_add(L.x, std::memory_order_relaxed);
+        e.sum[1].fetch_add(L.y, std::memory_order_relaxed);
+        e.sum[2].fetch_add(L.z, std::memory_order_relaxed);
+        e.count.fetch_add(1, std::memory_order_release);
+        PM_STAT_INC(RADIANCE_CACHE_INSERTS);
+        return;
+    }
+
+    PM_STAT_INC(RADIANCE_CACHE_DROPPED);
+}
+
+// Under concurrent adds the sums may run a sample or two ahead of the count
+// read here; the error is far below the cell's own variance.
+bool RadianceCache::lookup(const glm::vec3& p, const glm::vec3& n, glm::vec3& L) const {
+    PM_STAT_INC(RADIANCE_CACHE_LOOKUPS);
+
+    const uint64_t key = key_of(p, n);
+
+    for (int probe = 0; probe < kMaxProbes; ++probe) {
+        const Entry& e = m_entries[(key + (uint64_t)probe) & m_mask];
+
+        const uint64_t cur = e.key.load(std::memory_order_acquire);
+        if (cur == 0) return false;
+        if (cur != key) continue;
+
+        const uint32_t count = e.count.load(std::memory_order_acquire);
+        if (count < m_minSamples) return false;
+
+        const float inv = 1.0f / (float)count;
+        L = glm::vec3(e.sum[0].load(std::memory_order_relaxed),
+            e.sum[1].load(std::memory_order_relaxed),
+            e.sum[2].load(std::memory_order_relaxed)) * inv;
+        PM_STAT_INC(RADIANCE_CACHE_HITS);
+        return true;
+    }
+
+    return false;
+}
+
+void RadianceCache::clear() {
+    for (size_t i = 0; i <= m_mask; ++i) {
+        Entry& e = m_entries[i];
+        e.key.store(0, std::memory_order_relaxed);
+        e.count.store(0, std::memory_order_relaxed);
+        for (auto& s : e.sum) s.store(0.0f, std::memory_order_relaxed);
+    }
+}
+
+size_t RadianceCache::occupied() const {
+    size_t n = 0;
+    for (size_t i = 0; i <= m_mask; ++i) {
+        if (m_entries[i].key.load(std::memory_order_relaxed) != 0) ++n;
+    }
+    return n;
+}
@@ -0,0 +1,78 @@
+#include "RelightStore.h"
+
+#include <bit>
+
+// Exact position and path index: the same vertex reached by two chain
+// states has bit-identical coordinates and keeps its light sample (see
+// PathMutator::Path::light_u), and only then are the two merged.
+static uint64_t vertex_key(const glm::vec3& p, int index) {
+    uint64_t h = ((uint64_t)std::bit_cast<uint32_t>(p.x) << 32) ^ std::bit_cast<uint32_t>(p.y);
+    h ^= ((uint64_t)std::bit_cast<uint32_t>(p.z) << 16) ^ ((uint64_t)(uint32_t)index << 48);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+void RelightStore::Pixel::add(const glm::vec3& p, int index, const glm::vec3& n, const glm::vec3& lightU, const glm::vec3& weight) {
+    const uint64_t key = vertex_key(p, index);
+
+    auto it = m_lookup.find(key);
+    if (it != m_lookup.end()) {
+        Vertex& v = m_vertices[it->second];
+        if (v.p == p && v.index == index && v.n == n && v.lightU == lightU) {
+            v.weight += weight;
+            return;
+        }
+    }
+
+    Vertex v;
+    v.p = p;
+    v.index = index;
+    v.n = n;
+    v.lightU = lightU;
+    v.weight = weight;
+    m_lookup[key] = (uint32_t)m_vertices.size();
+    m_vertices.push_back(v);
+}
+
+void RelightStore::Pixel::scale(float s) {
+    for (Vertex& v : m_vertices) v.weight *= s;
+}
+
+void RelightStore::Pixel::clear() {
+    m_vertices.clear();
+    m_lookup.clear();
+}
+
+void RelightStore::reset(int width, int height) {
+    m_width = width;
+    m_height = height;
+    m_passes = 0;
+    m_pixels.clear();
+    m_pixels.resize((size_t)width * (size_t)height);
+}
+
+void RelightStore::store(int px, int py, Pixel& pixel) {
+    std::vector<Vertex>& dst = m_pixels[(size_t)py * (size_t)m_width + (size_t)px];
+    if (dst.empty()) {
+        dst = std::move(pixel.m_vertices);
+        dst.shrink_to_fit();
+    }
+    else {
+        dst.insert(dst.end(), pixel.m_vertices.begin(), pixel.m_vertices.end());
+    }
+    pixel.clear();
+}
+
+size_t RelightStore::vertex_count() const {
+    size_t n = 0;
+    for (const std::vector<Vertex>& p : m_pixels) n += p.size();
+    return n;
+}
+
+size_t RelightStore::memory_bytes() const {
+    size_t bytes = m_pixels.size() * sizeof(std::vector<Vertex>);
+    for (const std::vector<Vertex>& p : m_pixels) bytes += p.capacity() * sizeof(Vertex);
+    return bytes;
+}
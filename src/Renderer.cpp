@@ -1,12 +1,28 @@
 #include "Renderer.h"
+#include "ImageUtil.h"
+#include "TileWriter.h"
+#include "ChainRecorder.h"
+#include "Stats.h"
+#include "Trace.h"
 
 #include <algorithm>
 #include <fstream>
 #include <cmath>
 #include <iostream>
+#include <chrono>
+#include <memory>
+#include <atomic>
+#include <thread>
 
 static constexpr float PI = 3.14159265358979323846f;
 
+Renderer::Renderer(const Scene& scene,
+    const Camera& cam,
+    const glm::vec3& lightPos)
+    : Renderer(scene, cam, lightPos, RenderParams{})
+{
+}
+
 Renderer::Renderer(const Scene& scene,
     const Camera& cam,
     const glm::vec3& lightPos,
@@ -21,17 +37,76 @@ Renderer::Renderer(const Scene& scene,
     m_sceneDiag = std::sqrt(glm::dot(diag, diag));
     if (!(m_sceneDiag > 0.0f)) m_sceneDiag = 1.0f;
 
+    set_camera(cam);
+
+    PathMutator::Roulette rr;
+    rr.enabled = m_params.russianRoulette;
+    rr.minBounces = m_params.rrMinBounces;
+    rr.albedo = m_params.albedo;
+    m_mutator.set_roulette(rr);
+
+    m_lights.add_point(m_lightPos, m_params.lightIntensity);
+    m_lights.build();
+
+    if (m_params.guiding.enabled) {
+        m_guide = std::make_unique<PathGuide>(m_scene.bounds_min(), m_scene.bounds_max(), m_params.guiding);
+    }
+    set_bsdf_sampler(BSDFSampler::get(m_params.sampling));
+
+    if (m_params.radianceCache.enabled) {
+        const RadianceCache::Params& rc = m_params.radianceCache;
+        m_cache = std::make_unique<RadianceCache>(rc.cellSize * m_sceneDiag, rc.log2Entries, rc.minSamples);
+        m_mutator.set_radiance_cache(m_cache.get(), rc.depth);
+    }
+
+    if (m_params.visibilityTable.enabled) {
+        ClusterVisibility::Params vp = m_params.visibilityTable;
+        if (vp.threads <= 0) vp.threads = m_params.threads;
+
+        m_visTable = std::make_unique<ClusterVisibility>();
+        if (m_visTable->build(m_scene, vp)) {
+            m_mutator.set_visibility_table(m_visTable.get());
+        }
+        else {
+            m_visTable.reset();
+        }
+    }
+}
+
+void Renderer::set_camera(const Camera& cam) {
+    m_cam = cam;
     m_cam.forward = GeomUtil::safe_normalize(m_cam.forward);
     if (glm::dot(m_cam.forward, m_cam.forward) <= 0.0f) {
         m_cam.forward = glm::vec3(0, 0, 1);
     }
+    m_mutator.set_camera_center(m_cam.center);
+}
+
+void Renderer::set_lights(LightSet lights) {
+    m_lights = std::move(lights);
+    if (m_lights.node_count() == 0) m_lights.build();
+    m_mutator.set_light_connection(false);
+}
+
+void Renderer::set_bsdf_sampler(const BSDFSampler& sampler) {
+    if (m_guide) {
+        m_guidedSampler = std::make_unique<GuidedSampler>(*m_guide, sampler);
+        m_mutator.set_sampler(*m_guidedSampler);
+    }
+    else {
+        m_mutator.set_sampler(sampler);
+    }
 }
 
 float Renderer::clamp01(float x) {
     return std::max(0.0f, std::min(1.0f, x));
 }
 
-glm::vec3 Renderer::generate_primary_dir(int px, int py) const {
+float Renderer::luminance(const glm::vec3& c) {
+    return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
+glm::vec3 Renderer::generate_primary_dir(int px, int py, const glm::vec2& offset) const {
     glm::vec3 f = GeomUtil::safe_normalize(m_cam.forward);
 
     glm::vec3 up = m_cam.world_up;
@@ -51,8 +126,8 @@ glm::vec3 Renderer::generate_primary_dir(int px, int py) const {
     float cx = (float)m_cam.width * 0.5f;
     float cy = (float)m_cam.height * 0.5f;
 
-    float x = ((float)px + 0.5f - cx) * m_cam.pixel_size;
-    float y = (cy - ((float)py + 0.5f)) * m_cam.pixel_size;
+    float x = ((float)px + offset.x - cx) * m_cam.pixel_size;
+    float y = (cy - ((float)py + offset.y)) * m_cam.pixel_size;
 
     glm::vec3 dir = f * m_cam.focal_length + r * x + u * y;
     dir = GeomUtil::safe_normalize(dir);
@@ -61,6 +136,24 @@ glm::vec3 Renderer::generate_primary_dir(int px, int py) const {
     return dir;
 }
 
+// Each pass gives a pixel Kmutations + 1 consecutive samples: the seed path
+// (including the jitter) and one per mutation step.
+glm::vec3 Renderer::begin_pixel(int px, int py, int pass, Sampler& sampler) const {
+    const uint32_t perPass = (uint32_t)std::max(0, m_params.Kmutations) + 1u;
+    sampler.start_sample((uint32_t)pass * perPass);
+
+    if (!m_params.pixelJitter) return generate_primary_dir(px, py);
+    return generate_primary_dir(px, py, sampler.get_2d());
+}
+
+bool Renderer::sample_path(PathMutator::Path& path, const glm::vec3& rd0, Sampler& sampler) const {
+    return m_mutator.sample_path(path, m_params.maxBounces, rd0, m_params.retriesPerBounce, sampler);
+}
+
+float Renderer::continue_probability(int vertex, const glm::vec3& beta) const {
+    return m_mutator.continue_probability(vertex, beta);
+}
+
 glm::vec3 Renderer::shading_normal_at(const PathMutator::Path& path, int i) const {
     if (i < 0 || i >= (int)path.vertices.size()) return glm::vec3(0.0f);
     if (i >= (int)path.faces.size()) return glm::vec3(0.0f);
@@ -81,19 +174,74 @@ glm::vec3 Renderer::shading_normal_at(const PathMutator::Path& path, int i) cons
     return n / std::sqrt(n2);
 }
 
-glm::vec3 Renderer::compute_radiance_for_path(const PathMutator::Path& path) const {
+bool Renderer::sample_light(const PathMutator::Path& path, int i, const glm::vec3& ni, LightSet::Sample& ls) const {
+    if (i < 1 || i > (int)path.light_u.size()) return false;
+    return m_lights.sample(path.vertices[i], ni, path.light_u[i - 1], ls);
+}
+
+bool Renderer::direct_light(const PathMutator::Path& path, int i, const glm::vec3& ni, glm::vec3& out) const {
+    const glm::vec3& xi = path.vertices[i];
+    const bool hasLightVis = ((int)path.light_visible.size() == std::max(0, (int)path.vertices.size() - 2));
+
+    LightSet::Sample ls;
+    glm::vec3 toL = sample_light(path, i, ni, ls) ? ls.p - xi : glm::vec3(0.0f);
+    float dist2 = glm::dot(toL, toL);
+    if (!(dist2 > 1e-12f)) return false;
+
+    float dist = std::sqrt(dist2);
+    glm::vec3 wi = toL / dist;
+
+    float cosTheta = std::max(0.0f, glm::dot(ni, wi));
+    if (!(cosTheta > 0.0f)) return false;
+
+    bool vis = false;
+    uint8_t state = hasLightVis ? path.light_visible[i - 1] : (uint8_t)PathMutator::LIGHT_UNKNOWN;
+
+    if (state != PathMutator::LIGHT_UNKNOWN) {
+        vis = (state == PathMutator::LIGHT_VISIBLE);
+    }
+    else {
+        glm::vec3 xo = xi + m_params.visibilityEps * ni;
+        vis = m_scene.visible(xo, ls.p, m_params.visibilityEps);
+    }
+    if (!vis) return false;
+
+    out = m_params.albedo / PI * (ls.Li * cosTheta);
+    return true;
+}
+
+glm::vec3 Renderer::compute_radiance_for_path(const PathMutator::Path& path, bool train, int first) const {
+    PM_STAT_TIMER(T_RADIANCE);
+    PM_STAT_INC(RADIANCE_EVALS);
+
     const int N = (int)path.vertices.size();
     if (N < 3) return glm::vec3(0.0f);
 
-    const int nInternal = std::max(0, N - 2);
-    const bool hasCachedLightVis = ((int)path.light_visible.size() == nInternal);
-
     const glm::vec3 albedo = m_params.albedo;
     const glm::vec3 f_lam = albedo / PI;
-    const float pdf_hemi_uniform = 1.0f / (2.0f * PI);
+    const BSDFSampler& bsdf = m_mutator.sampler();
 
     glm::vec3 L(0.0f);
+    // beta scales the terms from vertex first on; pathBeta is the throughput
+    // from the camera, which the roulette survival probabilities follow.
     glm::vec3 beta(1.0f);
+    glm::vec3 pathBeta(1.0f);
+
+    // Throughput, contribution and outgoing bounce per evaluated vertex, for
+    // training the radiance cache and the path guide.
+    struct Term {
+        glm::vec3 beta;
+        glm::vec3 contribution;
+        glm::vec3 n;
+        int index;
+        glm::vec3 wo{ 0.0f };
+        float pdf = 0.0f;
+    };
+    const bool record = train && first == 1 && (m_cache || m_guide);
+    std::vector<Term> terms;
+    if (record) terms.reserve(N);
+
+    bool tailFromCache = false;
 
     for (int i = 1; i <= N - 2; ++i) {
         const glm::vec3& xi = path.vertices[i];
@@ -105,34 +253,24 @@ glm::vec3 Renderer::compute_radiance_for_path(const PathMutator::Path& path) con
         }
         ni /= std::sqrt(ni2);
 
-        {
-            glm::vec3 toL = m_lightPos - xi;
-            float dist2 = glm::dot(toL, toL);
-            if (dist2 > 1e-12f) {
-                float dist = std::sqrt(dist2);
-                glm::vec3 wi = toL / dist;
+        const glm::vec3 Lbefore = L;
+        const bool evaluated = i >= first;
 
-                float cosTheta = std::max(0.0f, glm::dot(ni, wi));
-                if (cosTheta > 0.0f) {
-                    bool vis = false;
-
-                    if (hasCachedLightVis) {
-                        vis = path.light_visible[i - 1];
-                    }
-                    else {
-                        
-                        glm::vec3 xo = xi + m_params.visibilityEps * ni;
-                        vis = m_scene.visible(xo, m_lightPos, m_params.visibilityEps);
-                    }
-
-                    if (vis) {
-                        glm::vec3 Li = m_params.lightIntensity / dist2;
-                        L += beta * (f_lam * (Li * cosTheta));
-                    }
-                }
+        if (evaluated) {
+            glm::vec3 cachedL;
+            if (i == N - 2 && path.cached_tail && m_cache && m_cache->lookup(xi, ni, cachedL)) {
+                // The cached value already includes this vertex's direct light.
+                L += beta * cachedL;
+                tailFromCache = true;
+            }
+            else {
+                glm::vec3 direct;
+                if (direct_light(path, i, ni, direct)) L += beta * direct;
             }
         }
 
+        if (record) terms.push_back({ beta, L - Lbefore, ni, i });
+
         if (i < N - 2) {
             const glm::vec3& xnext = path.vertices[i + 1];
             glm::vec3 wo = GeomUtil::safe_normalize(xnext - xi);
@@ -141,132 +279,1433 @@ glm::vec3 Renderer::compute_radiance_for_path(const PathMutator::Path& path) con
             float cosOut = std::max(0.0f, glm::dot(ni, wo));
             if (cosOut <= 0.0f) break;
 
-            beta *= (f_lam * (cosOut / pdf_hemi_uniform));
+            // Divide by the density the bounce was actually sampled with.
+            const float pdfOut = bsdf.pdf(xi, ni, wo);
+            if (!(pdfOut > 0.0f)) break;
+
+            if (record) {
+                terms.back().wo = wo;
+                terms.back().pdf = pdfOut;
+            }
+
+            const float q = m_mutator.continue_probability(i, pathBeta);
+            if (!(q > 0.0f)) break;
+
+            const glm::vec3 bounce = f_lam * (cosOut / pdfOut) / q;
+            pathBeta *= bounce;
+            if (evaluated) beta *= bounce;
+        }
+    }
+
+    // Radiance leaving vertex i is the suffix sum of the contributions from i
+    // on, divided by the throughput up to i; the radiance arriving at i along
+    // its bounce is what leaves vertex i + 1.
+    //
+    // A path cut off by maxBounces only carries a truncated tail; it is still
+    // cached at the cache depth (which is what a render with that maxBounces
+    // would have computed there) but not deeper, where the truncation would
+    // bias the cell low. The tail read from the cache adds nothing new and is
+    // not written back.
+    if (!terms.empty()) {
+        const bool truncated = !path.cached_tail && path.bounces >= m_params.maxBounces;
+        const int depth = m_params.radianceCache.depth;
+
+        glm::vec3 suffix(0.0f);
+        glm::vec3 outgoing(0.0f);   // leaving the vertex after the current one
+        for (int t = (int)terms.size() - 1; t >= 0; --t) {
+            const Term& term = terms[t];
+            const int i = term.index;
+
+            if (m_guide && term.pdf > 0.0f && t + 1 < (int)terms.size()) {
+                m_guide->record(path.vertices[i], term.wo, luminance(outgoing), term.pdf);
+            }
+
+            suffix += term.contribution;
+
+            const bool positive = term.beta.x > 0.0f && term.beta.y > 0.0f && term.beta.z > 0.0f;
+            outgoing = positive ? suffix / term.beta : glm::vec3(0.0f);
+
+            if (!m_cache || !positive) continue;
+            if (i < depth || (truncated && i > depth)) continue;
+            if (tailFromCache && i == N - 2) continue;
+
+            m_cache->add(path.vertices[i], term.n, outgoing);
         }
     }
 
     return L;
 }
 
-std::vector<glm::vec3> Renderer::render_scene(uint32_t seed, const int mutator_type) const {
-    const int W = m_cam.width;
-    const int H = m_cam.height;
+// Same walk as compute_radiance_for_path without the light: every vertex it
+// takes a next-event term at, with the throughput that term is scaled by.
+void Renderer::record_relight(const PathMutator::Path& path, float weight, RelightStore::Pixel& out) const {
+    const int N = (int)path.vertices.size();
+    if (N < 3) return;
+    if ((int)path.light_u.size() != N - 2) return;
 
-    std::vector<glm::vec3> img((size_t)W * (size_t)H, glm::vec3(0.0f));
+    const glm::vec3 f_lam = m_params.albedo / PI;
+    const BSDFSampler& bsdf = m_mutator.sampler();
 
-    std::mt19937 rng(seed);
-    std::uniform_real_distribution<float> u01(0.0f, 1.0f);
+    glm::vec3 beta(1.0f);
+
+    for (int i = 1; i <= N - 2; ++i) {
+        const glm::vec3& xi = path.vertices[i];
+
+        glm::vec3 ni = shading_normal_at(path, i);
+        float ni2 = glm::dot(ni, ni);
+        if (ni2 <= 0.0f) return;
+        ni /= std::sqrt(ni2);
+
+        out.add(xi, i, ni, path.light_u[i - 1], weight * beta);
+
+        if (i < N - 2) {
+            glm::vec3 wo = GeomUtil::safe_normalize(path.vertices[i + 1] - xi);
+            if (glm::dot(wo, wo) <= 0.0f) break;
+
+            float cosOut = std::max(0.0f, glm::dot(ni, wo));
+            if (cosOut <= 0.0f) break;
+
+            const float pdfOut = bsdf.pdf(xi, ni, wo);
+            if (!(pdfOut > 0.0f)) break;
+
+            const float q = m_mutator.continue_probability(i, beta);
+            if (!(q > 0.0f)) break;
+
+            beta *= (f_lam * (cosOut / pdfOut)) / q;
+        }
+    }
+}
+
+bool Renderer::propose_mutation(PathMutator::Path& proposal,
+    int index,
+    int mutator_type,
+    float radius,
+    const glm::vec3& primaryDir,
+    Sampler& sampler) const
+{
+    if (mutator_type == 0) {
+        return m_mutator.mutate_vertex_retrace(proposal, index, sampler);
+    }
+    if (mutator_type == 1) {
+        return m_mutator.mutate_vertex_meshwalk(proposal, index, radius, sampler);
+    }
+    if (mutator_type == 2) {
+        return m_mutator.mutate_vertex_project(proposal, index, radius, sampler);
+    }
+    if (mutator_type == 5) {
+        return m_mutator.mutate_subpath(proposal, index - 1, subpath_end(proposal, index), sampler);
+    }
+    if (mutator_type == 3) {
+        PathMutator::Path fresh;
+        bool ok = m_mutator.sample_path(
+            fresh,
+            m_params.maxBounces,
+            primaryDir,
+            m_params.retriesPerBounce,
+            sampler
+        );
+        if (ok) proposal = std::move(fresh);
+        return ok;
+    }
+    return false;
+}
+
+// Subpath mutations regenerate subpathLength vertices from index on, or up
+// to the light, keeping the vertex before index as the start.
+int Renderer::subpath_end(const PathMutator::Path& path, int index) const {
+    return std::min((int)path.vertices.size() - 1, index + std::max(1, m_params.subpathLength));
+}
+
+int Renderer::propose_multi_try(const PathMutator::Path& from,
+    int index,
+    int mutator_type,
+    float radius,
+    const glm::vec3& primaryDir,
+    int tries,
+    Sampler& sampler,
+    std::vector<PathMutator::Path>& out) const
+{
+    out.clear();
+
+    if (mutator_type == 3) {
+        for (int t = 0; t < tries; ++t) {
+            PathMutator::Path fresh;
+            if (m_mutator.sample_path(fresh, m_params.maxBounces, primaryDir, m_params.retriesPerBounce, sampler)) {
+                out.push_back(std::move(fresh));
+            }
+        }
+        return (int)out.size();
+    }
+
+    if (mutator_type == 5) {
+        const int j = subpath_end(from, index);
+        for (int t = 0; t < tries; ++t) {
+            out.push_back(from);
+            if (!m_mutator.mutate_subpath(out.back(), index - 1, j, sampler)) out.pop_back();
+        }
+        return (int)out.size();
+    }
+
+    std::vector<PathMutator::Candidate> cands;
+    m_mutator.propose_vertex_batch(from, index, mutator_type, radius, tries, sampler, cands);
+
+    out.reserve(cands.size());
+    for (const PathMutator::Candidate& c : cands) {
+        out.push_back(from);
+        m_mutator.apply_candidate(out.back(), index, c);
+    }
+
+    return (int)out.size();
+}
+
+// Multiple-try Metropolis weight w(y|x) = f(y) / T(x->y), i.e. the choice
+// lambda(x, y) = 1 / (T(x->y) T(y->x)) of Liu, Liang and Wong.
+double Renderer::multi_try_weight(const PathMutator::Path& from,
+    const PathMutator::Path& to,
+    float toLum,
+    int index,
+    int mutator_type,
+    float radius) const
+{
+    if (toLum <= 0.0f) return 0.0;
+    if (mutator_type == 3) return (double)toLum;
+
+    double t = 1.0;
+    if (mutator_type == 0) t = m_mutator.transition_pdf_retrace(from, to, index);
+    else if (mutator_type == 2) t = m_mutator.transition_pdf_project(from, to, index, radius);
+    else if (mutator_type == 5) t = m_mutator.transition_pdf_subpath(to, index - 1, subpath_end(to, index));
+
+    if (!(t > 0.0)) return 0.0;
+    return (double)toLum * m_mutator.path_pdf(to) / t;
+}
+
+// Without a Metropolis target the valid candidates are picked in proportion
+// to their luminance, falling back to a uniform pick when all are black.
+bool Renderer::multi_try_average_step(PathMutator::Path& proposal,
+    glm::vec3& propL,
+    int index,
+    int mutator_type,
+    float radius,
+    const glm::vec3& primaryDir,
+    Sampler& sampler,
+    std::uniform_real_distribution<float>& u01) const
+{
+    std::vector<PathMutator::Path> cands;
+    if (propose_multi_try(proposal, index, mutator_type, radius, primaryDir,
+        m_params.multiTry, sampler, cands) == 0) {
+        return false;
+    }
+
+    resolve_light_visibility(cands);
+
+    std::vector<glm::vec3> Ls(cands.size());
+    double sum = 0.0;
+    for (size_t j = 0; j < cands.size(); ++j) {
+        Ls[j] = compute_radiance_for_path(cands[j]);
+        sum += luminance(Ls[j]);
+    }
+
+    size_t pick = std::min(cands.size() - 1, (size_t)(u01(sampler.rng()) * (float)cands.size()));
+    if (sum > 0.0) {
+        double target = (double)u01(sampler.rng()) * sum;
+        for (size_t j = 0; j < cands.size(); ++j) {
+            pick = j;
+            target -= luminance(Ls[j]);
+            if (target < 0.0) break;
+        }
+    }
+
+    proposal = std::move(cands[pick]);
+    propL = Ls[pick];
+    return true;
+}
+
+// Multiple-try Metropolis: pick y among the forward candidates by weight, draw
+// a reference set from y that includes the current state, and accept with
+// min(1, sum w(y_j|x) / sum w(x_j|y)).
+bool Renderer::multi_try_metropolis_step(const PathMutator::Path& cur,
+    float curLum,
+    PathMutator::Path& proposal,
+    glm::vec3& propL,
+    float& propLum,
+    double& acceptance,
+    int index,
+    int mutator_type,
+    float radius,
+    const glm::vec3& primaryDir,
+    Sampler& sampler,
+    std::uniform_real_distribution<float>& u01,
+    double selectRatio) const
+{
+    acceptance = 0.0;
+
+    const int tries = m_params.multiTry;
+
+    std::vector<PathMutator::Path> fwd;
+    if (propose_multi_try(cur, index, mutator_type, radius, primaryDir, tries, sampler, fwd) == 0) {
+        return false;
+    }
+
+    resolve_light_visibility(fwd);
+
+    std::vector<glm::vec3> Ls(fwd.size());
+    std::vector<double> w(fwd.size());
+    double sumFwd = 0.0;
+
+    for (size_t j = 0; j < fwd.size(); ++j) {
+        Ls[j] = compute_radiance_for_path(fwd[j]);
+        w[j] = multi_try_weight(cur, fwd[j], luminance(Ls[j]), index, mutator_type, radius);
+        sumFwd += w[j];
+    }
+
+    if (!(sumFwd > 0.0)) return false;
+
+    size_t pick = 0;
+    double target = (double)u01(sampler.rng()) * sumFwd;
+    for (size_t j = 0; j < fwd.size(); ++j) {
+        pick = j;
+        target -= w[j];
+        if (target < 0.0) break;
+    }
+    while (w[pick] <= 0.0 && pick > 0) --pick;
+
+    proposal = std::move(fwd[pick]);
+    propL = Ls[pick];
+    propLum = luminance(propL);
+
+    std::vector<PathMutator::Path> rev;
+    propose_multi_try(proposal, index, mutator_type, radius, primaryDir, tries - 1, sampler, rev);
+    resolve_light_visibility(rev);
+
+    double sumRev = multi_try_weight(proposal, cur, curLum, index, mutator_type, radius);
+    for (const PathMutator::Path& x : rev) {
+        float lum = luminance(compute_radiance_for_path(x));
+        sumRev += multi_try_weight(proposal, x, lum, index, mutator_type, radius);
+    }
+
+    acceptance = (sumRev > 0.0) ? std::min(1.0, selectRatio * sumFwd / sumRev) : 1.0;
+    return true;
+}
+
+// Acceptance probability for moving the chain from cur to proposal, with the
+// target f(x) = luminance(L(x)) * p(x), i.e. the scalar path contribution in
+// area measure. Meshwalk is symmetric, since it rejects the walks it cannot
+// reverse (see propose_vertex_meshwalk); resampling is an independence proposal with T(x->y) = p(y). A
+// subpath move's density depends only on the regenerated vertices, so each
+// direction is evaluated on its own target path. selectRatio is the
+// probability of picking this strategy from the proposal over that from the
+// current state, for chains whose strategy mixture depends on the state.
+double Renderer::metropolis_acceptance(const PathMutator::Path& cur,
+    const PathMutator::Path& proposal,
+    float curLum,
+    float propLum,
+    int index,
+    int mutator_type,
+    float radius,
+    double selectRatio) const
+{
+    if (propLum <= 0.0f) return 0.0;
+    if (curLum <= 0.0f) return 1.0;
+
+    if (mutator_type == 3) {
+        return std::min(1.0, selectRatio * (double)propLum / (double)curLum);
+    }
+
+    double tFwd = 1.0;
+    double tRev = 1.0;
+
+    if (mutator_type == 0) {
+        tFwd = m_mutator.transition_pdf_retrace(cur, proposal, index);
+        tRev = m_mutator.transition_pdf_retrace(proposal, cur, index);
+    }
+    else if (mutator_type == 2) {
+        tFwd = m_mutator.transition_pdf_project(cur, proposal, index, radius);
+        tRev = m_mutator.transition_pdf_project(proposal, cur, index, radius);
+    }
+    else if (mutator_type == 5) {
+        const int j = subpath_end(cur, index);
+        tFwd = m_mutator.transition_pdf_subpath(proposal, index - 1, j);
+        tRev = m_mutator.transition_pdf_subpath(cur, index - 1, j);
+    }
+
+    const double num = selectRatio * (double)propLum * m_mutator.path_pdf(proposal) * tRev;
+    const double den = (double)curLum * m_mutator.path_pdf(cur) * tFwd;
+
+    if (!(num > 0.0)) return 0.0;
+    if (!(den > 0.0)) return 1.0;
+    return std::min(1.0, num / den);
+}
+
+// The adaptive scheduler picks the strategy when there is one; a chain
+// being replayed supplies the recorded strategy and consumes the same random
+// number the scheduler would have.
+int Renderer::select_strategy(int px, int py, int index, int step,
+    int mutator_type,
+    const MutationScheduler* scheduler,
+    const Chain* chain,
+    std::mt19937& rng,
+    std::uniform_real_distribution<float>& u01) const
+{
+    if (chain && step < (int)chain->replayStrategies.size()) {
+        if (mutator_type == 4) u01(rng);
+        return chain->replayStrategies[step];
+    }
+    if (scheduler) return scheduler->select(px, py, index, u01(rng));
+    return mutator_type;
+}
+
+void Renderer::record_step(Chain& chain,
+    int strategy,
+    int index,
+    ChainOutcome outcome,
+    double acceptance,
+    float proposalLum,
+    const PathMutator::Path& proposal,
+    std::chrono::steady_clock::time_point t0)
+{
+    ChainStep st;
+    st.strategy = (uint8_t)strategy;
+    st.outcome = (uint8_t)outcome;
+    st.index = index;
+    st.acceptance = (float)acceptance;
+    st.luminance = proposalLum;
+    st.micros = (float)std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+
+    if (outcome == CHAIN_FAILED) {
+        const Stats::Counter why = Stats::last_failure();
+        if (why != Stats::COUNTER_COUNT) st.reason = (uint16_t)why;
+    }
+    else if (index >= 0 && index < (int)proposal.vertices.size()) {
+        const glm::vec3& v = proposal.vertices[index];
+        st.vertex[0] = v.x;
+        st.vertex[1] = v.y;
+        st.vertex[2] = v.z;
+    }
+
+    chain.steps.push_back(st);
+}
+
+glm::vec3 Renderer::render_pixel(int px, int py,
+    uint32_t seed,
+    int mutator_type,
+    int pass,
+    Chain* chain) const
+{
+    if (m_params.metropolis) {
+        std::cerr << "Renderer::render_pixel: Metropolis chains span the image, not one pixel\n";
+        return glm::vec3(0.0f);
+    }
 
     const float baseRadius = std::max(1e-6f, m_params.mutateRadiusFrac * m_sceneDiag);
 
-    for (int y = 0; y < H; ++y) {
-        for (int x = 0; x < W; ++x) {
-            glm::vec3 rd0 = generate_primary_dir(x, y);
+    std::mt19937 rng(pixel_seed(pass_seed(seed, pass), px, py));
+    std::uniform_real_distribution<float> u01(0.0f, 1.0f);
+    Sampler sampler(m_params.sampler, rng, pixel_seed(seed, px, py));
 
-            PathMutator::Path cur;
+    if (chain) begin_chain(*chain, px, py, seed, pass, mutator_type);
+
+    const glm::vec3 rd0 = begin_pixel(px, py, pass, sampler);
+    const glm::vec3 L = render_pixel_average(px, py, rd0, mutator_type, baseRadius,
+        nullptr, nullptr, nullptr, sampler, u01, chain);
+
+    if (chain) end_chain(*chain, L);
+    return L;
+}
+
+// The chain's start time is kept in micros until end_chain.
+void Renderer::begin_chain(Chain& chain, int px, int py, uint32_t seed, int pass, int mutator_type) {
+    chain.px = px;
+    chain.py = py;
+    chain.renderSeed = seed;
+    chain.pixelSeed = pixel_seed(pass_seed(seed, pass), px, py);
+    chain.mutatorType = mutator_type;
+    chain.pass = pass;
+    chain.seedOk = false;
+    chain.seedPath.clear();
+    chain.steps.clear();
+    chain.result = glm::vec3(0.0f);
+    chain.micros = std::chrono::duration<double, std::micro>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Renderer::end_chain(Chain& chain, const glm::vec3& result) {
+    chain.result = result;
+    chain.micros = std::chrono::duration<double, std::micro>(
+        std::chrono::steady_clock::now().time_since_epoch()).count() - chain.micros;
+}
+
+glm::vec3 Renderer::render_pixel_average(int px, int py,
+    const glm::vec3& rd0,
+    int mutator_type,
+    float radius,
+    const MutationScheduler* scheduler,
+    MutationScheduler::Tally* tally,
+    RenderStats* stats,
+    Sampler& sampler,
+    std::uniform_real_distribution<float>& u01,
+    Chain* chain,
+    RelightStore::Pixel* relight) const
+{
+    PathMutator::Path cur;
+
+    bool okSeed = m_mutator.sample_path(
+        cur,
+        m_params.maxBounces,
+        rd0,
+        m_params.retriesPerBounce,
+        sampler
+    );
+
+    if (!okSeed) return glm::vec3(0.0f);
+
+    if (stats) {
+        stats->seedPaths++;
+        stats->seedVertices += cur.vertices.size();
+    }
+    if (chain) {
+        chain->seedOk = true;
+        chain->seedPath = cur.vertices;
+    }
 
-            bool okSeed = m_mutator.sample_path(
-                cur,
-                m_params.maxBounces,
-                rd0,
-                m_params.retriesPerBounce
-            );
+    glm::vec3 accum(0.0f);
+    int accepted = 0;
 
-            if (!okSeed) {
-                img[(size_t)y * (size_t)W + (size_t)x] = glm::vec3(0.0f);
-                continue;
+    resolve_light_visibility(cur);
+    accum += compute_radiance_for_path(cur, true);
+    accepted++;
+
+    // Each accepted state enters the average once.
+    if (relight) record_relight(cur, 1.0f, *relight);
+
+    const int K = std::max(0, m_params.Kmutations);
+    const uint32_t firstSample = sampler.sample_index();
+
+    for (int k = 0; k < K; ++k) {
+        sampler.start_sample(firstSample + 1 + (uint32_t)k);
+
+        PathMutator::Path proposal = cur;
+
+        const int N = (int)proposal.vertices.size();
+        if (N <= 2) break;
+
+        const int lo = 2;
+        const int hi = N - 2;
+        if (hi < lo) break;
+
+        int idx = lo + (int)std::floor(u01(sampler.rng()) * (float)(hi - lo + 1));
+        idx = std::max(lo, std::min(hi, idx));
+
+        const int strategy = select_strategy(px, py, idx, k, mutator_type, scheduler, chain, sampler.rng(), u01);
+
+        const auto t0 = std::chrono::steady_clock::now();
+        if (chain) Stats::set_last_failure(Stats::COUNTER_COUNT);
+
+        bool ok = false;
+        glm::vec3 L(0.0f);
+
+        if (m_params.multiTry > 1) {
+            ok = multi_try_average_step(proposal, L, idx, strategy, radius, rd0, sampler, u01);
+        }
+        else {
+            ok = propose_mutation(proposal, idx, strategy, radius, rd0, sampler);
+            if (ok) {
+                resolve_light_visibility(proposal);
+                L = compute_radiance_for_path(proposal);
             }
+        }
+
+        if (scheduler && tally) {
+            const auto t1 = std::chrono::steady_clock::now();
+            scheduler->record(*tally, px, py, idx, strategy, ok, luminance(L),
+                std::chrono::duration<double, std::micro>(t1 - t0).count());
+        }
+
+        if (stats) {
+            stats->mutationAttempts++;
+            if (ok) stats->mutationAccepts++;
+        }
+
+        if (chain) {
+            record_step(*chain, strategy, idx, ok ? CHAIN_ACCEPTED : CHAIN_FAILED, ok ? 1.0 : 0.0,
+                luminance(L), proposal, t0);
+        }
+
+        if (!ok) {
+            continue;
+        }
 
-            glm::vec3 accum(0.0f);
-            int accepted = 0;
+        cur = std::move(proposal);
+        accum += L;
+        accepted++;
 
-            accum += compute_radiance_for_path(cur);
-            accepted++;
+        if (relight) record_relight(cur, 1.0f, *relight);
+    }
+
+    if (accepted > 0) accum /= (float)accepted;
+    if (relight && accepted > 0) relight->scale(1.0f / (float)accepted);
+    return accum;
+}
 
-            const int K = std::max(0, m_params.Kmutations);
+// The seed phase of a Metropolis pass. Paths that fail to trace count as
+// black samples of the luminance mean, as they do in the image. The store
+// keeps the plain seed average: chain states are weighted by 1 / luminance
+// under these lights and only visit paths they light, so under other lights
+// they are no estimate at all.
+glm::vec3 Renderer::seed_pixel(const glm::vec3& rd0,
+    RenderStats* stats,
+    Sampler& sampler,
+    float* seedLum,
+    RelightStore::Pixel* relight) const
+{
+    const int S = std::max(1, m_params.seedPaths);
 
-            for (int k = 0; k < K; ++k) {
-                PathMutator::Path proposal = cur;
+    std::vector<PathMutator::Path> seeds((size_t)S);
+    std::vector<PathMutator::Path*> traced;
+    traced.reserve((size_t)S);
 
-                const int N = (int)proposal.vertices.size();
-                if (N <= 2) break;
+    for (int s = 0; s < S; ++s) {
+        seedLum[s] = 0.0f;
+        PathMutator::Path& p = seeds[(size_t)s];
+        if (!m_mutator.sample_path(p, m_params.maxBounces, rd0, m_params.retriesPerBounce, sampler)) {
+            continue;
+        }
+        if (stats) {
+            stats->seedPaths++;
+            stats->seedVertices += p.vertices.size();
+        }
+        traced.push_back(&p);
+    }
 
-                const int lo = 2;
-                const int hi = N - 2;
-                if (hi < lo) break;
+    resolve_light_visibility(traced.data(), traced.size());
 
-                int idx = lo + (int)std::floor(u01(rng) * (float)(hi - lo + 1));
-                idx = std::max(lo, std::min(hi, idx));
+    glm::vec3 sum(0.0f);
+    for (int s = 0; s < S; ++s) {
+        const PathMutator::Path& p = seeds[(size_t)s];
+        if (p.vertices.empty()) continue;
 
+        const glm::vec3 L = compute_radiance_for_path(p, true);
+        seedLum[s] = luminance(L);
+        sum += L;
+
+        if (relight) record_relight(p, 1.0f / (float)S, *relight);
+    }
+
+    return sum / (float)S;
+}
+
+// Metropolis-Hastings over the whole image. The state is a pixel and a path
+// through it, distributed according to luminance(L) * p, and every step
+// splats (1 - a) L / luminance(L) of the current state and a L' / luminance(L')
+// of the proposal into their pixels. Scaled by b * pixels / steps, with b the
+// mean seed luminance over the image, the splats estimate the image. A
+// pixel's brightness thus comes from how often the chains visit it, which
+// the mutations refine, rather than from its own few seeds.
+//
+// The chains start from seeds drawn in proportion to luminance (systematic
+// resampling), which removes start-up bias. A large step traces a fresh path
+// through a uniformly chosen pixel: an independence proposal with density
+// p / pixels, accepted with the ratio of luminances, which keeps the chains
+// moving across the image. A small step mutates the current path and keeps
+// its pixel.
+//
+// Splats are summed in 64-bit fixed point with atomic adds, so the chains can
+// run on any number of threads and still sum to the same image.
+void Renderer::render_metropolis_chains(uint32_t seed,
+    int pass,
+    int mutator_type,
+    MutationScheduler* scheduler,
+    const std::vector<float>& seedLum,
+    std::vector<glm::vec3>& img,
+    RenderStats* stats) const
+{
+    PM_TRACE_SCOPE("metropolis_chains", "render");
+
+    const int W = m_cam.width;
+    const int H = m_cam.height;
+    const size_t n = (size_t)W * (size_t)H;
+    const int S = std::max(1, m_params.seedPaths);
+    if (n == 0 || seedLum.size() != n * (size_t)S || img.size() != n) return;
+
+    double lumSum = 0.0;
+    for (float l : seedLum) lumSum += (double)l;
+    const double b = lumSum / (double)seedLum.size();
+
+    // Without steps the image stays the seed average.
+    const uint64_t total = (uint64_t)n * (uint64_t)std::max(0, m_params.Kmutations);
+    if (total == 0 || !(b > 0.0)) return;
+
+    const uint32_t passSeed = pass_seed(seed, pass);
+    const float radius = std::max(1e-6f, m_params.mutateRadiusFrac * m_sceneDiag);
+    const float largeStep = clamp01(m_params.largeStepProb);
+    const int C = (int)std::min<uint64_t>((uint64_t)std::max(1, m_params.chains), total);
+
+    // Seed indices (pixel * S + seed) of the chain starts. The streams with
+    // py = -1 are apart from the pixels'.
+    std::vector<size_t> starts((size_t)C);
+    {
+        std::mt19937 rng(pixel_seed(passSeed, -1, -1));
+        const double u = (double)std::uniform_real_distribution<float>(0.0f, 1.0f)(rng);
+        const double spacing = lumSum / (double)C;
+
+        double below = 0.0;
+        size_t j = 0;
+        for (int c = 0; c < C; ++c) {
+            const double target = ((double)c + u) * spacing;
+            while (j + 1 < seedLum.size() && below + (double)seedLum[j] <= target) {
+                below += (double)seedLum[j];
+                ++j;
+            }
+            starts[(size_t)c] = j;
+        }
+    }
+
+    // Traces the pixel's seeds again up to the chosen one, from the sample
+    // values the seed phase used.
+    auto start_state = [&](size_t start, PathMutator::Path& path, int& x, int& y) {
+        const size_t pi = start / (size_t)S;
+        const int s = (int)(start % (size_t)S);
+        x = (int)(pi % (size_t)W);
+        y = (int)(pi / (size_t)W);
+
+        std::mt19937 rng(pixel_seed(passSeed, x, y));
+        Sampler sampler(m_params.sampler, rng, pixel_seed(seed, x, y));
+        const glm::vec3 rd0 = begin_pixel(x, y, pass, sampler);
+        for (int k = 0; k <= s; ++k) {
+            m_mutator.sample_path(path, m_params.maxBounces, rd0, m_params.retriesPerBounce, sampler);
+        }
+    };
+
+    static constexpr double kSplatScale = 16777216.0;   // 2^24 per unit
+    std::vector<std::atomic<int64_t>> splats(3 * n);
+
+    auto splat = [&](int x, int y, const glm::vec3& L, float lum, double w) {
+        if (!(lum > 0.0f) || !(w > 0.0)) return;
+        const double s = w / (double)lum * kSplatScale;
+        std::atomic<int64_t>* dst = &splats[3 * ((size_t)y * (size_t)W + (size_t)x)];
+        for (int ch = 0; ch < 3; ++ch) {
+            dst[ch].fetch_add((int64_t)std::llround((double)L[ch] * s), std::memory_order_relaxed);
+        }
+    };
+
+    const uint64_t perChain = total / (uint64_t)C;
+    const uint64_t extra = total % (uint64_t)C;
+
+    int threads = m_params.threads > 0 ? m_params.threads : (int)std::thread::hardware_concurrency();
+    threads = std::max(1, std::min(threads, C));
+
+    std::atomic<int> nextChain{ 0 };
+    std::vector<RenderStats> threadStats((size_t)threads);
+    std::vector<MutationScheduler::Tally> tallies;
+    if (scheduler) tallies.assign((size_t)threads, scheduler->make_tally());
+
+    auto worker = [&](int t) {
+        RenderStats* ts = stats ? &threadStats[(size_t)t] : nullptr;
+        MutationScheduler::Tally* tally = scheduler ? &tallies[(size_t)t] : nullptr;
+        const uint64_t raysBefore = Scene::rays_traced();
+        std::uniform_real_distribution<float> u01(0.0f, 1.0f);
+
+        for (int c = nextChain.fetch_add(1); c < C; c = nextChain.fetch_add(1)) {
+            PM_TRACE_SCOPE_ARG("chain", "render", "chain", c);
+
+            PathMutator::Path cur;
+            int curX = 0, curY = 0;
+            start_state(starts[(size_t)c], cur, curX, curY);
+            resolve_light_visibility(cur);
+            glm::vec3 curL = compute_radiance_for_path(cur);
+            float curLum = luminance(curL);
+
+            std::mt19937 rng(pixel_seed(passSeed, c, -1));
+            Sampler sampler(rng);
+
+            const uint64_t steps = perChain + ((uint64_t)c < extra ? 1u : 0u);
+            for (uint64_t k = 0; k < steps; ++k) {
+                PathMutator::Path proposal;
+                int propX = curX, propY = curY;
+                glm::vec3 propL(0.0f);
+                float propLum = 0.0f;
+                double a = 0.0;
                 bool ok = false;
+                int strategy = -1;
+                int idx = 0;
+
+                const auto t0 = std::chrono::steady_clock::now();
 
-                if (mutator_type == 0) {
-                    ok = m_mutator.mutate_vertex_retrace(proposal, idx);
+                if (u01(rng) < largeStep) {
+                    propX = std::min(W - 1, (int)(u01(rng) * (float)W));
+                    propY = std::min(H - 1, (int)(u01(rng) * (float)H));
+                    const glm::vec3 dir = m_params.pixelJitter
+                        ? generate_primary_dir(propX, propY, sampler.get_2d())
+                        : generate_primary_dir(propX, propY);
+
+                    ok = m_mutator.sample_path(proposal, m_params.maxBounces, dir, m_params.retriesPerBounce, sampler);
+                    if (ok) {
+                        resolve_light_visibility(proposal);
+                        propL = compute_radiance_for_path(proposal);
+                        propLum = luminance(propL);
+                        a = metropolis_acceptance(cur, proposal, curLum, propLum, 0, 3, radius);
+                    }
                 }
-                else if (mutator_type == 1) {
-                    ok = m_mutator.mutate_vertex_meshwalk(proposal, idx, baseRadius);
+                else {
+                    const int N = (int)cur.vertices.size();
+                    const int lo = 2;
+                    const int hi = N - 2;
+                    idx = lo;
+                    if (hi >= lo) {
+                        idx = lo + (int)std::floor(u01(rng) * (float)(hi - lo + 1));
+                        idx = std::max(lo, std::min(hi, idx));
+                    }
+                    strategy = scheduler ? scheduler->select(curX, curY, idx, u01(rng)) : mutator_type;
+
+                    // The reverse move picks its strategy from the proposal's
+                    // table. Small steps keep the pixel and the vertex index,
+                    // so this is 1 unless the tables are keyed otherwise.
+                    const double selectRatio = scheduler
+                        ? scheduler->probability(propX, propY, idx, strategy) / scheduler->probability(curX, curY, idx, strategy)
+                        : 1.0;
+
+                    // Resampling keeps the primary ray, so the pixel and its
+                    // jitter stay as they are.
+                    proposal = cur;
+                    if (N >= 3 && (strategy == 3 || hi >= lo)) {
+                        const glm::vec3 primaryDir = GeomUtil::safe_normalize(cur.vertices[1] - cur.vertices[0]);
+                        if (m_params.multiTry > 1) {
+                            ok = multi_try_metropolis_step(cur, curLum, proposal, propL, propLum, a,
+                                idx, strategy, radius, primaryDir, sampler, u01, selectRatio);
+                        }
+                        else {
+                            ok = propose_mutation(proposal, idx, strategy, radius, primaryDir, sampler);
+                            if (ok) {
+                                resolve_light_visibility(proposal);
+                                propL = compute_radiance_for_path(proposal);
+                                propLum = luminance(propL);
+                                a = metropolis_acceptance(cur, proposal, curLum, propLum, idx, strategy, radius, selectRatio);
+                            }
+                        }
+                    }
                 }
-                else if (mutator_type == 2) {
-                    ok = m_mutator.mutate_vertex_project(proposal, idx, baseRadius);
+
+                const bool accept = ok && (double)u01(rng) < a;
+
+                if (ts) {
+                    ts->mutationAttempts++;
+                    if (accept) ts->mutationAccepts++;
                 }
-                else if (mutator_type == 3) {
-                    PathMutator::Path fresh;
-                    ok = m_mutator.sample_path(
-                        fresh,
-                        m_params.maxBounces,
-                        rd0,
-                        m_params.retriesPerBounce
-                    );
-                    if (ok) proposal = std::move(fresh);
+
+                if (tally && strategy >= 0) {
+                    const auto t1 = std::chrono::steady_clock::now();
+                    scheduler->record(*tally, curX, curY, idx, strategy, accept, a * (double)propLum,
+                        std::chrono::duration<double, std::micro>(t1 - t0).count());
                 }
-                else {
-                    ok = false;
+
+                splat(curX, curY, curL, curLum, 1.0 - a);
+                if (ok) splat(propX, propY, propL, propLum, a);
+
+                if (accept) {
+                    cur = std::move(proposal);
+                    curL = propL;
+                    curLum = propLum;
+                    curX = propX;
+                    curY = propY;
                 }
+            }
+        }
+
+        if (ts) ts->rays = Scene::rays_traced() - raysBefore;
+    };
+
+    if (threads == 1) {
+        worker(0);
+    }
+    else {
+        std::vector<std::thread> pool;
+        pool.reserve(threads);
+        for (int t = 0; t < threads; ++t) {
+            pool.emplace_back([&worker, t] {
+                if (Trace::enabled()) Trace::set_thread_name("chain worker " + std::to_string(t));
+                worker(t);
+            });
+        }
+        for (auto& th : pool) th.join();
+    }
+
+    for (MutationScheduler::Tally& tally : tallies) scheduler->merge(tally);
+
+    const double scale = b * (double)n / ((double)total * kSplatScale);
+    for (size_t i = 0; i < n; ++i) {
+        img[i] = glm::vec3(
+            (float)((double)splats[3 * i].load(std::memory_order_relaxed) * scale),
+            (float)((double)splats[3 * i + 1].load(std::memory_order_relaxed) * scale),
+            (float)((double)splats[3 * i + 2].load(std::memory_order_relaxed) * scale));
+    }
+
+    if (stats) {
+        for (const RenderStats& ts : threadStats) stats->add(ts);
+    }
+}
+
+double Renderer::RenderStats::avg_vertices_per_path() const {
+    return seedPaths ? (double)seedVertices / (double)seedPaths : 0.0;
+}
+
+double Renderer::RenderStats::rays_per_pixel() const {
+    return pixels ? (double)rays / (double)pixels : 0.0;
+}
+
+double Renderer::RenderStats::acceptance_rate() const {
+    return mutationAttempts ? (double)mutationAccepts / (double)mutationAttempts : 0.0;
+}
+
+void Renderer::RenderStats::add(const RenderStats& o) {
+    pixels += o.pixels;
+    seedPaths += o.seedPaths;
+    seedVertices += o.seedVertices;
+    rays += o.rays;
+    mutationAttempts += o.mutationAttempts;
+    mutationAccepts += o.mutationAccepts;
+}
+
+void Renderer::AOVs::resize(int w, int h) {
+    width = w;
+    height = h;
+
+    const size_t n = (size_t)w * (size_t)h;
+    rays.assign(n, 0.0f);
+    attempts.assign(n, 0.0f);
+    accepts.assign(n, 0.0f);
+    pathLength.assign(n, 0.0f);
+    timeMs.assign(n, 0.0f);
+    triangleId.assign(n, -1);
+    depth.assign(n, 0.0f);
+    normal.assign(n, glm::vec3(0.0f));
+    albedo.assign(n, glm::vec3(0.0f));
+}
+
+void Renderer::resolve_light_visibility(PathMutator::Path& path) const {
+    PathMutator::Path* one = &path;
+    resolve_light_visibility(&one, 1);
+}
+
+void Renderer::resolve_light_visibility(std::vector<PathMutator::Path>& paths) const {
+    std::vector<PathMutator::Path*> ptrs;
+    ptrs.reserve(paths.size());
+    for (PathMutator::Path& p : paths) ptrs.push_back(&p);
+    resolve_light_visibility(ptrs.data(), ptrs.size());
+}
+
+// Gathers the pending shadow rays of all given paths, skipping vertices that
+// face away from their light sample or lie past the point where
+// compute_radiance_for_path stops, and resolves them with a single batched
+// occlusion query.
+void Renderer::resolve_light_visibility(PathMutator::Path* const* paths, size_t count) const {
+    PM_STAT_TIMER(T_RESOLVE_LIGHT);
+
+    std::vector<glm::vec3> from, to;
+    std::vector<uint8_t*> slots;
+
+    for (size_t k = 0; k < count; ++k) {
+        PathMutator::Path& path = *paths[k];
+
+        const int N = (int)path.vertices.size();
+        if ((int)path.light_visible.size() != std::max(0, N - 2)) continue;
+
+        for (int i = 1; i <= N - 2; ++i) {
+            glm::vec3 ni = shading_normal_at(path, i);
+            if (glm::dot(ni, ni) <= 0.0f) break;
+
+            // A tail vertex read from the radiance cache needs no shadow ray.
+            glm::vec3 cachedL;
+            if (i == N - 2 && path.cached_tail && m_cache &&
+                m_cache->lookup(path.vertices[i], ni, cachedL)) {
+                break;
+            }
+
+            uint8_t& state = path.light_visible[i - 1];
+            LightSet::Sample ls;
+            if (state == PathMutator::LIGHT_UNKNOWN && sample_light(path, i, ni, ls) &&
+                glm::dot(ni, ls.p - path.vertices[i]) > 0.0f) {
+                from.push_back(path.vertices[i] + m_params.visibilityEps * ni);
+                to.push_back(ls.p);
+                slots.push_back(&state);
+            }
+
+            // Same early-out as compute_radiance_for_path: nothing past a
+            // segment that leaves the hemisphere is ever evaluated.
+            if (i < N - 2 && glm::dot(ni, path.vertices[i + 1] - path.vertices[i]) <= 0.0f) break;
+        }
+    }
+
+    if (slots.empty()) return;
+
+    PM_STAT_ADD(SHADOW_RAYS_DEFERRED, slots.size());
+
+    std::vector<uint8_t> vis;
+    m_scene.visible_batch(from, to, vis, m_params.visibilityEps);
+
+    for (size_t j = 0; j < slots.size(); ++j) {
+        *slots[j] = vis[j] ? PathMutator::LIGHT_VISIBLE : PathMutator::LIGHT_OCCLUDED;
+    }
+}
+
+// Hash of (seed, px, py) so every pixel draws from its own stream.
+uint32_t Renderer::pixel_seed(uint32_t seed, int px, int py) {
+    uint64_t h = ((uint64_t)seed << 32) ^ ((uint64_t)(uint32_t)py << 16) ^ (uint64_t)(uint32_t)px;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return (uint32_t)h;
+}
+
+uint32_t Renderer::pass_seed(uint32_t seed, int pass) {
+    return seed + 0x9e3779b9u * (uint32_t)pass;
+}
+
+std::vector<glm::vec3> Renderer::render_scene(uint32_t seed, const int mutator_type,
+    RenderStats* stats,
+    AOVs* aovs) const
+{
+    std::vector<glm::vec3> img;
+
+    std::unique_ptr<MutationScheduler> scheduler;
+    if (mutator_type == 4) {
+        scheduler = std::make_unique<MutationScheduler>(m_cam.width, m_cam.height, m_params.scheduler);
+    }
+
+    render_pass(seed, 0, mutator_type, scheduler.get(), img, nullptr, stats, aovs);
+    return img;
+}
+
+bool Renderer::render_to_file(const std::string& path,
+    uint32_t seed,
+    int mutator_type,
+    RenderStats* stats) const
+{
+    TileWriter writer;
+    if (!writer.open(path, m_cam.width, m_cam.height)) {
+        std::cerr << "Renderer::render_to_file: cannot open " << path << "\n";
+        return false;
+    }
+
+    std::unique_ptr<MutationScheduler> scheduler;
+    if (mutator_type == 4) {
+        scheduler = std::make_unique<MutationScheduler>(m_cam.width, m_cam.height, m_params.scheduler);
+    }
+
+    std::vector<glm::vec3> unused;
+    render_pass(seed, 0, mutator_type, scheduler.get(), unused, &writer, stats, nullptr);
+
+    if (!writer.close()) {
+        std::cerr << "Renderer::render_to_file: write failed for " << path << "\n";
+        return false;
+    }
+    return true;
+}
+
+std::vector<glm::vec3> Renderer::render_progressive(uint32_t seed,
+    int mutator_type,
+    int maxPasses,
+    const PassCallback& onPass,
+    RenderStats* stats,
+    AOVs* aovs) const
+{
+    const size_t n = (size_t)m_cam.width * (size_t)m_cam.height;
+    std::vector<glm::vec3> accum(n, glm::vec3(0.0f));
+    std::vector<glm::vec3> pass;
+
+    std::unique_ptr<MutationScheduler> scheduler;
+    if (mutator_type == 4) {
+        scheduler = std::make_unique<MutationScheduler>(m_cam.width, m_cam.height, m_params.scheduler);
+    }
+
+    if (stats) *stats = RenderStats{};
+
+    AOVs passAovs;
+
+    for (int p = 0; p < maxPasses; ++p) {
+        PM_TRACE_SCOPE_ARG("pass", "render", "pass", p);
+
+        RenderStats passStats;
+        render_pass(seed, p, mutator_type, scheduler.get(), pass, nullptr,
+            stats ? &passStats : nullptr,
+            aovs ? (p == 0 ? aovs : &passAovs) : nullptr);
+
+        if (stats) stats->add(passStats);
+
+        if (m_guide) {
+            PM_TRACE_SCOPE("guide_update", "render");
+            m_guide->update();
+        }
+
+        if (aovs && p > 0) {
+            const float w = 1.0f / (float)(p + 1);
+            for (size_t i = 0; i < n; ++i) {
+                aovs->rays[i] += passAovs.rays[i];
+                aovs->attempts[i] += passAovs.attempts[i];
+                aovs->accepts[i] += passAovs.accepts[i];
+                aovs->timeMs[i] += passAovs.timeMs[i];
+                aovs->pathLength[i] += (passAovs.pathLength[i] - aovs->pathLength[i]) * w;
+            }
+        }
+
+        // Running mean, so accum is always the average of the passes so far.
+        const float w = 1.0f / (float)(p + 1);
+        for (size_t i = 0; i < n; ++i) {
+            accum[i] += (pass[i] - accum[i]) * w;
+        }
+
+        if (onPass && !onPass(p, accum)) break;
+    }
+
+    return accum;
+}
+
+void Renderer::render_pass(uint32_t seed,
+    int pass,
+    int mutator_type,
+    MutationScheduler* scheduler,
+    std::vector<glm::vec3>& img,
+    TileWriter* sink,
+    RenderStats* stats,
+    AOVs* aovs) const
+{
+    const int W = m_cam.width;
+    const int H = m_cam.height;
+
+    // Metropolis passes trace the seed paths of every pixel here, then run
+    // their chains over the finished seeds.
+    const bool mh = m_params.metropolis;
+    const int S = std::max(1, m_params.seedPaths);
+    std::vector<float> seedLum(mh ? (size_t)W * (size_t)H * (size_t)S : 0);
+
+    // Streaming passes keep only one tile per worker.
+    const bool streamTiles = sink && !mh;
+    if (streamTiles) img.clear();
+    else img.assign((size_t)W * (size_t)H, glm::vec3(0.0f));
+    if (aovs) aovs->resize(W, H);
+
+    const float baseRadius = std::max(1e-6f, m_params.mutateRadiusFrac * m_sceneDiag);
 
-                if (!ok) {
-                    continue;
+    // The RNG streams change every pass; the Sobol scrambles are keyed by the
+    // base seed so the passes continue one sequence.
+    const uint32_t passSeed = pass_seed(seed, pass);
+
+    PM_STAT_TIMER(T_RENDER);
+    PM_TRACE_SCOPE("render_pass", "render");
+
+    if (stats) *stats = RenderStats{};
+
+    RelightStore* store = m_relight;
+    if (store && pass == 0) store->reset(W, H);
+
+    const int tile = std::max(1, m_params.tileSize);
+    const int tilesX = (W + tile - 1) / tile;
+    const int tilesY = (H + tile - 1) / tile;
+    const int tileCount = tilesX * tilesY;
+
+    int threads = m_params.threads > 0 ? m_params.threads : (int)std::thread::hardware_concurrency();
+    threads = std::max(1, std::min(threads, tileCount));
+
+    std::atomic<int> nextTile{ 0 };
+    std::vector<RenderStats> threadStats(threads);
+    std::vector<MutationScheduler::Tally> tallies;
+    if (scheduler) tallies.assign((size_t)threads, scheduler->make_tally());
+
+    auto worker = [&](int t) {
+        RenderStats* ts = stats ? &threadStats[t] : nullptr;
+        MutationScheduler::Tally* tally = scheduler ? &tallies[(size_t)t] : nullptr;
+        const uint64_t raysBefore = Scene::rays_traced();
+
+        std::uniform_real_distribution<float> u01(0.0f, 1.0f);
+        std::vector<glm::vec3> tileBuf(streamTiles ? (size_t)tile * (size_t)tile : 0);
+        Chain recorded;
+        RelightStore::Pixel relightPixel;
+        RelightStore::Pixel* rp = store ? &relightPixel : nullptr;
+
+        for (int ti = nextTile.fetch_add(1); ti < tileCount; ti = nextTile.fetch_add(1)) {
+            const int x0 = (ti % tilesX) * tile;
+            const int y0 = (ti / tilesX) * tile;
+            const int x1 = std::min(W, x0 + tile);
+            const int y1 = std::min(H, y0 + tile);
+
+            PM_TRACE_SCOPE_ARG("tile", "render", "tile", ti);
+
+            for (int y = y0; y < y1; ++y) {
+                for (int x = x0; x < x1; ++x) {
+                    std::mt19937 rng(pixel_seed(passSeed, x, y));
+                    Sampler sampler(m_params.sampler, rng, pixel_seed(seed, x, y));
+                    glm::vec3 rd0 = begin_pixel(x, y, pass, sampler);
+                    const size_t pi = (size_t)y * (size_t)W + (size_t)x;
+                    glm::vec3& out = streamTiles
+                        ? tileBuf[(size_t)(y - y0) * (size_t)(x1 - x0) + (size_t)(x - x0)]
+                        : img[pi];
+
+                    Chain* chain = nullptr;
+                    if (m_recorder && !mh && m_recorder->wants(x, y)) {
+                        chain = &recorded;
+                        begin_chain(*chain, x, y, seed, pass, mutator_type);
+                    }
+
+                    if (!aovs) {
+                        out = mh
+                            ? seed_pixel(rd0, ts, sampler, &seedLum[pi * (size_t)S], rp)
+                            : render_pixel_average(x, y, rd0, mutator_type, baseRadius, scheduler, tally, ts, sampler, u01, chain, rp);
+                    }
+                    else {
+                        // Per-pixel counters are gathered in their own RenderStats
+                        // and folded into the thread's afterwards.
+                        RenderStats ps;
+                        const uint64_t pixelRays = Scene::rays_traced();
+                        const auto t0 = std::chrono::steady_clock::now();
+
+                        out = mh
+                            ? seed_pixel(rd0, &ps, sampler, &seedLum[pi * (size_t)S], rp)
+                            : render_pixel_average(x, y, rd0, mutator_type, baseRadius, scheduler, tally, &ps, sampler, u01, chain, rp);
+
+                        const auto t1 = std::chrono::steady_clock::now();
+
+                        aovs->rays[pi] = (float)(Scene::rays_traced() - pixelRays);
+                        aovs->attempts[pi] = (float)ps.mutationAttempts;
+                        aovs->accepts[pi] = (float)ps.mutationAccepts;
+                        aovs->pathLength[pi] = (float)ps.avg_vertices_per_path();
+                        aovs->timeMs[pi] = (float)std::chrono::duration<double, std::milli>(t1 - t0).count();
+                        fill_primary_aovs(x, y, generate_primary_dir(x, y), *aovs);
+
+                        if (ts) ts->add(ps);
+                    }
+
+                    if (chain) {
+                        end_chain(*chain, out);
+                        m_recorder->write(*chain);
+                    }
+
+                    if (rp) store->store(x, y, *rp);
                 }
+            }
+
+            if (streamTiles) sink->write_tile(x0, y0, x1 - x0, y1 - y0, tileBuf.data());
+        }
+
+        if (ts) ts->rays = Scene::rays_traced() - raysBefore;
+    };
 
-                cur = std::move(proposal);
-                accum += compute_radiance_for_path(cur);
-                accepted++;
+    if (threads == 1) {
+        worker(0);
+    }
+    else {
+        std::vector<std::thread> pool;
+        pool.reserve(threads);
+        for (int t = 0; t < threads; ++t) {
+            pool.emplace_back([&worker, t] {
+                if (Trace::enabled()) Trace::set_thread_name("render worker " + std::to_string(t));
+                worker(t);
+            });
+        }
+        for (auto& th : pool) th.join();
+    }
+
+    if (stats) {
+        for (const RenderStats& ts : threadStats) stats->add(ts);
+        stats->pixels = (uint64_t)W * (uint64_t)H;
+    }
+
+    for (MutationScheduler::Tally& tally : tallies) scheduler->merge(tally);
+
+    if (mh) {
+        render_metropolis_chains(seed, pass, mutator_type, scheduler, seedLum, img, stats);
+
+        if (sink) {
+            std::vector<glm::vec3> tileBuf((size_t)tile * (size_t)tile);
+            for (int ti = 0; ti < tileCount; ++ti) {
+                const int x0 = (ti % tilesX) * tile;
+                const int y0 = (ti / tilesX) * tile;
+                const int tw = std::min(W, x0 + tile) - x0;
+                const int th = std::min(H, y0 + tile) - y0;
+                for (int y = 0; y < th; ++y) {
+                    std::copy_n(&img[(size_t)(y0 + y) * (size_t)W + (size_t)x0], tw, &tileBuf[(size_t)y * (size_t)tw]);
+                }
+                sink->write_tile(x0, y0, tw, th, tileBuf.data());
             }
+            img.clear();
+        }
+    }
+
+    // The next pass selects strategies from what this one measured.
+    if (scheduler) scheduler->update();
 
-            if (accepted > 0) accum /= (float)accepted;
-            img[(size_t)y * (size_t)W + (size_t)x] = accum;
+    if (store) store->end_pass();
+}
+
+bool Renderer::set_relight_store(RelightStore* store) {
+    if (store && m_cache) {
+        std::cerr << "Renderer: relight store not recorded with the radiance cache on\n";
+        m_relight = nullptr;
+        return false;
+    }
+    m_relight = store;
+    return true;
+}
+
+std::vector<glm::vec3> Renderer::relight(const RelightStore& store) const {
+    PM_TRACE_SCOPE("relight", "render");
+
+    const int W = store.width();
+    const int H = store.height();
+    std::vector<glm::vec3> img((size_t)W * (size_t)H, glm::vec3(0.0f));
+    if (store.empty() || store.passes() <= 0) return img;
+
+    const glm::vec3 f_lam = m_params.albedo / PI;
+    const float passScale = 1.0f / (float)store.passes();
+
+    std::atomic<int> nextRow{ 0 };
+
+    // Rows are handed out dynamically; each pixel's shadow rays go out as one
+    // batch.
+    auto worker = [&] {
+        std::vector<glm::vec3> from, to, terms;
+        std::vector<uint8_t> vis;
+
+        for (int y = nextRow.fetch_add(1); y < H; y = nextRow.fetch_add(1)) {
+            for (int x = 0; x < W; ++x) {
+                from.clear();
+                to.clear();
+                terms.clear();
+
+                for (const RelightStore::Vertex& v : store.pixel(x, y)) {
+                    LightSet::Sample ls;
+                    if (!m_lights.sample(v.p, v.n, v.lightU, ls)) continue;
+
+                    const glm::vec3 toL = ls.p - v.p;
+                    const float dist2 = glm::dot(toL, toL);
+                    if (!(dist2 > 1e-12f)) continue;
+
+                    const float cosTheta = std::max(0.0f, glm::dot(v.n, toL / std::sqrt(dist2)));
+                    if (!(cosTheta > 0.0f)) continue;
+
+                    from.push_back(v.p + m_params.visibilityEps * v.n);
+                    to.push_back(ls.p);
+                    terms.push_back(v.weight * (f_lam * (ls.Li * cosTheta)));
+                }
+
+                if (terms.empty()) continue;
+
+                m_scene.visible_batch(from, to, vis, m_params.visibilityEps);
+
+                glm::vec3 L(0.0f);
+                for (size_t j = 0; j < terms.size(); ++j) {
+                    if (vis[j]) L += terms[j];
+                }
+                img[(size_t)y * (size_t)W + (size_t)x] = L * passScale;
+            }
         }
+    };
+
+    int threads = m_params.threads > 0 ? m_params.threads : (int)std::thread::hardware_concurrency();
+    threads = std::max(1, std::min(threads, H));
+
+    if (threads == 1) {
+        worker();
+    }
+    else {
+        std::vector<std::thread> pool;
+        pool.reserve(threads);
+        for (int t = 0; t < threads; ++t) pool.emplace_back(worker);
+        for (auto& th : pool) th.join();
     }
 
     return img;
 }
 
+void Renderer::fill_primary_aovs(int px, int py, const glm::vec3& dir, AOVs& aovs) const {
+    const size_t i = (size_t)py * (size_t)aovs.width + (size_t)px;
+
+    Scene::Hit hit;
+    GeomUtil::Triangle tri;
+    if (!m_scene.intersect(m_cam.center, dir, hit, tri)) return;
+
+    aovs.triangleId[i] = hit.triIndex;
+    aovs.depth[i] = hit.t;
+    aovs.normal[i] = hit.n;
+    aovs.albedo[i] = m_params.albedo;
+}
+
 bool Renderer::write_ppm(const std::string& path,
     const std::vector<glm::vec3>& img,
     int W, int H,
     float gamma)
 {
-    if ((int)img.size() != W * H) return false;
+    return ImageUtil::write_ppm(path, img, W, H, gamma);
+}
 
-    std::ofstream out(path, std::ios::binary);
-    if (!out) return false;
+// Black -> blue -> magenta -> orange -> yellow -> white, for cost heatmaps.
+static glm::vec3 heat_color(float t) {
+    static const glm::vec3 stops[6] = {
+        glm::vec3(0.0f, 0.0f, 0.0f),
+        glm::vec3(0.1f, 0.1f, 0.6f),
+        glm::vec3(0.7f, 0.1f, 0.6f),
+        glm::vec3(1.0f, 0.5f, 0.1f),
+        glm::vec3(1.0f, 0.9f, 0.2f),
+        glm::vec3(1.0f, 1.0f, 1.0f)
+    };
+
+    t = std::max(0.0f, std::min(1.0f, t)) * 5.0f;
+    const int k = std::min(4, (int)t);
+    const float f = t - (float)k;
+    return stops[k] + f * (stops[k + 1] - stops[k]);
+}
+
+bool Renderer::write_aovs(const std::string& prefix, const AOVs& aovs) {
+    const int W = aovs.width;
+    const int H = aovs.height;
+    const size_t n = (size_t)W * (size_t)H;
+    if (n == 0 || aovs.rays.size() != n) return false;
 
-    out << "P6\n" << W << " " << H << "\n255\n";
+    std::vector<glm::vec3> img(n);
 
-    auto to_byte = [&](float c) -> unsigned char {
-        c = std::max(0.0f, c);
-        if (gamma > 0.0f) c = std::pow(c, 1.0f / gamma);
-        c = std::min(1.0f, c);
-        return (unsigned char)std::lround(c * 255.0f);
+    auto write_heat = [&](const char* name, const std::vector<float>& v) {
+        float vmax = 0.0f;
+        for (float x : v) vmax = std::max(vmax, x);
+        const float inv = vmax > 0.0f ? 1.0f / vmax : 0.0f;
+
+        for (size_t i = 0; i < n; ++i) img[i] = heat_color(v[i] * inv);
+        return write_ppm(prefix + "_" + name + ".ppm", img, W, H, 1.0f);
     };
 
-    for (int i = 0; i < W * H; ++i) {
-        unsigned char r = to_byte(img[i].x);
-        unsigned char g = to_byte(img[i].y);
-        unsigned char b = to_byte(img[i].z);
-        out.write((char*)&r, 1);
-        out.write((char*)&g, 1);
-        out.write((char*)&b, 1);
+    bool ok = true;
+    ok &= write_heat("rays", aovs.rays);
+    ok &= write_heat("attempts", aovs.attempts);
+    ok &= write_heat("accepts", aovs.accepts);
+    ok &= write_heat("path_length", aovs.pathLength);
+    ok &= write_heat("time", aovs.timeMs);
+
+    {
+        float dmax = 0.0f;
+        for (float d : aovs.depth) dmax = std::max(dmax, d);
+        const float inv = dmax > 0.0f ? 1.0f / dmax : 0.0f;
+
+        for (size_t i = 0; i < n; ++i) img[i] = glm::vec3(aovs.depth[i] * inv);
+        ok &= write_ppm(prefix + "_depth.ppm", img, W, H, 1.0f);
     }
 
-    return true;
+    for (size_t i = 0; i < n; ++i) {
+        const glm::vec3& nn = aovs.normal[i];
+        img[i] = (aovs.triangleId[i] < 0) ? glm::vec3(0.0f) : 0.5f * nn + glm::vec3(0.5f);
+    }
+    ok &= write_ppm(prefix + "_normal.ppm", img, W, H, 1.0f);
+
+    ok &= write_ppm(prefix + "_albedo.ppm", aovs.albedo, W, H, 1.0f);
+
+    for (size_t i = 0; i < n; ++i) {
+        const int32_t id = aovs.triangleId[i];
+        if (id < 0) {
+            img[i] = glm::vec3(0.0f);
+            continue;
+        }
+        uint32_t h = (uint32_t)id * 2654435761u;
+        h ^= h >> 15;
+        img[i] = glm::vec3((float)(h & 255u), (float)((h >> 8) & 255u), (float)((h >> 16) & 255u)) / 255.0f;
+    }
+    ok &= write_ppm(prefix + "_triangle_id.ppm", img, W, H, 1.0f);
+
+    return ok;
 }
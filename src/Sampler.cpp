@@ -0,0 +1,91 @@
+#include "Sampler.h"
+
+namespace {
+
+uint32_t reverse_bits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+uint32_t mix(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return h;
+}
+
+// Laine-Karras style hash in which every bit only depends on the bits below
+// it (Vegdahl's constants). Applied to bit-reversed values it is a nested
+// uniform (Owen) scramble.
+uint32_t owen_scramble(uint32_t x, uint32_t seed) {
+    x = reverse_bits(x);
+    x ^= x * 0x3d20adeau;
+    x += seed;
+    x *= (seed >> 16) | 1u;
+    x ^= x * 0x05526c56u;
+    x ^= x * 0x53a22864u;
+    return reverse_bits(x);
+}
+
+// Second Sobol dimension: the generator matrix is Pascal's triangle mod 2.
+uint32_t sobol_dim1(uint32_t i) {
+    uint32_t r = 0;
+    for (uint32_t v = 1u << 31; i; i >>= 1, v ^= v >> 1) {
+        if (i & 1u) r ^= v;
+    }
+    return r;
+}
+
+}
+
+Sampler::Sampler(std::mt19937& rng)
+    : m_rng(rng)
+{
+}
+
+Sampler::Sampler(Type type, std::mt19937& rng, uint32_t key)
+    : m_type(type)
+    , m_rng(rng)
+    , m_key(key)
+{
+}
+
+void Sampler::start_sample(uint32_t index) {
+    m_index = index;
+    m_pair = 0;
+}
+
+uint32_t Sampler::pair_seed(uint32_t pair) const {
+    return mix(m_key ^ mix(pair + 0x9e3779b9u));
+}
+
+float Sampler::get_1d() {
+    if (m_type == RANDOM) return m_u01(m_rng);
+    return sobol_2d(m_index, 0, pair_seed(m_pair++));
+}
+
+glm::vec2 Sampler::get_2d() {
+    if (m_type == RANDOM) {
+        const float a = m_u01(m_rng);
+        const float b = m_u01(m_rng);
+        return glm::vec2(a, b);
+    }
+
+    const uint32_t seed = pair_seed(m_pair++);
+    return glm::vec2(sobol_2d(m_index, 0, seed), sobol_2d(m_index, 1, seed));
+}
+
+// Shuffling the index with an Owen scramble keeps the sequence stratified:
+// the top k bits of both dimensions only depend on the low k index bits,
+// which the scramble permutes among themselves.
+float Sampler::sobol_2d(uint32_t index, int dim, uint32_t seed) {
+    const uint32_t i = owen_scramble(index, mix(seed ^ 0x68bc21ebu));
+    const uint32_t x = dim == 0 ? reverse_bits(i) : sobol_dim1(i);
+    const uint32_t y = owen_scramble(x, mix(seed + 1u + (uint32_t)dim));
+    return (float)(y >> 8) * (1.0f / 16777216.0f);
+}
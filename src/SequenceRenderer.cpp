@@ -0,0 +1,361 @@
+#include "SequenceRenderer.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <thread>
+
+static constexpr float PI = 3.14159265358979323846f;
+
+// Pixel whose primary ray passes closest to p, using the basis of
+// Renderer::generate_primary_dir. False if p is behind the camera or off
+// screen.
+static bool project_to_pixel(const Renderer::Camera& cam, const glm::vec3& p, int& px, int& py) {
+    const glm::vec3 f = GeomUtil::safe_normalize(cam.forward);
+
+    glm::vec3 up = cam.world_up;
+    if (glm::dot(up, up) <= 0.0f) up = glm::vec3(0, 1, 0);
+
+    glm::vec3 r = GeomUtil::safe_normalize(glm::cross(f, up));
+    if (glm::dot(r, r) <= 0.0f) {
+        up = glm::vec3(0, 0, 1);
+        r = GeomUtil::safe_normalize(glm::cross(f, up));
+        if (glm::dot(r, r) <= 0.0f) r = glm::vec3(1, 0, 0);
+    }
+    const glm::vec3 u = glm::cross(r, f);
+
+    const glm::vec3 d = p - cam.center;
+    const float z = glm::dot(d, f);
+    if (!(z > 0.0f)) return false;
+
+    const float x = glm::dot(d, r) * cam.focal_length / z;
+    const float y = glm::dot(d, u) * cam.focal_length / z;
+
+    const float fx = x / cam.pixel_size + (float)cam.width * 0.5f;
+    const float fy = (float)cam.height * 0.5f - y / cam.pixel_size;
+    if (!(fx >= 0.0f && fy >= 0.0f && fx < (float)cam.width && fy < (float)cam.height)) return false;
+
+    px = (int)fx;
+    py = (int)fy;
+    return true;
+}
+
+SequenceRenderer::SequenceRenderer(const Scene& scene,
+    const Renderer::Camera& cam,
+    const glm::vec3& lightPos,
+    const Renderer::RenderParams& params,
+    const Params& sequence)
+    : m_scene(scene)
+    , m_renderer(scene, cam, lightPos, params)
+    , m_seq(sequence)
+{
+}
+
+void SequenceRenderer::reset() {
+    m_hasHistory = false;
+    m_prevSurface.clear();
+    m_prevReservoir.clear();
+}
+
+bool SequenceRenderer::similar(const Surface& a, const Surface& b) const {
+    if (!a.valid || !b.valid) return false;
+    if (glm::dot(a.n, b.n) < m_seq.normalThreshold) return false;
+    return std::fabs(a.depth - b.depth) <= m_seq.depthThreshold * a.depth;
+}
+
+float SequenceRenderer::jacobian(const glm::vec3& y, const glm::vec3& ny, const glm::vec3& x, const glm::vec3& qx) const {
+    const glm::vec3 d = y - x;
+    const float dist2 = glm::dot(d, d);
+    const glm::vec3 dq = y - qx;
+    const float dq2 = glm::dot(dq, dq);
+    if (!(dist2 > 1e-12f && dq2 > 1e-12f)) return 0.0f;
+
+    const float cosY = -glm::dot(ny, d / std::sqrt(dist2));
+    const float cosYq = -glm::dot(ny, dq / std::sqrt(dq2));
+    if (!(cosY > 0.0f && cosYq > 0.0f)) return 0.0f;
+
+    const float J = (cosY / dist2) / (cosYq / dq2);
+    return (J <= m_seq.maxJacobian && J * m_seq.maxJacobian >= 1.0f) ? J : 0.0f;
+}
+
+bool SequenceRenderer::connects(const glm::vec3& x, const glm::vec3& nx, const glm::vec3& y, const glm::vec3& ny,
+    uint64_t& rays) const
+{
+    const glm::vec3 wi = GeomUtil::safe_normalize(y - x);
+    if (!(glm::dot(nx, wi) > 0.0f) || !(-glm::dot(ny, wi) > 0.0f)) return false;
+
+    const float eps = m_renderer.params().visibilityEps;
+    ++rays;
+    return m_scene.visible(x + eps * nx, y, eps);
+}
+
+bool SequenceRenderer::merge(Reservoir& r, const Reservoir& q, const glm::vec3& qx, const Surface& s,
+    float M, float u, uint64_t& rays) const
+{
+    if (!(M > 0.0f)) return false;
+
+    float w = 0.0f;
+    float phat = 0.0f;
+
+    if (q.W > 0.0f) {
+        const float J = jacobian(q.y, q.ny, s.x, qx);
+        if (J > 0.0f && connects(s.x, s.n, q.y, q.ny, rays)) {
+            const float cosX = glm::dot(s.n, GeomUtil::safe_normalize(q.y - s.x));
+            const glm::vec3 f = m_renderer.params().albedo / PI;
+            phat = Renderer::luminance(f * (q.Lo * cosX));
+            w = phat * q.W * M * J;
+        }
+    }
+
+    r.wsum += w;
+    r.M += M;
+    if (w > 0.0f && u * r.wsum < w) {
+        r.y = q.y;
+        r.ny = q.ny;
+        r.Lo = q.Lo;
+        r.phat = phat;
+        return true;
+    }
+    return false;
+}
+
+float SequenceRenderer::finish(Reservoir& r, const Surface& s, float ownM, const std::vector<Source>& sources,
+    int picked, uint64_t& rays) const
+{
+    if (!(r.phat > 0.0f)) {
+        r.W = 0.0f;
+        return 0.0f;
+    }
+
+    // The pixel's own domain holds every y it can see. A neighbour's holds
+    // y only if y could have been its sample and would have survived the
+    // shift to this pixel.
+    float Z = ownM;
+    for (int k = 0; k < (int)sources.size(); ++k) {
+        const Source& q = sources[(size_t)k];
+        if (k == picked || (jacobian(r.y, r.ny, s.x, q.x) > 0.0f && connects(q.x, q.n, r.y, r.ny, rays))) {
+            Z += q.M;
+        }
+    }
+
+    r.W = r.wsum / (Z * r.phat);
+    return Z;
+}
+
+glm::vec3 SequenceRenderer::shade(const Reservoir& r, const Surface& s) const {
+    if (!(r.W > 0.0f)) return glm::vec3(0.0f);
+
+    const glm::vec3 wi = GeomUtil::safe_normalize(r.y - s.x);
+    const float cosX = std::max(0.0f, glm::dot(s.n, wi));
+    return (m_renderer.params().albedo / PI) * (r.Lo * (cosX * r.W));
+}
+
+std::vector<glm::vec3> SequenceRenderer::render_frame(const Renderer::Camera& cam,
+    uint32_t seed,
+    FrameStats* stats)
+{
+    PM_TRACE_SCOPE_ARG("sequence_frame", "render", "frame", m_frame);
+    const auto t0 = std::chrono::steady_clock::now();
+
+    m_renderer.set_camera(cam);
+
+    const Renderer::Camera& c = m_renderer.camera();
+    const Renderer::RenderParams& params = m_renderer.params();
+    const int W = c.width;
+    const int H = c.height;
+    const size_t n = (size_t)W * (size_t)H;
+
+    const bool temporal = m_seq.temporal && m_hasHistory &&
+        m_prevCam.width == W && m_prevCam.height == H && m_prevSurface.size() == n;
+
+    std::vector<Surface> surface(n);
+    std::vector<Reservoir> reservoir(n);
+    std::vector<glm::vec3> direct(n, glm::vec3(0.0f));
+    std::vector<glm::vec3> img(n, glm::vec3(0.0f));
+
+    const uint32_t frameSeed = Renderer::pass_seed(seed, m_frame);
+    const glm::vec3 f = params.albedo / PI;
+    const BSDFSampler& bsdf = m_renderer.bsdf_sampler();
+
+    std::atomic<uint64_t> newPaths{ 0 }, temporalReuse{ 0 }, spatialReuse{ 0 }, rays{ 0 };
+
+    int threads = params.threads > 0 ? params.threads : (int)std::thread::hardware_concurrency();
+    threads = std::max(1, std::min(threads, H));
+
+    auto run_rows = [&](auto&& row) {
+        std::atomic<int> nextRow{ 0 };
+        auto worker = [&] {
+            for (int y = nextRow.fetch_add(1); y < H; y = nextRow.fetch_add(1)) row(y);
+        };
+        if (threads == 1) {
+            worker();
+            return;
+        }
+        std::vector<std::thread> pool;
+        pool.reserve(threads);
+        for (int t = 0; t < threads; ++t) pool.emplace_back(worker);
+        for (auto& th : pool) th.join();
+    };
+
+    // New candidate per pixel, then temporal reuse from the pixel the primary
+    // hit reprojects to in the previous frame.
+    run_rows([&](int y) {
+        uint64_t localPaths = 0, localTemporal = 0, localRays = 0;
+        std::vector<Source> sources;
+
+        for (int x = 0; x < W; ++x) {
+            const size_t pi = (size_t)y * (size_t)W + (size_t)x;
+
+            std::mt19937 rng(Renderer::pixel_seed(frameSeed, x, y));
+            std::uniform_real_distribution<float> u01(0.0f, 1.0f);
+            Sampler sampler(params.sampler, rng, Renderer::pixel_seed(seed, x, y));
+
+            const glm::vec3 rd0 = m_renderer.begin_pixel(x, y, m_frame, sampler);
+
+            PathMutator::Path path;
+            ++localPaths;
+            if (!m_renderer.sample_path(path, rd0, sampler)) {
+                continue;
+            }
+            m_renderer.resolve_light_visibility(path);
+
+            const int N = (int)path.vertices.size();
+            if (N < 3) continue;
+
+            const glm::vec3 n1 = m_renderer.shading_normal_at(path, 1);
+            if (glm::dot(n1, n1) <= 0.0f) continue;
+
+            Surface& s = surface[pi];
+            s.x = path.vertices[1];
+            s.n = n1;
+            s.depth = glm::length(s.x - c.center);
+            s.valid = true;
+
+            glm::vec3 d;
+            if (m_renderer.direct_light(path, 1, n1, d)) direct[pi] = d;
+
+            Reservoir& r = reservoir[pi];
+            r.M = 1.0f;
+            sources.clear();
+            int picked = -1;
+
+            if (N >= 4) {
+                const glm::vec3 wo = GeomUtil::safe_normalize(path.vertices[2] - s.x);
+                const float cosX = glm::dot(n1, wo);
+                float pdf = cosX > 0.0f ? bsdf.pdf(s.x, n1, wo) : 0.0f;
+                pdf *= m_renderer.continue_probability(1, glm::vec3(1.0f));
+
+                const glm::vec3 n2 = m_renderer.shading_normal_at(path, 2);
+                if (pdf > 0.0f && glm::dot(n2, n2) > 0.0f) {
+                    const glm::vec3 Lo = m_renderer.compute_radiance_for_path(path, false, 2);
+                    const float phat = Renderer::luminance(f * (Lo * cosX));
+                    if (phat > 0.0f) {
+                        r.y = path.vertices[2];
+                        r.ny = n2;
+                        r.Lo = Lo;
+                        r.phat = phat;
+                        r.wsum = phat / pdf;
+                    }
+                }
+            }
+
+            if (temporal) {
+                int qx, qy;
+                if (project_to_pixel(m_prevCam, s.x, qx, qy)) {
+                    const size_t qi = (size_t)qy * (size_t)W + (size_t)qx;
+                    const Surface& prev = m_prevSurface[qi];
+                    // Depth is compared from the previous camera.
+                    Surface here = s;
+                    here.depth = glm::length(s.x - m_prevCam.center);
+                    if (similar(here, prev)) {
+                        ++localTemporal;
+                        const float M = std::min(m_prevReservoir[qi].M, (float)m_seq.historyCap);
+                        if (merge(r, m_prevReservoir[qi], prev.x, s, M, u01(rng), localRays)) picked = 0;
+                        sources.push_back({ prev.x, prev.n, M });
+                    }
+                }
+            }
+
+            finish(r, s, 1.0f, sources, picked, localRays);
+        }
+
+        newPaths += localPaths;
+        temporalReuse += localTemporal;
+        rays += localRays;
+    });
+
+    // Spatial reuse from the temporally resampled neighbours; reads one
+    // buffer and writes another so pixels do not see each other's updates.
+    std::vector<Reservoir> spatial = reservoir;
+
+    if (m_seq.spatial && m_seq.spatialNeighbors > 0) {
+        run_rows([&](int y) {
+            uint64_t localSpatial = 0, localRays = 0;
+            std::vector<Source> sources;
+
+            for (int x = 0; x < W; ++x) {
+                const size_t pi = (size_t)y * (size_t)W + (size_t)x;
+                const Surface& s = surface[pi];
+                if (!s.valid) continue;
+
+                std::mt19937 rng(Renderer::pixel_seed(frameSeed ^ 0x5bd1e995u, x, y));
+                std::uniform_real_distribution<float> u01(0.0f, 1.0f);
+
+                // The temporal result enters as one reservoir of weight
+                // phat * W * M, like every neighbour.
+                const Reservoir& own = reservoir[pi];
+                Reservoir r = own;
+                r.wsum = own.phat * own.W * own.M;
+                sources.clear();
+                int picked = -1;
+
+                for (int k = 0; k < m_seq.spatialNeighbors; ++k) {
+                    const float rad = m_seq.spatialRadius * std::sqrt(u01(rng));
+                    const float phi = 2.0f * PI * u01(rng);
+                    const int qx = x + (int)std::lround(rad * std::cos(phi));
+                    const int qy = y + (int)std::lround(rad * std::sin(phi));
+                    const float u = u01(rng);
+                    if (qx < 0 || qy < 0 || qx >= W || qy >= H || (qx == x && qy == y)) continue;
+
+                    const size_t qi = (size_t)qy * (size_t)W + (size_t)qx;
+                    if (!similar(s, surface[qi])) continue;
+
+                    ++localSpatial;
+                    if (merge(r, reservoir[qi], surface[qi].x, s, reservoir[qi].M, u, localRays)) {
+                        picked = (int)sources.size();
+                    }
+                    sources.push_back({ surface[qi].x, surface[qi].n, reservoir[qi].M });
+                }
+
+                finish(r, s, own.M, sources, picked, localRays);
+                spatial[pi] = r;
+            }
+
+            spatialReuse += localSpatial;
+            rays += localRays;
+        });
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        if (surface[i].valid) img[i] = direct[i] + shade(spatial[i], surface[i]);
+    }
+
+    m_prevCam = c;
+    m_prevSurface = std::move(surface);
+    m_prevReservoir = std::move(spatial);
+    m_hasHistory = true;
+    ++m_frame;
+
+    if (stats) {
+        stats->newPaths = newPaths.load();
+        stats->temporalReuse = temporalReuse.load();
+        stats->spatialReuse = spatialReuse.load();
+        stats->visibilityRays = rays.load();
+        stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    }
+
+    return img;
+}
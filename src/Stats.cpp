@@ -0,0 +1,188 @@
+#include "Stats.h"
+
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+// Owns every thread's block. A thread's block is folded into `retired` when
+// the thread exits so its counts survive it.
+struct Registry {
+    std::mutex mutex;
+    std::vector<Stats::LiveBlock*> live;
+    Stats::Block retired;
+};
+
+Registry& registry() {
+    static Registry r;
+    return r;
+}
+
+void accumulate(Stats::Block& dst, const Stats::LiveBlock& src) {
+    constexpr auto relaxed = std::memory_order_relaxed;
+    for (int i = 0; i < Stats::COUNTER_COUNT; ++i) dst.counters[i] += src.counters[i].load(relaxed);
+    for (int i = 0; i < Stats::TIMER_COUNT; ++i) {
+        dst.nanos[i] += src.nanos[i].load(relaxed);
+        dst.calls[i] += src.calls[i].load(relaxed);
+    }
+}
+
+void clear(Stats::LiveBlock& b) {
+    constexpr auto relaxed = std::memory_order_relaxed;
+    for (auto& c : b.counters) c.store(0, relaxed);
+    for (auto& c : b.nanos) c.store(0, relaxed);
+    for (auto& c : b.calls) c.store(0, relaxed);
+}
+
+struct ThreadOwner {
+    std::unique_ptr<Stats::LiveBlock> block = std::make_unique<Stats::LiveBlock>();
+
+    ~ThreadOwner() {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        accumulate(r.retired, *block);
+        for (size_t i = 0; i < r.live.size(); ++i) {
+            if (r.live[i] == block.get()) {
+                r.live[i] = r.live.back();
+                r.live.pop_back();
+                break;
+            }
+        }
+    }
+};
+
+}
+
+Stats::LiveBlock* Stats::register_thread() {
+    thread_local ThreadOwner owner;
+
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.live.push_back(owner.block.get());
+    return owner.block.get();
+}
+
+Stats::Block Stats::merged() {
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+
+    Block total = r.retired;
+    for (const LiveBlock* b : r.live) accumulate(total, *b);
+    return total;
+}
+
+void Stats::reset() {
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+
+    r.retired = Block{};
+    for (LiveBlock* b : r.live) clear(*b);
+}
+
+const char* Stats::counter_name(Counter c) {
+    switch (c) {
+    case RAYS_INTERSECT: return "rays_intersect";
+    case RAYS_VISIBLE: return "rays_visible";
+    case RAYS_VISIBLE_BATCH: return "rays_visible_batch";
+    case TRIANGLE_TESTS: return "triangle_tests";
+    case BVH_NODES_VISITED: return "bvh_nodes_visited";
+    case SAMPLE_PATH_CALLS: return "sample_path_calls";
+    case SAMPLE_PATH_NO_PRIMARY_HIT: return "sample_path_no_primary_hit";
+    case SAMPLE_PATH_BOUNCES: return "sample_path_bounces";
+    case SAMPLE_PATH_RETRIES_EXHAUSTED: return "sample_path_retries_exhausted";
+    case SAMPLE_PATH_ROULETTE_KILLED: return "sample_path_roulette_killed";
+    case MESHWALK_ATTEMPTS: return "meshwalk_attempts";
+    case MESHWALK_OK: return "meshwalk_ok";
+    case MESHWALK_FAIL_INPUT: return "meshwalk_fail_input";
+    case MESHWALK_FAIL_DEGENERATE: return "meshwalk_fail_degenerate";
+    case MESHWALK_FAIL_OFF_MESH: return "meshwalk_fail_off_mesh";
+    case MESHWALK_FAIL_GUARD: return "meshwalk_fail_guard";
+    case MESHWALK_FAIL_IRREVERSIBLE: return "meshwalk_fail_irreversible";
+    case MESHWALK_FAIL_PREV_OCCLUDED: return "meshwalk_fail_prev_occluded";
+    case MESHWALK_FAIL_NEXT_OCCLUDED: return "meshwalk_fail_next_occluded";
+    case PROJECT_ATTEMPTS: return "project_attempts";
+    case PROJECT_OK: return "project_ok";
+    case PROJECT_FAIL_INPUT: return "project_fail_input";
+    case PROJECT_FAIL_DEGENERATE: return "project_fail_degenerate";
+    case PROJECT_FAIL_DIRECTION: return "project_fail_direction";
+    case PROJECT_FAIL_NO_HIT: return "project_fail_no_hit";
+    case PROJECT_FAIL_PREV_OCCLUDED: return "project_fail_prev_occluded";
+    case PROJECT_FAIL_NEXT_OCCLUDED: return "project_fail_next_occluded";
+    case RETRACE_ATTEMPTS: return "retrace_attempts";
+    case RETRACE_OK: return "retrace_ok";
+    case RETRACE_FAIL_INPUT: return "retrace_fail_input";
+    case RETRACE_FAIL_DEGENERATE: return "retrace_fail_degenerate";
+    case RETRACE_FAIL_DIRECTION: return "retrace_fail_direction";
+    case RETRACE_FAIL_NO_HIT: return "retrace_fail_no_hit";
+    case RETRACE_FAIL_PREV_OCCLUDED: return "retrace_fail_prev_occluded";
+    case RETRACE_FAIL_NEXT_OCCLUDED: return "retrace_fail_next_occluded";
+    case SUBPATH_ATTEMPTS: return "subpath_attempts";
+    case SUBPATH_OK: return "subpath_ok";
+    case SUBPATH_FAIL_INPUT: return "subpath_fail_input";
+    case SUBPATH_FAIL_DIRECTION: return "subpath_fail_direction";
+    case SUBPATH_FAIL_NO_HIT: return "subpath_fail_no_hit";
+    case SUBPATH_FAIL_OCCLUDED: return "subpath_fail_occluded";
+    case RADIANCE_EVALS: return "radiance_evals";
+    case SHADOW_RAYS_DEFERRED: return "shadow_rays_deferred";
+    case RADIANCE_CACHE_LOOKUPS: return "radiance_cache_lookups";
+    case RADIANCE_CACHE_HITS: return "radiance_cache_hits";
+    case RADIANCE_CACHE_INSERTS: return "radiance_cache_inserts";
+    case RADIANCE_CACHE_DROPPED: return "radiance_cache_dropped";
+    case VISIBILITY_TABLE_QUERIES: return "visibility_table_queries";
+    case VISIBILITY_TABLE_REJECTS: return "visibility_table_rejects";
+    default: return "unknown";
+    }
+}
+
+const char* Stats::timer_name(Timer t) {
+    switch (t) {
+    case T_INTERSECT: return "intersect";
+    case T_VISIBLE_BATCH: return "visible_batch";
+    case T_SAMPLE_PATH: return "sample_path";
+    case T_MESHWALK: return "mutate_meshwalk";
+    case T_PROJECT: return "mutate_project";
+    case T_RETRACE: return "mutate_retrace";
+    case T_SUBPATH: return "mutate_subpath";
+    case T_RADIANCE: return "radiance";
+    case T_RESOLVE_LIGHT: return "resolve_light_visibility";
+    case T_RENDER: return "render";
+    case T_SCENE_BUILD: return "scene_build";
+    case T_VISIBILITY_BUILD: return "visibility_build";
+    default: return "unknown";
+    }
+}
+
+bool Stats::write_json(const std::string& path, const std::string& label) {
+    std::ofstream out(path, std::ios::out);
+    if (!out) return false;
+
+    const Block b = merged();
+
+    out << "{\n";
+    out << "  \"label\": \"" << label << "\",\n";
+    out << "  \"enabled\": " << (RENDERER_ENABLE_STATS ? "true" : "false") << ",\n";
+
+    out << "  \"counters\": {\n";
+    for (int i = 0; i < COUNTER_COUNT; ++i) {
+        out << "    \"" << counter_name((Counter)i) << "\": " << b.counters[i]
+            << (i + 1 < COUNTER_COUNT ? ",\n" : "\n");
+    }
+    out << "  },\n";
+
+    out << "  \"timers\": {\n";
+    for (int i = 0; i < TIMER_COUNT; ++i) {
+        const double ms = (double)b.nanos[i] * 1e-6;
+        const double avgNs = b.calls[i] ? (double)b.nanos[i] / (double)b.calls[i] : 0.0;
+
+        out << "    \"" << timer_name((Timer)i) << "\": { \"calls\": " << b.calls[i]
+            << ", \"total_ms\": " << ms
+            << ", \"avg_ns\": " << avgNs << " }"
+            << (i + 1 < TIMER_COUNT ? ",\n" : "\n");
+    }
+    out << "  }\n";
+    out << "}\n";
+
+    return (bool)out;
+}
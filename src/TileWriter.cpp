@@ -0,0 +1,256 @@
+#include "TileWriter.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+TileWriter::~TileWriter() {
+    close();
+}
+
+bool TileWriter::is_open() const {
+#ifdef _WIN32
+    return m_handle != nullptr;
+#else
+    return m_fd >= 0;
+#endif
+}
+
+bool TileWriter::open(const std::string& path, int W, int H, float gamma) {
+    close();
+    m_failed = false;
+
+    if (W <= 0 || H <= 0) return false;
+
+    std::string ext = std::filesystem::path(path).extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char ch) { return (char)std::tolower(ch); });
+
+    if (ext == ".ppm") m_format = Format::PPM;
+    else if (ext == ".pfm") m_format = Format::PFM;
+    else if (ext == ".exr") m_format = Format::EXR;
+    else {
+        std::cerr << "TileWriter: unsupported extension '" << ext << "'\n";
+        return false;
+    }
+
+#ifdef _WIN32
+    HANDLE h = CreateFileA(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (h == INVALID_HANDLE_VALUE) return false;
+    m_handle = h;
+#else
+    m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (m_fd < 0) return false;
+#endif
+
+    m_width = W;
+    m_height = H;
+
+    std::vector<uint8_t> header;
+    if (m_format == Format::EXR) {
+        ImageUtil::exr_header(W, H, true, header);
+        m_rowBytes = ImageUtil::exr_chunk_bytes(W, true);
+    }
+    else {
+        const std::string s = m_format == Format::PPM ? ImageUtil::ppm_header(W, H) : ImageUtil::pfm_header(W, H);
+        header.assign(s.begin(), s.end());
+        m_rowBytes = (m_format == Format::PPM ? 3 : 12) * (size_t)W;
+    }
+    m_dataOffset = header.size();
+
+    if (m_format == Format::PPM) m_encode = std::make_unique<ImageUtil::ByteEncoder>(gamma);
+
+    if (!write_at(0, header.data(), header.size())) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool TileWriter::write_at(uint64_t offset, const void* data, size_t size) {
+    const uint8_t* p = (const uint8_t*)data;
+
+    while (size > 0) {
+#ifdef _WIN32
+        OVERLAPPED ov{};
+        ov.Offset = (DWORD)(offset & 0xffffffffu);
+        ov.OffsetHigh = (DWORD)(offset >> 32);
+
+        const DWORD chunk = (DWORD)std::min<size_t>(size, 1u << 30);
+        DWORD written = 0;
+        if (!WriteFile((HANDLE)m_handle, p, chunk, &written, &ov) || written == 0) return false;
+#else
+        const ssize_t written = ::pwrite(m_fd, p, size, (off_t)offset);
+        if (written <= 0) return false;
+#endif
+        p += written;
+        offset += (uint64_t)written;
+        size -= (size_t)written;
+    }
+    return true;
+}
+
+// PFM stores rows bottom-up; the other formats top-down.
+uint64_t TileWriter::row_offset(int y) const {
+    const int row = m_format == Format::PFM ? m_height - 1 - y : y;
+    return m_dataOffset + (uint64_t)m_rowBytes * (uint64_t)row;
+}
+
+uint64_t TileWriter::band_offset(int y0, int h) const {
+    return std::min(row_offset(y0), row_offset(y0 + h - 1));
+}
+
+void TileWriter::encode_rows(int x0, int y0, int w, int h, const glm::vec3* pixels,
+    uint8_t* base, uint64_t baseOffset) const
+{
+    const size_t W = (size_t)m_width;
+
+    for (int r = 0; r < h; ++r) {
+        const int y = y0 + r;
+        uint8_t* row = base + (row_offset(y) - baseOffset);
+        const glm::vec3* src = pixels + (size_t)r * (size_t)w;
+
+        if (m_format == Format::PPM) {
+            uint8_t* dst = row + 3 * (size_t)x0;
+            for (int x = 0; x < w; ++x) {
+                dst[3 * x + 0] = (*m_encode)(src[x].x);
+                dst[3 * x + 1] = (*m_encode)(src[x].y);
+                dst[3 * x + 2] = (*m_encode)(src[x].z);
+            }
+        }
+        else if (m_format == Format::PFM) {
+            // glm::vec3 is three packed floats.
+            std::memcpy(row + 12 * (size_t)x0, src, 12 * (size_t)w);
+        }
+        else {
+            // Scanline chunk: y, payload size, then the B, G and R planes.
+            // Only the tile at the left edge owns the prefix, like in
+            // write_runs, so tiles sharing a band never touch the same bytes.
+            if (x0 == 0) {
+                const int32_t prefix[2] = { y, (int32_t)(m_rowBytes - 8) };
+                std::memcpy(row, prefix, sizeof(prefix));
+            }
+
+            for (int c = 0; c < 3; ++c) {
+                const int comp = 2 - c;
+                uint8_t* dst = row + 8 + 2 * ((size_t)c * W + (size_t)x0);
+                for (int x = 0; x < w; ++x) {
+                    const uint16_t half = ImageUtil::float_to_half(src[x][comp]);
+                    std::memcpy(dst + 2 * (size_t)x, &half, 2);
+                }
+            }
+        }
+    }
+}
+
+bool TileWriter::write_runs(int x0, int y0, int w, int h, const uint8_t* base, uint64_t baseOffset) {
+    const uint64_t W = (uint64_t)m_width;
+    bool ok = true;
+
+    for (int r = 0; r < h && ok; ++r) {
+        const uint64_t rowOff = row_offset(y0 + r);
+        const uint8_t* row = base + (rowOff - baseOffset);
+
+        if (m_format == Format::EXR) {
+            // The tile at the left edge also writes the chunk's y and size.
+            if (x0 == 0) ok = write_at(rowOff, row, 8);
+            for (int c = 0; c < 3 && ok; ++c) {
+                const uint64_t at = 8 + 2 * ((uint64_t)c * W + (uint64_t)x0);
+                ok = write_at(rowOff + at, row + at, 2 * (size_t)w);
+            }
+        }
+        else {
+            const uint64_t px = m_format == Format::PPM ? 3 : 12;
+            ok = write_at(rowOff + px * (uint64_t)x0, row + px * (uint64_t)x0, (size_t)(px * (uint64_t)w));
+        }
+    }
+    return ok;
+}
+
+bool TileWriter::write_tile(int x0, int y0, int w, int h, const glm::vec3* pixels) {
+    if (!is_open() || x0 < 0 || y0 < 0 || w <= 0 || h <= 0 || x0 + w > m_width || y0 + h > m_height) {
+        return false;
+    }
+
+    PM_TRACE_SCOPE("write_tile", "io");
+
+    Band* band = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(m_bandMutex);
+        std::unique_ptr<Band>& slot = m_bands[y0];
+        if (!slot) {
+            slot = std::make_unique<Band>();
+            slot->h = h;
+            slot->offset = band_offset(y0, h);
+            slot->bytes.assign((size_t)h * m_rowBytes, 0);
+        }
+        if (slot->h == h) band = slot.get();
+    }
+
+    bool ok = true;
+    if (!band) {
+        std::vector<uint8_t> rows((size_t)h * m_rowBytes);
+        const uint64_t offset = band_offset(y0, h);
+        encode_rows(x0, y0, w, h, pixels, rows.data(), offset);
+        ok = write_runs(x0, y0, w, h, rows.data(), offset);
+    }
+    else {
+        // Tiles of a band cover disjoint bytes, so they encode unlocked.
+        encode_rows(x0, y0, w, h, pixels, band->bytes.data(), band->offset);
+
+        std::unique_ptr<Band> done;
+        {
+            std::lock_guard<std::mutex> lock(m_bandMutex);
+            band->pixels += (int64_t)w * (int64_t)h;
+            band->tiles.push_back({ x0, w });
+            if (band->pixels >= (int64_t)m_width * (int64_t)h) {
+                auto it = m_bands.find(y0);
+                done = std::move(it->second);
+                m_bands.erase(it);
+            }
+        }
+        if (done) ok = write_at(done->offset, done->bytes.data(), done->bytes.size());
+    }
+
+    if (!ok) m_failed.store(true);
+    return ok;
+}
+
+bool TileWriter::close() {
+    if (!is_open()) return !m_failed;
+
+    // Bands that never covered the whole width write just the tiles they got.
+    bool ok = true;
+    {
+        std::lock_guard<std::mutex> lock(m_bandMutex);
+        for (const auto& [y0, band] : m_bands) {
+            for (const auto& [x0, w] : band->tiles) {
+                ok &= write_runs(x0, y0, w, band->h, band->bytes.data(), band->offset);
+            }
+        }
+        m_bands.clear();
+    }
+
+    ok &= !m_failed;
+#ifdef _WIN32
+    ok &= CloseHandle((HANDLE)m_handle) != 0;
+    m_handle = nullptr;
+#else
+    ok &= ::close(m_fd) == 0;
+    m_fd = -1;
+#endif
+
+    m_encode.reset();
+    m_failed = !ok;
+    return ok;
+}
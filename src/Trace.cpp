@@ -0,0 +1,235 @@
+#include "Trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+std::atomic<bool> Trace::s_enabled{ false };
+
+namespace {
+
+// Rings start at this many events and double up to the capacity, so a
+// thread that records a handful of events does not pay for a full ring.
+constexpr size_t kInitialEvents = 256;
+
+// Events until the ring fills up, then `capacity` events with the oldest
+// at `next`. Only the owning thread touches events; a buffer whose
+// generation is behind the registry's holds events from before the last
+// Trace::enable and is reset by its owner on the next record.
+struct Buffer {
+    std::vector<Trace::Event> events;
+    size_t   capacity = 0;
+    size_t   next = 0;
+    bool     wrapped = false;
+    uint64_t generation = 0;
+    uint32_t tid = 0;
+    std::string name;
+
+    void reset(size_t cap, uint64_t gen) {
+        events.clear();
+        events.shrink_to_fit();
+        capacity = cap;
+        next = 0;
+        wrapped = false;
+        generation = gen;
+    }
+
+    // The recorded events, oldest first, in an exactly sized vector.
+    std::vector<Trace::Event> ordered() const {
+        std::vector<Trace::Event> out;
+        out.reserve(events.size());
+        out.insert(out.end(), events.begin() + (ptrdiff_t)next, events.end());
+        out.insert(out.end(), events.begin(), events.begin() + (ptrdiff_t)next);
+        return out;
+    }
+};
+
+// Owns every thread's buffer. When a thread exits its events move to
+// `retired`, trimmed to the used part, so events from finished render
+// workers are still written. Past retiredLimit events in total the oldest
+// retired buffers are dropped. enable() bumps `generation` instead of
+// resetting live buffers, which other threads may be appending to.
+struct Registry {
+    std::mutex mutex;
+    std::vector<Buffer*> live;
+    std::vector<std::unique_ptr<Buffer>> retired;
+    size_t retiredEvents = 0;
+    size_t retiredLimit = 1u << 18;
+    std::atomic<size_t> capacity{ 1u << 16 };
+    std::atomic<uint64_t> generation{ 1 };
+    uint32_t nextTid = 1;
+};
+
+Registry& registry() {
+    static Registry r;
+    return r;
+}
+
+struct ThreadOwner {
+    std::unique_ptr<Buffer> buffer;
+
+    ~ThreadOwner() {
+        if (!buffer) return;
+
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.live.erase(std::remove(r.live.begin(), r.live.end(), buffer.get()), r.live.end());
+        if (buffer->events.empty()) return;
+        if (buffer->generation != r.generation.load(std::memory_order_relaxed)) return;
+
+        buffer->events = buffer->ordered();
+        buffer->next = 0;
+        buffer->wrapped = false;
+        r.retiredEvents += buffer->events.size();
+        r.retired.push_back(std::move(buffer));
+
+        size_t drop = 0;
+        while (r.retiredEvents > r.retiredLimit && drop + 1 < r.retired.size()) {
+            r.retiredEvents -= r.retired[drop]->events.size();
+            ++drop;
+        }
+        r.retired.erase(r.retired.begin(), r.retired.begin() + (ptrdiff_t)drop);
+    }
+};
+
+Buffer& local_buffer() {
+    thread_local ThreadOwner owner;
+
+    if (!owner.buffer) {
+        owner.buffer = std::make_unique<Buffer>();
+
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        owner.buffer->tid = r.nextTid++;
+        r.live.push_back(owner.buffer.get());
+    }
+    return *owner.buffer;
+}
+
+void write_escaped(std::ostream& out, const char* s) {
+    for (; s && *s; ++s) {
+        if (*s == '"' || *s == '\\') out << '\\';
+        out << *s;
+    }
+}
+
+}
+
+uint64_t Trace::now_ns() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Trace::enable(size_t eventsPerThread, size_t retiredEvents) {
+    Registry& r = registry();
+    {
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.capacity.store(std::max<size_t>(1, eventsPerThread), std::memory_order_relaxed);
+        r.retired.clear();
+        r.retiredEvents = 0;
+        r.retiredLimit = retiredEvents;
+        // Live buffers are left to their owners, which see the new
+        // generation on their next record and reset themselves.
+        r.generation.fetch_add(1, std::memory_order_release);
+    }
+    s_enabled.store(true, std::memory_order_release);
+}
+
+void Trace::disable() {
+    s_enabled.store(false, std::memory_order_relaxed);
+}
+
+void Trace::set_thread_name(const std::string& name) {
+    local_buffer().name = name;
+}
+
+void Trace::record(const Event& e) {
+    Buffer& b = local_buffer();
+
+    Registry& r = registry();
+    const uint64_t gen = r.generation.load(std::memory_order_acquire);
+    const size_t cap = r.capacity.load(std::memory_order_relaxed);
+    if (b.generation != gen) b.reset(cap, gen);
+
+    if (!b.wrapped) {
+        if (b.events.size() == b.events.capacity()) {
+            b.events.reserve(std::min(cap, std::max(kInitialEvents, 2 * b.events.capacity())));
+        }
+        b.events.push_back(e);
+        if (b.events.size() == cap) b.wrapped = true;
+        return;
+    }
+
+    b.events[b.next] = e;
+    if (++b.next == cap) b.next = 0;
+}
+
+bool Trace::write_json(const std::string& path) {
+    std::ofstream out(path, std::ios::out);
+    if (!out) return false;
+
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+
+    // Live buffers that have not recorded since the last enable() still
+    // hold the previous recording.
+    const uint64_t gen = r.generation.load(std::memory_order_relaxed);
+    std::vector<const Buffer*> buffers;
+    for (const Buffer* b : r.live) {
+        if (b->generation == gen) buffers.push_back(b);
+    }
+    for (const auto& b : r.retired) buffers.push_back(b.get());
+
+    // Timestamps are written relative to the earliest recorded event.
+    uint64_t origin = UINT64_MAX;
+    for (const Buffer* b : buffers) {
+        for (const Event& e : b->events) origin = std::min(origin, e.startNs);
+    }
+    if (origin == UINT64_MAX) origin = 0;
+
+    out << std::fixed << std::setprecision(3);
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+
+    bool first = true;
+    auto sep = [&]() {
+        if (!first) out << ",\n";
+        first = false;
+    };
+
+    for (const Buffer* b : buffers) {
+        if (!b->name.empty()) {
+            sep();
+            out << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << b->tid
+                << ",\"args\":{\"name\":\"";
+            write_escaped(out, b->name.c_str());
+            out << "\"}}";
+        }
+
+        // Oldest first: a wrapped ring starts at `next`.
+        const size_t n = b->events.size();
+        for (size_t k = 0; k < n; ++k) {
+            const Event& e = b->events[(b->next + k) % n];
+
+            sep();
+            out << "{\"ph\":\"X\",\"pid\":1,\"tid\":" << b->tid << ",\"name\":\"";
+            write_escaped(out, e.name);
+            out << "\",\"cat\":\"";
+            write_escaped(out, e.category);
+            out << "\",\"ts\":" << (double)(e.startNs - origin) * 1e-3
+                << ",\"dur\":" << (double)e.durationNs * 1e-3;
+            if (e.argName) {
+                out << ",\"args\":{\"";
+                write_escaped(out, e.argName);
+                out << "\":" << e.arg << "}";
+            }
+            out << "}";
+        }
+    }
+
+    out << "\n]}\n";
+    return (bool)out;
+}
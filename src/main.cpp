@@ -1,10 +1,16 @@
 #include "scene.h"
-#include "renderer.h"
+#include "Renderer.h"
+#include "Denoiser.h"
+#include "ImageUtil.h"
+#include "Stats.h"
+#include "Trace.h"
 
 #include <iostream>
 #include <string>
 #include <cmath>
 #include <vector>
+#include <chrono>
+#include <cstdlib>
 
 static std::string mutator_name(int t) {
     switch (t) {
@@ -12,11 +18,20 @@ static std::string mutator_name(int t) {
     case 1: return "meshwalk";
     case 2: return "project";
     case 3: return "resample";
+    case 4: return "adaptive";
+    case 5: return "subpath";
     default: return "unknown";
     }
 }
 
 int main() {
+    // RENDERER_TRACE=<file.json> records a Chrome trace of the whole run.
+    const char* tracePath = std::getenv("RENDERER_TRACE");
+    if (tracePath && *tracePath) {
+        Trace::enable();
+        Trace::set_thread_name("main");
+    }
+
     Scene scene;
     const std::string scenePath = "C:/Users/neels/source/repos/PathMutation/Scenes/cornell-box.obj";
 
@@ -56,6 +71,8 @@ int main() {
     params.Kmutations = 64;
     params.visibilityEps = 1e-4f;
     params.albedo = glm::vec3(0.7f, 0.7f, 0.7f);
+    params.russianRoulette = true;
+    params.rrMinBounces = 3;
     params.lightIntensity = glm::vec3(20.0f, 20.0f, 20.0f);
 
     Renderer renderer(scene, cam, light_pos, params);
@@ -65,15 +82,28 @@ int main() {
         << " | Kmutations=" << params.Kmutations << "\n";
 
     const uint32_t seedBase = 1337u;
+    Denoiser denoiser(Denoiser::Params{});
 
-    for (int mutType = 0; mutType <= 3; ++mutType) {
+    for (int mutType = 0; mutType <= 5; ++mutType) {
         const uint32_t seed = seedBase + 100u * (uint32_t)mutType;
 
         std::cout << "  -> mutator_type=" << mutType
             << " (" << mutator_name(mutType) << ")"
             << " seed=" << seed << "\n";
 
-        std::vector<glm::vec3> img = renderer.render_scene(seed, mutType);
+        Stats::reset();
+
+        Renderer::RenderStats stats;
+        Renderer::AOVs aovs;
+        std::vector<glm::vec3> img = renderer.render_scene(seed, mutType, &stats, &aovs);
+
+        const std::string statsPath =
+            "C:/Users/neels/source/repos/PathMutation/Scenes/stats_" + mutator_name(mutType) + ".json";
+        Stats::write_json(statsPath, mutator_name(mutType));
+
+        std::cout << "     avg vertices/path=" << stats.avg_vertices_per_path()
+            << " rays/pixel=" << stats.rays_per_pixel()
+            << " acceptance=" << stats.acceptance_rate() << "\n";
 
         const std::string outPath =
             "C:/Users/neels/source/repos/PathMutation/Scenes/out_" + mutator_name(mutType) + ".ppm";
@@ -83,8 +113,63 @@ int main() {
             return 1;
         }
 
+        const std::string aovPrefix =
+            "C:/Users/neels/source/repos/PathMutation/Scenes/out_" + mutator_name(mutType);
+        if (!Renderer::write_aovs(aovPrefix, aovs)) {
+            std::cout << "Failed to write AOVs: " << aovPrefix << "_*.ppm\n";
+        }
+
+        // Linear HDR copy of the beauty image for tone mapping and comparison.
+        const std::string hdrPath =
+            "C:/Users/neels/source/repos/PathMutation/Scenes/out_" + mutator_name(mutType) + ".exr";
+        if (!ImageUtil::write_exr(hdrPath, img, cam.width, cam.height)) {
+            std::cout << "Failed to write image: " << hdrPath << "\n";
+        }
+
+        // Edge-aware filtered copy, guided by the primary-hit AOVs.
+        const std::string denoisedPath =
+            "C:/Users/neels/source/repos/PathMutation/Scenes/out_" + mutator_name(mutType) + "_denoised.ppm";
+        std::vector<glm::vec3> denoised;
+        if (!denoiser.denoise(img, aovs, denoised) ||
+            !Renderer::write_ppm(denoisedPath, denoised, cam.width, cam.height, 2.2f)) {
+            std::cout << "Failed to write image: " << denoisedPath << "\n";
+        }
+
         std::cout << "Wrote: " << outPath << "\n";
     }
 
+    // Convergence comparison: retrace chains with uniform averaging vs.
+    // Metropolis-Hastings, scored against a path-traced reference.
+    Renderer::RenderParams refParams = params;
+    refParams.Kmutations = 1024;
+    Renderer refRenderer(scene, cam, light_pos, refParams);
+
+    std::cout << "Rendering reference (resample, K=" << refParams.Kmutations << ")\n";
+    const std::vector<glm::vec3> reference = refRenderer.render_scene(seedBase + 7u, 3);
+
+    for (int metro = 0; metro <= 1; ++metro) {
+        Renderer::RenderParams cmpParams = params;
+        cmpParams.metropolis = (metro == 1);
+        Renderer cmpRenderer(scene, cam, light_pos, cmpParams);
+
+        const auto t0 = std::chrono::steady_clock::now();
+        std::vector<glm::vec3> img = cmpRenderer.render_scene(seedBase, 0);
+        const auto t1 = std::chrono::steady_clock::now();
+
+        const double secs = std::chrono::duration<double>(t1 - t0).count();
+        const double err = ImageUtil::rmse(img, reference);
+        const double efficiency = (err > 0.0 && secs > 0.0) ? 1.0 / (err * err * secs) : 0.0;
+
+        std::cout << "  retrace " << (cmpParams.metropolis ? "metropolis" : "averaging ")
+            << " | time=" << secs << "s"
+            << " | rmse=" << err
+            << " | 1/(mse*time)=" << efficiency << "\n";
+    }
+
+    if (tracePath && *tracePath) {
+        Trace::disable();
+        if (Trace::write_json(tracePath)) std::cout << "Wrote trace: " << tracePath << "\n";
+    }
+
     return 0;
 }
@@ -1,5 +1,7 @@
 #include "scene.h"
 #include "GeomUtil.h"
+#include "Stats.h"
+#include "Trace.h"
 
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h>
@@ -10,6 +12,7 @@
 #include <sstream>
 #include <cmath>
 #include <filesystem>
+#include <unordered_map>
 
 static uint64_t edge_key(uint32_t a, uint32_t b) {
     uint32_t lo = std::min(a, b);
@@ -23,49 +26,89 @@ struct EdgeRef {
 };
 
 bool Scene::load(const std::string& filename) {
+    PM_TRACE_SCOPE("Scene::load", "scene");
+
     Assimp::Importer importer;
 
-    const aiScene* scene = importer.ReadFile(
-        filename,
-        aiProcess_Triangulate |
-        aiProcess_GenNormals |
-        aiProcess_JoinIdenticalVertices
-    );
+    const aiScene* scene = nullptr;
+    {
+        PM_TRACE_SCOPE("assimp_import", "scene");
+        scene = importer.ReadFile(
+            filename,
+            aiProcess_Triangulate |
+            aiProcess_GenNormals |
+            aiProcess_JoinIdenticalVertices
+        );
+    }
 
     if (!scene || !scene->HasMeshes()) {
         std::cerr << "Assimp error: " << importer.GetErrorString() << "\n";
         return false;
     }
 
-    m_triangles.clear();
-    m_debugTriangles.clear();
-    m_positions.clear();
-    reset_bounds();
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> normals;
+    std::vector<uint32_t> indices;
 
-    std::vector<uint32_t> meshBase(scene->mNumMeshes, 0);
-    uint32_t totalVerts = 0;
+    {
+        PM_TRACE_SCOPE("gather_meshes", "scene");
 
-    for (unsigned int m = 0; m < scene->mNumMeshes; ++m) {
-        meshBase[m] = totalVerts;
-        totalVerts += scene->mMeshes[m]->mNumVertices;
-    }
+        std::vector<uint32_t> meshBase(scene->mNumMeshes, 0);
+        uint32_t totalVerts = 0;
+
+        for (unsigned int m = 0; m < scene->mNumMeshes; ++m) {
+            meshBase[m] = totalVerts;
+            totalVerts += scene->mMeshes[m]->mNumVertices;
+        }
 
-    m_positions.resize(totalVerts);
+        positions.resize(totalVerts);
+        normals.assign(totalVerts, glm::vec3(0.0f));
 
-    for (unsigned int m = 0; m < scene->mNumMeshes; ++m) {
-        const aiMesh* mesh = scene->mMeshes[m];
-        const uint32_t base = meshBase[m];
+        for (unsigned int m = 0; m < scene->mNumMeshes; ++m) {
+            const aiMesh* mesh = scene->mMeshes[m];
+            const bool hasNormals = mesh->HasNormals();
+            const uint32_t base = meshBase[m];
 
-        for (unsigned int i = 0; i < mesh->mNumVertices; ++i) {
-            const aiVector3D& p = mesh->mVertices[i];
-            glm::vec3 gp{ p.x, p.y, p.z };
-            m_positions[base + i] = gp;
-            expand_bounds(gp);
+            for (unsigned int i = 0; i < mesh->mNumVertices; ++i) {
+                const aiVector3D& p = mesh->mVertices[i];
+                positions[base + i] = glm::vec3{ p.x, p.y, p.z };
+
+                if (hasNormals) {
+                    const aiVector3D& n = mesh->mNormals[i];
+                    normals[base + i] = glm::vec3{ n.x, n.y, n.z };
+                }
+            }
+
+            for (unsigned int f = 0; f < mesh->mNumFaces; ++f) {
+                const aiFace& face = mesh->mFaces[f];
+                if (face.mNumIndices != 3) continue;
+
+                indices.push_back(base + uint32_t(face.mIndices[0]));
+                indices.push_back(base + uint32_t(face.mIndices[1]));
+                indices.push_back(base + uint32_t(face.mIndices[2]));
+            }
         }
     }
 
+    return build(positions, normals, indices);
+}
+
+bool Scene::build(const std::vector<glm::vec3>& positions,
+    const std::vector<glm::vec3>& normals,
+    const std::vector<uint32_t>& indices)
+{
+    PM_TRACE_SCOPE("Scene::build", "scene");
+
+    if (indices.size() % 3 != 0) return false;
+
+    const bool hasNormals = normals.size() == positions.size();
+
+    // Triangles are built aside and swapped in at the end, so a bad index
+    // leaves the scene as it was.
+    std::vector<GeomUtil::Triangle> triangles;
+
     std::unordered_map<uint64_t, EdgeRef> edgeMap;
-    edgeMap.reserve(size_t(totalVerts));
+    edgeMap.reserve(positions.size());
 
     auto add_edge = [&](int triId, uint8_t edgeIdx, uint32_t a, uint32_t b) {
         uint64_t key = edge_key(a, b);
@@ -80,56 +123,61 @@ bool Scene::load(const std::string& filename) {
 
         if (other.tri == triId) return;
 
-        if (m_triangles[other.tri].adj[other.edge] != -1) return;
+        if (triangles[other.tri].adj[other.edge] != -1) return;
 
-        m_triangles[other.tri].adj[other.edge] = triId;
-        m_triangles[other.tri].adjEdge[other.edge] = edgeIdx;
+        triangles[other.tri].adj[other.edge] = triId;
+        triangles[other.tri].adjEdge[other.edge] = edgeIdx;
 
-        m_triangles[triId].adj[edgeIdx] = other.tri;
-        m_triangles[triId].adjEdge[edgeIdx] = other.edge;
+        triangles[triId].adj[edgeIdx] = other.tri;
+        triangles[triId].adjEdge[edgeIdx] = other.edge;
     };
 
-    for (unsigned int m = 0; m < scene->mNumMeshes; ++m) {
-        const aiMesh* mesh = scene->mMeshes[m];
-        const bool hasNormals = mesh->HasNormals();
-        const uint32_t base = meshBase[m];
-
-        for (unsigned int f = 0; f < mesh->mNumFaces; ++f) {
-            const aiFace& face = mesh->mFaces[f];
-            if (face.mNumIndices != 3) continue;
-
-            GeomUtil::Triangle tri;
-
-            tri.i0 = base + uint32_t(face.mIndices[0]);
-            tri.i1 = base + uint32_t(face.mIndices[1]);
-            tri.i2 = base + uint32_t(face.mIndices[2]);
-
-            tri.v0 = m_positions[tri.i0];
-            tri.v1 = m_positions[tri.i1];
-            tri.v2 = m_positions[tri.i2];
-
-            tri.n0 = tri.n1 = tri.n2 = glm::vec3(0.0f);
-            if (hasNormals) {
-                const aiVector3D& n0 = mesh->mNormals[face.mIndices[0]];
-                const aiVector3D& n1 = mesh->mNormals[face.mIndices[1]];
-                const aiVector3D& n2 = mesh->mNormals[face.mIndices[2]];
-                tri.n0 = { n0.x, n0.y, n0.z };
-                tri.n1 = { n1.x, n1.y, n1.z };
-                tri.n2 = { n2.x, n2.y, n2.z };
-            }
+    triangles.reserve(indices.size() / 3);
+
+    for (size_t f = 0; f + 2 < indices.size(); f += 3) {
+        GeomUtil::Triangle tri;
+
+        tri.i0 = indices[f + 0];
+        tri.i1 = indices[f + 1];
+        tri.i2 = indices[f + 2];
 
-            tri.adj[0] = tri.adj[1] = tri.adj[2] = -1;
-            tri.adjEdge[0] = tri.adjEdge[1] = tri.adjEdge[2] = 255;
+        if (tri.i0 >= positions.size() || tri.i1 >= positions.size() || tri.i2 >= positions.size()) {
+            std::cerr << "Scene::build: index out of range in face " << f / 3 << "\n";
+            return false;
+        }
 
-            const int triId = (int)m_triangles.size();
-            m_triangles.push_back(tri);
+        tri.v0 = positions[tri.i0];
+        tri.v1 = positions[tri.i1];
+        tri.v2 = positions[tri.i2];
 
-            add_edge(triId, 0, tri.i0, tri.i1);
-            add_edge(triId, 1, tri.i1, tri.i2);
-            add_edge(triId, 2, tri.i2, tri.i0);
+        tri.n0 = tri.n1 = tri.n2 = glm::vec3(0.0f);
+        if (hasNormals) {
+            tri.n0 = normals[tri.i0];
+            tri.n1 = normals[tri.i1];
+            tri.n2 = normals[tri.i2];
         }
+
+        tri.adj[0] = tri.adj[1] = tri.adj[2] = -1;
+        tri.adjEdge[0] = tri.adjEdge[1] = tri.adjEdge[2] = 255;
+
+        const int triId = (int)triangles.size();
+        triangles.push_back(tri);
+
+        add_edge(triId, 0, tri.i0, tri.i1);
+        add_edge(triId, 1, tri.i1, tri.i2);
+        add_edge(triId, 2, tri.i2, tri.i0);
     }
 
+    m_triangles.swap(triangles);
+    m_debugTriangles.clear();
+    m_positions = positions;
+    reset_bounds();
+    for (const glm::vec3& p : m_positions) {
+        expand_bounds(p);
+    }
+
+    m_bvh.build(m_triangles);
+
     return true;
 }
 
@@ -329,35 +377,30 @@ bool Scene::export_obj(const std::string& obj_path) const {
     return true;
 }
 
+uint64_t Scene::rays_traced() {
+    return Stats::thread_count(Stats::RAYS_INTERSECT)
+        + Stats::thread_count(Stats::RAYS_VISIBLE)
+        + Stats::thread_count(Stats::RAYS_VISIBLE_BATCH);
+}
+
 bool Scene::intersect(const glm::vec3& origin,
     const glm::vec3& dir,
     Hit& outHit,
     GeomUtil::Triangle& tri) const
 {
+    Stats::add(Stats::RAYS_INTERSECT, 1);
+    PM_STAT_TIMER(T_INTERSECT);
+
     const float tMin = 1e-4f;
-    float bestT = std::numeric_limits<float>::infinity();
+    float bestT = 0.0f;
     int bestIdx = -1;
     float bestU = 0.0f, bestV = 0.0f;
 
-    for (int i = 0; i < (int)m_triangles.size(); ++i) {
-        const GeomUtil::Triangle& tri = m_triangles[i];
-
-        float t, u, v;
-        if (!GeomUtil::moller_trumbore(origin, dir, tri.v0, tri.v1, tri.v2, t, u, v)) {
-            continue;
-        }
-        if (t < tMin) continue;
-
-        if (t < bestT) {
-            bestT = t;
-            bestIdx = i;
-            bestU = u;
-            bestV = v;
-        }
+    if (!m_bvh.intersect(origin, dir, tMin, std::numeric_limits<float>::infinity(),
+        bestIdx, bestT, bestU, bestV)) {
+        return false;
     }
 
-    if (bestIdx < 0) return false;
-
     tri = m_triangles[bestIdx];
 
     const float u = bestU;
@@ -402,11 +445,30 @@ bool Scene::visible_along_ray(const glm::vec3& origin,
 {
     if (t_target <= 0.0f) return true;
 
-    Hit h;
-    GeomUtil::Triangle tri;
-    if (!intersect(origin, dir, h, tri)) {
-        return true;
-    }
+    Stats::add(Stats::RAYS_VISIBLE, 1);
+    PM_STAT_TIMER(T_INTERSECT);
+
+    return !m_bvh.occluded(origin, dir, 1e-4f, t_target - eps);
+}
 
-    return !(h.t < (t_target - eps));
+void Scene::visible_batch(const std::vector<glm::vec3>& origins,
+    const std::vector<glm::vec3>& targets,
+    std::vector<uint8_t>& outVisible,
+    float eps) const
+{
+    const size_t n = std::min(origins.size(), targets.size());
+    outVisible.assign(n, 1);
+    if (n == 0) return;
+
+    Stats::add(Stats::RAYS_VISIBLE_BATCH, n);
+    PM_STAT_TIMER(T_VISIBLE_BATCH);
+
+    for (size_t i = 0; i < n; ++i) {
+        glm::vec3 d = targets[i] - origins[i];
+        float dist2 = glm::dot(d, d);
+        if (dist2 <= 0.0f) continue;
+
+        float dist = std::sqrt(dist2);
+        outVisible[i] = m_bvh.occluded(origins[i], d / dist, 1e-4f, dist - eps) ? 0 : 1;
+    }
 }